@@ -1,5 +1,31 @@
 #include "fab_utility.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+
+
+unsigned long long Utl_GetMicroseconds(void)
+{
+#ifdef _WIN32
+	/* Not cached in a static since it may be called from any thread */
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	/* Split so the multiplication can't overflow after the machine has been up for a while */
+	const unsigned long long ticks = (unsigned long long)counter.QuadPart;
+	const unsigned long long persecond = (unsigned long long)frequency.QuadPart;
+	return ticks / persecond * 1000000 + ticks % persecond * 1000000 / persecond;
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (unsigned long long)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+#endif
+}
+
 
 
 void Utl_PushFrontList(Utl_List* list, Utl_ListLinks* node)
@@ -99,6 +125,251 @@ void Utl_ClearList(Utl_List* list, void(*destroy_func)(void*))
 
 
 
+void Utl_InitVector(Utl_Vector* vector, const int elementsize)
+{
+	Utl_Assert(vector);
+	Utl_Assert(elementsize > 0);
+	vector->data = NULL;
+	vector->count = 0;
+	vector->capacity = 0;
+	vector->elementsize = elementsize;
+}
+
+void Utl_ReserveVector(Utl_Vector* vector, const int capacity)
+{
+	Utl_Assert(vector);
+	if (capacity <= vector->capacity) return;
+	vector->data = Utl_Realloc(vector->data, (size_t)vector->elementsize * capacity);
+	vector->capacity = capacity;
+}
+
+void* Utl_PushVector(Utl_Vector* vector, const void* element)
+{
+	Utl_Assert(vector);
+	if (vector->count >= vector->capacity)
+		Utl_ReserveVector(vector, vector->capacity ? vector->capacity * 2 : 8);
+	char* slot = (char*)vector->data + (size_t)vector->elementsize * vector->count++;
+	if (element)
+		memcpy(slot, element, vector->elementsize);
+	else
+		memset(slot, 0, vector->elementsize);
+	return slot;
+}
+
+void* Utl_PopVector(Utl_Vector* vector)
+{
+	Utl_Assert(vector);
+	if (vector->count <= 0) return NULL;
+	return (char*)vector->data + (size_t)vector->elementsize * --vector->count;
+}
+
+void Utl_FreeVector(Utl_Vector* vector)
+{
+	Utl_Assert(vector);
+	Utl_Free(vector->data);
+	vector->data = NULL;
+	vector->count = 0;
+	vector->capacity = 0;
+}
+
+
+
+/* Control bytes of slots without a key have the high bit set, full slots have the low 7 bits of the hash */
+#define CTRL_EMPTY		((signed char)-128)
+#define CTRL_DELETED	((signed char)-2)
+
+#define hash_h1(hash)	((hash) >> 7)
+#define hash_h2(hash)	((signed char)((hash) & 0x7F))
+
+/* Maps are kept at most 7/8 full so every probe sequence reaches an empty slot */
+#define max_load(capacity)	((capacity) - (capacity) / 8)
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+
+/* Bit i is set if control byte i of the group matches */
+static unsigned int match_group(const signed char* group, const signed char ctrl)
+{
+	const __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(ctrl)));
+}
+
+/* Bit i is set if slot i of the group has no key, empty and deleted are the only control bytes with the high bit */
+static unsigned int match_group_free(const signed char* group)
+{
+	return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+}
+#else
+static unsigned int match_group(const signed char* group, const signed char ctrl)
+{
+	unsigned int mask = 0;
+	for (int i = 0; i < Utl_HASHMAP_GROUP_SIZE; i++)
+		mask |= (unsigned int)(group[i] == ctrl) << i;
+	return mask;
+}
+
+static unsigned int match_group_free(const signed char* group)
+{
+	unsigned int mask = 0;
+	for (int i = 0; i < Utl_HASHMAP_GROUP_SIZE; i++)
+		mask |= (unsigned int)(group[i] < 0) << i;
+	return mask;
+}
+#endif
+
+/* Index of the lowest set bit, the mask can't be 0 */
+static int lowest_bit(unsigned int mask)
+{
+	int i = 0;
+	while (!(mask & 1)) { mask >>= 1; i++; }
+	return i;
+}
+
+/* Sets the control byte of a slot, and its copy after the last group if it is in the first group */
+static void set_ctrl(Utl_HashMap* map, const int slot, const signed char ctrl)
+{
+	map->ctrl[slot] = ctrl;
+	if (slot < Utl_HASHMAP_GROUP_SIZE)
+		map->ctrl[map->capacity + slot] = ctrl;
+}
+
+#define value_at(map, slot)	((char*)(map)->values + (size_t)(map)->valuesize * (slot))
+
+/* Slot of a key, or -1 if it isn't in the map. Groups are probed with growing steps so every group is visited */
+static int find_slot(const Utl_HashMap* map, const char* key, const unsigned int hash)
+{
+	if (!map->capacity) return -1;
+	const int mask = map->capacity - 1;
+	int pos = hash_h1(hash) & mask;
+	for (int step = Utl_HASHMAP_GROUP_SIZE; ; step += Utl_HASHMAP_GROUP_SIZE)
+	{
+		const signed char* group = map->ctrl + pos;
+		for (unsigned int match = match_group(group, hash_h2(hash)); match; match &= match - 1)
+		{
+			const int slot = (pos + lowest_bit(match)) & mask;
+			if (strcmp(map->keys[slot], key) == 0)
+				return slot;
+		}
+		if (match_group(group, CTRL_EMPTY)) return -1;
+		pos = (pos + step) & mask;
+	}
+}
+
+/* First slot without a key along the probe sequence of a hash */
+static int find_free_slot(const Utl_HashMap* map, const unsigned int hash)
+{
+	const int mask = map->capacity - 1;
+	int pos = hash_h1(hash) & mask;
+	for (int step = Utl_HASHMAP_GROUP_SIZE; ; step += Utl_HASHMAP_GROUP_SIZE)
+	{
+		const unsigned int freeslots = match_group_free(map->ctrl + pos);
+		if (freeslots) return (pos + lowest_bit(freeslots)) & mask;
+		pos = (pos + step) & mask;
+	}
+}
+
+/* Moves every key into new slots, which also drops the deleted control bytes */
+static void rehash(Utl_HashMap* map, const int capacity)
+{
+	Utl_HashMap old = *map;
+	map->capacity = capacity;
+	map->ctrl = Utl_Malloc(capacity + Utl_HASHMAP_GROUP_SIZE);
+	memset(map->ctrl, CTRL_EMPTY, capacity + Utl_HASHMAP_GROUP_SIZE);
+	map->keys = Utl_Malloc(sizeof(const char*) * capacity);
+	map->values = Utl_Malloc((size_t)map->valuesize * capacity);
+	map->growthleft = max_load(capacity) - map->count;
+
+	for (int i = 0; i < old.capacity; i++)
+	{
+		if (old.ctrl[i] < 0) continue;
+		const unsigned int hash = Utl_HashString(old.keys[i]);
+		const int slot = find_free_slot(map, hash);
+		set_ctrl(map, slot, hash_h2(hash));
+		map->keys[slot] = old.keys[i];
+		memcpy(value_at(map, slot), value_at(&old, i), map->valuesize);
+	}
+	Utl_Free(old.ctrl);
+	Utl_Free(old.keys);
+	Utl_Free(old.values);
+}
+
+unsigned int Utl_HashString(const char* string)
+{
+	Utl_Assert(string);
+	unsigned int hash = 2166136261u;
+	for (; *string; string++)
+	{
+		hash ^= (unsigned char)*string;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+void Utl_InitHashMap(Utl_HashMap* map, const int valuesize)
+{
+	Utl_Assert(map);
+	Utl_Assert(valuesize > 0);
+	memset(map, 0, sizeof(Utl_HashMap));
+	map->valuesize = valuesize;
+}
+
+void* Utl_FindHashMap(const Utl_HashMap* map, const char* key)
+{
+	Utl_Assert(map && key);
+	const int slot = find_slot(map, key, Utl_HashString(key));
+	return slot >= 0 ? value_at(map, slot) : NULL;
+}
+
+void* Utl_InsertHashMap(Utl_HashMap* map, const char* key, Utl_Bool* inserted)
+{
+	Utl_Assert(map && key);
+	const unsigned int hash = Utl_HashString(key);
+	int slot = find_slot(map, key, hash);
+	if (inserted) *inserted = slot < 0;
+	if (slot >= 0) return value_at(map, slot);
+
+	if (map->growthleft <= 0)
+	{
+		/* Mostly deleted slots are cleaned up in place, otherwise the map doubles */
+		if (map->capacity && map->count < max_load(map->capacity) / 2)
+			rehash(map, map->capacity);
+		else
+			rehash(map, map->capacity ? map->capacity * 2 : Utl_HASHMAP_GROUP_SIZE);
+	}
+
+	slot = find_free_slot(map, hash);
+	/* Reusing a deleted slot doesn't use up an empty one */
+	if (map->ctrl[slot] == CTRL_EMPTY)
+		map->growthleft--;
+	set_ctrl(map, slot, hash_h2(hash));
+	map->keys[slot] = key;
+	memset(value_at(map, slot), 0, map->valuesize);
+	map->count++;
+	return value_at(map, slot);
+}
+
+Utl_Bool Utl_RemoveHashMap(Utl_HashMap* map, const char* key)
+{
+	Utl_Assert(map && key);
+	const int slot = find_slot(map, key, Utl_HashString(key));
+	if (slot < 0) return Utl_FALSE;
+	/* The slot may be in the middle of a probe sequence, so it can't go back to empty */
+	set_ctrl(map, slot, CTRL_DELETED);
+	map->count--;
+	return Utl_TRUE;
+}
+
+void Utl_FreeHashMap(Utl_HashMap* map)
+{
+	Utl_Assert(map);
+	Utl_Free(map->ctrl);
+	Utl_Free(map->keys);
+	Utl_Free(map->values);
+	Utl_InitHashMap(map, map->valuesize);
+}
+
+
+
 char* Utl_CopyCutString(const char* srcstring, const int start, const int length)
 {
 	Utl_Assert(srcstring);
@@ -40,42 +40,59 @@ typedef enum
 
 
 
-#ifndef Utl_USE_64BIT_NUMBERS
+/* 64 bit ints with doubles unless Utl_USE_32BIT_NUMBERS is defined, so an int that overflows into a float keeps its digits */
+#ifdef Utl_USE_32BIT_NUMBERS
 typedef float Utl_Float;
 typedef int32_t Utl_Int;
+#define Utl_INT_MIN INT32_MIN
+#define Utl_INT_MAX INT32_MAX
 #define Utl_StringToFloat strtof
 #else
 typedef double Utl_Float;
-typedef int64_tUtl_Int;
+typedef int64_t Utl_Int;
+#define Utl_INT_MIN INT64_MIN
+#define Utl_INT_MAX INT64_MAX
 #define Utl_StringToFloat strtod
 #endif
 
 
 
-/* Compile without using Fabric wrappers for allocating memory */
-#define Utl_USE_STD_ALLOC
-#ifdef Utl_USE_STD_ALLOC
-
+/* Memory the host and the compiler use, script memory goes through the allocator of the state, see lnn_memory.h */
 #define Utl_Malloc(size)			malloc(size)
 #define Utl_Calloc(count, size)		calloc(count, size)
 #define Utl_Realloc(block, size)	realloc(block, size)
 #define	Utl_AllocType(type)			(type*)calloc(1, sizeof(type))
 #define Utl_Free(block)				free(block)
 
-#else
 
-void* Lnn_Malloc(const size size);
-void* Lnn_Calloc(const int count, const size size);
-void* Lnn_Realloc(void* block, const size size);
-void Lnn_Free(void* block);
-#define Lnn_MALLOC(size)			Lnn_Malloc(size)
-#define Lnn_CALLOC(count, size)		Lnn_Calloc(count, size)
-#define Lnn_REALLOC(block, size)	Lnn_Realloc(block, size)
-#define	Lnn_ALLOC_TYPE(type)		Lnn_Calloc(1, sizeof(type))
-#define Lnn_FREE(block)				Lnn_Free(block)
 
+/* Atomic counters, for reference counts and lock free queues that are shared between threads */
+#ifdef _MSC_VER
+#include <intrin.h>
+typedef volatile long Utl_AtomicInt;
+#define Utl_AtomicIncrement(counter)	_InterlockedIncrement(counter)
+#define Utl_AtomicDecrement(counter)	_InterlockedDecrement(counter)
+#define Utl_AtomicLoad(counter)			_InterlockedOr(counter, 0)
+#define Utl_AtomicStore(counter, value)	((void)_InterlockedExchange(counter, value))
+#define Utl_AtomicCompareExchange(counter, expected, desired)	\
+	(_InterlockedCompareExchange(counter, desired, expected) == (expected))
+#else
+typedef volatile long Utl_AtomicInt;
+#define Utl_AtomicIncrement(counter)	__atomic_add_fetch(counter, 1, __ATOMIC_ACQ_REL)
+#define Utl_AtomicDecrement(counter)	__atomic_sub_fetch(counter, 1, __ATOMIC_ACQ_REL)
+#define Utl_AtomicLoad(counter)			__atomic_load_n(counter, __ATOMIC_ACQUIRE)
+#define Utl_AtomicStore(counter, value)	__atomic_store_n(counter, value, __ATOMIC_RELEASE)
+#define Utl_AtomicCompareExchange(counter, expected, desired)	\
+	__sync_bool_compare_and_swap(counter, expected, desired)
 #endif
 
+/**
+ * @brief Reads a clock that only goes forward, for timing things.
+ * It can be called from any thread.
+ * @return Microseconds since some point in the past.
+ */
+unsigned long long Utl_GetMicroseconds(void);
+
 
 
 /* Double linked list implementation */
@@ -140,13 +157,130 @@ void Utl_UnlinkFromList(Utl_List* list,
  * @brief Removes all elements from a list and calling the destroy_func on every element.
  * This does not free the list itself, only empties it.
  * @param list Pointer to the list to empty.
- * @param destroy_func Pointer to a destructor function, or NULL to use Lnn_Free().
+ * @param destroy_func Pointer to a destructor function, or NULL to use Utl_Free().
  */
 void Utl_ClearList(Utl_List* list,
 				   void(*destroy_func)(void*));
 
 
 
+/* Growable array implementation */
+
+/**
+ * @brief Array that keeps its elements in one contiguous block and grows it by doubling.
+ * Pointers to elements are only valid until the next push.
+ */
+typedef struct
+{
+	void*	data;
+	int		count;
+	int		capacity;
+	int		elementsize;
+} Utl_Vector;
+
+/* Reads or writes an element, the index has to be in bounds */
+#define Utl_VectorAt(vector, type, index)	(((type*)(vector)->data)[index])
+#define Utl_VectorBack(vector, type)		Utl_VectorAt(vector, type, (vector)->count - 1)
+
+/**
+ * @brief Sets up an empty vector, it doesn't allocate anything until the first push.
+ * @param elementsize Size in bytes of every element.
+ */
+void Utl_InitVector(Utl_Vector* vector,
+					const int elementsize);
+
+/**
+ * @brief Copies an element onto the end of a vector.
+ * @param element Pointer to the element to copy, or NULL to push zeroes.
+ * @return Pointer to the element in the vector.
+ */
+void* Utl_PushVector(Utl_Vector* vector,
+					 const void* element);
+
+/**
+ * @brief Removes the element at the end of a vector.
+ * @return Pointer to the removed element, it stays valid until the next push. NULL if the vector was empty.
+ */
+void* Utl_PopVector(Utl_Vector* vector);
+
+/**
+ * @brief Makes sure a vector has room for a number of elements without growing.
+ */
+void Utl_ReserveVector(Utl_Vector* vector,
+					   const int capacity);
+
+/**
+ * @brief Frees the elements of a vector and empties it, it can be pushed to again afterwards.
+ */
+void Utl_FreeVector(Utl_Vector* vector);
+
+
+
+/* Hash map implementation */
+
+/**
+ * Open addressing hash map from strings to values of a fixed size.
+ * Like a swiss table, every slot has a control byte that is either empty, deleted, or the low 7 bits
+ * of the hash of its key. Probing looks at a group of 16 control bytes at once, with sse2 when the
+ * cpu has it, and only compares the keys whose control byte matched.
+ * The first group of control bytes is repeated after the last one so any slot can start a group.
+ * The map doesn't copy its keys, they have to stay alive and unchanged while they are in it.
+ */
+#define Utl_HASHMAP_GROUP_SIZE	16
+
+typedef struct
+{
+	signed char*	ctrl;		/* capacity + Utl_HASHMAP_GROUP_SIZE control bytes */
+	const char**	keys;
+	void*			values;
+	int				valuesize;
+	int				capacity;	/* Power of two, 0 before the first insert */
+	int				count;
+	int				growthleft;	/* Inserts left before the map has to be rehashed */
+} Utl_HashMap;
+
+/**
+ * @brief Hashes a null terminated string with FNV-1a.
+ */
+unsigned int Utl_HashString(const char* string);
+
+/**
+ * @brief Sets up an empty map, it doesn't allocate anything until the first insert.
+ * @param valuesize Size in bytes of every value.
+ */
+void Utl_InitHashMap(Utl_HashMap* map,
+					 const int valuesize);
+
+/**
+ * @brief Looks up the value of a key.
+ * @return Pointer to the value, or NULL if the key isn't in the map.
+ */
+void* Utl_FindHashMap(const Utl_HashMap* map,
+					  const char* key);
+
+/**
+ * @brief Finds the value of a key, adding the key with a zeroed value if it isn't in the map.
+ * @param inserted Set to whether the key was added, can be NULL.
+ * @return Pointer to the value, it stays valid until the next insert.
+ */
+void* Utl_InsertHashMap(Utl_HashMap* map,
+						const char* key,
+						Utl_Bool* inserted);
+
+/**
+ * @brief Removes a key from a map.
+ * @return Utl_FALSE if the key wasn't in the map.
+ */
+Utl_Bool Utl_RemoveHashMap(Utl_HashMap* map,
+						   const char* key);
+
+/**
+ * @brief Frees the slots of a map and empties it, the keys aren't freed.
+ */
+void Utl_FreeHashMap(Utl_HashMap* map);
+
+
+
 /* String functions */
 
 #define Utl_Stringify2(str) #str
@@ -0,0 +1,198 @@
+#include "lnn_array.h"
+#include "lnn_state.h"
+#include "lnn_gc.h"
+#include "lnn_object.h"
+
+const char* lnn_elementskind_names[Lnn_NUM_ELEMENTSKINDS] =
+{
+	"EK_INT",
+	"EK_FLOAT",
+	"EK_VALUE"
+};
+
+const size_t lnn_elementskind_sizes[Lnn_NUM_ELEMENTSKINDS] =
+{
+	sizeof(Utl_Int),
+	sizeof(Utl_Float),
+	sizeof(Lnn_Value)
+};
+
+
+
+Lnn_Array* Lnn_NewArray(Lnn_State* state, const int capacity)
+{
+	Utl_Assert(state && capacity >= 0);
+	Lnn_Array* array = (Lnn_Array*)Lnn_GCAllocate(state, sizeof(Lnn_Array), Lnn_VT_ARRAY);
+	if (!array) return NULL;
+	array->kind = Lnn_EK_INT;
+	array->length = 0;
+	array->capacity = capacity;
+	array->elements.ints = capacity ? Lnn_Allocate(state, Lnn_ElementsBytes(Lnn_EK_INT, capacity)) : NULL;
+	/* The collector is left an empty array */
+	if (capacity && !array->elements.ints)
+	{
+		array->capacity = 0;
+		return NULL;
+	}
+	return array;
+}
+
+Lnn_Array* Lnn_NewFloatArray(Lnn_State* state, const int length)
+{
+	Utl_Assert(state && length >= 0);
+	Lnn_Array* array = (Lnn_Array*)Lnn_GCAllocate(state, sizeof(Lnn_Array), Lnn_VT_ARRAY);
+	if (!array) return NULL;
+	array->kind = Lnn_EK_FLOAT;
+	array->length = length;
+	array->capacity = length;
+	array->elements.floats = length ? Lnn_Allocate(state, Lnn_ElementsBytes(Lnn_EK_FLOAT, length)) : NULL;
+	if (length && !array->elements.floats)
+	{
+		array->length = array->capacity = 0;
+		return NULL;
+	}
+	return array;
+}
+
+Lnn_Value Lnn_ArrayElement(const Lnn_Array* array, const int index)
+{
+	switch (array->kind)
+	{
+	case Lnn_EK_INT: return Lnn_IntValue(array->elements.ints[index]);
+	case Lnn_EK_FLOAT: return Lnn_FloatValue(array->elements.floats[index]);
+	default: return array->elements.values[index];
+	}
+}
+
+/* Least general elements kind that can store a value */
+static Lnn_ElementsKind kind_of_value(const Lnn_Value value)
+{
+	if (Lnn_IsInt(value)) return Lnn_EK_INT;
+	return Lnn_IsFloat(value) ? Lnn_EK_FLOAT : Lnn_EK_VALUE;
+}
+
+Utl_Bool Lnn_GeneralizeArray(Lnn_State* state, Lnn_Array* array, const Lnn_ElementsKind kind)
+{
+	Utl_Assert(kind > array->kind);
+	void* elements = array->capacity ? Lnn_Allocate(state, Lnn_ElementsBytes(kind, array->capacity)) : NULL;
+	if (array->capacity && !elements) return Utl_FALSE;
+	for (int i = 0; i < array->length; i++)
+	{
+		const Lnn_Value element = Lnn_ArrayElement(array, i);
+		if (kind == Lnn_EK_FLOAT)
+			((Utl_Float*)elements)[i] = Lnn_NumberOf(element);
+		else
+			((Lnn_Value*)elements)[i] = element;
+	}
+	Lnn_Deallocate(state, array->elements.ints, Lnn_ElementsBytes(array->kind, array->capacity));
+	array->elements.ints = elements;
+	array->kind = kind;
+	return Utl_TRUE;
+}
+
+static Utl_Bool store_element(Lnn_State* state, Lnn_Array* array, const int index, const Lnn_Value value)
+{
+	const Lnn_ElementsKind kind = kind_of_value(value);
+	if (kind > array->kind && !Lnn_GeneralizeArray(state, array, kind))
+		return Utl_FALSE;
+
+	switch (array->kind)
+	{
+	case Lnn_EK_INT: array->elements.ints[index] = value.u.integer; return Utl_TRUE;
+	case Lnn_EK_FLOAT: array->elements.floats[index] = Lnn_NumberOf(value); return Utl_TRUE;
+	default:
+		array->elements.values[index] = value;
+		Lnn_GCWriteBarrier(state, &array->obj, value);
+		return Utl_TRUE;
+	}
+}
+
+Utl_Bool Lnn_PushElement(Lnn_State* state, Lnn_Array* array, const Lnn_Value value)
+{
+	Utl_Assert(state && array);
+	if (array->length >= array->capacity)
+	{
+		const int capacity = array->capacity ? array->capacity * 2 : 4;
+		void* elements = Lnn_Reallocate(state, array->elements.ints,
+										Lnn_ElementsBytes(array->kind, array->capacity),
+										Lnn_ElementsBytes(array->kind, capacity));
+		if (!elements) return Utl_FALSE;
+		array->elements.ints = elements;
+		array->capacity = capacity;
+	}
+	if (!store_element(state, array, array->length, value)) return Utl_FALSE;
+	array->length++;
+	return Utl_TRUE;
+}
+
+Utl_Bool Lnn_GetElement(Lnn_State* state,
+						const Lnn_Value array,
+						const Lnn_Value index,
+						Lnn_Value* result)
+{
+	/* Reading doesn't allocate, the state is only taken to match Lnn_SetElement() */
+	(void)state;
+	Utl_Assert(state && result);
+	if (array.type != Lnn_VT_ARRAY)
+	{
+		printf("ERROR! Can't index %s\n", lnn_valuetype_names[array.type]);
+		return Utl_FALSE;
+	}
+	if (!Lnn_IsArrayIndex(array.u.array, index))
+	{
+		printf("ERROR! Index ");
+		Lnn_PrintValue(index);
+		printf(" is out of bounds of an array with %i elements\n", array.u.array->length);
+		return Utl_FALSE;
+	}
+	*result = Lnn_ArrayElement(array.u.array, Lnn_ArrayIndexOf(index));
+	return Utl_TRUE;
+}
+
+Utl_Bool Lnn_SetElement(Lnn_State* state,
+						const Lnn_Value array,
+						const Lnn_Value index,
+						const Lnn_Value value)
+{
+	Utl_Assert(state);
+	if (array.type != Lnn_VT_ARRAY)
+	{
+		printf("ERROR! Can't index %s\n", lnn_valuetype_names[array.type]);
+		return Utl_FALSE;
+	}
+	if (Lnn_IsNumber(index) && Lnn_NumberOf(index) == array.u.array->length)
+		return Lnn_PushElement(state, array.u.array, value);
+	if (!Lnn_IsArrayIndex(array.u.array, index))
+	{
+		printf("ERROR! Index ");
+		Lnn_PrintValue(index);
+		printf(" is out of bounds of an array with %i elements\n", array.u.array->length);
+		return Utl_FALSE;
+	}
+	return store_element(state, array.u.array, Lnn_ArrayIndexOf(index), value);
+}
+
+
+
+void Lnn_PrintArray(const Lnn_Array* array, const int depth)
+{
+	if (depth > 2 && array->length > 0)
+	{
+		printf("[...]");
+		return;
+	}
+
+	putchar('[');
+	for (int i = 0; i < array->length; i++)
+	{
+		if (i) printf(", ");
+		const Lnn_Value element = Lnn_ArrayElement(array, i);
+		if (element.type == Lnn_VT_OBJECT)
+			Lnn_PrintInstance(element.u.instance, depth + 1);
+		else if (element.type == Lnn_VT_ARRAY)
+			Lnn_PrintArray(element.u.array, depth + 1);
+		else
+			Lnn_PrintValue(element);
+	}
+	putchar(']');
+}
@@ -0,0 +1,118 @@
+#ifndef _Lnn_ARRAY_H_
+#define _Lnn_ARRAY_H_
+
+#include "fab_utility.h"
+#include "lnn_value.h"
+
+struct Lnn_State;
+
+/**
+ * Arrays keep their elements in one contiguous block that grows by doubling.
+ * The elements kind says how they are stored. Arrays start out as packed ints and move to
+ * a more general kind when an element doesn't fit, they never go back.
+ */
+typedef enum
+{
+	Lnn_EK_INT,		/* Ints, stored as Utl_Int */
+	Lnn_EK_FLOAT,	/* Any numbers, stored as Utl_Float so ints stored in them are read back as floats */
+	Lnn_EK_VALUE,	/* Any values, stored as Lnn_Value */
+	Lnn_NUM_ELEMENTSKINDS
+} Lnn_ElementsKind;
+extern const char* lnn_elementskind_names[Lnn_NUM_ELEMENTSKINDS];
+extern const size_t lnn_elementskind_sizes[Lnn_NUM_ELEMENTSKINDS];
+
+/* Size in bytes of a block of elements, what it was allocated with from the state */
+#define Lnn_ElementsBytes(kind, count)	(lnn_elementskind_sizes[kind] * (size_t)(count))
+
+typedef struct Lnn_Array
+{
+	Lnn_Object obj;
+	Lnn_ElementsKind kind;
+	int length;
+	int capacity;
+	union
+	{
+		Utl_Int* ints;
+		Utl_Float* floats;
+		Lnn_Value* values;
+	} elements;
+} Lnn_Array;
+
+/**
+ * @brief Creates an empty array owned by a state.
+ * @param state State that owns the array.
+ * @param capacity How many elements to make room for right away.
+ * @return The array, or NULL if there is no memory left, the error is printed.
+ */
+Lnn_Array* Lnn_NewArray(struct Lnn_State* state,
+						const int capacity);
+
+/**
+ * @brief Creates an array of the kind Lnn_EK_FLOAT with room for length elements,
+ * for native code that fills in the elements itself.
+ * @param state State that owns the array.
+ * @param length How many elements the array has, they are uninitialized.
+ * @return The array, or NULL if there is no memory left, the error is printed.
+ */
+Lnn_Array* Lnn_NewFloatArray(struct Lnn_State* state,
+							 const int length);
+
+/* Checks if a value is an int, or a float with a whole value, that is in bounds of an array */
+#define Lnn_IsArrayIndex(array, index)																\
+	(Lnn_IsInt(index) ? (index).u.integer >= 0 && (index).u.integer < (array)->length :			\
+	 Lnn_IsFloat(index) && (index).u.number >= 0 && (index).u.number < (array)->length &&			\
+	 (Utl_Float)(int)(index).u.number == (index).u.number)
+
+/* Index a value that passed Lnn_IsArrayIndex() stands for */
+#define Lnn_ArrayIndexOf(index)		(Lnn_IsInt(index) ? (int)(index).u.integer : (int)(index).u.number)
+
+/**
+ * @brief Moves an array to a more general elements kind, converting the elements it has.
+ * @return Utl_FALSE if there is no memory left, the error is printed and the array is left as it was.
+ */
+Utl_Bool Lnn_GeneralizeArray(struct Lnn_State* state,
+						 Lnn_Array* array,
+						 const Lnn_ElementsKind kind);
+
+/**
+ * @brief Reads an element without any checks, the index has to be in bounds.
+ */
+Lnn_Value Lnn_ArrayElement(const Lnn_Array* array,
+						   const int index);
+
+/**
+ * @brief Gets an element of an array.
+ * @param state State the array belongs to.
+ * @param array Value to index.
+ * @param index Value to index it with.
+ * @param result Where the element is put.
+ * @return Utl_FALSE if the value isn't an array or the index isn't in bounds, the error is printed.
+ */
+Utl_Bool Lnn_GetElement(struct Lnn_State* state,
+						const Lnn_Value array,
+						const Lnn_Value index,
+						Lnn_Value* result);
+
+/**
+ * @brief Sets an element of an array. Setting the element at the length of the array appends it.
+ * The array moves to a more general elements kind if the value doesn't fit the one it has.
+ * @return Utl_FALSE if the value isn't an array, the index isn't in bounds or there is no memory left,
+ * the error is printed.
+ */
+Utl_Bool Lnn_SetElement(struct Lnn_State* state,
+						const Lnn_Value array,
+						const Lnn_Value index,
+						const Lnn_Value value);
+
+/**
+ * @brief Appends an element to the end of an array.
+ * @return Utl_FALSE if there is no memory left, the error is printed and the array is left as it was.
+ */
+Utl_Bool Lnn_PushElement(struct Lnn_State* state,
+					 Lnn_Array* array,
+					 const Lnn_Value value);
+
+void Lnn_PrintArray(const Lnn_Array* array,
+					const int depth);
+
+#endif
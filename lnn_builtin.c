@@ -0,0 +1,144 @@
+#include "lnn_builtin.h"
+#include "lnn_state.h"
+#include "lnn_array.h"
+#include "lnn_kernels.h"
+
+/**
+ * @brief Gets the elements of an argument that has to be an array of numbers.
+ * @param elements Set to the elements, may be NULL if the array is empty.
+ * @param temp Set to memory that has to be freed afterwards, or NULL.
+ * @return Utl_FALSE if the argument isn't an array of numbers, the error is printed.
+ */
+static Utl_Bool number_elements(const char* function, const Lnn_Value value, const Utl_Float** elements, Utl_Float** temp)
+{
+	*temp = NULL;
+	if (!Lnn_IsArray(value))
+	{
+		printf("ERROR! %s needs an array, not %s\n", function, lnn_valuetype_names[value.type]);
+		return Utl_FALSE;
+	}
+	if (value.u.array->kind == Lnn_EK_VALUE)
+	{
+		printf("ERROR! %s needs an array of numbers\n", function);
+		return Utl_FALSE;
+	}
+	*elements = Lnn_FloatElements(value.u.array, temp);
+	return Utl_TRUE;
+}
+
+/* Builtin that reduces an array of numbers to one number */
+#define define_reduce_builtin(name, kernel, emptyresult)								\
+	static Utl_Bool name(Lnn_State* state, const Lnn_Value* args, Lnn_Value* result)	\
+	{																					\
+		const Utl_Float* a;																\
+		Utl_Float* temp;																\
+		if (!number_elements(#kernel, args[0], &a, &temp)) return Utl_FALSE;			\
+		const int count = args[0].u.array->length;										\
+		*result = count > 0 ? Lnn_FloatValue(state->kernels->kernel(a, count)) : emptyresult;	\
+		Utl_Free(temp);																	\
+		return Utl_TRUE;																\
+	}
+
+define_reduce_builtin(builtin_sum, sum, Lnn_FloatValue(0))
+define_reduce_builtin(builtin_min, min, Lnn_NullValue())
+define_reduce_builtin(builtin_max, max, Lnn_NullValue())
+
+static Utl_Bool builtin_dot(Lnn_State* state, const Lnn_Value* args, Lnn_Value* result)
+{
+	const Utl_Float* a;
+	const Utl_Float* b;
+	Utl_Float* atemp;
+	Utl_Float* btemp = NULL;
+	if (!number_elements("dot", args[0], &a, &atemp)) return Utl_FALSE;
+	const Utl_Bool numbers = number_elements("dot", args[1], &b, &btemp);
+	Utl_Bool ok = Utl_FALSE;
+	if (numbers && args[0].u.array->length != args[1].u.array->length)
+		printf("ERROR! dot needs arrays of the same length, not %i and %i\n", args[0].u.array->length, args[1].u.array->length);
+	else if (numbers)
+	{
+		*result = Lnn_FloatValue(state->kernels->dot(a, b, args[0].u.array->length));
+		ok = Utl_TRUE;
+	}
+	Utl_Free(atemp);
+	Utl_Free(btemp);
+	return ok;
+}
+
+static Utl_Bool builtin_scale(Lnn_State* state, const Lnn_Value* args, Lnn_Value* result)
+{
+	const Utl_Float* a;
+	Utl_Float* temp;
+	if (!number_elements("scale", args[0], &a, &temp)) return Utl_FALSE;
+	if (!Lnn_IsNumber(args[1]))
+	{
+		printf("ERROR! scale needs a number to multiply by, not %s\n", lnn_valuetype_names[args[1].type]);
+		Utl_Free(temp);
+		return Utl_FALSE;
+	}
+	Lnn_Array* scaled = Lnn_NewFloatArray(state, args[0].u.array->length);
+	if (!scaled)
+	{
+		Utl_Free(temp);
+		return Utl_FALSE;
+	}
+	state->kernels->scale(scaled->elements.floats, a, Lnn_NumberOf(args[1]), scaled->length);
+	*result = Lnn_ArrayValue(scaled);
+	Utl_Free(temp);
+	return Utl_TRUE;
+}
+
+static Utl_Bool builtin_add(Lnn_State* state, const Lnn_Value* args, Lnn_Value* result)
+{
+	const Utl_Float* a;
+	const Utl_Float* b;
+	Utl_Float* atemp;
+	Utl_Float* btemp = NULL;
+	if (!number_elements("add", args[0], &a, &atemp)) return Utl_FALSE;
+	const Utl_Bool numbers = number_elements("add", args[1], &b, &btemp);
+	Utl_Bool ok = Utl_FALSE;
+	if (numbers && args[0].u.array->length != args[1].u.array->length)
+		printf("ERROR! add needs arrays of the same length, not %i and %i\n", args[0].u.array->length, args[1].u.array->length);
+	else if (numbers)
+	{
+		Lnn_Array* sums = Lnn_NewFloatArray(state, args[0].u.array->length);
+		if (sums)
+		{
+			state->kernels->add(sums->elements.floats, a, b, sums->length);
+			*result = Lnn_ArrayValue(sums);
+			ok = Utl_TRUE;
+		}
+	}
+	Utl_Free(atemp);
+	Utl_Free(btemp);
+	return ok;
+}
+
+/* Only reached by the tiers that can't suspend a run */
+static Utl_Bool builtin_yield(Lnn_State* state, const Lnn_Value* args, Lnn_Value* result)
+{
+	(void)state;
+	(void)args;
+	(void)result;
+	printf("ERROR! yield only works in coroutines, which run on the vm\n");
+	return Utl_FALSE;
+}
+
+const Lnn_Builtin lnn_builtins[Lnn_NUM_BUILTINS] =
+{
+	{ "sum", 1, builtin_sum },
+	{ "min", 1, builtin_min },
+	{ "max", 1, builtin_max },
+	{ "dot", 2, builtin_dot },
+	{ "scale", 2, builtin_scale },
+	{ "add", 2, builtin_add },
+	{ "yield", 1, builtin_yield },
+};
+
+int Lnn_FindBuiltin(const char* name)
+{
+	Utl_Assert(name);
+	for (int i = 0; i < Lnn_NUM_BUILTINS; i++)
+		if (strcmp(lnn_builtins[i].name, name) == 0)
+			return i;
+	return -1;
+}
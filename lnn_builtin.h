@@ -0,0 +1,50 @@
+#ifndef _Lnn_BUILTIN_H_
+#define _Lnn_BUILTIN_H_
+
+#include "fab_utility.h"
+#include "lnn_value.h"
+
+struct Lnn_State;
+
+/**
+ * @brief A function written in C that scripts can call by name.
+ * @param state State the call runs in.
+ * @param args The arguments, there are always as many as the builtin takes.
+ * @param result Where the return value is put, it may point to the first argument.
+ * @return Utl_FALSE if there was a runtime error, the error is printed.
+ */
+typedef Utl_Bool(*Lnn_BuiltinFunction)(struct Lnn_State* state,
+									   const Lnn_Value* args,
+									   Lnn_Value* result);
+
+/* Most arguments any builtin takes */
+#define Lnn_MAX_BUILTIN_ARGS 4
+
+typedef struct Lnn_Builtin
+{
+	const char* name;
+	int numargs;
+	Lnn_BuiltinFunction function;
+} Lnn_Builtin;
+
+/* The array builtins run on the kernels in lnn_kernels.h */
+typedef enum
+{
+	Lnn_BI_SUM,		/* sum(a) */
+	Lnn_BI_MIN,		/* min(a), null if a is empty */
+	Lnn_BI_MAX,		/* max(a), null if a is empty */
+	Lnn_BI_DOT,		/* dot(a, b) */
+	Lnn_BI_SCALE,	/* scale(a, k), a new array with every element multiplied by k */
+	Lnn_BI_ADD,		/* add(a, b), a new array with the sums of the elements */
+	Lnn_BI_YIELD,	/* yield(v), suspends the coroutine, the vm compiles it to an instruction */
+	Lnn_NUM_BUILTINS
+} Lnn_BuiltinID;
+extern const Lnn_Builtin lnn_builtins[Lnn_NUM_BUILTINS];
+
+/**
+ * @brief Finds a builtin by name.
+ * @return The Lnn_BuiltinID of the builtin, or -1 if there is none with the name.
+ */
+int Lnn_FindBuiltin(const char* name);
+
+#endif
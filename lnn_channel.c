@@ -0,0 +1,400 @@
+#include "lnn_channel.h"
+#include "lnn_state.h"
+#include "lnn_string.h"
+#include "lnn_array.h"
+#include "lnn_object.h"
+#include "lnn_native.h"
+
+const char* lnn_channelkind_names[Lnn_NUM_CHANNELKINDS] =
+{
+	"CK_SPSC",
+	"CK_MPMC"
+};
+
+/* Copy of an object that no state owns, members are in slot order */
+typedef struct copied_instance
+{
+	Lnn_Object obj;
+	int nummembers;
+	char** names;
+	Lnn_Value* values;
+} copied_instance;
+
+/* Positions wrap around, so they are compared by their difference */
+#define position_after(pos, n)		((long)((unsigned long)(pos) + (unsigned long)(n)))
+#define position_diff(a, b)			((long)((unsigned long)(a) - (unsigned long)(b)))
+
+
+
+static void free_copy(const Lnn_Value value)
+{
+	switch (value.type)
+	{
+	case Lnn_VT_STRING:
+		Lnn_DestroyObject(&value.u.string->obj);
+		return;
+	case Lnn_VT_ARRAY:
+	{
+		Lnn_Array* array = value.u.array;
+		if (array->kind == Lnn_EK_VALUE)
+			for (int i = 0; i < array->length; i++)
+				free_copy(array->elements.values[i]);
+		Utl_Free(array->elements.ints);
+		Utl_Free(array);
+		return;
+	}
+	case Lnn_VT_OBJECT:
+	{
+		copied_instance* instance = (copied_instance*)value.u.object;
+		for (int i = 0; i < instance->nummembers; i++)
+		{
+			Utl_Free(instance->names[i]);
+			free_copy(instance->values[i]);
+		}
+		Utl_Free(instance->names);
+		Utl_Free(instance->values);
+		Utl_Free(instance);
+		return;
+	}
+	default:
+		return;
+	}
+}
+
+static Utl_Bool copy_out(Lnn_State* state, const Lnn_Value value, const int depth, Lnn_Value* copy)
+{
+	if (depth > Lnn_CHANNEL_MAX_DEPTH)
+	{
+		printf("ERROR! Can't copy values nested deeper than %i to another state, or ones that contain themselves\n", Lnn_CHANNEL_MAX_DEPTH);
+		return Utl_FALSE;
+	}
+
+	switch (value.type)
+	{
+	case Lnn_VT_NULL:
+	case Lnn_VT_BOOL:
+	case Lnn_VT_FLOAT:
+	case Lnn_VT_INT:
+	case Lnn_VT_SHORTSTRING:
+		*copy = value;
+		return Utl_TRUE;
+
+	case Lnn_VT_STRING:
+	{
+		int len;
+		const char* chars = Lnn_StringChars(state, &value, &len);
+		*copy = Lnn_StringValue(Lnn_AllocString(chars, len));
+		return Utl_TRUE;
+	}
+
+	case Lnn_VT_ARRAY:
+	{
+		const Lnn_Array* source = value.u.array;
+		Lnn_Array* array = Utl_AllocType(Lnn_Array);
+		array->obj.type = Lnn_VT_ARRAY;
+		array->kind = source->kind;
+		array->length = array->capacity = source->length;
+		array->elements.ints = Utl_Malloc(Lnn_ElementsBytes(source->kind, source->length) + 1);
+		if (source->kind != Lnn_EK_VALUE)
+		{
+			/* Numbers don't refer to anything, so the elements are copied in one go */
+			if (source->length)
+				memcpy(array->elements.ints, source->elements.ints, Lnn_ElementsBytes(source->kind, source->length));
+			*copy = Lnn_ArrayValue(array);
+			return Utl_TRUE;
+		}
+		for (int i = 0; i < source->length; i++)
+		{
+			if (!copy_out(state, source->elements.values[i], depth + 1, &array->elements.values[i]))
+			{
+				array->length = i;
+				free_copy(Lnn_ArrayValue(array));
+				return Utl_FALSE;
+			}
+		}
+		*copy = Lnn_ArrayValue(array);
+		return Utl_TRUE;
+	}
+
+	case Lnn_VT_OBJECT:
+	{
+		const Lnn_Instance* source = value.u.instance;
+		const int nummembers = source->shape->numslots;
+		copied_instance* instance = Utl_AllocType(copied_instance);
+		instance->obj.type = Lnn_VT_OBJECT;
+		instance->names = Utl_Malloc(sizeof(char*) * (nummembers + 1));
+		instance->values = Utl_Malloc(sizeof(Lnn_Value) * (nummembers + 1));
+		/* Every shape adds the member in the last slot, so walking up the tree gives the names from the back */
+		const Lnn_Shape* shape = source->shape;
+		for (int i = nummembers - 1; i >= 0; i--, shape = shape->parent)
+			instance->names[i] = shape->name;
+		for (int i = 0; i < nummembers; i++)
+		{
+			if (!copy_out(state, source->slots[i], depth + 1, &instance->values[i]))
+			{
+				free_copy(Lnn_ObjectValue((Lnn_Instance*)instance));
+				return Utl_FALSE;
+			}
+			instance->names[i] = _strdup(instance->names[i]);
+			instance->nummembers++;
+		}
+		*copy = Lnn_ObjectValue((Lnn_Instance*)instance);
+		return Utl_TRUE;
+	}
+
+	default:
+		printf("ERROR! Can't copy %s to another state\n", lnn_valuetype_names[value.type]);
+		return Utl_FALSE;
+	}
+}
+
+/* Whatever was made before running out of memory is left to the collector */
+static Utl_Bool copy_in(Lnn_State* state, const Lnn_Value copy, Lnn_Value* value)
+{
+	switch (copy.type)
+	{
+	case Lnn_VT_STRING:
+		*value = Lnn_NewStringValue(state, copy.u.string->chars, copy.u.string->len);
+		return value->type != Lnn_VT_NULL;
+
+	case Lnn_VT_ARRAY:
+	{
+		const Lnn_Array* source = copy.u.array;
+		Lnn_Array* array = Lnn_NewArray(state, source->length);
+		if (!array) return Utl_FALSE;
+		if (source->kind == Lnn_EK_VALUE)
+		{
+			for (int i = 0; i < source->length; i++)
+			{
+				Lnn_Value element;
+				if (!copy_in(state, source->elements.values[i], &element) || !Lnn_PushElement(state, array, element))
+					return Utl_FALSE;
+			}
+		} else
+		{
+			if (source->kind != Lnn_EK_INT && !Lnn_GeneralizeArray(state, array, source->kind))
+				return Utl_FALSE;
+			if (source->length)
+				memcpy(array->elements.ints, source->elements.ints, Lnn_ElementsBytes(source->kind, source->length));
+			array->length = source->length;
+		}
+		*value = Lnn_ArrayValue(array);
+		return Utl_TRUE;
+	}
+
+	case Lnn_VT_OBJECT:
+	{
+		const copied_instance* source = (const copied_instance*)copy.u.object;
+		Lnn_Instance* instance = Lnn_NewInstance(state, source->nummembers);
+		if (!instance) return Utl_FALSE;
+		const Lnn_Value object = Lnn_ObjectValue(instance);
+		for (int i = 0; i < source->nummembers; i++)
+		{
+			Lnn_Value member;
+			if (!copy_in(state, source->values[i], &member) || !Lnn_SetMember(state, NULL, source->names[i], object, member))
+				return Utl_FALSE;
+		}
+		*value = object;
+		return Utl_TRUE;
+	}
+
+	default:
+		*value = copy;
+		return Utl_TRUE;
+	}
+}
+
+
+
+Utl_Bool Lnn_DetachValue(Lnn_State* state, const Lnn_Value value, Lnn_Value* copy)
+{
+	Utl_Assert(state && copy);
+	return copy_out(state, value, 0, copy);
+}
+
+Utl_Bool Lnn_AttachValue(Lnn_State* state, const Lnn_Value copy, Lnn_Value* value)
+{
+	Utl_Assert(state && value);
+	if (copy_in(state, copy, value)) return Utl_TRUE;
+	*value = Lnn_NullValue();
+	return Utl_FALSE;
+}
+
+void Lnn_FreeDetachedValue(const Lnn_Value copy)
+{
+	free_copy(copy);
+}
+
+
+
+Lnn_Channel* Lnn_CreateChannel(const int capacity, const Lnn_ChannelKind kind)
+{
+	if (capacity < 1)
+	{
+		printf("ERROR! Channels need room for at least one value, not %i\n", capacity);
+		return NULL;
+	}
+	unsigned long numcells = 1;
+	while (numcells < (unsigned long)capacity)
+		numcells <<= 1;
+
+	Lnn_Channel* channel = Utl_AllocType(Lnn_Channel);
+	channel->kind = kind;
+	channel->cells = Utl_Malloc(sizeof(Lnn_ChannelCell) * numcells);
+	for (unsigned long i = 0; i < numcells; i++)
+	{
+		channel->cells[i].sequence = (long)i;
+		channel->cells[i].value = Lnn_NullValue();
+	}
+	channel->mask = numcells - 1;
+	channel->refcount = 1;
+	return channel;
+}
+
+void Lnn_RetainChannel(Lnn_Channel* channel)
+{
+	Utl_Assert(channel);
+	Utl_AtomicIncrement(&channel->refcount);
+}
+
+void Lnn_ReleaseChannel(Lnn_Channel* channel)
+{
+	Utl_Assert(channel);
+	if (Utl_AtomicDecrement(&channel->refcount) > 0) return;
+
+	for (long pos = channel->receivepos; pos != channel->sendpos; pos = position_after(pos, 1))
+		free_copy(channel->cells[(unsigned long)pos & channel->mask].value);
+	Utl_Free(channel->cells);
+	Utl_Free(channel);
+}
+
+Utl_Bool Lnn_TrySend(Lnn_State* state, Lnn_Channel* channel, const Lnn_Value value, Utl_Bool* sent)
+{
+	Utl_Assert(state && channel && sent);
+	*sent = Utl_FALSE;
+	if (value.type == Lnn_VT_NULL)
+	{
+		printf("ERROR! Can't send null through a channel\n");
+		return Utl_FALSE;
+	}
+
+	/* The receivers haven't taken the value from a lap ago, senders that spin on a full channel don't copy */
+	long pos = Utl_AtomicLoad(&channel->sendpos);
+	if (position_diff(Utl_AtomicLoad(&channel->cells[(unsigned long)pos & channel->mask].sequence), pos) < 0)
+		return Utl_TRUE;
+	Lnn_Value copy;
+	if (!copy_out(state, value, 0, &copy)) return Utl_FALSE;
+
+	Lnn_ChannelCell* cell;
+	for (;;)
+	{
+		cell = &channel->cells[(unsigned long)pos & channel->mask];
+		const long diff = position_diff(Utl_AtomicLoad(&cell->sequence), pos);
+		if (diff < 0)
+		{
+			/* Other senders filled it while the value was copied */
+			free_copy(copy);
+			return Utl_TRUE;
+		}
+		if (diff == 0)
+		{
+			if (channel->kind == Lnn_CK_SPSC)
+			{
+				Utl_AtomicStore(&channel->sendpos, position_after(pos, 1));
+				break;
+			}
+			if (Utl_AtomicCompareExchange(&channel->sendpos, pos, position_after(pos, 1)))
+				break;
+		}
+		/* Another sender got there first */
+		pos = Utl_AtomicLoad(&channel->sendpos);
+	}
+	cell->value = copy;
+	Utl_AtomicStore(&cell->sequence, position_after(pos, 1));
+	*sent = Utl_TRUE;
+	return Utl_TRUE;
+}
+
+Utl_Bool Lnn_TryReceive(Lnn_State* state, Lnn_Channel* channel, Lnn_Value* value)
+{
+	Utl_Assert(state && channel && value);
+	*value = Lnn_NullValue();
+
+	long pos = Utl_AtomicLoad(&channel->receivepos);
+	Lnn_ChannelCell* cell;
+	for (;;)
+	{
+		cell = &channel->cells[(unsigned long)pos & channel->mask];
+		const long diff = position_diff(Utl_AtomicLoad(&cell->sequence), position_after(pos, 1));
+		if (diff < 0) return Utl_FALSE;
+		if (diff == 0)
+		{
+			if (channel->kind == Lnn_CK_SPSC)
+			{
+				Utl_AtomicStore(&channel->receivepos, position_after(pos, 1));
+				break;
+			}
+			if (Utl_AtomicCompareExchange(&channel->receivepos, pos, position_after(pos, 1)))
+				break;
+		}
+		pos = Utl_AtomicLoad(&channel->receivepos);
+	}
+	const Lnn_Value copy = cell->value;
+	/* The cell is free for the sender one lap ahead */
+	Utl_AtomicStore(&cell->sequence, position_after(pos, channel->mask + 1));
+	/* A value there is no memory for is lost, the state is flagged so the run fails */
+	if (!copy_in(state, copy, value))
+		*value = Lnn_NullValue();
+	free_copy(copy);
+	return Utl_TRUE;
+}
+
+
+
+/* Scripts only get channel values from Lnn_BindChannel(), the state holds a reference to every one of them */
+static Lnn_Channel* channel_of(const char* function, const Lnn_Value value)
+{
+	if (value.type != Lnn_VT_CHANNEL)
+	{
+		printf("ERROR! %s needs a channel, not %s\n", function, lnn_valuetype_names[value.type]);
+		return NULL;
+	}
+	return value.u.channel;
+}
+
+static Utl_Bool native_send(Lnn_State* state, const Lnn_Value* args, Lnn_Value* result)
+{
+	Lnn_Channel* channel = channel_of("send", args[0]);
+	if (!channel) return Utl_FALSE;
+	Utl_Bool sent;
+	if (!Lnn_TrySend(state, channel, args[1], &sent)) return Utl_FALSE;
+	*result = Lnn_BoolValue(sent);
+	return Utl_TRUE;
+}
+
+static Utl_Bool native_receive(Lnn_State* state, const Lnn_Value* args, Lnn_Value* result)
+{
+	Lnn_Channel* channel = channel_of("receive", args[0]);
+	if (!channel) return Utl_FALSE;
+	Lnn_TryReceive(state, channel, result);
+	return !state->memory.outofmemory;
+}
+
+int Lnn_BindChannel(Lnn_State* state, const char* name, Lnn_Channel* channel)
+{
+	Utl_Assert(state && name && channel);
+	if (state->numchannels == 0)
+	{
+		Lnn_RegisterNative(state, "send", 2, native_send);
+		Lnn_RegisterNative(state, "receive", 1, native_receive);
+	}
+
+	Lnn_RetainChannel(channel);
+	state->channels = Utl_Realloc(state->channels, sizeof(Lnn_Channel*) * (state->numchannels + 1));
+	state->channels[state->numchannels] = channel;
+
+	const int slot = Lnn_GetGlobalSlot(state, name);
+	state->globals[slot].value = Lnn_ChannelValue(channel);
+	state->numchannels++;
+	return slot;
+}
@@ -0,0 +1,134 @@
+#ifndef _Lnn_CHANNEL_H_
+#define _Lnn_CHANNEL_H_
+
+#include "fab_utility.h"
+#include "lnn_value.h"
+
+struct Lnn_State;
+
+/**
+ * Channels pass values from one state to another, usually on another thread, without any locks.
+ * A channel is a bounded ring buffer where every cell has a sequence number that says whether it
+ * is free or has a value for the next receiver, so senders and receivers only meet on the one
+ * cell they use. Channels are shared by reference counting and outlive the states bound to them.
+ * Every state has its own heap, so nothing that lives on one can be handed over as it is.
+ * Numbers, booleans and short strings are moved in the cell itself. Long strings, arrays and
+ * objects are deep copied out of the sending state when sent and into the receiving one when received,
+ * arrays of numbers with one copy of their elements. Functions and channels can't be sent, and null
+ * can't either since receiving from an empty channel gives null.
+ */
+
+/**
+ * @brief Deep copies a value out of the heap of a state into memory no state owns.
+ * Values that aren't on a heap are returned as they are.
+ * @param state State the value belongs to.
+ * @param copy Set to the copy, free it with Lnn_FreeDetachedValue().
+ * @return Utl_FALSE if the value or something in it can't be copied, the error is printed and nothing is left allocated.
+ */
+Utl_Bool Lnn_DetachValue(struct Lnn_State* state,
+						 const Lnn_Value value,
+						 Lnn_Value* copy);
+
+/**
+ * @brief Makes a value in a state from a copy made by Lnn_DetachValue(), the copy can be attached again.
+ * @param value Set to the value, or null if it couldn't be made.
+ * @return Utl_FALSE if there is no memory left, the error is printed.
+ */
+Utl_Bool Lnn_AttachValue(struct Lnn_State* state,
+						 const Lnn_Value copy,
+						 Lnn_Value* value);
+
+void Lnn_FreeDetachedValue(const Lnn_Value copy);
+
+
+
+typedef enum
+{
+	Lnn_CK_SPSC,	/* One thread sends and one thread receives, they only ever store their positions */
+	Lnn_CK_MPMC,	/* Any number of threads send and receive, positions are claimed by compare and swap */
+	Lnn_NUM_CHANNELKINDS
+} Lnn_ChannelKind;
+extern const char* lnn_channelkind_names[Lnn_NUM_CHANNELKINDS];
+
+/* Nested arrays and objects deeper than this can't be sent, which also catches ones that contain themselves */
+#define Lnn_CHANNEL_MAX_DEPTH 64
+
+typedef struct Lnn_ChannelCell
+{
+	Utl_AtomicInt sequence;	/* Position it can be sent to at, or one past the position it can be received from */
+	Lnn_Value value;		/* Heap values are copies that no state owns */
+} Lnn_ChannelCell;
+
+typedef struct Lnn_Channel
+{
+	Lnn_ChannelKind kind;
+	Lnn_ChannelCell* cells;
+	unsigned long mask;		/* Number of cells minus one, it is a power of two */
+	Utl_AtomicInt refcount;
+
+	/* Kept on their own cache lines so senders and receivers don't slow each other down */
+	char pad0[64];
+	Utl_AtomicInt sendpos;
+	char pad1[64];
+	Utl_AtomicInt receivepos;
+	char pad2[64];
+} Lnn_Channel;
+
+/**
+ * @brief Creates a channel with one reference.
+ * @param capacity Most values that can wait in it, rounded up to a power of two.
+ * @param kind Whether one or many threads send and receive.
+ * @return The channel, or NULL if capacity is less than 1.
+ */
+Lnn_Channel* Lnn_CreateChannel(const int capacity,
+							   const Lnn_ChannelKind kind);
+
+/**
+ * @brief Adds a reference to a channel. Can be called from any thread.
+ */
+void Lnn_RetainChannel(Lnn_Channel* channel);
+
+/**
+ * @brief Drops a reference to a channel, the last one destroys it with the values still in it.
+ * Can be called from any thread.
+ */
+void Lnn_ReleaseChannel(Lnn_Channel* channel);
+
+/**
+ * @brief Sends a value without waiting.
+ * @param state State the value belongs to.
+ * @param value The value, anything on the heap is copied once there is room for it.
+ * @param sent Set to Utl_FALSE if the channel was full.
+ * @return Utl_FALSE if the value can't be sent, the error is printed. A full channel doesn't look at the value.
+ */
+Utl_Bool Lnn_TrySend(struct Lnn_State* state,
+					 Lnn_Channel* channel,
+					 const Lnn_Value value,
+					 Utl_Bool* sent);
+
+/**
+ * @brief Receives a value without waiting.
+ * @param state State to make the value in.
+ * @param value Set to the value, or null if the channel was empty.
+ * A value there is no memory left for is lost and null too, the error is printed and receive() fails the run.
+ * @return Utl_FALSE if the channel was empty.
+ */
+Utl_Bool Lnn_TryReceive(struct Lnn_State* state,
+						Lnn_Channel* channel,
+						Lnn_Value* value);
+
+/**
+ * @brief Binds a channel to a global of a state, the state holds a reference to it until it is destroyed.
+ * Binding the first channel registers the natives send(channel, value), which gives whether the value was sent,
+ * and receive(channel), which gives the value or null if there was none. Neither waits, a script that runs
+ * as a coroutine can yield while a channel is full or empty.
+ * The global holds a channel value, which scripts can only pass around and compare, so they can't make one up.
+ * @param state State scripts use the channel in.
+ * @param name Name of the global, scripts pass it to send and receive.
+ * @return Slot of the global.
+ */
+int Lnn_BindChannel(struct Lnn_State* state,
+					const char* name,
+					Lnn_Channel* channel);
+
+#endif
@@ -1,5 +1,6 @@
 #include "lnn_code.h"
 #include "lnn_parse.h"
+#include "lnn_function.h"
 
 const char* lnn_keyword_strings[Lnn_NUM_KEYWORDS] =
 {
@@ -176,26 +177,109 @@ Lnn_SeparatorID Lnn_GetSeparator(const char c)
 
 
 
+const char* lnn_variablekind_names[Lnn_NUM_VARIABLEKINDS] =
+{
+	"VK_GLOBAL",
+	"VK_LOCAL",
+	"VK_CAPTURE",
+	"VK_BUILTIN"
+};
+
+void Lnn_DestroyFunction(Lnn_Function* function)
+{
+	if (!function) return;
+	for (int i = 0; i < function->numlocals; i++)
+		Utl_Free(function->locals[i]);
+	Utl_Free(function->locals);
+	Utl_Free(function->boxed);
+	Utl_Free(function->scalars);
+	Utl_Free(function->captures);
+	Utl_Free(function->name);
+	Lnn_DestroyCodeBlock(function->block);
+	Lnn_DestroyPrototype(function->prototype);
+	Utl_Free(function);
+}
+
+
+
+const char* lnn_exprnodetype_names[Lnn_NUM_EXPRNODETYPES] =
+{
+	"ET_OPERATOR",
+	"ET_NUMBERLITERAL",
+	"ET_INTLITERAL",
+	"ET_STRINGLITERAL",
+	"ET_BOOLLITERAL",
+	"ET_OBJECT",
+	"ET_ARRAY",
+	"ET_VARIABLE",
+	"ET_CLOSURE",
+	"ET_FUNCTIONCALL"
+};
+
 void Lnn_PrintExprNode(const Lnn_ExprNode* expr)
 {
 	if (!expr) return;
 	switch (expr->type)
 	{
 	case Lnn_ET_OPERATOR: printf("%s", lnn_operatorid_names[expr->u.op.id]); return;
-	case Lnn_ET_VARIABLE: printf("%s", expr->u.variable); return;
+	case Lnn_ET_VARIABLE: printf("%s", expr->u.variable.name); return;
 	case Lnn_ET_NUMBERLITERAL: printf("%f", expr->u.number); return;
-	case Lnn_ET_STRINGLITERAL: printf("\"%s\"", expr->u.str); return;
-	case Lnn_ET_BOOLLITERAL: expr->u.boolean ? printf("true") : printf("false");
+	case Lnn_ET_INTLITERAL: printf("%lld", (long long)expr->u.integer); return;
+	case Lnn_ET_STRINGLITERAL: printf("\"%s\"", expr->u.str.chars); return;
+	case Lnn_ET_BOOLLITERAL: expr->u.boolean ? printf("true") : printf("false"); return;
+	case Lnn_ET_OBJECT: printf("{%i fields}", expr->u.object.numfields); return;
+	case Lnn_ET_ARRAY: printf("[%i elements]", expr->u.array.numelements); return;
+	case Lnn_ET_CLOSURE: printf("function(%i params)", expr->u.closure->numparams); return;
+	case Lnn_ET_FUNCTIONCALL: printf("%s(%i args)", expr->u.functioncall.callee.name, expr->u.functioncall.numargs); return;
 	default: return;
 	}
 }
 
 void Lnn_DestroyExpression(Lnn_ExprNode* expr)
 {
+	if (!expr) return;
+	switch (expr->type)
+	{
+	case Lnn_ET_OPERATOR:
+		Lnn_DestroyExpression(expr->u.op.left);
+		Lnn_DestroyExpression(expr->u.op.right);
+		break;
+	case Lnn_ET_STRINGLITERAL: Utl_Free(expr->u.str.chars); break;
+	case Lnn_ET_VARIABLE: Utl_Free(expr->u.variable.name); break;
+	case Lnn_ET_CLOSURE: Lnn_DestroyFunction(expr->u.closure); break;
+	case Lnn_ET_OBJECT:
+		for (int i = 0; i < expr->u.object.numfields; i++)
+		{
+			Utl_Free(expr->u.object.names[i]);
+			Lnn_DestroyExpression(expr->u.object.values[i]);
+		}
+		Utl_Free(expr->u.object.names);
+		Utl_Free(expr->u.object.values);
+		break;
+	case Lnn_ET_ARRAY:
+		for (int i = 0; i < expr->u.array.numelements; i++)
+			Lnn_DestroyExpression(expr->u.array.elements[i]);
+		Utl_Free(expr->u.array.elements);
+		break;
+	case Lnn_ET_FUNCTIONCALL:
+		for (int i = 0; i < expr->u.functioncall.numargs; i++)
+			Lnn_DestroyExpression(expr->u.functioncall.args[i]);
+		Utl_Free(expr->u.functioncall.args);
+		Utl_Free(expr->u.functioncall.callee.name);
+		break;
+	default:
+		break;
+	}
+	Utl_Free(expr);
 }
 
 void Lnn_DestroyCodeBlock(Lnn_CodeBlock* block)
 {
+	if (!block) return;
+	for (int i = 0; i < block->numstatements; i++)
+		Lnn_DestroyStatement(&block->statements[i]);
+	Utl_Free(block->statements);
+	Utl_Free(block);
 }
 
 const char* lnn_statementtype_names[Lnn_NUM_STATEMENTTYPES] =
@@ -211,6 +295,34 @@ const char* lnn_statementtype_names[Lnn_NUM_STATEMENTTYPES] =
 
 void Lnn_DestroyStatement(Lnn_Statement* stmt)
 {
+	if (!stmt) return;
+	switch (stmt->type)
+	{
+	case Lnn_ST_EXPRESSION: Lnn_DestroyExpression(stmt->u.stmt_expr.expression); break;
+	case Lnn_ST_RETURN: Lnn_DestroyExpression(stmt->u.stmt_return.expression); break;
+	case Lnn_ST_IF:
+		Lnn_DestroyExpression(stmt->u.stmt_if.condition);
+		Lnn_DestroyCodeBlock(stmt->u.stmt_if.block_ontrue);
+		Lnn_DestroyCodeBlock(stmt->u.stmt_if.block_onfalse);
+		break;
+	case Lnn_ST_FOR:
+		Lnn_DestroyExpression(stmt->u.stmt_for.init);
+		Lnn_DestroyExpression(stmt->u.stmt_for.condition);
+		Lnn_DestroyExpression(stmt->u.stmt_for.loop);
+		Lnn_DestroyCodeBlock(stmt->u.stmt_for.block);
+		break;
+	case Lnn_ST_WHILE:
+		Lnn_DestroyExpression(stmt->u.stmt_while.condition);
+		Lnn_DestroyCodeBlock(stmt->u.stmt_while.block);
+		break;
+	case Lnn_ST_DOWHILE:
+		Lnn_DestroyExpression(stmt->u.stmt_dowhile.condition);
+		Lnn_DestroyCodeBlock(stmt->u.stmt_dowhile.block);
+		break;
+	case Lnn_ST_SCOPE: Lnn_DestroyCodeBlock(stmt->u.stmt_scope.block); break;
+	default:
+		break;
+	}
 }
 
 
@@ -265,15 +377,12 @@ static void print_code_block(const Lnn_CodeBlock* block, const int indent)
 {
 	if (!block)
 		{ indented_printf("null\n"); return; }
-	if (block->statements.count == 0)
+	if (block->numstatements == 0)
 		{ indented_printf("empty\n"); return; }
-	if (block->statements.count < 0 || block->statements.count > 500)
-		{ indented_printf("Block has invalid number of statements at %i\n", block->statements.count); return; }
-	Lnn_Statement* stmt_iter = block->statements.begin;
-	for (int i = 0; i < block->statements.count; i++)
-	{
-		print_statement(stmt_iter, indent);
-	}
+	if (block->numstatements < 0 || block->numstatements > 500)
+		{ indented_printf("Block has invalid number of statements at %i\n", block->numstatements); return; }
+	for (int i = 0; i < block->numstatements; i++)
+		print_statement(&block->statements[i], indent);
 }
 
 void Lnn_PrintCodeTree(const Lnn_CodeBlock* block)
@@ -78,10 +78,10 @@ extern const int lnn_operator_precedence[Lnn_NUM_OPERATORS];
  */
 Lnn_OperatorID Lnn_GetOperator(const char* string);
 
-#define Lnn_IsAssignmentOp(op)	((op) >= Lnn_OP_ASSIGN		|| (op) <= Lnn_OP_ASSIGNDIV)
-#define Lnn_IsLogicalOp(op)		((op) >= Lnn_OP_NOT			|| (op) <= Lnn_OP_XOR)
-#define Lnn_IsRelationalOp(op)	((op) >= Lnn_OP_EQUALITY	|| (op) <= Lnn_OP_GREATEREQUAL)
-#define Lnn_IsArithmeticOp(op)	((op) >= Lnn_OP_ADD	|| (op) <= Lnn_OP_DIV)
+#define Lnn_IsAssignmentOp(op)	((op) >= Lnn_OP_ASSIGN		&& (op) <= Lnn_OP_ASSIGNDIV)
+#define Lnn_IsLogicalOp(op)		((op) >= Lnn_OP_NOT			&& (op) <= Lnn_OP_XOR)
+#define Lnn_IsRelationalOp(op)	((op) >= Lnn_OP_EQUALITY	&& (op) <= Lnn_OP_GREATEREQUAL)
+#define Lnn_IsArithmeticOp(op)	((op) >= Lnn_OP_ADD			&& (op) <= Lnn_OP_DIV)
 #define Lnn_IsUnaryOp(op)		((op) == Lnn_OP_NOT			|| (op) == Lnn_OP_NEGATIVE)
 
 
@@ -111,13 +111,97 @@ Lnn_SeparatorID Lnn_GetSeparator(const char c);
 
 
 
+/**
+ * Variables are resolved by Lnn_ResolveVariables() after parsing.
+ * Names assigned at the top level of the script are globals. Inside a function the parameters
+ * and the names it assigns are its locals, unless they are locals of a function around it or globals.
+ */
+typedef enum
+{
+	Lnn_VK_GLOBAL,		/* index: Unused, the compilers look up the global slot by name */
+	Lnn_VK_LOCAL,		/* index: Local of the function the reference is in */
+	Lnn_VK_CAPTURE,		/* index: Capture of the function the reference is in */
+	Lnn_VK_BUILTIN,		/* index: Lnn_BuiltinID, only for called names */
+	Lnn_NUM_VARIABLEKINDS
+} Lnn_VariableKind;
+extern const char* lnn_variablekind_names[Lnn_NUM_VARIABLEKINDS];
+
+typedef struct Lnn_VariableRef
+{
+	char* name;
+	Lnn_VariableKind kind;
+	int index;
+} Lnn_VariableRef;
+
+/**
+ * @brief A variable that a function uses from the function around it.
+ * Captures are copied into the closure when it is made. Captured locals that could change
+ * after that are boxed, they live in a cell that the function and its closures share.
+ */
+typedef struct Lnn_Capture
+{
+	Utl_Bool fromlocal;		/* If it is a local of the function around, otherwise one of its captures */
+	int index;				/* Index of that local or capture */
+	Utl_Bool boxed;			/* The captured value is the cell of a boxed local */
+} Lnn_Capture;
+
+struct Lnn_CodeBlock;
+struct Lnn_Prototype;
+struct Lnn_ExprNode;
+
+/* Most fields a literal can have for its local to be replaced by scalars */
+#define Lnn_MAX_SCALAR_FIELDS 16
+
+/**
+ * @brief What the resolver found out about a local that only ever holds arrays or objects that don't escape.
+ * Such a local is replaced by scalars, its fields are kept in hidden slots of the frame and the literals
+ * assigned to it don't allocate anything.
+ */
+typedef struct Lnn_ScalarLocal
+{
+	int slot;								/* First hidden slot of the fields, -1 if the local isn't replaced */
+	const struct Lnn_ExprNode* literal;		/* First literal assigned to it, the others have the same fields */
+} Lnn_ScalarLocal;
+
+/**
+ * @brief A function literal with what the resolver found out about its variables.
+ * Locals are the first slots of the frame of a call, the parameters come first.
+ * Closures that never escape the call that made them keep their captures in hidden slots after the locals.
+ */
+typedef struct Lnn_Function
+{
+	char* name;					/* Name it was declared with, or NULL */
+	struct Lnn_Function* parent;	/* Function it is in, or NULL at the top level of the script */
+	int numparams;
+	char** locals;				/* Names of the locals */
+	Utl_Bool* boxed;			/* If a local lives in a cell, one for every local */
+	Lnn_ScalarLocal* scalars;	/* If a local is replaced by scalars, one for every local */
+	int numlocals;
+	int numslots;				/* Locals, hidden capture slots and hidden scalar slots */
+	Lnn_Capture* captures;
+	int numcaptures;
+	Utl_Bool escapes;			/* If not, the closure is a plain function value and its captures stay in the frame that made it */
+	int captureslot;			/* First hidden slot in the frame of the parent when it doesn't escape */
+	struct Lnn_CodeBlock* block;
+	struct Lnn_Prototype* prototype;	/* Made by the walker the first time it runs the literal */
+} Lnn_Function;
+
+/**
+ * @brief Destroys a function with its code block.
+ */
+void Lnn_DestroyFunction(Lnn_Function* function);
+
+
+
 typedef enum
 {
 	Lnn_ET_OPERATOR,
-	Lnn_ET_NUMBERLITERAL,
+	Lnn_ET_NUMBERLITERAL,	/* A number with a decimal point, or one too big for an int */
+	Lnn_ET_INTLITERAL,
 	Lnn_ET_STRINGLITERAL,
 	Lnn_ET_BOOLLITERAL,
 	Lnn_ET_OBJECT,
+	Lnn_ET_ARRAY,
 	Lnn_ET_VARIABLE,
 	Lnn_ET_CLOSURE,
 	Lnn_ET_FUNCTIONCALL,
@@ -125,7 +209,10 @@ typedef enum
 } Lnn_ExprNodeType;
 extern const char* lnn_exprnodetype_names[Lnn_NUM_EXPRNODETYPES];
 
-typedef struct
+/* Name of an expression type that may be out of range, for errors about nodes no case handled */
+#define Lnn_ExprNodeTypeName(type)	((unsigned)(type) < Lnn_NUM_EXPRNODETYPES ? lnn_exprnodetype_names[type] : "ET_INVALID")
+
+typedef struct Lnn_ExprNode
 {
 	Lnn_ExprNodeType type;
 	struct Lnn_ExprNode* parent;
@@ -138,23 +225,40 @@ typedef struct
 			struct Lnn_ExprNode* right;
 		} op;
 		Utl_Float number;
+		Utl_Int integer;
 		Utl_Bool boolean;
 		struct
 		{
 			char* chars;
 			int len;
 		} str;
-		//Lnn_Function* closure;
-		char* variable;
+		Lnn_Function* closure;
+		Lnn_VariableRef variable;
+		struct
+		{
+			int numfields;
+			char** names;					/* Array of member names */
+			struct Lnn_ExprNode** values;	/* Array of the values of the members */
+		} object;
 		struct
 		{
-			char* identifier;
+			int numelements;
+			struct Lnn_ExprNode** elements;	/* Array of the element values */
+		} array;
+		struct
+		{
+			Lnn_VariableRef callee;
 			int numargs;
 			struct Lnn_ExprNode** args; /* Array of arguments */
 		} functioncall;
 	} u;
 } Lnn_ExprNode;
 
+#define Lnn_IsNumberLiteral(expr)	((expr)->type == Lnn_ET_NUMBERLITERAL || (expr)->type == Lnn_ET_INTLITERAL)
+
+/* Value of a number or int literal as a float */
+#define Lnn_LiteralNumber(expr)		((expr)->type == Lnn_ET_INTLITERAL ? (Utl_Float)(expr)->u.integer : (expr)->u.number)
+
 void Lnn_PrintExprNode(const Lnn_ExprNode* expr);
 
 /**
@@ -166,13 +270,15 @@ void Lnn_DestroyExpression(Lnn_ExprNode* expr);
 
 
 /**
- * @brief Code blocks are containers for a list statements.
+ * @brief Code blocks are containers for an array of statements.
  * These are the statements that are in the same scope depth and are executed in order.
  * Scopes contain code blocks and are executed recursively from other code blocks.
+ * The parser finalizes every block into one contiguous array so running it streams through memory.
  */
 typedef struct Lnn_CodeBlock
 {
-	Utl_List statements; /* List of Lnn_Statement */
+	struct Lnn_Statement* statements;	/* Array of the statements in the order they run */
+	int numstatements;
 } Lnn_CodeBlock;
 
 /**
@@ -198,7 +304,6 @@ extern const char* lnn_statementtype_names[Lnn_NUM_STATEMENTTYPES];
 
 typedef struct Lnn_Statement
 {
-	Utl_ListLinks links;
 	Lnn_StatementType type;
 	union
 	{
@@ -241,8 +346,9 @@ typedef struct Lnn_Statement
 } Lnn_Statement;
 
 /**
- * @brief Destroys a statement and all its child nodes recursively.
- * @param stmt Statement to destroy.
+ * @brief Destroys all child nodes of a statement recursively.
+ * The statement itself isn't freed since it is part of the array of its block.
+ * @param stmt Statement to destroy the children of.
  */
 void Lnn_DestroyStatement(Lnn_Statement* stmt);
 
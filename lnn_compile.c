@@ -0,0 +1,804 @@
+#include "lnn_vm.h"
+#include "lnn_jit.h"
+#include "lnn_resolve.h"
+#include "lnn_program.h"
+
+const char* lnn_opcode_names[Lnn_NUM_OPCODES] =
+{
+	"BC_HALT",
+	"BC_POP",
+	"BC_PUSHNULL",
+	"BC_PUSHTRUE",
+	"BC_PUSHFALSE",
+	"BC_PUSHCONST",
+	"BC_GETGLOBAL",
+	"BC_SETGLOBAL",
+	"BC_JUMP",
+	"BC_JUMPIFFALSE",
+
+	"BC_NOT",
+	"BC_NEGATIVE",
+	"BC_AND",
+	"BC_OR",
+	"BC_XOR",
+
+	"BC_DUP",
+	"BC_NEWOBJECT",
+	"BC_GETMEMBER",
+	"BC_SETMEMBER",
+	"BC_INITMEMBER",
+	"BC_DUP2",
+	"BC_NEWARRAY",
+	"BC_PUSHELEMENT",
+	"BC_CALLBUILTIN",
+	"BC_ELEMENTWISE",
+	"BC_GETLOCAL",
+	"BC_SETLOCAL",
+	"BC_GETBOXED",
+	"BC_SETBOXED",
+	"BC_GETCAPTURE",
+	"BC_GETBOXEDCAPTURE",
+	"BC_SETBOXEDCAPTURE",
+	"BC_CLOSURE",
+	"BC_STACKCLOSURE",
+	"BC_CALL",
+	"BC_RETURN",
+	"BC_TAILCALL",
+	"BC_YIELD",
+
+	"BC_EQUALITY",
+	"BC_INEQUALITY",
+	"BC_LESS",
+	"BC_GREATER",
+	"BC_LESSEQUAL",
+	"BC_GREATEREQUAL",
+	"BC_ADD",
+	"BC_SUB",
+	"BC_MUL",
+	"BC_DIV",
+	"BC_GETELEMENT",
+	"BC_SETELEMENT",
+
+	"BC_EQUALITY_NUM_NUM",
+	"BC_INEQUALITY_NUM_NUM",
+	"BC_LESS_NUM_NUM",
+	"BC_GREATER_NUM_NUM",
+	"BC_LESSEQUAL_NUM_NUM",
+	"BC_GREATEREQUAL_NUM_NUM",
+	"BC_ADD_NUM_NUM",
+	"BC_ADD_STR_STR",
+	"BC_SUB_NUM_NUM",
+	"BC_MUL_NUM_NUM",
+	"BC_DIV_NUM_NUM",
+	"BC_GETELEMENT_INT",
+	"BC_GETELEMENT_FLOAT",
+	"BC_GETELEMENT_VALUE",
+	"BC_SETELEMENT_INT",
+	"BC_SETELEMENT_FLOAT",
+	"BC_SETELEMENT_VALUE",
+	"BC_EQUALITY_INT_INT",
+	"BC_INEQUALITY_INT_INT",
+	"BC_LESS_INT_INT",
+	"BC_GREATER_INT_INT",
+	"BC_LESSEQUAL_INT_INT",
+	"BC_GREATEREQUAL_INT_INT",
+	"BC_ADD_INT_INT",
+	"BC_SUB_INT_INT",
+	"BC_MUL_INT_INT",
+
+	"BC_SETGLOBAL_POP",
+	"BC_SETLOCAL_POP",
+	"BC_ADD_CONST",
+	"BC_SUB_CONST",
+	"BC_MUL_CONST",
+	"BC_DIV_CONST",
+	"BC_EQUALITY_JUMPIFFALSE",
+	"BC_INEQUALITY_JUMPIFFALSE",
+	"BC_LESS_JUMPIFFALSE",
+	"BC_GREATER_JUMPIFFALSE",
+	"BC_LESSEQUAL_JUMPIFFALSE",
+	"BC_GREATEREQUAL_JUMPIFFALSE",
+	"BC_GETLOCAL_GETMEMBER",
+};
+
+/* The generic instruction for every binary operator, or HALT if it isn't a plain binary operator */
+static const Lnn_OpCode operator_opcodes[Lnn_NUM_OPERATORS] =
+{
+	Lnn_BC_HALT,			/* ASSIGN */
+	Lnn_BC_ADD,				/* ASSIGNADD */
+	Lnn_BC_SUB,				/* ASSIGNSUB */
+	Lnn_BC_MUL,				/* ASSIGNMUL */
+	Lnn_BC_DIV,				/* ASSIGNDIV */
+
+	Lnn_BC_NOT,				/* NOT */
+	Lnn_BC_AND,				/* AND */
+	Lnn_BC_OR,				/* OR */
+	Lnn_BC_XOR,				/* XOR */
+	Lnn_BC_NEGATIVE,		/* NEGATIVE */
+
+	Lnn_BC_EQUALITY,		/* EQUALITY */
+	Lnn_BC_INEQUALITY,		/* INEQUALITY */
+	Lnn_BC_LESS,			/* LESS */
+	Lnn_BC_GREATER,			/* GREATER */
+	Lnn_BC_LESSEQUAL,		/* LESSEQUAL */
+	Lnn_BC_GREATEREQUAL,	/* GREATEREQUAL */
+
+	Lnn_BC_ADD,				/* ADD */
+	Lnn_BC_SUB,				/* SUB */
+	Lnn_BC_MUL,				/* MUL */
+	Lnn_BC_DIV,				/* DIV */
+
+	Lnn_BC_HALT,			/* MEMBERACCESS */
+	Lnn_BC_HALT,			/* ARRAYACCESS */
+};
+
+
+
+typedef struct
+{
+	Lnn_State* state;
+	Lnn_Chunk* chunk;
+	const Lnn_Function* function;	/* Function being compiled, NULL at the top level */
+	int stackdepth;
+} compiler;
+
+/* Pushing and popping values changes how deep the stack is when the instruction runs */
+static int emit(compiler* c, const Lnn_OpCode op, const int arg, const int stackchange)
+{
+	Lnn_Chunk* chunk = c->chunk;
+	if (chunk->numcode >= chunk->capcode)
+	{
+		chunk->capcode = chunk->capcode ? chunk->capcode * 2 : 64;
+		chunk->code = Utl_Realloc(chunk->code, sizeof(Lnn_Instruction) * chunk->capcode);
+	}
+	chunk->code[chunk->numcode] = Lnn_MakeInstr(op, arg);
+
+	c->stackdepth += stackchange;
+	if (c->stackdepth > chunk->maxstack)
+		chunk->maxstack = c->stackdepth;
+	return chunk->numcode++;
+}
+
+/* Sets where a jump instruction goes once it is known */
+static void patch_jump(compiler* c, const int jump, const int target)
+{
+	c->chunk->code[jump] = Lnn_MakeInstr(Lnn_InstrOp(c->chunk->code[jump]), target);
+}
+
+static int add_constant(compiler* c, const Lnn_Value value)
+{
+	Lnn_Chunk* chunk = c->chunk;
+	/* 1 and 1.0 are equal but they aren't the same constant */
+	for (int i = 0; i < chunk->numconstants; i++)
+		if (chunk->constants[i].type == value.type && Lnn_ValuesEqual(c->state, chunk->constants[i], value))
+			return i;
+
+	if (chunk->numconstants >= chunk->capconstants)
+	{
+		chunk->capconstants = chunk->capconstants ? chunk->capconstants * 2 : 16;
+		chunk->constants = Utl_Realloc(chunk->constants, sizeof(Lnn_Value) * chunk->capconstants);
+	}
+	chunk->constants[chunk->numconstants] = value;
+	return chunk->numconstants++;
+}
+
+
+
+/* Every member access gets its own inline cache */
+static int add_member_cache(compiler* c, const char* name)
+{
+	Lnn_Chunk* chunk = c->chunk;
+	if (chunk->numcaches >= chunk->capcaches)
+	{
+		chunk->capcaches = chunk->capcaches ? chunk->capcaches * 2 : 16;
+		chunk->caches = Utl_Realloc(chunk->caches, sizeof(Lnn_MemberCache) * chunk->capcaches);
+	}
+	Lnn_MemberCache* cache = &chunk->caches[chunk->numcaches];
+	memset(cache, 0, sizeof(Lnn_MemberCache));
+	cache->name = _strdup(name);
+	return chunk->numcaches++;
+}
+
+static int add_prototype(compiler* c, Lnn_Prototype* prototype)
+{
+	Lnn_Chunk* chunk = c->chunk;
+	if (chunk->numprototypes >= chunk->capprototypes)
+	{
+		chunk->capprototypes = chunk->capprototypes ? chunk->capprototypes * 2 : 4;
+		chunk->prototypes = Utl_Realloc(chunk->prototypes, sizeof(Lnn_Prototype*) * chunk->capprototypes);
+	}
+	chunk->prototypes[chunk->numprototypes] = prototype;
+	return chunk->numprototypes++;
+}
+
+/* Pushes the value of a variable, boxed ones are read through their cell */
+static void emit_get_variable(compiler* c, const Lnn_VariableRef* ref)
+{
+	switch (ref->kind)
+	{
+	case Lnn_VK_LOCAL:
+		emit(c, c->function->boxed[ref->index] ? Lnn_BC_GETBOXED : Lnn_BC_GETLOCAL, ref->index, 1);
+		return;
+	case Lnn_VK_CAPTURE:
+		emit(c, c->function->captures[ref->index].boxed ? Lnn_BC_GETBOXEDCAPTURE : Lnn_BC_GETCAPTURE, ref->index, 1);
+		return;
+	default:
+		emit(c, Lnn_BC_GETGLOBAL, Lnn_GetGlobalSlot(c->state, ref->name), 1);
+		return;
+	}
+}
+
+/* Stores the value on top of the stack in a variable and leaves it there */
+static void emit_set_variable(compiler* c, const Lnn_VariableRef* ref)
+{
+	switch (ref->kind)
+	{
+	case Lnn_VK_LOCAL:
+		emit(c, c->function->boxed[ref->index] ? Lnn_BC_SETBOXED : Lnn_BC_SETLOCAL, ref->index, 0);
+		return;
+	case Lnn_VK_CAPTURE:
+		/* Captures that are assigned are always boxed */
+		Utl_Assert(c->function->captures[ref->index].boxed);
+		emit(c, Lnn_BC_SETBOXEDCAPTURE, ref->index, 0);
+		return;
+	default:
+		emit(c, Lnn_BC_SETGLOBAL, Lnn_GetGlobalSlot(c->state, ref->name), 0);
+		return;
+	}
+}
+
+/* The right side of a '.' has to be a name */
+static const char* member_name(const Lnn_ExprNode* expr)
+{
+	if (expr->u.op.right->type != Lnn_ET_VARIABLE)
+	{
+		printf("ERROR! Expected a member name after '.'\n");
+		return NULL;
+	}
+	return expr->u.op.right->u.variable.name;
+}
+
+
+
+static Utl_Bool compile_expression(compiler* c, const Lnn_ExprNode* expr);
+static Utl_Bool compile_codeblock(compiler* c, const Lnn_CodeBlock* block);
+
+/* Hidden slot of the field a '.' or '[]' reads, -1 if it reads a real array or object */
+static int scalar_slot(const compiler* c, const Lnn_ExprNode* access)
+{
+	return c->function ? Lnn_ScalarSlot(c->function, access) : -1;
+}
+
+/* Assigns a field of a local replaced by scalars, it is a local of its own */
+static Utl_Bool compile_scalar_assignment(compiler* c, const Lnn_ExprNode* expr, const int slot)
+{
+	if (expr->u.op.id != Lnn_OP_ASSIGN)
+		emit(c, Lnn_BC_GETLOCAL, slot, 1);
+	if (!compile_expression(c, expr->u.op.right)) return Utl_FALSE;
+	if (expr->u.op.id != Lnn_OP_ASSIGN)
+		emit(c, operator_opcodes[expr->u.op.id], 0, -1);
+	emit(c, Lnn_BC_SETLOCAL, slot, 0);
+	return Utl_TRUE;
+}
+
+/**
+ * @brief Stores the fields of a literal in the hidden slots of the local that replaces it.
+ * Every field is worked out before any is stored since the literal can read the old ones.
+ * What is left on the stack is only there to be popped, the resolver makes sure nothing uses it.
+ */
+static Utl_Bool compile_scalar_literal(compiler* c, const Lnn_ExprNode* literal, const int slot)
+{
+	const int numfields = literal->type == Lnn_ET_ARRAY ? literal->u.array.numelements : literal->u.object.numfields;
+	for (int i = 0; i < numfields; i++)
+		if (!compile_expression(c, literal->type == Lnn_ET_ARRAY ? literal->u.array.elements[i] : literal->u.object.values[i]))
+			return Utl_FALSE;
+	if (numfields == 0)
+	{
+		emit(c, Lnn_BC_PUSHNULL, 0, 1);
+		return Utl_TRUE;
+	}
+	for (int i = numfields - 1; i > 0; i--)
+	{
+		emit(c, Lnn_BC_SETLOCAL, slot + i, 0);
+		emit(c, Lnn_BC_POP, 0, -1);
+	}
+	emit(c, Lnn_BC_SETLOCAL, slot, 0);
+	return Utl_TRUE;
+}
+
+static Utl_Bool compile_member_assignment(compiler* c, const Lnn_ExprNode* expr)
+{
+	const Lnn_ExprNode* target = expr->u.op.left;
+	const char* name = member_name(target);
+	if (!name) return Utl_FALSE;
+	const int slot = scalar_slot(c, target);
+	if (slot >= 0) return compile_scalar_assignment(c, expr, slot);
+	const int cache = add_member_cache(c, name);
+
+	if (!compile_expression(c, target->u.op.left)) return Utl_FALSE;
+	if (expr->u.op.id != Lnn_OP_ASSIGN)
+	{
+		emit(c, Lnn_BC_DUP, 0, 1);
+		emit(c, Lnn_BC_GETMEMBER, add_member_cache(c, name), 0);
+	}
+	if (!compile_expression(c, expr->u.op.right)) return Utl_FALSE;
+	if (expr->u.op.id != Lnn_OP_ASSIGN)
+		emit(c, operator_opcodes[expr->u.op.id], 0, -1);
+	emit(c, Lnn_BC_SETMEMBER, cache, -1);
+	return Utl_TRUE;
+}
+
+static Utl_Bool compile_element_assignment(compiler* c, const Lnn_ExprNode* expr)
+{
+	const Lnn_ExprNode* target = expr->u.op.left;
+	const int slot = scalar_slot(c, target);
+	if (slot >= 0) return compile_scalar_assignment(c, expr, slot);
+	if (!compile_expression(c, target->u.op.left)) return Utl_FALSE;
+	if (!compile_expression(c, target->u.op.right)) return Utl_FALSE;
+	if (expr->u.op.id != Lnn_OP_ASSIGN)
+	{
+		emit(c, Lnn_BC_DUP2, 0, 2);
+		emit(c, Lnn_BC_GETELEMENT, 0, -1);
+	}
+	if (!compile_expression(c, expr->u.op.right)) return Utl_FALSE;
+	if (expr->u.op.id != Lnn_OP_ASSIGN)
+		emit(c, operator_opcodes[expr->u.op.id], 0, -1);
+	emit(c, Lnn_BC_SETELEMENT, 0, -2);
+	return Utl_TRUE;
+}
+
+static Utl_Bool compile_assignment(compiler* c, const Lnn_ExprNode* expr)
+{
+	const Lnn_ExprNode* target = expr->u.op.left;
+	if (target->type == Lnn_ET_OPERATOR && target->u.op.id == Lnn_OP_MEMBERACCESS)
+		return compile_member_assignment(c, expr);
+	if (target->type == Lnn_ET_OPERATOR && target->u.op.id == Lnn_OP_ARRAYACCESS)
+		return compile_element_assignment(c, expr);
+	if (target->type != Lnn_ET_VARIABLE)
+	{
+		printf("ERROR! Can only assign to variables, members and elements\n");
+		return Utl_FALSE;
+	}
+	if (target->u.variable.kind == Lnn_VK_LOCAL && c->function->scalars[target->u.variable.index].slot >= 0)
+		return compile_scalar_literal(c, expr->u.op.right, c->function->scalars[target->u.variable.index].slot);
+
+	if (expr->u.op.id != Lnn_OP_ASSIGN)
+		emit_get_variable(c, &target->u.variable);
+	if (!compile_expression(c, expr->u.op.right)) return Utl_FALSE;
+	if (expr->u.op.id != Lnn_OP_ASSIGN)
+		emit(c, operator_opcodes[expr->u.op.id], 0, -1);
+	emit_set_variable(c, &target->u.variable);
+	return Utl_TRUE;
+}
+
+/* The function goes under the arguments, its frame starts with them */
+static Utl_Bool compile_call(compiler* c, const Lnn_ExprNode* expr, const Lnn_OpCode op)
+{
+	emit_get_variable(c, &expr->u.functioncall.callee);
+	for (int i = 0; i < expr->u.functioncall.numargs; i++)
+		if (!compile_expression(c, expr->u.functioncall.args[i])) return Utl_FALSE;
+	emit(c, op, expr->u.functioncall.numargs, -expr->u.functioncall.numargs);
+	return Utl_TRUE;
+}
+
+static Lnn_Chunk* compile_function(Lnn_State* state, const Lnn_Function* function);
+
+/**
+ * @brief Compiles a function literal into a chunk of its own.
+ * Functions without captures are constants, the others copy their captures when the literal runs.
+ */
+static Utl_Bool compile_closure(compiler* c, const Lnn_Function* function)
+{
+	Lnn_Chunk* code = compile_function(c->state, function);
+	if (!code) return Utl_FALSE;
+	Lnn_Prototype* prototype = Lnn_CreatePrototype(function, code);
+	const int index = add_prototype(c, prototype);
+
+	if (function->numcaptures == 0)
+		emit(c, Lnn_BC_PUSHCONST, add_constant(c, Lnn_FunctionValue(prototype)), 1);
+	else
+		emit(c, function->escapes ? Lnn_BC_CLOSURE : Lnn_BC_STACKCLOSURE, index, 1);
+	return Utl_TRUE;
+}
+
+static Utl_Bool compile_operator(compiler* c, const Lnn_ExprNode* expr)
+{
+	const Lnn_OperatorID op = expr->u.op.id;
+	if (Lnn_IsAssignmentOp(op))
+		return compile_assignment(c, expr);
+
+	if (op == Lnn_OP_MEMBERACCESS)
+	{
+		const char* name = member_name(expr);
+		if (!name) return Utl_FALSE;
+		const int slot = scalar_slot(c, expr);
+		if (slot >= 0)
+		{
+			emit(c, Lnn_BC_GETLOCAL, slot, 1);
+			return Utl_TRUE;
+		}
+		if (!compile_expression(c, expr->u.op.left)) return Utl_FALSE;
+		emit(c, Lnn_BC_GETMEMBER, add_member_cache(c, name), 0);
+		return Utl_TRUE;
+	}
+
+	if (op == Lnn_OP_ARRAYACCESS)
+	{
+		const int slot = scalar_slot(c, expr);
+		if (slot >= 0)
+		{
+			emit(c, Lnn_BC_GETLOCAL, slot, 1);
+			return Utl_TRUE;
+		}
+		if (!compile_expression(c, expr->u.op.left)) return Utl_FALSE;
+		if (!compile_expression(c, expr->u.op.right)) return Utl_FALSE;
+		emit(c, Lnn_BC_GETELEMENT, 0, -1);
+		return Utl_TRUE;
+	}
+
+	if (operator_opcodes[op] == Lnn_BC_HALT)
+	{
+		printf("ERROR! Operator %s isn't supported yet\n", lnn_operatorid_names[op]);
+		return Utl_FALSE;
+	}
+
+	if (Lnn_IsUnaryOp(op))
+	{
+		if (!compile_expression(c, expr->u.op.right)) return Utl_FALSE;
+		emit(c, operator_opcodes[op], 0, 0);
+		return Utl_TRUE;
+	}
+
+	if (!compile_expression(c, expr->u.op.left)) return Utl_FALSE;
+	if (!compile_expression(c, expr->u.op.right)) return Utl_FALSE;
+	emit(c, operator_opcodes[op], 0, -1);
+	return Utl_TRUE;
+}
+
+static Utl_Bool compile_expression(compiler* c, const Lnn_ExprNode* expr)
+{
+	Utl_Assert(expr);
+	switch (expr->type)
+	{
+	case Lnn_ET_OPERATOR:
+		return compile_operator(c, expr);
+
+	case Lnn_ET_NUMBERLITERAL:
+		emit(c, Lnn_BC_PUSHCONST, add_constant(c, Lnn_FloatValue(expr->u.number)), 1);
+		return Utl_TRUE;
+
+	case Lnn_ET_INTLITERAL:
+		emit(c, Lnn_BC_PUSHCONST, add_constant(c, Lnn_IntValue(expr->u.integer)), 1);
+		return Utl_TRUE;
+
+	case Lnn_ET_STRINGLITERAL:
+		emit(c, Lnn_BC_PUSHCONST, add_constant(c, Lnn_LiteralString(c->state, expr->u.str.chars, expr->u.str.len)), 1);
+		return Utl_TRUE;
+
+	case Lnn_ET_BOOLLITERAL:
+		emit(c, expr->u.boolean ? Lnn_BC_PUSHTRUE : Lnn_BC_PUSHFALSE, 0, 1);
+		return Utl_TRUE;
+
+	case Lnn_ET_VARIABLE:
+		emit_get_variable(c, &expr->u.variable);
+		return Utl_TRUE;
+
+	case Lnn_ET_OBJECT:
+		/* Objects made by the same literal get the same shape */
+		emit(c, Lnn_BC_NEWOBJECT, expr->u.object.numfields, 1);
+		for (int i = 0; i < expr->u.object.numfields; i++)
+		{
+			if (!compile_expression(c, expr->u.object.values[i])) return Utl_FALSE;
+			emit(c, Lnn_BC_INITMEMBER, add_member_cache(c, expr->u.object.names[i]), -1);
+		}
+		return Utl_TRUE;
+
+	case Lnn_ET_FUNCTIONCALL:
+	{
+		if (expr->u.functioncall.callee.kind != Lnn_VK_BUILTIN)
+			return compile_call(c, expr, Lnn_BC_CALL);
+		const int builtin = expr->u.functioncall.callee.index;
+		if (expr->u.functioncall.numargs != lnn_builtins[builtin].numargs)
+		{
+			printf("ERROR! %s takes %i arguments, not %i\n", lnn_builtins[builtin].name,
+				   lnn_builtins[builtin].numargs, expr->u.functioncall.numargs);
+			return Utl_FALSE;
+		}
+		for (int i = 0; i < expr->u.functioncall.numargs; i++)
+			if (!compile_expression(c, expr->u.functioncall.args[i])) return Utl_FALSE;
+		if (builtin == Lnn_BI_YIELD)
+			emit(c, Lnn_BC_YIELD, 0, 0);
+		else
+			emit(c, Lnn_BC_CALLBUILTIN, builtin, 1 - expr->u.functioncall.numargs);
+		return Utl_TRUE;
+	}
+
+	case Lnn_ET_CLOSURE:
+		return compile_closure(c, expr->u.closure);
+
+	case Lnn_ET_ARRAY:
+		emit(c, Lnn_BC_NEWARRAY, expr->u.array.numelements, 1);
+		for (int i = 0; i < expr->u.array.numelements; i++)
+		{
+			if (!compile_expression(c, expr->u.array.elements[i])) return Utl_FALSE;
+			emit(c, Lnn_BC_PUSHELEMENT, 0, -1);
+		}
+		return Utl_TRUE;
+
+	default:
+		printf("ERROR! Expression type %s isn't supported yet\n", Lnn_ExprNodeTypeName(expr->type));
+		return Utl_FALSE;
+	}
+}
+
+
+
+static Utl_Bool compile_if_statement(compiler* c, const Lnn_Statement* stmt)
+{
+	if (!compile_expression(c, stmt->u.stmt_if.condition)) return Utl_FALSE;
+	const int jump_onfalse = emit(c, Lnn_BC_JUMPIFFALSE, 0, -1);
+	if (!compile_codeblock(c, stmt->u.stmt_if.block_ontrue)) return Utl_FALSE;
+
+	if (stmt->u.stmt_if.block_onfalse)
+	{
+		const int jump_end = emit(c, Lnn_BC_JUMP, 0, 0);
+		patch_jump(c, jump_onfalse, c->chunk->numcode);
+		if (!compile_codeblock(c, stmt->u.stmt_if.block_onfalse)) return Utl_FALSE;
+		patch_jump(c, jump_end, c->chunk->numcode);
+	} else
+		patch_jump(c, jump_onfalse, c->chunk->numcode);
+	return Utl_TRUE;
+}
+
+static Utl_Bool compile_while_statement(compiler* c, const Lnn_Statement* stmt)
+{
+	/* Elementwise loops first try to run as a kernel, and only loop if that wasn't possible */
+	int jump_kernel = -1;
+	Lnn_ElementwiseLoop loop;
+	if (Lnn_MatchElementwiseLoop(c->state, stmt, &loop))
+	{
+		Lnn_Chunk* chunk = c->chunk;
+		if (chunk->numloops >= chunk->caploops)
+		{
+			chunk->caploops = chunk->caploops ? chunk->caploops * 2 : 4;
+			chunk->loops = Utl_Realloc(chunk->loops, sizeof(Lnn_ElementwiseLoop) * chunk->caploops);
+		}
+		chunk->loops[chunk->numloops] = loop;
+		emit(c, Lnn_BC_ELEMENTWISE, chunk->numloops++, 1);
+		jump_kernel = emit(c, Lnn_BC_JUMPIFFALSE, 0, -1);
+	}
+
+	const int loopstart = c->chunk->numcode;
+	if (!compile_expression(c, stmt->u.stmt_while.condition)) return Utl_FALSE;
+	const int jump_end = emit(c, Lnn_BC_JUMPIFFALSE, 0, -1);
+	if (!compile_codeblock(c, stmt->u.stmt_while.block)) return Utl_FALSE;
+	emit(c, Lnn_BC_JUMP, loopstart, 0);
+	patch_jump(c, jump_end, c->chunk->numcode);
+	if (jump_kernel >= 0)
+		patch_jump(c, jump_kernel, c->chunk->numcode);
+	return Utl_TRUE;
+}
+
+static Utl_Bool compile_statement(compiler* c, const Lnn_Statement* stmt)
+{
+	switch (stmt->type)
+	{
+	case Lnn_ST_EXPRESSION:
+		if (!compile_expression(c, stmt->u.stmt_expr.expression)) return Utl_FALSE;
+		emit(c, Lnn_BC_POP, 0, -1);
+		return Utl_TRUE;
+
+	case Lnn_ST_IF:
+		return compile_if_statement(c, stmt);
+
+	case Lnn_ST_WHILE:
+		return compile_while_statement(c, stmt);
+
+	case Lnn_ST_RETURN:
+		if (stmt->u.stmt_return.expression && stmt->u.stmt_return.expression->type == Lnn_ET_FUNCTIONCALL &&
+			stmt->u.stmt_return.expression->u.functioncall.callee.kind != Lnn_VK_BUILTIN)
+		{
+			/* return f(x) reuses the frame, the RETURN is only reached if it couldn't */
+			if (!compile_call(c, stmt->u.stmt_return.expression, Lnn_BC_TAILCALL)) return Utl_FALSE;
+		} else if (stmt->u.stmt_return.expression)
+		{
+			if (!compile_expression(c, stmt->u.stmt_return.expression)) return Utl_FALSE;
+		} else
+			emit(c, Lnn_BC_PUSHNULL, 0, 1);
+		emit(c, Lnn_BC_RETURN, 0, -1);
+		return Utl_TRUE;
+
+	default:
+		printf("ERROR! Statement type %s isn't supported yet\n", lnn_statementtype_names[stmt->type]);
+		return Utl_FALSE;
+	}
+}
+
+static Utl_Bool compile_codeblock(compiler* c, const Lnn_CodeBlock* block)
+{
+	for (const Lnn_Statement* i = block->statements; i < block->statements + block->numstatements; i++)
+		if (!compile_statement(c, i)) return Utl_FALSE;
+	return Utl_TRUE;
+}
+
+
+
+/* Functions return null if they get to the end without a return statement */
+static Lnn_Chunk* compile_function(Lnn_State* state, const Lnn_Function* function)
+{
+	compiler c = { 0 };
+	c.state = state;
+	c.function = function;
+	c.chunk = Utl_AllocType(Lnn_Chunk);
+	if (!compile_codeblock(&c, function->block))
+	{
+		Lnn_DestroyChunk(c.chunk);
+		return NULL;
+	}
+	emit(&c, Lnn_BC_PUSHNULL, 0, 1);
+	emit(&c, Lnn_BC_RETURN, 0, -1);
+#ifndef Lnn_NO_PEEPHOLE
+	Lnn_OptimizeChunk(c.chunk);
+#endif
+	return c.chunk;
+}
+
+Lnn_Chunk* Lnn_CompileCode(Lnn_State* state, const Lnn_CodeBlock* block)
+{
+	Utl_Assert(state && block);
+
+	compiler c = { 0 };
+	c.state = state;
+	c.chunk = Utl_AllocType(Lnn_Chunk);
+	if (!compile_codeblock(&c, block))
+	{
+		Lnn_DestroyChunk(c.chunk);
+		return NULL;
+	}
+	emit(&c, Lnn_BC_HALT, 0, 0);
+#ifndef Lnn_NO_PEEPHOLE
+	Lnn_OptimizeChunk(c.chunk);
+#endif
+	return c.chunk;
+}
+
+
+
+/**
+ * @brief Checks if two instructions can be fused into one superinstruction.
+ * @return The fused instruction, or 0 (BC_HALT) if they can't be fused.
+ */
+static Lnn_Instruction fuse_pair(const Lnn_Instruction first, const Lnn_Instruction second)
+{
+	const Lnn_OpCode a = Lnn_InstrOp(first);
+	const Lnn_OpCode b = Lnn_InstrOp(second);
+
+	/* x = ... as a statement */
+	if (a == Lnn_BC_SETGLOBAL && b == Lnn_BC_POP)
+		return Lnn_MakeInstr(Lnn_BC_SETGLOBAL_POP, Lnn_InstrArg(first));
+	if (a == Lnn_BC_SETLOCAL && b == Lnn_BC_POP)
+		return Lnn_MakeInstr(Lnn_BC_SETLOCAL_POP, Lnn_InstrArg(first));
+
+	/* x + 1 */
+	if (a == Lnn_BC_PUSHCONST && b >= Lnn_BC_ADD && b <= Lnn_BC_DIV)
+		return Lnn_MakeInstr(Lnn_BC_ADD_CONST + (b - Lnn_BC_ADD), Lnn_InstrArg(first));
+
+	/* if x < y then */
+	if (a >= Lnn_BC_EQUALITY && a <= Lnn_BC_GREATEREQUAL && b == Lnn_BC_JUMPIFFALSE)
+		return Lnn_MakeInstr(Lnn_BC_EQUALITY_JUMPIFFALSE + (a - Lnn_BC_EQUALITY), Lnn_InstrArg(second));
+
+	/* p.x where p is a local, both arguments have to fit in one */
+	if (a == Lnn_BC_GETLOCAL && b == Lnn_BC_GETMEMBER && Lnn_FitsArgA(Lnn_InstrArg(first)) && Lnn_FitsArgB(Lnn_InstrArg(second)))
+		return Lnn_MakeInstrAB(Lnn_BC_GETLOCAL_GETMEMBER, Lnn_InstrArg(first), Lnn_InstrArg(second));
+
+	return Lnn_MakeInstr(Lnn_BC_HALT, 0);
+}
+
+void Lnn_OptimizeChunk(Lnn_Chunk* chunk)
+{
+	Utl_Assert(chunk);
+	const int numcode = chunk->numcode;
+	Lnn_Instruction* code = chunk->code;
+
+	/* Instructions that are jumped to have to stay the first of a sequence */
+	Utl_Bool* jumptarget = Utl_Calloc(numcode + 1, sizeof(Utl_Bool));
+	for (int i = 0; i < numcode; i++)
+		if (Lnn_IsJumpOp(Lnn_InstrOp(code[i])))
+			jumptarget[Lnn_InstrArg(code[i])] = Utl_TRUE;
+
+	/* Fuse in place, the output can never get ahead of the input */
+	int* newindex = Utl_Malloc(sizeof(int) * (numcode + 1));
+	int out = 0;
+	for (int i = 0; i < numcode;)
+	{
+		newindex[i] = out;
+		if (i + 1 < numcode && !jumptarget[i + 1])
+		{
+			const Lnn_Instruction fused = fuse_pair(code[i], code[i + 1]);
+			if (Lnn_InstrOp(fused) != Lnn_BC_HALT)
+			{
+				newindex[i + 1] = out;
+				code[out++] = fused;
+				i += 2;
+				continue;
+			}
+		}
+		code[out++] = code[i++];
+	}
+	newindex[numcode] = out;
+
+	/* Jumps still point to where instructions were before fusing */
+	for (int i = 0; i < out; i++)
+		if (Lnn_IsJumpOp(Lnn_InstrOp(code[i])))
+			code[i] = Lnn_MakeInstr(Lnn_InstrOp(code[i]), newindex[Lnn_InstrArg(code[i])]);
+	chunk->numcode = out;
+
+	Utl_Free(newindex);
+	Utl_Free(jumptarget);
+}
+
+void Lnn_DestroyChunk(Lnn_Chunk* chunk)
+{
+	if (!chunk) return;
+	/* What a loaded chunk still shares with the program belongs to the program */
+	const Lnn_Chunk* source = chunk->source;
+	if (!source || chunk->constants != source->constants)
+		Utl_Free(chunk->constants);
+	for (int i = 0; i < chunk->numcaches; i++)
+		Utl_Free(chunk->caches[i].name);
+	Utl_Free(chunk->caches);
+	if (!source || chunk->loops != source->loops)
+		Utl_Free(chunk->loops);
+	for (int i = 0; i < chunk->numprototypes; i++)
+	{
+		Lnn_DestroyChunk(chunk->prototypes[i]->code);
+		Lnn_DestroyPrototype(chunk->prototypes[i]);
+	}
+	Utl_Free(chunk->prototypes);
+	if (!source || chunk->code != source->code)
+		Utl_Free(chunk->code);
+#ifdef Lnn_JIT
+	Lnn_DestroyJitCode(chunk->jitcode);
+#endif
+	if (chunk->program)
+		Lnn_ReleaseProgram(chunk->program);
+	Utl_Free(chunk);
+}
+
+void Lnn_PrintChunk(const Lnn_Chunk* chunk)
+{
+	printf("Chunk, %i instructions, %i constants, max stack %i\n", chunk->numcode, chunk->numconstants, chunk->maxstack);
+	for (int i = 0; i < chunk->numcode; i++)
+	{
+		const Lnn_Instruction instr = chunk->code[i];
+		printf("%4i  %-24s %i", i, lnn_opcode_names[Lnn_InstrOp(instr)], Lnn_InstrArg(instr));
+		const Lnn_OpCode op = Lnn_InstrOp(instr);
+		if (op == Lnn_BC_PUSHCONST || (op >= Lnn_BC_ADD_CONST && op <= Lnn_BC_DIV_CONST))
+		{
+			printf("  (");
+			Lnn_PrintValue(chunk->constants[Lnn_InstrArg(instr)]);
+			putchar(')');
+		} else if (op == Lnn_BC_GETMEMBER || op == Lnn_BC_SETMEMBER || op == Lnn_BC_INITMEMBER)
+		{
+			const Lnn_MemberCache* cache = &chunk->caches[Lnn_InstrArg(instr)];
+			printf("  (.%s, %i shapes)", cache->name, cache->numentries);
+		} else if (op == Lnn_BC_GETLOCAL_GETMEMBER)
+		{
+			const Lnn_MemberCache* cache = &chunk->caches[Lnn_InstrArgB(instr)];
+			printf("  (local %i .%s, %i shapes)", Lnn_InstrArgA(instr), cache->name, cache->numentries);
+		} else if (op == Lnn_BC_CALLBUILTIN)
+			printf("  (%s)", lnn_builtins[Lnn_InstrArg(instr)].name);
+		else if (op == Lnn_BC_ELEMENTWISE)
+			printf("  (%s)", lnn_elementwiseop_names[chunk->loops[Lnn_InstrArg(instr)].op]);
+		else if (op == Lnn_BC_CLOSURE || op == Lnn_BC_STACKCLOSURE)
+			printf("  (%s)", chunk->prototypes[Lnn_InstrArg(instr)]->name);
+		putchar('\n');
+	}
+	for (int i = 0; i < chunk->numprototypes; i++)
+	{
+		const Lnn_Prototype* prototype = chunk->prototypes[i];
+		printf("Function %s, %i params, %i slots, %i captures%s\n", prototype->name, prototype->numparams,
+			   prototype->numslots, prototype->numcaptures, prototype->escapes ? "" : ", doesn't escape");
+		Lnn_PrintChunk(prototype->code);
+	}
+}
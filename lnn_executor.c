@@ -0,0 +1,686 @@
+#include "lnn_executor.h"
+#include "lnn_channel.h"
+#include <math.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+
+
+#ifdef _WIN32
+typedef HANDLE thread_t;
+typedef SRWLOCK mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#define THREAD_RESULT					DWORD WINAPI
+#define mutex_init(mutex)				InitializeSRWLock(mutex)
+#define mutex_destroy(mutex)			((void)(mutex))
+#define mutex_lock(mutex)				AcquireSRWLockExclusive(mutex)
+#define mutex_unlock(mutex)				ReleaseSRWLockExclusive(mutex)
+#define cond_init(cond)					InitializeConditionVariable(cond)
+#define cond_destroy(cond)				((void)(cond))
+#define cond_signal(cond)				WakeConditionVariable(cond)
+#define cond_broadcast(cond)			WakeAllConditionVariable(cond)
+#define cond_wait(cond, mutex)			SleepConditionVariableSRW(cond, mutex, INFINITE, 0)
+#define cond_timedwait(cond, mutex, ms)	SleepConditionVariableSRW(cond, mutex, ms, 0)
+#else
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#define THREAD_RESULT					void*
+#define mutex_init(mutex)				pthread_mutex_init(mutex, NULL)
+#define mutex_destroy(mutex)			pthread_mutex_destroy(mutex)
+#define mutex_lock(mutex)				pthread_mutex_lock(mutex)
+#define mutex_unlock(mutex)				pthread_mutex_unlock(mutex)
+#define cond_init(cond)					pthread_cond_init(cond, NULL)
+#define cond_destroy(cond)				pthread_cond_destroy(cond)
+#define cond_signal(cond)				pthread_cond_signal(cond)
+#define cond_broadcast(cond)			pthread_cond_broadcast(cond)
+#define cond_wait(cond, mutex)			pthread_cond_wait(cond, mutex)
+
+static void cond_timedwait(cond_t* cond, mutex_t* mutex, const int ms)
+{
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += ms / 1000;
+	until.tv_nsec += (long)(ms % 1000) * 1000000;
+	if (until.tv_nsec >= 1000000000)
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	pthread_cond_timedwait(cond, mutex, &until);
+}
+#endif
+
+
+
+typedef struct queued_task
+{
+	Lnn_Task task;
+	int queuedon;					/* Worker the task was queued on */
+	unsigned long long submitted;	/* Microseconds */
+	unsigned long long queued;		/* When it was put in the queue it is in, for preempted tasks that is after their last slice */
+	Lnn_Coroutine* coroutine;		/* Run of a task with a budget that was preempted, it has to go on in the same worker */
+} queued_task;
+
+/* Ring buffer of tasks, the oldest one is at head */
+typedef struct task_queue
+{
+	queued_task* tasks;
+	int head;
+	int count;
+	int capacity;
+} task_queue;
+
+typedef struct loaded_program
+{
+	Lnn_Program* program;	/* The worker holds a reference while the chunk is loaded */
+	Lnn_Chunk* chunk;
+	int users;				/* Preempted tasks that run in the chunk, it isn't dropped while there are any */
+} loaded_program;
+
+typedef struct worker
+{
+	struct Lnn_Executor* executor;
+	int index;
+	thread_t thread;
+	Lnn_State* state;		/* Only the thread of the worker uses it after it starts */
+
+	/* Everything below up to the loaded programs is guarded by the mutex */
+	mutex_t mutex;
+	cond_t wakeup;
+	task_queue tasks;		/* Other workers can steal these */
+	task_queue preempted;	/* These can only run here */
+	Utl_Bool sleeping;
+	Utl_Bool stopping;
+	Lnn_ExecutorStats stats;
+
+	loaded_program* loaded;	/* Oldest first */
+	int numloaded;
+	int caploaded;
+} worker;
+
+struct Lnn_Executor
+{
+	worker* workers;
+	int numworkers;
+
+	mutex_t mutex;
+	cond_t alldone;
+	int unfinished;			/* Tasks submitted and not done yet, guarded by the mutex */
+};
+
+
+
+/**
+ * @brief Gets what a worker loaded for a program, loading it the first time.
+ * The pointer is only good until the next call.
+ */
+static loaded_program* get_loaded_program(worker* w, Lnn_Program* program)
+{
+	for (int i = 0; i < w->numloaded; i++)
+		if (w->loaded[i].program == program)
+			return &w->loaded[i];
+
+	/* The oldest chunk no preempted task is in makes room */
+	for (int i = 0; i < w->numloaded && w->numloaded >= Lnn_EXECUTOR_MAX_LOADED; i++)
+	{
+		if (w->loaded[i].users > 0) continue;
+		Lnn_DestroyChunk(w->loaded[i].chunk);
+		Lnn_ReleaseProgram(w->loaded[i].program);
+		memmove(&w->loaded[i], &w->loaded[i + 1], sizeof(loaded_program) * (w->numloaded - i - 1));
+		w->numloaded--;
+		i--;
+	}
+	if (w->numloaded >= w->caploaded)
+	{
+		w->caploaded = w->caploaded ? w->caploaded * 2 : 8;
+		w->loaded = Utl_Realloc(w->loaded, sizeof(loaded_program) * w->caploaded);
+	}
+	Lnn_RetainProgram(program);
+	loaded_program* loaded = &w->loaded[w->numloaded++];
+	loaded->program = program;
+	loaded->chunk = Lnn_LoadProgram(w->state, program);
+	loaded->users = 0;
+	return loaded;
+}
+
+/* These have to be called with the mutex of the worker that has the queue locked */
+static Utl_Bool pop_oldest_task(task_queue* queue, queued_task* task)
+{
+	if (queue->count == 0) return Utl_FALSE;
+	*task = queue->tasks[queue->head];
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+	return Utl_TRUE;
+}
+
+static Utl_Bool pop_newest_task(task_queue* queue, queued_task* task)
+{
+	if (queue->count == 0) return Utl_FALSE;
+	queue->count--;
+	*task = queue->tasks[(queue->head + queue->count) % queue->capacity];
+	return Utl_TRUE;
+}
+
+static void push_task(task_queue* queue, const queued_task* task)
+{
+	if (queue->count >= queue->capacity)
+	{
+		/* Unwraps the ring into the start of the bigger buffer */
+		const int newcap = queue->capacity ? queue->capacity * 2 : 64;
+		queued_task* tasks = Utl_Malloc(sizeof(queued_task) * newcap);
+		for (int i = 0; i < queue->count; i++)
+			tasks[i] = queue->tasks[(queue->head + i) % queue->capacity];
+		Utl_Free(queue->tasks);
+		queue->tasks = tasks;
+		queue->head = 0;
+		queue->capacity = newcap;
+	}
+	queue->tasks[(queue->head + queue->count) % queue->capacity] = *task;
+	queue->count++;
+}
+
+/* Tasks waiting in a worker, guarded by its mutex */
+#define queue_depth(w)	((w)->tasks.count + (w)->preempted.count)
+
+/* Takes whichever task has waited longer, a new one or a preempted one, so preempted tasks get their turn fairly */
+static Utl_Bool pop_next_task(worker* w, queued_task* task)
+{
+	if (w->preempted.count > 0 &&
+		(w->tasks.count == 0 || w->preempted.tasks[w->preempted.head].queued <= w->tasks.tasks[w->tasks.head].queued))
+		return pop_oldest_task(&w->preempted, task);
+	return pop_oldest_task(&w->tasks, task);
+}
+
+/* Takes the newest task of the first other worker that has one, starting after the thief */
+static Utl_Bool steal_task(worker* thief, queued_task* task)
+{
+	Lnn_Executor* executor = thief->executor;
+	for (int i = 1; i < executor->numworkers; i++)
+	{
+		worker* victim = &executor->workers[(thief->index + i) % executor->numworkers];
+		mutex_lock(&victim->mutex);
+		const Utl_Bool stolen = pop_newest_task(&victim->tasks, task);
+		mutex_unlock(&victim->mutex);
+		if (stolen) return Utl_TRUE;
+	}
+	return Utl_FALSE;
+}
+
+/* Runs a task, or the next slice of it if it has a budget. A task that isn't done goes back in the preempted queue */
+static void run_task(worker* w, queued_task* task)
+{
+	const unsigned long long started = Utl_GetMicroseconds();
+	loaded_program* loaded = get_loaded_program(w, task->task.program);
+	Lnn_ExecResult result;
+	if (task->coroutine)
+		result = Lnn_ResumeCoroutine(w->state, task->coroutine, Lnn_NullValue(), NULL);
+	else
+	{
+		if (task->task.prepare)
+			task->task.prepare(w->state, task->task.userdata);
+		if (task->task.budget > 0)
+		{
+			task->coroutine = Lnn_CreateCoroutine(w->state, loaded->chunk);
+			if (task->coroutine)
+			{
+				task->coroutine->budget = task->task.budget;
+				loaded->users++;
+				result = Lnn_ResumeCoroutine(w->state, task->coroutine, Lnn_NullValue(), NULL);
+			} else
+				result = Lnn_EXEC_ERROR;
+		} else
+			result = Lnn_RunChunk(w->state, loaded->chunk);
+	}
+	const unsigned long long finished = Utl_GetMicroseconds();
+
+	/* A yield in a task gives up the rest of its slice */
+	if (result == Lnn_EXEC_PREEMPTED || result == Lnn_EXEC_YIELD)
+	{
+		mutex_lock(&w->mutex);
+		w->stats.preemptions++;
+		w->stats.waitmicros += started - task->queued;
+		w->stats.runmicros += finished - started;
+		task->queued = finished;
+		push_task(&w->preempted, task);
+		mutex_unlock(&w->mutex);
+		return;
+	}
+
+	if (task->task.done)
+		task->task.done(w->state, result, task->task.userdata);
+	if (task->coroutine)
+	{
+		Lnn_DestroyCoroutine(w->state, task->coroutine);
+		loaded->users--;
+	}
+	Lnn_ReleaseProgram(task->task.program);
+
+	mutex_lock(&w->mutex);
+	w->stats.tasksrun++;
+	if (task->queuedon != w->index) w->stats.tasksstolen++;
+	if (result != Lnn_EXEC_OK) w->stats.taskerrors++;
+	w->stats.waitmicros += started - task->queued;
+	w->stats.runmicros += finished - started;
+	if (finished - task->submitted > w->stats.maxlatency)
+		w->stats.maxlatency = finished - task->submitted;
+	mutex_unlock(&w->mutex);
+
+	Lnn_Executor* executor = w->executor;
+	mutex_lock(&executor->mutex);
+	if (--executor->unfinished == 0)
+		cond_broadcast(&executor->alldone);
+	mutex_unlock(&executor->mutex);
+}
+
+static THREAD_RESULT worker_main(void* arg)
+{
+	worker* w = arg;
+	for (;;)
+	{
+		queued_task task;
+		mutex_lock(&w->mutex);
+		Utl_Bool found = pop_next_task(w, &task);
+		mutex_unlock(&w->mutex);
+		if (!found)
+			found = steal_task(w, &task);
+
+		if (found)
+		{
+			run_task(w, &task);
+			continue;
+		}
+
+		mutex_lock(&w->mutex);
+		if (queue_depth(w) == 0)
+		{
+			if (w->stopping)
+			{
+				mutex_unlock(&w->mutex);
+				break;
+			}
+			/* Wakes up by itself now and then since nothing signals a worker when another one falls behind */
+			w->sleeping = Utl_TRUE;
+			cond_timedwait(&w->wakeup, &w->mutex, Lnn_EXECUTOR_IDLE_WAIT_MS);
+			w->sleeping = Utl_FALSE;
+		}
+		mutex_unlock(&w->mutex);
+	}
+	return 0;
+}
+
+
+
+Lnn_Executor* Lnn_CreateExecutor(const int numworkers, Lnn_TaskCallback setup, void* userdata)
+{
+	if (numworkers < 1)
+	{
+		printf("ERROR! An executor needs at least one worker, got %i\n", numworkers);
+		return NULL;
+	}
+
+	Lnn_Executor* executor = Utl_AllocType(Lnn_Executor);
+	executor->numworkers = numworkers;
+	executor->workers = Utl_Malloc(sizeof(worker) * numworkers);
+	memset(executor->workers, 0, sizeof(worker) * numworkers);
+	mutex_init(&executor->mutex);
+	cond_init(&executor->alldone);
+
+	for (int i = 0; i < numworkers; i++)
+	{
+		worker* w = &executor->workers[i];
+		w->executor = executor;
+		w->index = i;
+		w->state = Lnn_CreateState();
+		if (setup) setup(w->state, userdata);
+		mutex_init(&w->mutex);
+		cond_init(&w->wakeup);
+	}
+	/* Started after every worker is set up since they steal from each other */
+	for (int i = 0; i < numworkers; i++)
+	{
+		worker* w = &executor->workers[i];
+#ifdef _WIN32
+		w->thread = CreateThread(NULL, 0, worker_main, w, 0, NULL);
+#else
+		pthread_create(&w->thread, NULL, worker_main, w);
+#endif
+	}
+	return executor;
+}
+
+void Lnn_DestroyExecutor(Lnn_Executor* executor)
+{
+	if (!executor) return;
+	Lnn_WaitForExecutor(executor);
+
+	for (int i = 0; i < executor->numworkers; i++)
+	{
+		worker* w = &executor->workers[i];
+		mutex_lock(&w->mutex);
+		w->stopping = Utl_TRUE;
+		cond_signal(&w->wakeup);
+		mutex_unlock(&w->mutex);
+	}
+	for (int i = 0; i < executor->numworkers; i++)
+	{
+		worker* w = &executor->workers[i];
+#ifdef _WIN32
+		WaitForSingleObject(w->thread, INFINITE);
+		CloseHandle(w->thread);
+#else
+		pthread_join(w->thread, NULL);
+#endif
+	}
+	/* Only torn down once every worker has stopped since they look into each other's queues */
+	for (int i = 0; i < executor->numworkers; i++)
+	{
+		worker* w = &executor->workers[i];
+		for (int j = 0; j < w->numloaded; j++)
+		{
+			Lnn_DestroyChunk(w->loaded[j].chunk);
+			Lnn_ReleaseProgram(w->loaded[j].program);
+		}
+		Utl_Free(w->loaded);
+		Lnn_DestroyState(w->state);
+		Utl_Free(w->tasks.tasks);
+		Utl_Free(w->preempted.tasks);
+		mutex_destroy(&w->mutex);
+		cond_destroy(&w->wakeup);
+	}
+
+	mutex_destroy(&executor->mutex);
+	cond_destroy(&executor->alldone);
+	Utl_Free(executor->workers);
+	Utl_Free(executor);
+}
+
+void Lnn_SubmitTask(Lnn_Executor* executor, const Lnn_Task* task)
+{
+	Utl_Assert(executor && task && task->program);
+
+	queued_task queued;
+	queued.task = *task;
+	/* Programs are spread over the workers by address, they stay on the same one unless it is stolen */
+	queued.queuedon = task->affinity >= 0 ?
+		task->affinity % executor->numworkers :
+		(int)(((uintptr_t)task->program >> 4) % (uintptr_t)executor->numworkers);
+	queued.submitted = queued.queued = Utl_GetMicroseconds();
+	queued.coroutine = NULL;
+	Lnn_RetainProgram(task->program);
+
+	mutex_lock(&executor->mutex);
+	executor->unfinished++;
+	mutex_unlock(&executor->mutex);
+
+	worker* target = &executor->workers[queued.queuedon];
+	mutex_lock(&target->mutex);
+	push_task(&target->tasks, &queued);
+	if (queue_depth(target) > target->stats.maxqueuedepth)
+		target->stats.maxqueuedepth = queue_depth(target);
+	const Utl_Bool wasidle = target->sleeping;
+	if (wasidle) cond_signal(&target->wakeup);
+	mutex_unlock(&target->mutex);
+	if (wasidle) return;
+
+	/* The worker is busy, so one that is idle is woken up to steal the task */
+	for (int i = 1; i < executor->numworkers; i++)
+	{
+		worker* w = &executor->workers[(queued.queuedon + i) % executor->numworkers];
+		mutex_lock(&w->mutex);
+		const Utl_Bool idle = w->sleeping;
+		if (idle) cond_signal(&w->wakeup);
+		mutex_unlock(&w->mutex);
+		if (idle) break;
+	}
+}
+
+void Lnn_WaitForExecutor(Lnn_Executor* executor)
+{
+	Utl_Assert(executor);
+	mutex_lock(&executor->mutex);
+	while (executor->unfinished > 0)
+		cond_wait(&executor->alldone, &executor->mutex);
+	mutex_unlock(&executor->mutex);
+}
+
+int Lnn_GetNumWorkers(const Lnn_Executor* executor)
+{
+	Utl_Assert(executor);
+	return executor->numworkers;
+}
+
+void Lnn_GetExecutorStats(Lnn_Executor* executor, const int index, Lnn_ExecutorStats* stats)
+{
+	Utl_Assert(executor && stats);
+	Utl_Assert(index < executor->numworkers);
+	memset(stats, 0, sizeof(Lnn_ExecutorStats));
+	for (int i = 0; i < executor->numworkers; i++)
+	{
+		if (index >= 0 && i != index) continue;
+		worker* w = &executor->workers[i];
+		mutex_lock(&w->mutex);
+		stats->queuedepth += queue_depth(w);
+		if (w->stats.maxqueuedepth > stats->maxqueuedepth)
+			stats->maxqueuedepth = w->stats.maxqueuedepth;
+		stats->tasksrun += w->stats.tasksrun;
+		stats->tasksstolen += w->stats.tasksstolen;
+		stats->taskerrors += w->stats.taskerrors;
+		stats->preemptions += w->stats.preemptions;
+		stats->waitmicros += w->stats.waitmicros;
+		stats->runmicros += w->stats.runmicros;
+		if (w->stats.maxlatency > stats->maxlatency)
+			stats->maxlatency = w->stats.maxlatency;
+		mutex_unlock(&w->mutex);
+	}
+}
+
+void Lnn_PrintExecutorStats(Lnn_Executor* executor)
+{
+	Utl_Assert(executor);
+	printf("Executor, %i workers:\n", executor->numworkers);
+	for (int i = -1; i < executor->numworkers; i++)
+	{
+		Lnn_ExecutorStats stats;
+		Lnn_GetExecutorStats(executor, i, &stats);
+		const unsigned long long runs = stats.tasksrun ? stats.tasksrun : 1;
+		if (i < 0) printf("  All:      "); else printf("  Worker %i: ", i);
+		printf("%llu tasks, %llu stolen, %llu errors, %llu preemptions, queue %i (max %i), mean wait %llu us, mean run %llu us, max latency %llu us\n",
+			   stats.tasksrun, stats.tasksstolen, stats.taskerrors, stats.preemptions, stats.queuedepth, stats.maxqueuedepth,
+			   stats.waitmicros / runs, stats.runmicros / runs, stats.maxlatency);
+	}
+}
+
+
+
+const char* lnn_reduceop_names[Lnn_NUM_REDUCEOPS] =
+{
+	"RO_SUM",
+	"RO_MIN",
+	"RO_MAX"
+};
+
+typedef struct parallel_loop
+{
+	Lnn_Executor* executor;
+	const Lnn_ParallelFor* desc;
+	Lnn_Value* inputs;		/* Detached copies of the inputs */
+	Utl_Bool* attached;		/* Whether a worker has the inputs yet, only that worker uses its flag */
+
+	mutex_t mutex;
+	cond_t alldone;
+	int unfinished;			/* Ranges not done yet, guarded by the mutex like failed */
+	Utl_Bool failed;
+} parallel_loop;
+
+/* Userdata of the task that runs a range */
+typedef struct parallel_range
+{
+	parallel_loop* loop;
+	int first;
+	int last;
+	Lnn_Value* partials;	/* What the range left in the reductions */
+} parallel_range;
+
+static Lnn_Value reduce_identity(const Lnn_ReduceOp op)
+{
+	switch (op)
+	{
+	case Lnn_RO_MIN: return Lnn_FloatValue(HUGE_VAL);
+	case Lnn_RO_MAX: return Lnn_FloatValue(-HUGE_VAL);
+	default: return Lnn_IntValue(0);
+	}
+}
+
+/* Combines two numbers, sums of ints stay ints as long as they fit */
+static Lnn_Value reduce(const Lnn_ReduceOp op, const Lnn_Value a, const Lnn_Value b)
+{
+	switch (op)
+	{
+	case Lnn_RO_MIN: return Lnn_NumberOf(b) < Lnn_NumberOf(a) ? b : a;
+	case Lnn_RO_MAX: return Lnn_NumberOf(b) > Lnn_NumberOf(a) ? b : a;
+	default:
+	{
+		Utl_Int sum;
+		if (Lnn_IsInt(a) && Lnn_IsInt(b) && Lnn_AddInts(a.u.integer, b.u.integer, &sum))
+			return Lnn_IntValue(sum);
+		return Lnn_FloatValue(Lnn_NumberOf(a) + Lnn_NumberOf(b));
+	}
+	}
+}
+
+static void prepare_range(Lnn_State* state, void* userdata)
+{
+	const parallel_range* range = userdata;
+	parallel_loop* loop = range->loop;
+	const Lnn_ParallelFor* desc = loop->desc;
+
+	for (int i = 0; i < loop->executor->numworkers; i++)
+	{
+		if (loop->executor->workers[i].state != state || loop->attached[i]) continue;
+		for (int j = 0; j < desc->numinputs; j++)
+		{
+			const int slot = Lnn_GetGlobalSlot(state, desc->inputs[j].name);
+			if (!Lnn_AttachValue(state, loop->inputs[j], &state->globals[slot].value))
+			{
+				mutex_lock(&loop->mutex);
+				loop->failed = Utl_TRUE;
+				mutex_unlock(&loop->mutex);
+			}
+		}
+		loop->attached[i] = Utl_TRUE;
+	}
+
+	// Lnn_GetGlobalSlot may grow the globals, so it must run before indexing them.
+	const int first = Lnn_GetGlobalSlot(state, "first");
+	state->globals[first].value = Lnn_IntValue(range->first);
+	const int last = Lnn_GetGlobalSlot(state, "last");
+	state->globals[last].value = Lnn_IntValue(range->last);
+	for (int i = 0; i < desc->numreductions; i++)
+	{
+		const int slot = Lnn_GetGlobalSlot(state, desc->reductions[i].name);
+		state->globals[slot].value = reduce_identity(desc->reductions[i].op);
+	}
+}
+
+static void finish_range(Lnn_State* state, Lnn_ExecResult result, void* userdata)
+{
+	const parallel_range* range = userdata;
+	parallel_loop* loop = range->loop;
+	const Lnn_ParallelFor* desc = loop->desc;
+
+	Utl_Bool ok = result == Lnn_EXEC_OK;
+	for (int i = 0; i < desc->numreductions && ok; i++)
+	{
+		const Lnn_Value value = state->globals[Lnn_FindGlobalSlot(state, desc->reductions[i].name)].value;
+		if (!Lnn_IsNumber(value))
+		{
+			printf("ERROR! Reduction %s has to be a number, not %s\n", desc->reductions[i].name, lnn_valuetype_names[value.type]);
+			ok = Utl_FALSE;
+		}
+		range->partials[i] = value;
+	}
+
+	mutex_lock(&loop->mutex);
+	if (!ok) loop->failed = Utl_TRUE;
+	if (--loop->unfinished == 0)
+		cond_broadcast(&loop->alldone);
+	mutex_unlock(&loop->mutex);
+}
+
+Utl_Bool Lnn_RunParallelFor(Lnn_Executor* executor, const Lnn_ParallelFor* desc, Lnn_Value* results)
+{
+	Utl_Assert(executor && desc && desc->program);
+	Utl_Assert(desc->numinputs == 0 || desc->state);
+	Utl_Assert(desc->numreductions == 0 || results);
+	for (int i = 0; i < desc->numreductions; i++)
+		results[i] = reduce_identity(desc->reductions[i].op);
+	if (desc->last <= desc->first) return Utl_TRUE;
+
+	parallel_loop loop = { 0 };
+	loop.executor = executor;
+	loop.desc = desc;
+	loop.inputs = Utl_Malloc(sizeof(Lnn_Value) * (desc->numinputs + 1));
+	for (int i = 0; i < desc->numinputs; i++)
+	{
+		if (Lnn_DetachValue(desc->state, desc->inputs[i].value, &loop.inputs[i])) continue;
+		while (i-- > 0)
+			Lnn_FreeDetachedValue(loop.inputs[i]);
+		Utl_Free(loop.inputs);
+		return Utl_FALSE;
+	}
+	loop.attached = Utl_Calloc(executor->numworkers, sizeof(Utl_Bool));
+
+	const int count = desc->last - desc->first;
+	const int splits = executor->numworkers * Lnn_PARALLEL_RANGES_PER_WORKER;
+	const int grain = desc->grain > 0 ? desc->grain : (count + splits - 1) / splits;
+	const int numranges = (count + grain - 1) / grain;
+	parallel_range* ranges = Utl_Malloc(sizeof(parallel_range) * numranges);
+	Lnn_Value* partials = Utl_Malloc(sizeof(Lnn_Value) * ((size_t)numranges * desc->numreductions + 1));
+
+	mutex_init(&loop.mutex);
+	cond_init(&loop.alldone);
+	loop.unfinished = numranges;
+	for (int i = 0; i < numranges; i++)
+	{
+		parallel_range* range = &ranges[i];
+		range->loop = &loop;
+		range->first = desc->first + i * grain;
+		range->last = i == numranges - 1 ? desc->last : range->first + grain;
+		range->partials = &partials[i * desc->numreductions];
+
+		Lnn_Task task = { 0 };
+		task.program = desc->program;
+		task.prepare = prepare_range;
+		task.done = finish_range;
+		task.userdata = range;
+		/* Neighbouring ranges go to the same worker, idle workers steal from the end of the queues */
+		task.affinity = (int)((long long)i * executor->numworkers / numranges);
+		Lnn_SubmitTask(executor, &task);
+	}
+
+	mutex_lock(&loop.mutex);
+	while (loop.unfinished > 0)
+		cond_wait(&loop.alldone, &loop.mutex);
+	mutex_unlock(&loop.mutex);
+
+	if (!loop.failed)
+		for (int i = 0; i < numranges; i++)
+			for (int j = 0; j < desc->numreductions; j++)
+				results[j] = reduce(desc->reductions[j].op, results[j], ranges[i].partials[j]);
+
+	mutex_destroy(&loop.mutex);
+	cond_destroy(&loop.alldone);
+	for (int i = 0; i < desc->numinputs; i++)
+		Lnn_FreeDetachedValue(loop.inputs[i]);
+	Utl_Free(loop.inputs);
+	Utl_Free(loop.attached);
+	Utl_Free(ranges);
+	Utl_Free(partials);
+	return !loop.failed;
+}
@@ -0,0 +1,161 @@
+#ifndef _Lnn_EXECUTOR_H_
+#define _Lnn_EXECUTOR_H_
+
+#include "fab_utility.h"
+#include "lnn_state.h"
+#include "lnn_vm.h"
+#include "lnn_program.h"
+
+/**
+ * The executor runs many short invocations of programs on a fixed pool of worker threads.
+ * Every worker owns a state and a queue of tasks. A task is queued on the worker its program has
+ * affinity to, so the chunk that worker loaded for the program stays quickened, jit compiled and
+ * with its inline caches filled in between invocations. Workers run their own queue oldest first,
+ * and a worker with nothing to do steals the newest task from the queue of another worker.
+ * Globals of a program are left from its last run in the same worker, tasks that need them reset
+ * can set them in the prepare callback.
+ * A task with a budget runs as a coroutine in time slices of that many ticks, so long tasks don't hold
+ * up short ones behind them. When a slice runs out the task is queued again on the same worker, which
+ * takes turns between it and the other tasks by how long they have waited. Tasks that are preempted
+ * can't be stolen, and tasks of the same program that interleave in a worker see each other's globals.
+ * A yield in a task with a budget gives up the rest of its slice, without a budget it is an error.
+ */
+
+/* Most programs a worker keeps a loaded chunk for, the oldest one no preempted task runs in is dropped after that */
+#define Lnn_EXECUTOR_MAX_LOADED 64
+
+/* How long an idle worker sleeps before it looks for tasks to steal again */
+#define Lnn_EXECUTOR_IDLE_WAIT_MS 10
+
+/* Called on the worker thread with the state of the worker */
+typedef void (*Lnn_TaskCallback)(Lnn_State* state, void* userdata);
+typedef void (*Lnn_TaskDoneCallback)(Lnn_State* state, Lnn_ExecResult result, void* userdata);
+
+typedef struct Lnn_Task
+{
+	Lnn_Program* program;		/* The executor holds a reference to it until the task is done */
+	Lnn_TaskCallback prepare;	/* Called before running, to set the globals the program reads. Can be NULL */
+	Lnn_TaskDoneCallback done;	/* Called after running, to read the globals the program set. Can be NULL */
+	void* userdata;
+	int affinity;				/* Worker to queue the task on, or -1 to pick it from the program */
+	int budget;					/* Ticks per time slice, or 0 to run the task to the end at once */
+} Lnn_Task;
+
+typedef struct Lnn_ExecutorStats
+{
+	int queuedepth;				/* Tasks waiting to run right now */
+	int maxqueuedepth;			/* Most tasks that waited in one queue at once */
+	unsigned long long tasksrun;
+	unsigned long long tasksstolen;	/* Tasks run by another worker than the one they were queued on */
+	unsigned long long taskerrors;	/* Runs that ended with a runtime error */
+	unsigned long long preemptions;	/* Times slices of tasks ran out and they were queued again */
+	unsigned long long waitmicros;	/* Time tasks spent in a queue, added up */
+	unsigned long long runmicros;	/* Time tasks spent running, added up */
+	unsigned long long maxlatency;	/* Longest time from submitting a task to it being done */
+} Lnn_ExecutorStats;
+
+typedef struct Lnn_Executor Lnn_Executor;
+
+/**
+ * @brief Creates an executor and starts its workers.
+ * @param numworkers How many worker threads and states to make.
+ * @param setup Called once for every worker state before it runs anything, to register natives. Can be NULL.
+ * @param userdata Passed to setup.
+ * @return The executor, or NULL if numworkers is less than 1.
+ */
+Lnn_Executor* Lnn_CreateExecutor(const int numworkers,
+								 Lnn_TaskCallback setup,
+								 void* userdata);
+
+/**
+ * @brief Waits for every task that has been submitted, stops the workers and destroys their states.
+ */
+void Lnn_DestroyExecutor(Lnn_Executor* executor);
+
+/**
+ * @brief Queues a task to run on one of the workers. Can be called from any thread.
+ * @param task The task, it is copied.
+ */
+void Lnn_SubmitTask(Lnn_Executor* executor,
+					const Lnn_Task* task);
+
+/**
+ * @brief Waits until every task that has been submitted is done.
+ */
+void Lnn_WaitForExecutor(Lnn_Executor* executor);
+
+int Lnn_GetNumWorkers(const Lnn_Executor* executor);
+
+/**
+ * @brief Gets the statistics of the executor. Can be called from any thread while tasks run.
+ * @param worker Worker to get them for, or -1 for all of them added up.
+ * @param stats Filled in with the statistics.
+ */
+void Lnn_GetExecutorStats(Lnn_Executor* executor,
+						  const int worker,
+						  Lnn_ExecutorStats* stats);
+
+void Lnn_PrintExecutorStats(Lnn_Executor* executor);
+
+
+
+/**
+ * A parallel for runs a program over a range of indices on the workers of an executor.
+ * The range is split into smaller ranges that are run as tasks, the program reads the globals
+ * first and last and goes over the indices from first up to but not including last.
+ * Inputs are values of the calling state that are deep copied into every worker state once per loop,
+ * the program should only read them. Reductions are globals that every range starts out with
+ * the identity of the operator in, and that it folds its indices into. What the ranges end up with
+ * is combined in the order of the ranges, so the result doesn't depend on which worker ran what.
+ */
+
+/* A loop is split into this many ranges per worker unless a grain is given, so workers that finish early can steal */
+#define Lnn_PARALLEL_RANGES_PER_WORKER 4
+
+typedef enum
+{
+	Lnn_RO_SUM,		/* Starts out at 0 */
+	Lnn_RO_MIN,		/* Starts out at infinity */
+	Lnn_RO_MAX,		/* Starts out at minus infinity */
+	Lnn_NUM_REDUCEOPS
+} Lnn_ReduceOp;
+extern const char* lnn_reduceop_names[Lnn_NUM_REDUCEOPS];
+
+typedef struct Lnn_ParallelInput
+{
+	const char* name;	/* Global the workers see it in */
+	Lnn_Value value;	/* Belongs to the calling state */
+} Lnn_ParallelInput;
+
+typedef struct Lnn_ParallelReduction
+{
+	const char* name;	/* Global every range folds into, it has to hold a number when the range is done */
+	Lnn_ReduceOp op;
+} Lnn_ParallelReduction;
+
+typedef struct Lnn_ParallelFor
+{
+	Lnn_Program* program;
+	int first;
+	int last;
+	int grain;						/* Fewest indices in one range, or 0 to split by the number of workers */
+	Lnn_State* state;				/* State the inputs belong to, can be NULL if there are none */
+	const Lnn_ParallelInput* inputs;
+	int numinputs;
+	const Lnn_ParallelReduction* reductions;
+	int numreductions;
+} Lnn_ParallelFor;
+
+/**
+ * @brief Runs a parallel for and waits until every range is done. Mustn't be called from a task of the same executor.
+ * Other tasks on the executor can run in between, but shouldn't set the globals of the inputs.
+ * @param desc The loop.
+ * @param results Set to the combined value of every reduction, can be NULL if there are none.
+ * @return Utl_FALSE if an input couldn't be copied, a range ended with a runtime error
+ * or didn't leave a number in a reduction. The errors are printed.
+ */
+Utl_Bool Lnn_RunParallelFor(Lnn_Executor* executor,
+							const Lnn_ParallelFor* desc,
+							Lnn_Value* results);
+
+#endif
@@ -0,0 +1,121 @@
+#include "lnn_function.h"
+#include "lnn_state.h"
+#include "lnn_gc.h"
+
+
+
+Lnn_Prototype* Lnn_CreatePrototype(const Lnn_Function* function, void* code)
+{
+	Utl_Assert(function);
+	Lnn_Prototype* prototype = Utl_AllocType(Lnn_Prototype);
+	prototype->name = _strdup(function->name ? function->name : "function");
+	prototype->numparams = function->numparams;
+	prototype->numlocals = function->numlocals;
+	prototype->numslots = function->numslots;
+	prototype->numcaptures = function->numcaptures;
+	prototype->escapes = function->escapes;
+	prototype->captureslot = function->captureslot;
+	prototype->code = code;
+
+	prototype->boxed = Utl_Malloc(sizeof(Utl_Bool) * (function->numlocals + 1));
+	if (function->numlocals)
+		memcpy(prototype->boxed, function->boxed, sizeof(Utl_Bool) * function->numlocals);
+	prototype->captures = Utl_Malloc(sizeof(Lnn_Capture) * (function->numcaptures + 1));
+	if (function->numcaptures)
+		memcpy(prototype->captures, function->captures, sizeof(Lnn_Capture) * function->numcaptures);
+	return prototype;
+}
+
+Lnn_Prototype* Lnn_CopyPrototype(const Lnn_Prototype* prototype, void* code)
+{
+	Utl_Assert(prototype);
+	Lnn_Prototype* copy = Utl_AllocType(Lnn_Prototype);
+	*copy = *prototype;
+	copy->name = _strdup(prototype->name);
+	copy->code = code;
+	copy->boxed = Utl_Malloc(sizeof(Utl_Bool) * (prototype->numlocals + 1));
+	memcpy(copy->boxed, prototype->boxed, sizeof(Utl_Bool) * prototype->numlocals);
+	copy->captures = Utl_Malloc(sizeof(Lnn_Capture) * (prototype->numcaptures + 1));
+	memcpy(copy->captures, prototype->captures, sizeof(Lnn_Capture) * prototype->numcaptures);
+	return copy;
+}
+
+void Lnn_DestroyPrototype(Lnn_Prototype* prototype)
+{
+	if (!prototype) return;
+	Utl_Free(prototype->name);
+	Utl_Free(prototype->boxed);
+	Utl_Free(prototype->captures);
+	Utl_Free(prototype);
+}
+
+
+
+void Lnn_CopyCaptures(const Lnn_Prototype* prototype,
+					  const Lnn_Value* locals,
+					  const Lnn_Value* captures,
+					  Lnn_Value* result)
+{
+	for (int i = 0; i < prototype->numcaptures; i++)
+	{
+		const Lnn_Capture* capture = &prototype->captures[i];
+		result[i] = capture->fromlocal ? locals[capture->index] : captures[capture->index];
+	}
+}
+
+Lnn_Closure* Lnn_NewClosure(Lnn_State* state,
+							const Lnn_Prototype* prototype,
+							const Lnn_Value* locals,
+							const Lnn_Value* captures)
+{
+	Utl_Assert(state && prototype);
+	const int numcaptures = prototype->numcaptures;
+	Lnn_Closure* closure = (Lnn_Closure*)Lnn_GCAllocate(state, sizeof(Lnn_Closure) + sizeof(Lnn_Value) * numcaptures,
+														Lnn_VT_CLOSURE);
+	if (!closure) return NULL;
+	closure->prototype = prototype;
+	closure->numcaptures = numcaptures;
+	Lnn_CopyCaptures(prototype, locals, captures, closure->captures);
+	/* The closure is old and black if the nursery was full */
+	for (int i = 0; i < numcaptures; i++)
+		Lnn_GCWriteBarrier(state, &closure->obj, closure->captures[i]);
+	return closure;
+}
+
+Lnn_Cell* Lnn_NewCell(Lnn_State* state, const Lnn_Value value)
+{
+	Utl_Assert(state);
+	Lnn_Cell* cell = (Lnn_Cell*)Lnn_GCAllocate(state, sizeof(Lnn_Cell), Lnn_VT_CELL);
+	if (!cell) return NULL;
+	cell->value = value;
+	Lnn_GCWriteBarrier(state, &cell->obj, value);
+	return cell;
+}
+
+Utl_Bool Lnn_BoxLocals(Lnn_State* state, const Lnn_Prototype* prototype, Lnn_Value* locals)
+{
+	for (int i = 0; i < prototype->numlocals; i++)
+		if (prototype->boxed[i])
+		{
+			Lnn_Cell* cell = Lnn_NewCell(state, locals[i]);
+			if (!cell) return Utl_FALSE;
+			locals[i] = Lnn_CellValue(cell);
+		}
+	return Utl_TRUE;
+}
+
+const Lnn_Prototype* Lnn_CheckCall(const Lnn_Value callee, const int numargs)
+{
+	if (!Lnn_IsCallable(callee))
+	{
+		printf("ERROR! Can't call %s\n", lnn_valuetype_names[callee.type]);
+		return NULL;
+	}
+	const Lnn_Prototype* prototype = Lnn_CalledPrototype(callee);
+	if (numargs != prototype->numparams)
+	{
+		printf("ERROR! %s takes %i arguments, not %i\n", prototype->name, prototype->numparams, numargs);
+		return NULL;
+	}
+	return prototype;
+}
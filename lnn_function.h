@@ -0,0 +1,137 @@
+#ifndef _Lnn_FUNCTION_H_
+#define _Lnn_FUNCTION_H_
+
+#include "fab_utility.h"
+#include "lnn_value.h"
+#include "lnn_code.h"
+#include "lnn_gc.h"
+
+struct Lnn_State;
+
+/**
+ * Functions are made from function literals, how depends on what the resolver found out about their captures.
+ * A function without captures, or one whose closure never escapes the call that made it, is a plain
+ * Lnn_VT_FUNCTION value that only points to its prototype. The captures of one that doesn't escape are
+ * copied into hidden slots of the frame that made it, so calling it doesn't allocate anything.
+ * Every other function is an Lnn_Closure object with its captures copied into it.
+ * Captures are copied by value, only locals that can change after being captured are boxed in an Lnn_Cell.
+ */
+
+/* Most values the frames of all running calls can have together */
+#define Lnn_STACK_SIZE (16 * 1024)
+
+/* Most calls that can be running at once */
+#define Lnn_MAX_CALL_DEPTH 256
+
+/**
+ * @brief What a tier needs to call a function literal, made from the resolved Lnn_Function.
+ * It doesn't point into the parsed tree so the tree can be destroyed after compiling.
+ */
+typedef struct Lnn_Prototype
+{
+	char* name;				/* Name for error messages, "function" if it has none */
+	int numparams;
+	int numlocals;
+	int numslots;			/* Locals and hidden capture and scalar slots */
+	Utl_Bool* boxed;		/* If a local lives in a cell, one for every local */
+	Lnn_Capture* captures;
+	int numcaptures;
+	Utl_Bool escapes;
+	int captureslot;		/* Where the captures go in the frame of the parent if it doesn't escape */
+	void* code;				/* Code of the tier that made the prototype, the tier destroys it */
+} Lnn_Prototype;
+
+typedef struct Lnn_Closure
+{
+	Lnn_Object obj;
+	const Lnn_Prototype* prototype;
+	int numcaptures;
+	Lnn_Value captures[];
+} Lnn_Closure;
+
+typedef struct Lnn_Cell
+{
+	Lnn_Object obj;
+	Lnn_Value value;
+} Lnn_Cell;
+
+/* Gets the prototype of a callable value */
+#define Lnn_CalledPrototype(v)	((v).type == Lnn_VT_FUNCTION ? (v).u.prototype : (v).u.closure->prototype)
+
+/**
+ * @brief Creates the prototype of a resolved function.
+ * @param function The function literal.
+ * @param code Code of the function in the tier that calls this.
+ * @return The new prototype, destroy it with Lnn_DestroyPrototype().
+ */
+Lnn_Prototype* Lnn_CreatePrototype(const Lnn_Function* function,
+								   void* code);
+
+/**
+ * @brief Copies a prototype for other code of the same function.
+ * @return The new prototype, destroy it with Lnn_DestroyPrototype().
+ */
+Lnn_Prototype* Lnn_CopyPrototype(const Lnn_Prototype* prototype,
+								 void* code);
+
+/**
+ * @brief Destroys a prototype, but not its code.
+ */
+void Lnn_DestroyPrototype(Lnn_Prototype* prototype);
+
+/**
+ * @brief Copies the captures of a function from the frame that makes it.
+ * @param prototype Prototype of the function being made.
+ * @param locals Locals of the frame that makes it.
+ * @param captures Captures of the function that makes it.
+ * @param result Where the prototype->numcaptures captures are copied to.
+ */
+void Lnn_CopyCaptures(const Lnn_Prototype* prototype,
+					  const Lnn_Value* locals,
+					  const Lnn_Value* captures,
+					  Lnn_Value* result);
+
+/**
+ * @brief Creates a closure owned by a state with its captures copied from the frame that makes it.
+ * @param state State that owns the closure.
+ * @param prototype Prototype of the function, it has to outlive the closure.
+ * @param locals Locals of the frame that makes it.
+ * @param captures Captures of the function that makes it.
+ * @return The closure, or NULL if there is no memory left, the error is printed.
+ */
+Lnn_Closure* Lnn_NewClosure(struct Lnn_State* state,
+							const Lnn_Prototype* prototype,
+							const Lnn_Value* locals,
+							const Lnn_Value* captures);
+
+/**
+ * @brief Creates a cell owned by a state to box a captured local.
+ * @return The cell, or NULL if there is no memory left, the error is printed.
+ */
+Lnn_Cell* Lnn_NewCell(struct Lnn_State* state,
+					  const Lnn_Value value);
+
+/**
+ * @brief Puts the boxed locals of a new frame in cells, called before the function runs.
+ * @param locals The locals with the arguments in the parameters and null in the rest.
+ * @return Utl_FALSE if there is no memory left for a cell, the error is printed.
+ */
+Utl_Bool Lnn_BoxLocals(struct Lnn_State* state,
+				   const Lnn_Prototype* prototype,
+				   Lnn_Value* locals);
+
+/* Stores a value in a cell */
+#define Lnn_SetCell(state, cell, v)						\
+	{													\
+		(cell)->value = (v);							\
+		Lnn_GCWriteBarrier(state, &(cell)->obj, (v));	\
+	}
+
+/**
+ * @brief Checks that a value can be called with some number of arguments.
+ * @return The prototype of the function, or NULL if it can't be called like that, the error is printed.
+ */
+const Lnn_Prototype* Lnn_CheckCall(const Lnn_Value callee,
+								   const int numargs);
+
+#endif
@@ -0,0 +1,534 @@
+#include "lnn_gc.h"
+#include "lnn_state.h"
+#include "lnn_object.h"
+#include "lnn_array.h"
+#include "lnn_string.h"
+#include "lnn_function.h"
+#include "lnn_vm.h"
+
+const char* lnn_gcphase_names[Lnn_NUM_GCPHASES] =
+{
+	"GCP_IDLE",
+	"GCP_MARK",
+	"GCP_SWEEP",
+};
+
+/* Objects in the nursery are aligned to this */
+#define NURSERY_ALIGNMENT 8
+
+/* Units of work done between checks of the clock in an incremental step */
+#define WORK_PER_CLOCK_CHECK 64
+
+
+
+static void record_pause(Lnn_GCPauses* pauses, const unsigned long long micros)
+{
+	int bucket = 0;
+	while (bucket < Lnn_GC_NUM_PAUSE_BUCKETS - 1 && (2ULL << bucket) <= micros)
+		bucket++;
+	pauses->buckets[bucket]++;
+	pauses->count++;
+	pauses->totalmicros += micros;
+	if (micros > pauses->maxmicros)
+		pauses->maxmicros = micros;
+}
+
+/* Pushes onto one of the object stacks of the collector */
+#define push_object(array, count, capacity, object)									\
+	{																				\
+		if ((count) >= (capacity))													\
+		{																			\
+			(capacity) = (capacity) ? (capacity) * 2 : 64;							\
+			(array) = Utl_Realloc((array), sizeof(Lnn_Object*) * (capacity));		\
+		}																			\
+		(array)[(count)++] = (object);												\
+	}
+
+#define is_managed(value) ((value).type >= Lnn_VT_STRING && !((value).u.object->flags & Lnn_GC_STATIC))
+
+
+
+static size_t object_size(const Lnn_Object* object)
+{
+	switch (object->type)
+	{
+	case Lnn_VT_STRING:
+	{
+		/* Only flat strings have their characters in the object */
+		const Lnn_String* string = (const Lnn_String*)object;
+		return sizeof(Lnn_String) + (string->kind == Lnn_SK_FLAT ? string->len + 1 : 0);
+	}
+	case Lnn_VT_OBJECT: return sizeof(Lnn_Instance);
+	case Lnn_VT_ARRAY: return sizeof(Lnn_Array);
+	case Lnn_VT_CLOSURE: return sizeof(Lnn_Closure) + sizeof(Lnn_Value) * ((const Lnn_Closure*)object)->numcaptures;
+	case Lnn_VT_CELL: return sizeof(Lnn_Cell);
+	default:
+		Utl_Assert(0);
+		return 0;
+	}
+}
+
+/* Visits a string an object points to directly instead of through a value */
+static void visit_string(Lnn_State* state, Lnn_String** string, void(*visit)(Lnn_State*, Lnn_Value*))
+{
+	Lnn_Value value = Lnn_StringValue(*string);
+	visit(state, &value);
+	*string = value.u.string;
+}
+
+/**
+ * @brief Calls visit on every value an object refers to.
+ */
+static void trace_object(Lnn_State* state, Lnn_Object* object, void(*visit)(Lnn_State*, Lnn_Value*))
+{
+	switch (object->type)
+	{
+	case Lnn_VT_STRING:
+	{
+		/* Ropes refer to their halves, and flattened ropes to their flat copy */
+		Lnn_String* string = (Lnn_String*)object;
+		if (string->kind != Lnn_SK_FLAT)
+			visit_string(state, &string->left, visit);
+		if (string->kind == Lnn_SK_ROPE)
+			visit_string(state, &string->right, visit);
+		return;
+	}
+	case Lnn_VT_OBJECT:
+	{
+		Lnn_Instance* instance = (Lnn_Instance*)object;
+		for (int i = 0; i < instance->shape->numslots; i++)
+			visit(state, &instance->slots[i]);
+		return;
+	}
+	case Lnn_VT_ARRAY:
+	{
+		/* Only generic elements can refer to objects */
+		Lnn_Array* array = (Lnn_Array*)object;
+		if (array->kind == Lnn_EK_VALUE)
+			for (int i = 0; i < array->length; i++)
+				visit(state, &array->elements.values[i]);
+		return;
+	}
+	case Lnn_VT_CLOSURE:
+	{
+		Lnn_Closure* closure = (Lnn_Closure*)object;
+		for (int i = 0; i < closure->numcaptures; i++)
+			visit(state, &closure->captures[i]);
+		return;
+	}
+	case Lnn_VT_CELL: visit(state, &((Lnn_Cell*)object)->value); return;
+	default:
+		Utl_Assert(0);
+		return;
+	}
+}
+
+/* Objects that own memory outside of the collector */
+#define has_finalizer(type) ((type) == Lnn_VT_OBJECT || (type) == Lnn_VT_ARRAY)
+
+/**
+ * @brief Frees the memory an object owns outside of the collector, but not the object itself.
+ */
+static void finalize_object(Lnn_State* state, Lnn_Object* object)
+{
+	switch (object->type)
+	{
+	case Lnn_VT_OBJECT:
+	{
+		Lnn_Instance* instance = (Lnn_Instance*)object;
+		Lnn_Deallocate(state, instance->slots, sizeof(Lnn_Value) * instance->capslots);
+		return;
+	}
+	case Lnn_VT_ARRAY:
+	{
+		Lnn_Array* array = (Lnn_Array*)object;
+		Lnn_Deallocate(state, array->elements.ints, Lnn_ElementsBytes(array->kind, array->capacity));
+		return;
+	}
+	default: return;
+	}
+}
+
+/* Color of objects that become old while a cycle is running, they have to survive it */
+static Lnn_GCColor allocation_color(const Lnn_GC* gc)
+{
+	return gc->phase == Lnn_GCP_IDLE ? Lnn_GC_WHITE : Lnn_GC_BLACK;
+}
+
+static void add_old_bytes(Lnn_State* state, const size_t size)
+{
+	Lnn_GC* gc = &state->gc;
+	gc->oldbytes += size;
+	gc->stepbytes += size;
+	if (gc->phase != Lnn_GCP_IDLE ? gc->stepbytes >= Lnn_GC_STEP_BYTES : gc->oldbytes >= gc->threshold)
+		gc->pending = Utl_TRUE;
+}
+
+
+
+Utl_Bool Lnn_InitGC(Lnn_State* state)
+{
+	Lnn_GC* gc = &state->gc;
+	memset(gc, 0, sizeof(Lnn_GC));
+	gc->nursery = Lnn_Allocate(state, Lnn_GC_NURSERY_SIZE);
+	gc->nurserytop = gc->nursery;
+	gc->threshold = Lnn_GC_MIN_THRESHOLD;
+	gc->stepbudget = Lnn_GC_DEFAULT_STEP_BUDGET;
+	return gc->nursery != NULL;
+}
+
+void Lnn_FreeGC(Lnn_State* state)
+{
+	Lnn_GC* gc = &state->gc;
+	while (gc->old.begin)
+	{
+		Lnn_Object* object = (Lnn_Object*)Utl_PopFrontList(&gc->old);
+		finalize_object(state, object);
+		Lnn_Deallocate(state, object, object_size(object));
+	}
+	for (int i = 0; i < gc->numfinalizable; i++)
+		finalize_object(state, gc->finalizable[i]);
+	Lnn_Deallocate(state, gc->nursery, Lnn_GC_NURSERY_SIZE);
+	Utl_Free(gc->gray);
+	Utl_Free(gc->remembered);
+	Utl_Free(gc->promoted);
+	Utl_Free(gc->finalizable);
+}
+
+Lnn_Object* Lnn_GCAllocate(Lnn_State* state, const size_t size, const Lnn_ValueType type)
+{
+	Utl_Assert(state && size >= sizeof(Lnn_Object));
+	Lnn_GC* gc = &state->gc;
+	Lnn_Object* object;
+
+	const size_t aligned = (size + NURSERY_ALIGNMENT - 1) & ~(size_t)(NURSERY_ALIGNMENT - 1);
+	if (size < Lnn_GC_LARGE_OBJECT_SIZE && gc->nurserytop + aligned <= gc->nursery + Lnn_GC_NURSERY_SIZE)
+	{
+		object = (Lnn_Object*)gc->nurserytop;
+		gc->nurserytop += aligned;
+		object->links.prev = object->links.next = NULL;
+		object->color = Lnn_GC_WHITE;
+		object->flags = Lnn_GC_YOUNG;
+		if (has_finalizer(type))
+			push_object(gc->finalizable, gc->numfinalizable, gc->capfinalizable, object);
+	} else
+	{
+		/* Large objects, and everything made after the nursery filled up, go straight to the old generation */
+		if (size < Lnn_GC_LARGE_OBJECT_SIZE)
+		{
+			gc->nurseryfull = Utl_TRUE;
+			gc->pending = Utl_TRUE;
+		}
+		object = Lnn_Allocate(state, size);
+		if (!object) return NULL;
+		object->color = allocation_color(gc);
+		object->flags = 0;
+		Utl_PushBackList(&gc->old, &object->links);
+		add_old_bytes(state, size);
+	}
+	object->type = type;
+	return object;
+}
+
+
+
+/* Minor collection */
+
+/**
+ * @brief Moves a young object to the old generation, or finds where it was already moved.
+ * @return The old copy of the object.
+ */
+static Lnn_Object* promote(Lnn_State* state, Lnn_Object* object)
+{
+	if (object->flags & Lnn_GC_FORWARDED)
+		return (Lnn_Object*)object->links.next;
+
+	Lnn_GC* gc = &state->gc;
+	const size_t size = object_size(object);
+	/* Once one copy failed the others aren't tried, the nursery can't be emptied anyway */
+	Lnn_Object* copy = gc->stuck ? NULL : Lnn_Allocate(state, size);
+	if (!copy)
+	{
+		/* The object stays where it is. It is traced like a copy so what it refers to is moved too,
+		   and since no old object remembers it the collector can't run again. */
+		gc->stuck = Utl_TRUE;
+		object->flags |= Lnn_GC_FORWARDED;
+		object->links.next = &object->links;
+		push_object(gc->promoted, gc->numpromoted, gc->cappromoted, object);
+		return object;
+	}
+	memcpy(copy, object, size);
+	copy->flags = 0;
+	/* Promoted objects are gray while marking since the objects they refer to haven't been marked */
+	copy->color = gc->phase == Lnn_GCP_MARK ? Lnn_GC_GRAY : allocation_color(gc);
+	Utl_PushBackList(&gc->old, &copy->links);
+	add_old_bytes(state, size);
+
+	object->flags |= Lnn_GC_FORWARDED;
+	object->links.next = &copy->links;
+	push_object(gc->promoted, gc->numpromoted, gc->cappromoted, copy);
+	if (copy->color == Lnn_GC_GRAY)
+		push_object(gc->gray, gc->numgray, gc->capgray, copy);
+	return copy;
+}
+
+/* Suspended coroutines are roots, a running one has its values on the stack and a dead one has none */
+#define for_saved_values(coroutine, value, action)											\
+	if ((coroutine)->status == Lnn_CO_SUSPENDED)											\
+		for (Lnn_Value* value = (coroutine)->values; value < (coroutine)->values + (coroutine)->numvalues; value++)	\
+			action
+
+static void forward_value(Lnn_State* state, Lnn_Value* value)
+{
+	if (is_managed(*value) && (value->u.object->flags & Lnn_GC_YOUNG))
+		value->u.object = promote(state, value->u.object);
+}
+
+static void minor_collect(Lnn_State* state, Lnn_Value* stack, Lnn_Value* stacktop)
+{
+	Lnn_GC* gc = &state->gc;
+	const unsigned long long start = Utl_GetMicroseconds();
+
+	for (int i = 0; i < state->numglobals; i++)
+		forward_value(state, &state->globals[i].value);
+	for (Lnn_Value* i = stack; i < stacktop; i++)
+		forward_value(state, i);
+	for (Utl_ListLinks* i = state->coroutines.begin; i; i = i->next)
+		for_saved_values((Lnn_Coroutine*)i, value, forward_value(state, value));
+	for (int i = 0; i < gc->numremembered; i++)
+	{
+		gc->remembered[i]->flags &= ~Lnn_GC_REMEMBERED;
+		trace_object(state, gc->remembered[i], &forward_value);
+	}
+	gc->numremembered = 0;
+
+	/* Objects that were moved can refer to more young objects */
+	while (gc->numpromoted > 0)
+		trace_object(state, gc->promoted[--gc->numpromoted], &forward_value);
+
+	/* Young objects that weren't moved are dead, the copies of the others own their memory now */
+	int numkept = 0;
+	for (int i = 0; i < gc->numfinalizable; i++)
+	{
+		Lnn_Object* object = gc->finalizable[i];
+		if (!(object->flags & Lnn_GC_FORWARDED))
+			finalize_object(state, object);
+		else if ((Lnn_Object*)object->links.next == object)
+			gc->finalizable[numkept++] = object;
+	}
+	gc->numfinalizable = numkept;
+
+	if (gc->stuck)
+	{
+		record_pause(&gc->minorpauses, Utl_GetMicroseconds() - start);
+		return;
+	}
+	gc->nurserytop = gc->nursery;
+	gc->nurseryfull = Utl_FALSE;
+	gc->numminor++;
+	record_pause(&gc->minorpauses, Utl_GetMicroseconds() - start);
+}
+
+
+
+/* Major collection */
+
+static void mark_value(Lnn_State* state, Lnn_Value* value)
+{
+	if (!is_managed(*value)) return;
+	Lnn_Object* object = value->u.object;
+	/* Young objects are found by the minor collection that finishes the mark */
+	if (object->flags & Lnn_GC_YOUNG || object->color != Lnn_GC_WHITE) return;
+	object->color = Lnn_GC_GRAY;
+	push_object(state->gc.gray, state->gc.numgray, state->gc.capgray, object);
+}
+
+static void mark_roots(Lnn_State* state, Lnn_Value* stack, Lnn_Value* stacktop)
+{
+	for (int i = 0; i < state->numglobals; i++)
+		mark_value(state, &state->globals[i].value);
+	for (Lnn_Value* i = stack; i < stacktop; i++)
+		mark_value(state, i);
+	for (Utl_ListLinks* i = state->coroutines.begin; i; i = i->next)
+		for_saved_values((Lnn_Coroutine*)i, value, mark_value(state, value));
+}
+
+/**
+ * @brief Blackens gray objects until there are none left or the deadline has passed.
+ * @return Utl_TRUE if there are no gray objects left.
+ */
+static Utl_Bool propagate(Lnn_State* state, const unsigned long long deadline)
+{
+	Lnn_GC* gc = &state->gc;
+	int work = 0;
+	while (gc->numgray > 0)
+	{
+		Lnn_Object* object = gc->gray[--gc->numgray];
+		object->color = Lnn_GC_BLACK;
+		trace_object(state, object, &mark_value);
+		if (++work % WORK_PER_CLOCK_CHECK == 0 && Utl_GetMicroseconds() >= deadline)
+			break;
+	}
+	return gc->numgray == 0;
+}
+
+/**
+ * @brief Frees white objects and makes black ones white for the next cycle,
+ * until the end of the list or the deadline has passed.
+ * @return Utl_TRUE if the whole old generation has been swept.
+ */
+static Utl_Bool sweep(Lnn_State* state, const unsigned long long deadline)
+{
+	Lnn_GC* gc = &state->gc;
+	int work = 0;
+	while (gc->sweepcursor)
+	{
+		Lnn_Object* object = (Lnn_Object*)gc->sweepcursor;
+		gc->sweepcursor = gc->sweepcursor->next;
+		if (object->color == Lnn_GC_WHITE)
+		{
+			const size_t size = object_size(object);
+			gc->oldbytes -= size;
+			Utl_UnlinkFromList(&gc->old, &object->links);
+			finalize_object(state, object);
+			Lnn_Deallocate(state, object, size);
+		} else
+			object->color = Lnn_GC_WHITE;
+		if (++work % WORK_PER_CLOCK_CHECK == 0 && Utl_GetMicroseconds() >= deadline)
+			break;
+	}
+	return gc->sweepcursor == NULL;
+}
+
+static void finish_cycle(Lnn_GC* gc)
+{
+	gc->phase = Lnn_GCP_IDLE;
+	gc->threshold = gc->oldbytes * 2 > Lnn_GC_MIN_THRESHOLD ? gc->oldbytes * 2 : Lnn_GC_MIN_THRESHOLD;
+	gc->nummajor++;
+}
+
+/**
+ * @brief Does one incremental step of the major cycle, starting a new cycle if there is none.
+ * @param budget Microseconds the step may take, or 0 to finish the cycle.
+ */
+static void major_step(Lnn_State* state, Lnn_Value* stack, Lnn_Value* stacktop, const int budget)
+{
+	Lnn_GC* gc = &state->gc;
+	const unsigned long long start = Utl_GetMicroseconds();
+	const unsigned long long deadline = budget > 0 ? start + budget : (unsigned long long)-1;
+
+	if (gc->phase == Lnn_GCP_IDLE)
+	{
+		gc->phase = Lnn_GCP_MARK;
+		mark_roots(state, stack, stacktop);
+	}
+
+	if (gc->phase == Lnn_GCP_MARK && propagate(state, deadline))
+	{
+		/* The roots may have changed since they were marked, and young objects can refer to old ones.
+		   Emptying the nursery and marking the roots again finds everything that's still alive. */
+		minor_collect(state, stack, stacktop);
+		/* Old objects only the objects left in the nursery refer to would look dead */
+		if (gc->stuck) return;
+		mark_roots(state, stack, stacktop);
+		propagate(state, (unsigned long long)-1);
+		gc->phase = Lnn_GCP_SWEEP;
+		gc->sweepcursor = gc->old.begin;
+	}
+
+	if (gc->phase == Lnn_GCP_SWEEP && Utl_GetMicroseconds() < deadline && sweep(state, deadline))
+		finish_cycle(gc);
+
+	gc->stepbytes = 0;
+	record_pause(&gc->majorpauses, Utl_GetMicroseconds() - start);
+}
+
+
+
+Utl_Bool Lnn_GCRunPending(Lnn_State* state, Lnn_Value* stack, Lnn_Value* stacktop)
+{
+	Utl_Assert(state);
+	Lnn_GC* gc = &state->gc;
+	if (gc->stuck)
+	{
+		printf("ERROR! Out of memory, the collector couldn't move every live object out of the nursery\n");
+		return Utl_FALSE;
+	}
+	gc->pending = Utl_FALSE;
+
+	/* The error was printed when the allocation failed, whatever needed the memory may not have been able to fail */
+	if (state->memory.outofmemory)
+	{
+		state->memory.outofmemory = Utl_FALSE;
+		return Utl_FALSE;
+	}
+
+	/* A state over its memory limit gets one chance to free enough by collecting everything */
+	if (Lnn_IsOverMemoryLimit(&state->memory))
+	{
+		Lnn_GCFullCollect(state, stack, stacktop);
+		if (!Lnn_IsOverMemoryLimit(&state->memory)) return Utl_TRUE;
+		printf("ERROR! Out of memory, %zu bytes in use with a limit of %zu\n", state->memory.livebytes, state->memory.limit);
+		return Utl_FALSE;
+	}
+
+	if (gc->nurseryfull)
+		minor_collect(state, stack, stacktop);
+	if (gc->phase != Lnn_GCP_IDLE || gc->oldbytes >= gc->threshold)
+		major_step(state, stack, stacktop, gc->stepbudget);
+	return !gc->stuck;
+}
+
+void Lnn_GCFullCollect(Lnn_State* state, Lnn_Value* stack, Lnn_Value* stacktop)
+{
+	Utl_Assert(state);
+	if (state->gc.stuck) return;
+	minor_collect(state, stack, stacktop);
+	if (state->gc.stuck) return;
+	/* A cycle that was already running may have kept garbage made before it started */
+	if (state->gc.phase != Lnn_GCP_IDLE)
+		major_step(state, stack, stacktop, 0);
+	major_step(state, stack, stacktop, 0);
+	state->gc.pending = Utl_FALSE;
+}
+
+void Lnn_GCBarrier(Lnn_State* state, Lnn_Object* owner, Lnn_Object* value)
+{
+	Lnn_GC* gc = &state->gc;
+	if (value->flags & Lnn_GC_STATIC) return;
+
+	if (value->flags & Lnn_GC_YOUNG)
+	{
+		if (!(owner->flags & Lnn_GC_REMEMBERED))
+		{
+			owner->flags |= Lnn_GC_REMEMBERED;
+			push_object(gc->remembered, gc->numremembered, gc->capremembered, owner);
+		}
+	} else if (gc->phase == Lnn_GCP_MARK && value->color == Lnn_GC_WHITE)
+	{
+		value->color = Lnn_GC_GRAY;
+		push_object(gc->gray, gc->numgray, gc->capgray, value);
+	}
+}
+
+
+
+static void print_pauses(const char* name, const Lnn_GCPauses* pauses)
+{
+	printf("  %s pauses: %llu, total %lluus, max %lluus\n", name, pauses->count, pauses->totalmicros, pauses->maxmicros);
+	for (int i = 0; i < Lnn_GC_NUM_PAUSE_BUCKETS; i++)
+		if (pauses->buckets[i])
+			printf("    < %6lluus  %llu\n", 2ULL << i, pauses->buckets[i]);
+}
+
+void Lnn_PrintGCStats(const Lnn_State* state)
+{
+	Utl_Assert(state);
+	const Lnn_GC* gc = &state->gc;
+	printf("Garbage collector:\n");
+	printf("  %s, %i old objects, %zu old bytes, %zu young bytes\n", lnn_gcphase_names[gc->phase],
+		   gc->old.count, gc->oldbytes, (size_t)(gc->nurserytop - gc->nursery));
+	printf("  %llu minor collections, %llu major cycles\n", gc->numminor, gc->nummajor);
+	print_pauses("Minor", &gc->minorpauses);
+	print_pauses("Major", &gc->majorpauses);
+}
@@ -0,0 +1,182 @@
+#ifndef _Lnn_GC_H_
+#define _Lnn_GC_H_
+
+#include "fab_utility.h"
+#include "lnn_value.h"
+
+struct Lnn_State;
+
+/**
+ * Generational garbage collector for the objects made while running.
+ * New objects are bump allocated in the nursery. When it fills up the live ones are moved
+ * out to the old generation in a minor collection, which only has to look at the roots and
+ * the old objects that were written a young value since the last one.
+ * The old generation is collected by an incremental tri-color mark and sweep that is spread
+ * out over many short steps, each one stopping when its time budget runs out.
+ *
+ * Collections only happen at safepoints, where the interpreter passes the part of its stack
+ * that is in use. Allocating never collects, so values held in C variables stay valid until
+ * the next safepoint.
+ */
+
+#define Lnn_GC_NURSERY_SIZE			(256 * 1024)
+#define Lnn_GC_LARGE_OBJECT_SIZE	(Lnn_GC_NURSERY_SIZE / 16)	/* Bigger objects are allocated old right away */
+#define Lnn_GC_MIN_THRESHOLD		(1024 * 1024)				/* Old generation bytes before the first major cycle */
+#define Lnn_GC_STEP_BYTES			(64 * 1024)					/* Old generation growth between two incremental steps */
+#define Lnn_GC_DEFAULT_STEP_BUDGET	500							/* Microseconds */
+#define Lnn_GC_NUM_PAUSE_BUCKETS	16
+
+typedef enum
+{
+	Lnn_GC_WHITE,	/* Not found yet, freed when the sweep reaches it */
+	Lnn_GC_GRAY,	/* Found but the objects it refers to haven't been marked */
+	Lnn_GC_BLACK,	/* Found and everything it refers to is marked */
+} Lnn_GCColor;
+
+enum
+{
+	Lnn_GC_STATIC = 1 << 0,		/* Not managed by the collector, like the constants of compiled code */
+	Lnn_GC_YOUNG = 1 << 1,		/* Lives in the nursery */
+	Lnn_GC_FORWARDED = 1 << 2,	/* Moved out of the nursery, links.next points to the new copy */
+	Lnn_GC_REMEMBERED = 1 << 3,	/* Old object that is in the remembered set */
+};
+
+typedef enum
+{
+	Lnn_GCP_IDLE,
+	Lnn_GCP_MARK,
+	Lnn_GCP_SWEEP,
+	Lnn_NUM_GCPHASES
+} Lnn_GCPhase;
+extern const char* lnn_gcphase_names[Lnn_NUM_GCPHASES];
+
+/**
+ * @brief Histogram of pause times. Bucket i counts the pauses that took
+ * from 2^i up to 2^(i+1) microseconds, the first bucket also has the ones under a microsecond.
+ */
+typedef struct Lnn_GCPauses
+{
+	unsigned long long buckets[Lnn_GC_NUM_PAUSE_BUCKETS];
+	unsigned long long count;
+	unsigned long long totalmicros;
+	unsigned long long maxmicros;
+} Lnn_GCPauses;
+
+typedef struct Lnn_GC
+{
+	char* nursery;
+	char* nurserytop;			/* Where the next young object is put */
+	Utl_Bool nurseryfull;		/* An allocation didn't fit, a minor collection is due */
+	Utl_Bool stuck;				/* A minor collection had no memory to move a live object, nothing is collected anymore */
+
+	Utl_List old;				/* List of Lnn_Object in the old generation */
+	size_t oldbytes;
+	size_t threshold;			/* Old generation size that starts the next major cycle */
+	size_t stepbytes;			/* Old generation growth since the last step */
+
+	Lnn_GCPhase phase;
+	Lnn_Object** gray;			/* Stack of gray objects */
+	int numgray;
+	int capgray;
+	Utl_ListLinks* sweepcursor;	/* Next old object to sweep */
+
+	Lnn_Object** remembered;	/* Old objects that may refer to young ones */
+	int numremembered;
+	int capremembered;
+
+	Lnn_Object** finalizable;	/* Young objects that own memory outside of the collector */
+	int numfinalizable;
+	int capfinalizable;
+
+	Lnn_Object** promoted;		/* Objects moved out of the nursery whose references haven't been updated */
+	int numpromoted;
+	int cappromoted;
+
+	Utl_Bool pending;			/* Work is due at the next safepoint */
+	int holdoff;				/* Natives that are running, they can keep values in C so nothing is collected */
+	int stepbudget;				/* Microseconds an incremental step may run for */
+
+	unsigned long long numminor;
+	unsigned long long nummajor;
+	Lnn_GCPauses minorpauses;
+	Lnn_GCPauses majorpauses;	/* One pause per incremental step */
+} Lnn_GC;
+
+/**
+ * @brief Sets up the collector of a state, the memory of the state has to be set up first.
+ * @return Utl_FALSE if the allocator can't give the nursery, the error is printed.
+ */
+Utl_Bool Lnn_InitGC(struct Lnn_State* state);
+
+/**
+ * @brief Frees every object of the collector of a state, reachable or not, and the nursery.
+ */
+void Lnn_FreeGC(struct Lnn_State* state);
+
+/**
+ * @brief Allocates a managed object. Never collects, so it's safe to call in the middle of an operation.
+ * @param state State that owns the object.
+ * @param size Size of the object in bytes, including the Lnn_Object header.
+ * @param type Type of value the object is.
+ * @return The object with its header filled in, the rest is uninitialized.
+ * NULL if there is no memory left, the error is printed and the run fails at its next safepoint.
+ */
+Lnn_Object* Lnn_GCAllocate(struct Lnn_State* state,
+						   const size_t size,
+						   const Lnn_ValueType type);
+
+/**
+ * @brief Runs the collection work that is due. Call it through Lnn_GCSafepoint().
+ * A state that is over its memory limit gets a full collection.
+ * @param state State to collect.
+ * @param stack Bottom of the interpreter stack, or NULL if nothing is on it.
+ * @param stacktop One past the last value on the stack.
+ * @return Utl_FALSE if the state is still over its memory limit, an allocation failed since the last safepoint
+ * or the collector is stuck, the error is printed.
+ */
+Utl_Bool Lnn_GCRunPending(struct Lnn_State* state,
+						  Lnn_Value* stack,
+						  Lnn_Value* stacktop);
+
+/**
+ * Collects if there's work due. Every value that is alive has to be in the globals or on the stack.
+ * Gives Utl_FALSE if the state is out of memory, the run has to stop then.
+ */
+#define Lnn_GCSafepoint(state, stack, stacktop)		\
+	((state)->gc.pending && !(state)->gc.holdoff ? Lnn_GCRunPending(state, stack, stacktop) : Utl_TRUE)
+
+/**
+ * Forgets an allocation that failed before a run, the run or host it failed for has been told already.
+ * Runs that start inside a native keep it since the run that called the native has to fail.
+ */
+#define Lnn_GCStartRun(state)	\
+	{ if (!(state)->gc.holdoff) (state)->memory.outofmemory = Utl_FALSE; }
+
+/**
+ * @brief Does a minor collection and then a complete major cycle without stopping.
+ * Does nothing once the collector is stuck.
+ */
+void Lnn_GCFullCollect(struct Lnn_State* state,
+					   Lnn_Value* stack,
+					   Lnn_Value* stacktop);
+
+/**
+ * @brief Slow path of Lnn_GCWriteBarrier().
+ */
+void Lnn_GCBarrier(struct Lnn_State* state,
+				   Lnn_Object* owner,
+				   Lnn_Object* value);
+
+/**
+ * Has to be used whenever a value is stored in a managed object.
+ * It keeps a black object from referring to a white one while marking,
+ * and remembers old objects that are given young values.
+ */
+#define Lnn_GCWriteBarrier(state, owner, value)														\
+	if ((value).type >= Lnn_VT_STRING && !((owner)->flags & Lnn_GC_YOUNG) &&						\
+		(((value).u.object->flags & Lnn_GC_YOUNG) || (owner)->color == Lnn_GC_BLACK))				\
+		Lnn_GCBarrier(state, owner, (value).u.object)
+
+void Lnn_PrintGCStats(const struct Lnn_State* state);
+
+#endif
@@ -0,0 +1,755 @@
+#include "lnn_jit.h"
+
+#ifdef Lnn_JIT
+
+#include <stddef.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+/**
+ * Register use in jit code. Only registers that are volatile in both the System V and the
+ * Windows calling conventions are used, so the code needs no prologue and never calls anything.
+ */
+enum
+{
+	RAX = 0,
+	RCX = 1,
+	R8 = 8,			/* Lnn_JitContext* */
+	R9 = 9,			/* Lnn_Value* sp */
+	R10 = 10,		/* Lnn_Global* globals */
+	R11 = 11,		/* const Lnn_Value* constants */
+	XMM0 = 0,
+	XMM1 = 1,
+};
+
+enum
+{
+	CC_O = 0x0,
+	CC_B = 0x2,
+	CC_AE = 0x3,
+	CC_E = 0x4,
+	CC_NE = 0x5,
+	CC_A = 0x7,
+	CC_P = 0xA,
+	CC_NP = 0xB,
+	CC_L = 0xC,
+	CC_GE = 0xD,
+	CC_LE = 0xE,
+	CC_G = 0xF,
+};
+
+#define VALUE_SIZE		((int)sizeof(Lnn_Value))
+#define TYPE_OFFSET		((int)offsetof(Lnn_Value, type))
+#define NUMBER_OFFSET	((int)offsetof(Lnn_Value, u.number))
+#define INT_OFFSET		((int)offsetof(Lnn_Value, u.integer))
+#define BOOL_OFFSET		((int)offsetof(Lnn_Value, u.boolean))
+#define GLOBAL_SIZE		((int)sizeof(Lnn_Global))
+#define GLOBAL_OFFSET	((int)offsetof(Lnn_Global, value))
+
+/* Values are copied 8 bytes at a time */
+typedef char value_size_check[sizeof(Lnn_Value) % 8 == 0 ? 1 : -1];
+
+/* Scalar sse instructions work on floats or doubles depending on the size of Utl_Float */
+#define SSE_PREFIX		(sizeof(Utl_Float) == 4 ? 0xF3 : 0xF2)
+#define SSE_MOVLOAD		0x10
+#define SSE_ADD			0x58
+#define SSE_MUL			0x59
+#define SSE_SUB			0x5C
+#define SSE_DIV			0x5E
+
+/* Integer instructions work on 32 or 64 bits depending on the size of Utl_Int, two byte opcodes have 0x0F in the high byte */
+#define INT_WIDE		(sizeof(Utl_Int) == 8)
+#define INT_LOAD		0x8B
+#define INT_STORE		0x89
+#define INT_ADD			0x03
+#define INT_SUB			0x2B
+#define INT_CMP			0x3B
+#define INT_IMUL		0x0FAF
+
+
+
+typedef enum
+{
+	PATCH_LABEL,		/* Jump to the code of an instruction */
+	PATCH_GUARDEXIT,	/* Jump to a stub that exits with ~ip */
+	PATCH_SLOWEXIT,		/* Jump to a stub that exits with ip, for cases the interpreter does without throwing the code away */
+	PATCH_EXIT,			/* Jump to the common exit with the return value already in eax */
+} patchtype;
+
+typedef struct
+{
+	int at;				/* Offset of the rel32 to patch */
+	patchtype type;
+	int index;			/* Instruction index */
+} patch;
+
+typedef struct
+{
+	unsigned char* bytes;
+	int size;
+	int cap;
+
+	int* labels;		/* Offset of the code of every instruction */
+	patch* patches;
+	int numpatches;
+	int cappatches;
+} assembler;
+
+static void emit_byte(assembler* a, const int byte)
+{
+	if (a->size >= a->cap)
+	{
+		a->cap = a->cap ? a->cap * 2 : 1024;
+		a->bytes = Utl_Realloc(a->bytes, a->cap);
+	}
+	a->bytes[a->size++] = (unsigned char)byte;
+}
+
+static void emit_u32(assembler* a, const uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		emit_byte(a, (value >> (i * 8)) & 0xFF);
+}
+
+static void emit_u64(assembler* a, const uint64_t value)
+{
+	for (int i = 0; i < 8; i++)
+		emit_byte(a, (int)((value >> (i * 8)) & 0xFF));
+}
+
+/* REX prefix, left out when it would be empty */
+static void emit_rex(assembler* a, const int w, const int reg, const int base)
+{
+	const int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+	if (rex != 0x40)
+		emit_byte(a, rex);
+}
+
+/* ModRM for [base + disp32], base can't be rsp or r12 */
+static void emit_mem(assembler* a, const int reg, const int base, const int disp)
+{
+	emit_byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+	emit_u32(a, (uint32_t)disp);
+}
+
+/* mov reg64, [base + disp] */
+static void emit_load64(assembler* a, const int reg, const int base, const int disp)
+{
+	emit_rex(a, 1, reg, base);
+	emit_byte(a, 0x8B);
+	emit_mem(a, reg, base, disp);
+}
+
+/* mov [base + disp], reg64 */
+static void emit_store64(assembler* a, const int base, const int disp, const int reg)
+{
+	emit_rex(a, 1, reg, base);
+	emit_byte(a, 0x89);
+	emit_mem(a, reg, base, disp);
+}
+
+/* mov reg32, [base + disp] */
+static void emit_load32(assembler* a, const int reg, const int base, const int disp)
+{
+	emit_rex(a, 0, reg, base);
+	emit_byte(a, 0x8B);
+	emit_mem(a, reg, base, disp);
+}
+
+/* mov [base + disp], reg32 */
+static void emit_store32(assembler* a, const int base, const int disp, const int reg)
+{
+	emit_rex(a, 0, reg, base);
+	emit_byte(a, 0x89);
+	emit_mem(a, reg, base, disp);
+}
+
+/* Group 1 and mov instructions on a dword in memory with an immediate */
+static void emit_mem_imm32(assembler* a, const int opcode, const int ext, const int base, const int disp, const uint32_t imm)
+{
+	emit_rex(a, 0, 0, base);
+	emit_byte(a, opcode);
+	emit_mem(a, ext, base, disp);
+	emit_u32(a, imm);
+}
+
+#define emit_mov_mem_imm32(a, base, disp, imm)	emit_mem_imm32(a, 0xC7, 0, base, disp, imm)
+#define emit_cmp_mem_imm32(a, base, disp, imm)	emit_mem_imm32(a, 0x81, 7, base, disp, imm)
+#define emit_xor_mem_imm32(a, base, disp, imm)	emit_mem_imm32(a, 0x81, 6, base, disp, imm)
+#define emit_sub_mem_imm32(a, base, disp, imm)	emit_mem_imm32(a, 0x81, 5, base, disp, imm)
+
+/* add/sub reg64, imm32 */
+static void emit_addsub_imm32(assembler* a, const int reg, const int imm)
+{
+	emit_rex(a, 1, 0, reg);
+	emit_byte(a, 0x81);
+	emit_byte(a, 0xC0 | ((imm < 0 ? 5 : 0) << 3) | (reg & 7));
+	emit_u32(a, (uint32_t)(imm < 0 ? -imm : imm));
+}
+
+/* Scalar sse instruction with a memory operand */
+static void emit_sse(assembler* a, const int prefix, const int opcode, const int xmm, const int base, const int disp)
+{
+	if (prefix)
+		emit_byte(a, prefix);
+	emit_rex(a, 0, xmm, base);
+	emit_byte(a, 0x0F);
+	emit_byte(a, opcode);
+	emit_mem(a, xmm, base, disp);
+}
+
+/**
+ * movq [base + disp], xmm
+ * Numbers are always stored as 8 bytes so that copying the value later can be forwarded from the store.
+ * A float loaded with movss has zeroes above it so the padding of the union is zeroed.
+ */
+static void emit_store_number(assembler* a, const int base, const int disp, const int xmm)
+{
+	emit_sse(a, 0x66, 0xD6, xmm, base, disp);
+}
+
+/* Scalar sse instruction on two registers */
+static void emit_sse_reg(assembler* a, const int prefix, const int opcode, const int dst, const int src)
+{
+	if (prefix)
+		emit_byte(a, prefix);
+	emit_byte(a, 0x0F);
+	emit_byte(a, opcode);
+	emit_byte(a, 0xC0 | (dst << 3) | src);
+}
+
+/* ucomiss or ucomisd xmm, xmm */
+static void emit_ucomi(assembler* a, const int x, const int y)
+{
+	emit_sse_reg(a, sizeof(Utl_Float) == 4 ? 0 : 0x66, 0x2E, x, y);
+}
+
+/* Converts the int at [base + disp] to a Utl_Float, the register is cleared first so the padding of a stored number is zero */
+static void emit_convert_int(assembler* a, const int xmm, const int base, const int disp)
+{
+	emit_sse_reg(a, 0, 0x57, xmm, xmm); /* xorps xmm, xmm */
+	emit_byte(a, SSE_PREFIX);
+	emit_rex(a, INT_WIDE, xmm, base);
+	emit_byte(a, 0x0F);
+	emit_byte(a, 0x2A); /* cvtsi2ss or cvtsi2sd */
+	emit_mem(a, xmm, base, disp);
+}
+
+/* Integer instruction on a register and [base + disp] */
+static void emit_int_op(assembler* a, const int opcode, const int reg, const int base, const int disp)
+{
+	emit_rex(a, INT_WIDE, reg, base);
+	if (opcode > 0xFF)
+		emit_byte(a, opcode >> 8);
+	emit_byte(a, opcode & 0xFF);
+	emit_mem(a, reg, base, disp);
+}
+
+/* setcc on al (0) or cl (1) */
+static void emit_setcc(assembler* a, const int cc, const int reg)
+{
+	emit_byte(a, 0x0F);
+	emit_byte(a, 0x90 | cc);
+	emit_byte(a, 0xC0 | reg);
+}
+
+static void add_patch(assembler* a, const patchtype type, const int index)
+{
+	if (a->numpatches >= a->cappatches)
+	{
+		a->cappatches = a->cappatches ? a->cappatches * 2 : 64;
+		a->patches = Utl_Realloc(a->patches, sizeof(patch) * a->cappatches);
+	}
+	a->patches[a->numpatches].at = a->size;
+	a->patches[a->numpatches].type = type;
+	a->patches[a->numpatches].index = index;
+	a->numpatches++;
+	emit_u32(a, 0);
+}
+
+static void emit_jmp(assembler* a, const patchtype type, const int index)
+{
+	emit_byte(a, 0xE9);
+	add_patch(a, type, index);
+}
+
+/**
+ * Jumps within the code of one instruction, cc is -1 for an unconditional jump.
+ * They return where the rel32 is, bind_local() points it at the code that comes next.
+ */
+static int emit_jump_local(assembler* a, const int cc)
+{
+	if (cc < 0)
+		emit_byte(a, 0xE9);
+	else
+	{
+		emit_byte(a, 0x0F);
+		emit_byte(a, 0x80 | cc);
+	}
+	emit_u32(a, 0);
+	return a->size - 4;
+}
+
+static void bind_local(assembler* a, const int at)
+{
+	const uint32_t rel = (uint32_t)(a->size - (at + 4));
+	memcpy(a->bytes + at, &rel, 4);
+}
+
+static void emit_jcc(assembler* a, const int cc, const patchtype type, const int index)
+{
+	emit_byte(a, 0x0F);
+	emit_byte(a, 0x80 | cc);
+	add_patch(a, type, index);
+}
+
+/* Exits to the interpreter so it runs the instruction at index */
+static void emit_exit(assembler* a, const int index)
+{
+	emit_byte(a, 0xB8); /* mov eax, imm32 */
+	emit_u32(a, (uint32_t)index);
+	emit_jmp(a, PATCH_EXIT, 0);
+}
+
+/* Checks that the value at [sp + disp] has a type, otherwise exits with ~index */
+static void emit_guard_type(assembler* a, const int disp, const Lnn_ValueType type, const int index)
+{
+	emit_cmp_mem_imm32(a, R9, disp + TYPE_OFFSET, type);
+	emit_jcc(a, CC_NE, PATCH_GUARDEXIT, index);
+}
+
+/* Loads the number at [sp + disp] as a Utl_Float, ints are converted and anything else exits with ~index */
+static void emit_load_number(assembler* a, const int xmm, const int disp, const int index)
+{
+	emit_cmp_mem_imm32(a, R9, disp + TYPE_OFFSET, Lnn_VT_INT);
+	const int tofloat = emit_jump_local(a, CC_NE);
+	emit_convert_int(a, xmm, R9, disp + INT_OFFSET);
+	const int done = emit_jump_local(a, -1);
+	bind_local(a, tofloat);
+	emit_guard_type(a, disp, Lnn_VT_FLOAT, index);
+	emit_sse(a, SSE_PREFIX, SSE_MOVLOAD, xmm, R9, disp + NUMBER_OFFSET);
+	bind_local(a, done);
+}
+
+static void emit_copy_value(assembler* a, const int dstbase, const int dstdisp, const int srcbase, const int srcdisp)
+{
+	for (int offset = 0; offset < VALUE_SIZE; offset += 8)
+	{
+		emit_load64(a, RAX, srcbase, srcdisp + offset);
+		emit_store64(a, dstbase, dstdisp + offset, RAX);
+	}
+}
+
+
+
+/* The sse arithmetic opcode of a NUM_NUM or CONST instruction */
+static int arithmetic_sse_opcode(const Lnn_OpCode op)
+{
+	switch (op)
+	{
+	case Lnn_BC_ADD_NUM_NUM: case Lnn_BC_ADD_CONST: return SSE_ADD;
+	case Lnn_BC_SUB_NUM_NUM: case Lnn_BC_SUB_CONST: return SSE_SUB;
+	case Lnn_BC_MUL_NUM_NUM: case Lnn_BC_MUL_CONST: return SSE_MUL;
+	default: return SSE_DIV;
+	}
+}
+
+/**
+ * @brief Compares two numbers on the stack and puts the result in al.
+ * Ints are converted, anything that isn't a number exits with ~index.
+ * @param cmp The generic comparison opcode.
+ * @param adisp Stack offset of the left operand.
+ * @param bdisp Stack offset of the right operand.
+ */
+static void emit_compare_numbers(assembler* a, const Lnn_OpCode cmp, const int adisp, const int bdisp, const int index)
+{
+	emit_load_number(a, XMM0, adisp, index);
+	emit_load_number(a, XMM1, bdisp, index);
+	/* Comparisons are turned around so that unordered (NaN) operands give false */
+	switch (cmp)
+	{
+	case Lnn_BC_LESS:
+	case Lnn_BC_LESSEQUAL:
+		emit_ucomi(a, XMM1, XMM0);
+		emit_setcc(a, cmp == Lnn_BC_LESS ? CC_A : CC_AE, RAX);
+		break;
+	case Lnn_BC_GREATER:
+	case Lnn_BC_GREATEREQUAL:
+		emit_ucomi(a, XMM0, XMM1);
+		emit_setcc(a, cmp == Lnn_BC_GREATER ? CC_A : CC_AE, RAX);
+		break;
+	case Lnn_BC_EQUALITY:
+		emit_ucomi(a, XMM0, XMM1);
+		emit_setcc(a, CC_E, RAX);
+		emit_setcc(a, CC_NP, RCX);
+		emit_byte(a, 0x20); emit_byte(a, 0xC8); /* and al, cl */
+		break;
+	default: /* INEQUALITY */
+		emit_ucomi(a, XMM0, XMM1);
+		emit_setcc(a, CC_NE, RAX);
+		emit_setcc(a, CC_P, RCX);
+		emit_byte(a, 0x08); emit_byte(a, 0xC8); /* or al, cl */
+		break;
+	}
+}
+
+/* Condition code of a comparison of two ints, in the same order as the generic comparison opcodes */
+static const int int_compare_codes[] = { CC_E, CC_NE, CC_L, CC_G, CC_LE, CC_GE };
+
+/* Compares two ints on the stack and puts the result in al, the types have to be checked already */
+static void emit_compare_ints(assembler* a, const Lnn_OpCode cmp, const int adisp, const int bdisp)
+{
+	emit_int_op(a, INT_LOAD, RAX, R9, adisp + INT_OFFSET);
+	emit_int_op(a, INT_CMP, RAX, R9, bdisp + INT_OFFSET);
+	emit_setcc(a, int_compare_codes[cmp - Lnn_BC_EQUALITY], RAX);
+}
+
+/* The integer arithmetic opcode of an INT_INT or CONST instruction */
+static int arithmetic_int_opcode(const Lnn_OpCode op)
+{
+	switch (op)
+	{
+	case Lnn_BC_ADD_INT_INT: case Lnn_BC_ADD_CONST: return INT_ADD;
+	case Lnn_BC_SUB_INT_INT: case Lnn_BC_SUB_CONST: return INT_SUB;
+	default: return INT_IMUL;
+	}
+}
+
+static void emit_instruction(assembler* a, const Lnn_Chunk* chunk, const int index)
+{
+	const Lnn_Instruction instr = chunk->code[index];
+	const Lnn_OpCode op = Lnn_InstrOp(instr);
+	const int arg = Lnn_InstrArg(instr);
+
+	switch (op)
+	{
+	case Lnn_BC_POP:
+		emit_addsub_imm32(a, R9, -VALUE_SIZE);
+		return;
+
+	case Lnn_BC_PUSHNULL:
+	case Lnn_BC_PUSHTRUE:
+	case Lnn_BC_PUSHFALSE:
+		emit_mov_mem_imm32(a, R9, TYPE_OFFSET, op == Lnn_BC_PUSHNULL ? Lnn_VT_NULL : Lnn_VT_BOOL);
+		emit_mov_mem_imm32(a, R9, BOOL_OFFSET, op == Lnn_BC_PUSHTRUE);
+		emit_addsub_imm32(a, R9, VALUE_SIZE);
+		return;
+
+	case Lnn_BC_PUSHCONST:
+		emit_copy_value(a, R9, 0, R11, arg * VALUE_SIZE);
+		emit_addsub_imm32(a, R9, VALUE_SIZE);
+		return;
+
+	case Lnn_BC_GETGLOBAL:
+		emit_copy_value(a, R9, 0, R10, arg * GLOBAL_SIZE + GLOBAL_OFFSET);
+		emit_addsub_imm32(a, R9, VALUE_SIZE);
+		return;
+
+	case Lnn_BC_SETGLOBAL:
+	case Lnn_BC_SETGLOBAL_POP:
+		emit_copy_value(a, R10, arg * GLOBAL_SIZE + GLOBAL_OFFSET, R9, -VALUE_SIZE);
+		if (op == Lnn_BC_SETGLOBAL_POP)
+			emit_addsub_imm32(a, R9, -VALUE_SIZE);
+		return;
+
+	case Lnn_BC_JUMP:
+		/* Loop iterations spend a tick. The last one is left for the interpreter, which runs
+		 * the back-edge again after the exit, so it isn't spent twice */
+		if (arg <= index)
+		{
+			emit_cmp_mem_imm32(a, R8, (int)offsetof(Lnn_JitContext, ticks), 1);
+			emit_jcc(a, CC_LE, PATCH_SLOWEXIT, index);
+			emit_sub_mem_imm32(a, R8, (int)offsetof(Lnn_JitContext, ticks), 1);
+		}
+		emit_jmp(a, PATCH_LABEL, arg);
+		return;
+
+	case Lnn_BC_JUMPIFFALSE:
+		/* Null and false are false */
+		emit_addsub_imm32(a, R9, -VALUE_SIZE);
+		emit_load32(a, RAX, R9, TYPE_OFFSET);
+		emit_byte(a, 0x3D); emit_u32(a, Lnn_VT_NULL); /* cmp eax, imm32 */
+		emit_jcc(a, CC_E, PATCH_LABEL, arg);
+		emit_byte(a, 0x3D); emit_u32(a, Lnn_VT_BOOL);
+		emit_jcc(a, CC_NE, PATCH_LABEL, index + 1);
+		emit_cmp_mem_imm32(a, R9, BOOL_OFFSET, 0);
+		emit_jcc(a, CC_E, PATCH_LABEL, arg);
+		return;
+
+	case Lnn_BC_NEGATIVE:
+	{
+		/* Ints are negated unless it overflows, which the interpreter turns into a float */
+		emit_cmp_mem_imm32(a, R9, -VALUE_SIZE + TYPE_OFFSET, Lnn_VT_INT);
+		const int isfloat = emit_jump_local(a, CC_NE);
+		emit_int_op(a, INT_LOAD, RAX, R9, -VALUE_SIZE + INT_OFFSET);
+		emit_rex(a, INT_WIDE, 0, RAX);
+		emit_byte(a, 0xF7); emit_byte(a, 0xD8); /* neg eax */
+		emit_jcc(a, CC_O, PATCH_SLOWEXIT, index);
+		emit_int_op(a, INT_STORE, RAX, R9, -VALUE_SIZE + INT_OFFSET);
+		const int done = emit_jump_local(a, -1);
+		/* Flip the sign bit, it is in the last 4 bytes of the number */
+		bind_local(a, isfloat);
+		emit_guard_type(a, -VALUE_SIZE, Lnn_VT_FLOAT, index);
+		emit_xor_mem_imm32(a, R9, -VALUE_SIZE + NUMBER_OFFSET + (int)sizeof(Utl_Float) - 4, 0x80000000u);
+		bind_local(a, done);
+		return;
+	}
+
+	case Lnn_BC_ADD_NUM_NUM:
+	case Lnn_BC_SUB_NUM_NUM:
+	case Lnn_BC_MUL_NUM_NUM:
+	case Lnn_BC_DIV_NUM_NUM:
+		/* Either operand can be an int, the result is always a float */
+		emit_load_number(a, XMM0, -2 * VALUE_SIZE, index);
+		emit_load_number(a, XMM1, -VALUE_SIZE, index);
+		emit_sse_reg(a, SSE_PREFIX, arithmetic_sse_opcode(op), XMM0, XMM1);
+		emit_store_number(a, R9, -2 * VALUE_SIZE + NUMBER_OFFSET, XMM0);
+		emit_mov_mem_imm32(a, R9, -2 * VALUE_SIZE + TYPE_OFFSET, Lnn_VT_FLOAT);
+		emit_addsub_imm32(a, R9, -VALUE_SIZE);
+		return;
+
+	case Lnn_BC_ADD_INT_INT:
+	case Lnn_BC_SUB_INT_INT:
+	case Lnn_BC_MUL_INT_INT:
+		/* A result that doesn't fit is left to the interpreter, the left operand is already an int */
+		emit_guard_type(a, -2 * VALUE_SIZE, Lnn_VT_INT, index);
+		emit_guard_type(a, -VALUE_SIZE, Lnn_VT_INT, index);
+		emit_int_op(a, INT_LOAD, RAX, R9, -2 * VALUE_SIZE + INT_OFFSET);
+		emit_int_op(a, arithmetic_int_opcode(op), RAX, R9, -VALUE_SIZE + INT_OFFSET);
+		emit_jcc(a, CC_O, PATCH_SLOWEXIT, index);
+		emit_int_op(a, INT_STORE, RAX, R9, -2 * VALUE_SIZE + INT_OFFSET);
+		emit_addsub_imm32(a, R9, -VALUE_SIZE);
+		return;
+
+	case Lnn_BC_ADD_CONST:
+	case Lnn_BC_SUB_CONST:
+	case Lnn_BC_MUL_CONST:
+	case Lnn_BC_DIV_CONST:
+	{
+		/* The constant is known, the type of the operand is checked when it runs */
+		const Lnn_Value constant = chunk->constants[arg];
+		if (!Lnn_IsNumber(constant)) break;
+		const int constdisp = arg * VALUE_SIZE + (Lnn_IsInt(constant) ? INT_OFFSET : NUMBER_OFFSET);
+		int done = -1;
+		emit_cmp_mem_imm32(a, R9, -VALUE_SIZE + TYPE_OFFSET, Lnn_VT_INT);
+		const int isfloat = emit_jump_local(a, CC_NE);
+		if (Lnn_IsInt(constant) && op != Lnn_BC_DIV_CONST)
+		{
+			emit_int_op(a, INT_LOAD, RAX, R9, -VALUE_SIZE + INT_OFFSET);
+			emit_int_op(a, arithmetic_int_opcode(op), RAX, R11, constdisp);
+			emit_jcc(a, CC_O, PATCH_SLOWEXIT, index);
+			emit_int_op(a, INT_STORE, RAX, R9, -VALUE_SIZE + INT_OFFSET);
+			done = emit_jump_local(a, -1);
+		} else
+			emit_convert_int(a, XMM0, R9, -VALUE_SIZE + INT_OFFSET);
+		const int converted = emit_jump_local(a, -1);
+		bind_local(a, isfloat);
+		emit_guard_type(a, -VALUE_SIZE, Lnn_VT_FLOAT, index);
+		emit_sse(a, SSE_PREFIX, SSE_MOVLOAD, XMM0, R9, -VALUE_SIZE + NUMBER_OFFSET);
+		bind_local(a, converted);
+		if (Lnn_IsInt(constant))
+		{
+			emit_convert_int(a, XMM1, R11, constdisp);
+			emit_sse_reg(a, SSE_PREFIX, arithmetic_sse_opcode(op), XMM0, XMM1);
+		} else
+			emit_sse(a, SSE_PREFIX, arithmetic_sse_opcode(op), XMM0, R11, constdisp);
+		emit_store_number(a, R9, -VALUE_SIZE + NUMBER_OFFSET, XMM0);
+		emit_mov_mem_imm32(a, R9, -VALUE_SIZE + TYPE_OFFSET, Lnn_VT_FLOAT);
+		if (done >= 0)
+			bind_local(a, done);
+		return;
+	}
+
+	case Lnn_BC_EQUALITY_NUM_NUM:
+	case Lnn_BC_INEQUALITY_NUM_NUM:
+	case Lnn_BC_LESS_NUM_NUM:
+	case Lnn_BC_GREATER_NUM_NUM:
+	case Lnn_BC_LESSEQUAL_NUM_NUM:
+	case Lnn_BC_GREATEREQUAL_NUM_NUM:
+	case Lnn_BC_EQUALITY_INT_INT:
+	case Lnn_BC_INEQUALITY_INT_INT:
+	case Lnn_BC_LESS_INT_INT:
+	case Lnn_BC_GREATER_INT_INT:
+	case Lnn_BC_LESSEQUAL_INT_INT:
+	case Lnn_BC_GREATEREQUAL_INT_INT:
+		if (op >= Lnn_BC_EQUALITY_INT_INT)
+		{
+			emit_guard_type(a, -2 * VALUE_SIZE, Lnn_VT_INT, index);
+			emit_guard_type(a, -VALUE_SIZE, Lnn_VT_INT, index);
+			emit_compare_ints(a, Lnn_BC_EQUALITY + (op - Lnn_BC_EQUALITY_INT_INT), -2 * VALUE_SIZE, -VALUE_SIZE);
+		} else
+			emit_compare_numbers(a, Lnn_BC_EQUALITY + (op - Lnn_BC_EQUALITY_NUM_NUM), -2 * VALUE_SIZE, -VALUE_SIZE, index);
+		emit_byte(a, 0x0F); emit_byte(a, 0xB6); emit_byte(a, 0xC0); /* movzx eax, al */
+		emit_store32(a, R9, -2 * VALUE_SIZE + BOOL_OFFSET, RAX);
+		emit_mov_mem_imm32(a, R9, -2 * VALUE_SIZE + TYPE_OFFSET, Lnn_VT_BOOL);
+		emit_addsub_imm32(a, R9, -VALUE_SIZE);
+		return;
+
+	case Lnn_BC_EQUALITY_JUMPIFFALSE:
+	case Lnn_BC_INEQUALITY_JUMPIFFALSE:
+	case Lnn_BC_LESS_JUMPIFFALSE:
+	case Lnn_BC_GREATER_JUMPIFFALSE:
+	case Lnn_BC_LESSEQUAL_JUMPIFFALSE:
+	case Lnn_BC_GREATEREQUAL_JUMPIFFALSE:
+	{
+		/* Fused comparisons aren't quickened, two ints are compared as ints and other numbers as floats */
+		const Lnn_OpCode cmp = Lnn_BC_EQUALITY + (op - Lnn_BC_EQUALITY_JUMPIFFALSE);
+		emit_cmp_mem_imm32(a, R9, -2 * VALUE_SIZE + TYPE_OFFSET, Lnn_VT_INT);
+		const int leftfloat = emit_jump_local(a, CC_NE);
+		emit_cmp_mem_imm32(a, R9, -VALUE_SIZE + TYPE_OFFSET, Lnn_VT_INT);
+		const int rightfloat = emit_jump_local(a, CC_NE);
+		emit_compare_ints(a, cmp, -2 * VALUE_SIZE, -VALUE_SIZE);
+		const int done = emit_jump_local(a, -1);
+		bind_local(a, leftfloat);
+		bind_local(a, rightfloat);
+		emit_compare_numbers(a, cmp, -2 * VALUE_SIZE, -VALUE_SIZE, index);
+		bind_local(a, done);
+		emit_addsub_imm32(a, R9, -2 * VALUE_SIZE);
+		emit_byte(a, 0x84); emit_byte(a, 0xC0); /* test al, al */
+		emit_jcc(a, CC_E, PATCH_LABEL, arg);
+		return;
+	}
+
+	default:
+		break;
+	}
+
+	/* Everything else, like generic instructions and halt, is left to the interpreter */
+	emit_exit(a, index);
+}
+
+
+
+static void* allocate_executable(const void* code, const size_t size)
+{
+#ifdef _WIN32
+	void* memory = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!memory) return NULL;
+	memcpy(memory, code, size);
+	DWORD oldprotect;
+	if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &oldprotect))
+	{
+		VirtualFree(memory, 0, MEM_RELEASE);
+		return NULL;
+	}
+	return memory;
+#else
+	void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) return NULL;
+	memcpy(memory, code, size);
+	if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(memory, size);
+		return NULL;
+	}
+	return memory;
+#endif
+}
+
+static void free_executable(void* memory, const size_t size)
+{
+#ifdef _WIN32
+	(void)size;
+	VirtualFree(memory, 0, MEM_RELEASE);
+#else
+	munmap(memory, size);
+#endif
+}
+
+
+
+Lnn_JitCode* Lnn_JitCompileChunk(const Lnn_Chunk* chunk)
+{
+	Utl_Assert(chunk);
+
+	assembler a = { 0 };
+	a.labels = Utl_Malloc(sizeof(int) * (chunk->numcode + 1));
+
+	/* Put the context in r8 and load the vm state into registers */
+#ifdef _WIN32
+	emit_byte(&a, 0x49); emit_byte(&a, 0x89); emit_byte(&a, 0xC8); /* mov r8, rcx */
+#else
+	emit_byte(&a, 0x49); emit_byte(&a, 0x89); emit_byte(&a, 0xF8); /* mov r8, rdi */
+#endif
+	emit_load64(&a, R9, R8, (int)offsetof(Lnn_JitContext, sp));
+	emit_load64(&a, R10, R8, (int)offsetof(Lnn_JitContext, globals));
+	emit_byte(&a, 0x49); emit_byte(&a, 0xBB); emit_u64(&a, (uint64_t)(uintptr_t)chunk->constants); /* mov r11, imm64 */
+
+	/* Jump to where the interpreter is, either the start or the top of a loop */
+	emit_load32(&a, RAX, R8, (int)offsetof(Lnn_JitContext, ip));
+	emit_byte(&a, 0x3D); emit_u32(&a, 0); /* cmp eax, imm32 */
+	emit_jcc(&a, CC_E, PATCH_LABEL, 0);
+	for (int i = 0; i < chunk->numcode; i++)
+	{
+		const Lnn_Instruction instr = chunk->code[i];
+		if (Lnn_InstrOp(instr) == Lnn_BC_JUMP && Lnn_InstrArg(instr) <= i)
+		{
+			emit_byte(&a, 0x3D); emit_u32(&a, (uint32_t)Lnn_InstrArg(instr));
+			emit_jcc(&a, CC_E, PATCH_LABEL, Lnn_InstrArg(instr));
+		}
+	}
+	/* Anywhere else is left to the interpreter, eax already has the index */
+	emit_jmp(&a, PATCH_EXIT, 0);
+
+	for (int i = 0; i < chunk->numcode; i++)
+	{
+		a.labels[i] = a.size;
+		emit_instruction(&a, chunk, i);
+	}
+	a.labels[chunk->numcode] = a.size;
+	emit_exit(&a, chunk->numcode);
+
+	/* Every exit stores sp back into the context and returns eax */
+	const int exit = a.size;
+	emit_store64(&a, R8, (int)offsetof(Lnn_JitContext, sp), R9);
+	emit_byte(&a, 0xC3); /* ret */
+
+	/* Guard and slow exits get their own stubs so the fast path doesn't have to set eax */
+	const int numpatches = a.numpatches;
+	for (int i = 0; i < numpatches; i++)
+	{
+		patch* p = &a.patches[i];
+		int target;
+		switch (p->type)
+		{
+		case PATCH_LABEL: target = a.labels[p->index]; break;
+		case PATCH_EXIT: target = exit; break;
+		default:
+			target = a.size;
+			emit_byte(&a, 0xB8); /* mov eax, ~index or index */
+			emit_u32(&a, (uint32_t)(p->type == PATCH_GUARDEXIT ? ~p->index : p->index));
+			emit_byte(&a, 0xE9); emit_u32(&a, (uint32_t)(exit - (a.size + 4)));
+			break;
+		}
+		const uint32_t rel = (uint32_t)(target - (p->at + 4));
+		memcpy(a.bytes + p->at, &rel, 4);
+	}
+
+	Lnn_JitCode* code = NULL;
+	void* memory = allocate_executable(a.bytes, a.size);
+	if (memory)
+	{
+		code = Utl_AllocType(Lnn_JitCode);
+		code->memory = memory;
+		code->size = a.size;
+		code->function = (Lnn_JitFunction)memory;
+	} else
+		printf("ERROR! Couldn't allocate executable memory for jit code\n");
+
+	Utl_Free(a.bytes);
+	Utl_Free(a.labels);
+	Utl_Free(a.patches);
+	return code;
+}
+
+void Lnn_DestroyJitCode(Lnn_JitCode* code)
+{
+	if (!code) return;
+	free_executable(code->memory, code->size);
+	Utl_Free(code);
+}
+
+#endif
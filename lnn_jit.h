@@ -0,0 +1,46 @@
+#ifndef _Lnn_JIT_H_
+#define _Lnn_JIT_H_
+
+#include "fab_utility.h"
+#include "lnn_vm.h"
+
+#ifdef Lnn_JIT
+
+/**
+ * @brief The vm state that jit code reads when it is entered and writes back when it exits.
+ */
+typedef struct Lnn_JitContext
+{
+	Lnn_Value* sp;
+	Lnn_Global* globals;
+	int ip;					/* Index of the instruction to start at, must be the start of the chunk or a loop */
+	int ticks;				/* Loop iterations left of the budget of the run, it exits at the last one */
+} Lnn_JitContext;
+
+/**
+ * Jit code returns the index of the instruction the interpreter should continue from.
+ * If a type guard failed it returns the inverted index (~ip) instead.
+ */
+typedef int (*Lnn_JitFunction)(Lnn_JitContext* context);
+
+typedef struct Lnn_JitCode
+{
+	Lnn_JitFunction function;
+	void* memory;
+	size_t size;
+} Lnn_JitCode;
+
+/**
+ * @brief Compiles a chunk into x86-64 machine code.
+ * Quickened instructions become guarded templates for the types they were quickened for.
+ * Instructions that aren't supported exit back to the interpreter.
+ * @param chunk The chunk to compile, it should have run enough to be quickened.
+ * @return The new jit code, or NULL if executable memory couldn't be allocated.
+ */
+Lnn_JitCode* Lnn_JitCompileChunk(const Lnn_Chunk* chunk);
+
+void Lnn_DestroyJitCode(Lnn_JitCode* code);
+
+#endif
+
+#endif
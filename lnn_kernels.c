@@ -0,0 +1,476 @@
+#include "lnn_kernels.h"
+#include "lnn_state.h"
+#include <math.h>
+
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(Lnn_NO_SIMD)
+#define Lnn_X86_KERNELS
+#endif
+
+#ifdef Lnn_X86_KERNELS
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AVX2_FUNCTION
+#else
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
+
+const char* lnn_elementwiseop_names[Lnn_NUM_ELEMENTWISEOPS] =
+{
+	"EW_ADD",
+	"EW_SUB",
+	"EW_MUL",
+	"EW_SCALE"
+};
+
+
+
+/* Plain C kernels, for cpus without vector kernels */
+
+#ifndef Lnn_X86_KERNELS
+
+static Utl_Float scalar_sum(const Utl_Float* a, const int count)
+{
+	Utl_Float sum = 0;
+	for (int i = 0; i < count; i++) sum += a[i];
+	return sum;
+}
+
+static Utl_Float scalar_min(const Utl_Float* a, const int count)
+{
+	Utl_Float min = a[0];
+	for (int i = 1; i < count; i++) if (a[i] < min) min = a[i];
+	return min;
+}
+
+static Utl_Float scalar_max(const Utl_Float* a, const int count)
+{
+	Utl_Float max = a[0];
+	for (int i = 1; i < count; i++) if (a[i] > max) max = a[i];
+	return max;
+}
+
+static Utl_Float scalar_dot(const Utl_Float* a, const Utl_Float* b, const int count)
+{
+	Utl_Float sum = 0;
+	for (int i = 0; i < count; i++) sum += a[i] * b[i];
+	return sum;
+}
+
+static void scalar_add(Utl_Float* dst, const Utl_Float* a, const Utl_Float* b, const int count)
+{
+	for (int i = 0; i < count; i++) dst[i] = a[i] + b[i];
+}
+
+static void scalar_sub(Utl_Float* dst, const Utl_Float* a, const Utl_Float* b, const int count)
+{
+	for (int i = 0; i < count; i++) dst[i] = a[i] - b[i];
+}
+
+static void scalar_mul(Utl_Float* dst, const Utl_Float* a, const Utl_Float* b, const int count)
+{
+	for (int i = 0; i < count; i++) dst[i] = a[i] * b[i];
+}
+
+static void scalar_scale(Utl_Float* dst, const Utl_Float* a, const Utl_Float k, const int count)
+{
+	for (int i = 0; i < count; i++) dst[i] = a[i] * k;
+}
+
+static const Lnn_ArrayKernels scalar_kernels =
+{
+	"scalar",
+	scalar_sum, scalar_min, scalar_max, scalar_dot,
+	scalar_add, scalar_sub, scalar_mul, scalar_scale,
+};
+
+#endif
+
+
+
+#ifdef Lnn_X86_KERNELS
+
+/* The vector operations for the width of Utl_Float, sse is 128 bits and avx 256 bits */
+#ifndef Utl_USE_32BIT_NUMBERS
+#define sse_LANES	2
+#define avx_LANES	4
+typedef __m128d sse_type;
+typedef __m256d avx_type;
+#define sse_load	_mm_loadu_pd
+#define sse_store	_mm_storeu_pd
+#define sse_set1	_mm_set1_pd
+#define sse_add		_mm_add_pd
+#define sse_sub		_mm_sub_pd
+#define sse_mul		_mm_mul_pd
+#define sse_min		_mm_min_pd
+#define sse_max		_mm_max_pd
+#define avx_load	_mm256_loadu_pd
+#define avx_store	_mm256_storeu_pd
+#define avx_set1	_mm256_set1_pd
+#define avx_add		_mm256_add_pd
+#define avx_sub		_mm256_sub_pd
+#define avx_mul		_mm256_mul_pd
+#define avx_min		_mm256_min_pd
+#define avx_max		_mm256_max_pd
+#else
+#define sse_LANES	4
+#define avx_LANES	8
+typedef __m128 sse_type;
+typedef __m256 avx_type;
+#define sse_load	_mm_loadu_ps
+#define sse_store	_mm_storeu_ps
+#define sse_set1	_mm_set1_ps
+#define sse_add		_mm_add_ps
+#define sse_sub		_mm_sub_ps
+#define sse_mul		_mm_mul_ps
+#define sse_min		_mm_min_ps
+#define sse_max		_mm_max_ps
+#define avx_load	_mm256_loadu_ps
+#define avx_store	_mm256_storeu_ps
+#define avx_set1	_mm256_set1_ps
+#define avx_add		_mm256_add_ps
+#define avx_sub		_mm256_sub_ps
+#define avx_mul		_mm256_mul_ps
+#define avx_min		_mm256_min_ps
+#define avx_max		_mm256_max_ps
+#endif
+
+/* Reduction over the lanes of a vector and then the elements that didn't fill a whole vector */
+#define define_vector_reduce(name, attribute, v, init, vop, sop)									\
+	attribute static Utl_Float name(const Utl_Float* a, const int count)							\
+	{																								\
+		Utl_Float result = init;																	\
+		int i = 0;																					\
+		if (count >= v##_LANES)																		\
+		{																							\
+			v##_type acc = v##_load(a);																\
+			for (i = v##_LANES; i + v##_LANES <= count; i += v##_LANES)								\
+				acc = v##_##vop(acc, v##_load(a + i));												\
+			Utl_Float lanes[v##_LANES];																\
+			v##_store(lanes, acc);																	\
+			result = lanes[0];																		\
+			for (int j = 1; j < v##_LANES; j++) result = sop(result, lanes[j]);						\
+		}																							\
+		for (; i < count; i++) result = sop(result, a[i]);											\
+		return result;																				\
+	}
+
+/* Operation on two arrays that writes every result to a third */
+#define define_vector_binary(name, attribute, v, vop, sop)											\
+	attribute static void name(Utl_Float* dst, const Utl_Float* a, const Utl_Float* b, const int count)	\
+	{																								\
+		int i = 0;																					\
+		for (; i + v##_LANES <= count; i += v##_LANES)												\
+			v##_store(dst + i, v##_##vop(v##_load(a + i), v##_load(b + i)));						\
+		for (; i < count; i++) dst[i] = sop(a[i], b[i]);											\
+	}
+
+#define scalar_add_op(x, y) ((x) + (y))
+#define scalar_sub_op(x, y) ((x) - (y))
+#define scalar_mul_op(x, y) ((x) * (y))
+#define scalar_min_op(x, y) ((y) < (x) ? (y) : (x))
+#define scalar_max_op(x, y) ((y) > (x) ? (y) : (x))
+
+/* Every kernel for one vector width */
+#define define_vector_kernels(prefix, attribute, v)													\
+	define_vector_reduce(prefix##_min, attribute, v, a[0], min, scalar_min_op)						\
+	define_vector_reduce(prefix##_max, attribute, v, a[0], max, scalar_max_op)						\
+	define_vector_binary(prefix##_add, attribute, v, add, scalar_add_op)							\
+	define_vector_binary(prefix##_sub, attribute, v, sub, scalar_sub_op)							\
+	define_vector_binary(prefix##_mul, attribute, v, mul, scalar_mul_op)							\
+	attribute static Utl_Float prefix##_sum(const Utl_Float* a, const int count)					\
+	{																								\
+		v##_type acc = v##_set1(0);																	\
+		int i = 0;																					\
+		for (; i + v##_LANES <= count; i += v##_LANES)												\
+			acc = v##_add(acc, v##_load(a + i));													\
+		Utl_Float lanes[v##_LANES];																	\
+		v##_store(lanes, acc);																		\
+		Utl_Float sum = 0;																			\
+		for (int j = 0; j < v##_LANES; j++) sum += lanes[j];										\
+		for (; i < count; i++) sum += a[i];															\
+		return sum;																					\
+	}																								\
+	attribute static Utl_Float prefix##_dot(const Utl_Float* a, const Utl_Float* b, const int count)	\
+	{																								\
+		v##_type acc = v##_set1(0);																	\
+		int i = 0;																					\
+		for (; i + v##_LANES <= count; i += v##_LANES)												\
+			acc = v##_add(acc, v##_mul(v##_load(a + i), v##_load(b + i)));							\
+		Utl_Float lanes[v##_LANES];																	\
+		v##_store(lanes, acc);																		\
+		Utl_Float sum = 0;																			\
+		for (int j = 0; j < v##_LANES; j++) sum += lanes[j];										\
+		for (; i < count; i++) sum += a[i] * b[i];													\
+		return sum;																					\
+	}																								\
+	attribute static void prefix##_scale(Utl_Float* dst, const Utl_Float* a, const Utl_Float k, const int count)	\
+	{																								\
+		const v##_type factor = v##_set1(k);														\
+		int i = 0;																					\
+		for (; i + v##_LANES <= count; i += v##_LANES)												\
+			v##_store(dst + i, v##_mul(v##_load(a + i), factor));									\
+		for (; i < count; i++) dst[i] = a[i] * k;													\
+	}																								\
+	static const Lnn_ArrayKernels prefix##_kernels =												\
+	{																								\
+		#prefix,																					\
+		prefix##_sum, prefix##_min, prefix##_max, prefix##_dot,										\
+		prefix##_add, prefix##_sub, prefix##_mul, prefix##_scale,									\
+	};
+
+define_vector_kernels(sse2, , sse)
+define_vector_kernels(avx2, AVX2_FUNCTION, avx)
+
+static Utl_Bool cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return Utl_FALSE;
+	/* The os also has to save the ymm registers on context switches */
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6) return Utl_FALSE;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif
+
+const Lnn_ArrayKernels* Lnn_SelectArrayKernels(void)
+{
+#ifdef Lnn_X86_KERNELS
+	/* SSE2 is always there on x86-64 */
+	return cpu_has_avx2() ? &avx2_kernels : &sse2_kernels;
+#else
+	return &scalar_kernels;
+#endif
+}
+
+const Utl_Float* Lnn_FloatElements(const Lnn_Array* array, Utl_Float** temp)
+{
+	Utl_Assert(array && temp);
+	*temp = NULL;
+	switch (array->kind)
+	{
+	case Lnn_EK_FLOAT: return array->elements.floats;
+	case Lnn_EK_INT:
+		*temp = Utl_Malloc(sizeof(Utl_Float) * (array->length + 1));
+		for (int i = 0; i < array->length; i++)
+			(*temp)[i] = (Utl_Float)array->elements.ints[i];
+		return *temp;
+	default: return NULL;
+	}
+}
+
+
+
+/* Elementwise loops */
+
+/* Kernels only read and write globals, locals of functions live in their frame */
+#define is_global(expr)	((expr)->type == Lnn_ET_VARIABLE && (expr)->u.variable.kind == Lnn_VK_GLOBAL)
+
+/* c[i] where i is the counter */
+static const char* element_of_counter(const Lnn_ExprNode* expr, const char* counter)
+{
+	if (expr->type != Lnn_ET_OPERATOR || expr->u.op.id != Lnn_OP_ARRAYACCESS ||
+		!is_global(expr->u.op.left) || !is_global(expr->u.op.right) ||
+		strcmp(expr->u.op.right->u.variable.name, counter) != 0 || strcmp(expr->u.op.left->u.variable.name, counter) == 0)
+		return NULL;
+	return expr->u.op.left->u.variable.name;
+}
+
+/* A number literal or a global that isn't the counter */
+static Utl_Bool match_scalar(Lnn_State* state, const Lnn_ExprNode* expr, const char* counter, int* slot, Lnn_Value* number)
+{
+	if (Lnn_IsNumberLiteral(expr))
+	{
+		*slot = -1;
+		*number = expr->type == Lnn_ET_INTLITERAL ? Lnn_IntValue(expr->u.integer) : Lnn_FloatValue(expr->u.number);
+		return Utl_TRUE;
+	}
+	if (is_global(expr) && strcmp(expr->u.variable.name, counter) != 0)
+	{
+		*slot = Lnn_GetGlobalSlot(state, expr->u.variable.name);
+		return Utl_TRUE;
+	}
+	return Utl_FALSE;
+}
+
+/* i += 1 or i = i + 1 */
+static Utl_Bool is_increment(const Lnn_ExprNode* expr, const char* counter)
+{
+	if (expr->type != Lnn_ET_OPERATOR || !is_global(expr->u.op.left) ||
+		strcmp(expr->u.op.left->u.variable.name, counter) != 0)
+		return Utl_FALSE;
+	const Lnn_ExprNode* right = expr->u.op.right;
+	if (expr->u.op.id == Lnn_OP_ASSIGNADD)
+		return Lnn_IsNumberLiteral(right) && Lnn_LiteralNumber(right) == 1;
+	if (expr->u.op.id == Lnn_OP_ASSIGN)
+		return right->type == Lnn_ET_OPERATOR && right->u.op.id == Lnn_OP_ADD &&
+			is_global(right->u.op.left) && strcmp(right->u.op.left->u.variable.name, counter) == 0 &&
+			Lnn_IsNumberLiteral(right->u.op.right) && Lnn_LiteralNumber(right->u.op.right) == 1;
+	return Utl_FALSE;
+}
+
+Utl_Bool Lnn_MatchElementwiseLoop(Lnn_State* state, const Lnn_Statement* stmt, Lnn_ElementwiseLoop* loop)
+{
+	Utl_Assert(state && stmt && loop);
+	if (stmt->type != Lnn_ST_WHILE || stmt->u.stmt_while.block->numstatements != 2) return Utl_FALSE;
+
+	/* while i < limit */
+	const Lnn_ExprNode* condition = stmt->u.stmt_while.condition;
+	if (condition->type != Lnn_ET_OPERATOR || condition->u.op.id != Lnn_OP_LESS ||
+		!is_global(condition->u.op.left))
+		return Utl_FALSE;
+	const char* counter = condition->u.op.left->u.variable.name;
+	const Lnn_ExprNode* limit = condition->u.op.right;
+	const Lnn_Statement* body = &stmt->u.stmt_while.block->statements[0];
+	const Lnn_Statement* increment = &stmt->u.stmt_while.block->statements[1];
+	if (body->type != Lnn_ST_EXPRESSION || increment->type != Lnn_ST_EXPRESSION ||
+		!is_increment(increment->u.stmt_expr.expression, counter))
+		return Utl_FALSE;
+
+	/* dst[i] = a[i] op b[i], dst[i] = a[i] * k, or a compound assignment of dst[i] */
+	const Lnn_ExprNode* assignment = body->u.stmt_expr.expression;
+	if (assignment->type != Lnn_ET_OPERATOR || !Lnn_IsAssignmentOp(assignment->u.op.id) ||
+		assignment->u.op.id == Lnn_OP_ASSIGNDIV)
+		return Utl_FALSE;
+	const char* dst = element_of_counter(assignment->u.op.left, counter);
+	if (!dst) return Utl_FALSE;
+
+	const char* a = dst;
+	const char* b = NULL;
+	const Lnn_ExprNode* factor = NULL;
+	const Lnn_ExprNode* value = assignment->u.op.right;
+	Lnn_OperatorID op = Lnn_OP_ADD + (assignment->u.op.id - Lnn_OP_ASSIGNADD);
+	if (assignment->u.op.id == Lnn_OP_ASSIGN)
+	{
+		if (value->type != Lnn_ET_OPERATOR || !Lnn_IsArithmeticOp(value->u.op.id) || value->u.op.id == Lnn_OP_DIV)
+			return Utl_FALSE;
+		op = value->u.op.id;
+		a = element_of_counter(value->u.op.left, counter);
+		b = element_of_counter(value->u.op.right, counter);
+		if (op == Lnn_OP_MUL && a && !b)
+			factor = value->u.op.right;
+		else if (op == Lnn_OP_MUL && !a && b)
+		{
+			a = b;
+			b = NULL;
+			factor = value->u.op.left;
+		}
+		if (!a || (!b && !factor)) return Utl_FALSE;
+	} else
+	{
+		b = element_of_counter(value, counter);
+		if (!b)
+		{
+			if (op != Lnn_OP_MUL) return Utl_FALSE;
+			factor = value;
+		}
+	}
+
+	loop->counter = Lnn_GetGlobalSlot(state, counter);
+	loop->dst = Lnn_GetGlobalSlot(state, dst);
+	loop->a = Lnn_GetGlobalSlot(state, a);
+	loop->b = b ? Lnn_GetGlobalSlot(state, b) : -1;
+	loop->factorslot = -1;
+	loop->factor = Lnn_NullValue();
+	if (factor)
+	{
+		loop->op = Lnn_EW_SCALE;
+		if (!match_scalar(state, factor, counter, &loop->factorslot, &loop->factor)) return Utl_FALSE;
+	} else
+		loop->op = op == Lnn_OP_ADD ? Lnn_EW_ADD : op == Lnn_OP_SUB ? Lnn_EW_SUB : Lnn_EW_MUL;
+
+	/* The limit is a number, a global or the length of a global */
+	loop->limitlength = Utl_FALSE;
+	loop->limit = Lnn_NullValue();
+	if (limit->type == Lnn_ET_OPERATOR && limit->u.op.id == Lnn_OP_MEMBERACCESS &&
+		is_global(limit->u.op.left) && limit->u.op.right->type == Lnn_ET_VARIABLE &&
+		strcmp(limit->u.op.right->u.variable.name, "length") == 0 && strcmp(limit->u.op.left->u.variable.name, counter) != 0)
+	{
+		loop->limitslot = Lnn_GetGlobalSlot(state, limit->u.op.left->u.variable.name);
+		loop->limitlength = Utl_TRUE;
+		return Utl_TRUE;
+	}
+	return match_scalar(state, limit, counter, &loop->limitslot, &loop->limit);
+}
+
+/* An array of numbers that has the elements from index start up to end */
+#define is_number_array(value, end) \
+	(Lnn_IsArray(value) && (value).u.array->kind != Lnn_EK_VALUE && (value).u.array->length >= (end))
+
+Utl_Bool Lnn_RunElementwiseLoop(Lnn_State* state, const Lnn_ElementwiseLoop* loop)
+{
+	Utl_Assert(state && loop);
+	Lnn_Global* globals = state->globals;
+
+	/* The counter is an int, or a float with a whole value, that can index an array */
+	const Lnn_Value counter = globals[loop->counter].value;
+	if (Lnn_IsInt(counter) ? counter.u.integer < 0 || counter.u.integer > INT32_MAX :
+		!Lnn_IsFloat(counter) || !(counter.u.number >= 0 && counter.u.number <= INT32_MAX) ||
+		(Utl_Float)(int)counter.u.number != counter.u.number)
+		return Utl_FALSE;
+	const int start = Lnn_ArrayIndexOf(counter);
+
+	double limit = Lnn_IsInt(loop->limit) ? (double)loop->limit.u.integer : (double)loop->limit.u.number;
+	if (loop->limitslot >= 0)
+	{
+		const Lnn_Value value = globals[loop->limitslot].value;
+		if (loop->limitlength && Lnn_IsArray(value))
+			limit = value.u.array->length;
+		else if (!loop->limitlength && Lnn_IsInt(value))
+			limit = (double)value.u.integer;
+		else if (!loop->limitlength && Lnn_IsFloat(value))
+			limit = value.u.number;
+		else
+			return Utl_FALSE;
+	}
+	/* The loop runs until the counter isn't less than the limit */
+	const double span = ceil(limit - (double)start);
+	if (!(span >= 1) || span > INT32_MAX - start) return Utl_FALSE;
+	const int count = (int)span;
+	const int end = start + count;
+
+	const Lnn_Value factor = loop->factorslot >= 0 ? globals[loop->factorslot].value : loop->factor;
+	if (loop->op == Lnn_EW_SCALE && !Lnn_IsNumber(factor)) return Utl_FALSE;
+
+	const Lnn_Value dstvalue = globals[loop->dst].value;
+	const Lnn_Value avalue = globals[loop->a].value;
+	const Lnn_Value bvalue = loop->b >= 0 ? globals[loop->b].value : avalue;
+	if (!is_number_array(dstvalue, end) || !is_number_array(avalue, end) || !is_number_array(bvalue, end))
+		return Utl_FALSE;
+
+	/* The kernels compute floats, ints only come out when every operand is an int and that is left to the vm.
+	 * Storing the first float moves an int array to floats anyway, so it is done up front */
+	if (avalue.u.array->kind == Lnn_EK_INT &&
+		(loop->op == Lnn_EW_SCALE ? Lnn_IsInt(factor) : bvalue.u.array->kind == Lnn_EK_INT))
+		return Utl_FALSE;
+	Lnn_Array* dst = dstvalue.u.array;
+	if (dst->kind == Lnn_EK_INT && !Lnn_GeneralizeArray(state, dst, Lnn_EK_FLOAT))
+		return Utl_FALSE;
+
+	Utl_Float* atemp;
+	Utl_Float* btemp;
+	const Utl_Float* a = Lnn_FloatElements(avalue.u.array, &atemp);
+	const Utl_Float* b = Lnn_FloatElements(bvalue.u.array, &btemp);
+	const Lnn_ArrayKernels* kernels = state->kernels;
+	switch (loop->op)
+	{
+	case Lnn_EW_ADD: kernels->add(dst->elements.floats + start, a + start, b + start, count); break;
+	case Lnn_EW_SUB: kernels->sub(dst->elements.floats + start, a + start, b + start, count); break;
+	case Lnn_EW_MUL: kernels->mul(dst->elements.floats + start, a + start, b + start, count); break;
+	default: kernels->scale(dst->elements.floats + start, a + start, Lnn_NumberOf(factor), count); break;
+	}
+	Utl_Free(atemp);
+	Utl_Free(btemp);
+
+	globals[loop->counter].value = Lnn_IsInt(counter) ? Lnn_IntValue(end) : Lnn_FloatValue((Utl_Float)end);
+	return Utl_TRUE;
+}
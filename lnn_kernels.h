@@ -0,0 +1,97 @@
+#ifndef _Lnn_KERNELS_H_
+#define _Lnn_KERNELS_H_
+
+#include "fab_utility.h"
+#include "lnn_code.h"
+#include "lnn_array.h"
+
+struct Lnn_State;
+
+/**
+ * Native kernels for arrays of numbers. There is a plain C version of every kernel and on x86
+ * also an SSE2 and an AVX2 version, the best one the cpu supports is picked when a state is created.
+ * The vectorized sums add the elements in a different order, so their result can differ in the last bits.
+ */
+typedef struct Lnn_ArrayKernels
+{
+	const char* name;
+	Utl_Float(*sum)(const Utl_Float* a, const int count);
+	Utl_Float(*min)(const Utl_Float* a, const int count);	/* count has to be at least 1 */
+	Utl_Float(*max)(const Utl_Float* a, const int count);
+	Utl_Float(*dot)(const Utl_Float* a, const Utl_Float* b, const int count);
+	void(*add)(Utl_Float* dst, const Utl_Float* a, const Utl_Float* b, const int count);
+	void(*sub)(Utl_Float* dst, const Utl_Float* a, const Utl_Float* b, const int count);
+	void(*mul)(Utl_Float* dst, const Utl_Float* a, const Utl_Float* b, const int count);
+	void(*scale)(Utl_Float* dst, const Utl_Float* a, const Utl_Float k, const int count);
+} Lnn_ArrayKernels;
+
+/**
+ * @brief Picks the fastest kernels the cpu can run.
+ * Define Lnn_NO_SIMD to always get the plain C kernels.
+ */
+const Lnn_ArrayKernels* Lnn_SelectArrayKernels(void);
+
+/**
+ * @brief Gets the elements of an array of numbers as Utl_Float.
+ * @param array An array of the kind Lnn_EK_INT or Lnn_EK_FLOAT.
+ * @param temp Set to a converted copy of the elements if the array is Lnn_EK_INT, free it afterwards.
+ * Set to NULL if the elements of the array are returned directly.
+ * @return The elements, or NULL if the array has generic values.
+ */
+const Utl_Float* Lnn_FloatElements(const Lnn_Array* array,
+								   Utl_Float** temp);
+
+
+
+typedef enum
+{
+	Lnn_EW_ADD,		/* c[i] = a[i] + b[i] */
+	Lnn_EW_SUB,		/* c[i] = a[i] - b[i] */
+	Lnn_EW_MUL,		/* c[i] = a[i] * b[i] */
+	Lnn_EW_SCALE,	/* c[i] = a[i] * k */
+	Lnn_NUM_ELEMENTWISEOPS
+} Lnn_ElementwiseOp;
+extern const char* lnn_elementwiseop_names[Lnn_NUM_ELEMENTWISEOPS];
+
+/**
+ * @brief A while loop that applies one operation to every element of arrays, like
+ * while i < n do c[i] = a[i] + b[i] i += 1 end
+ * Compound assignments like c[i] += a[i] work too. The arrays, the counter and the factor
+ * have to be global variables, and the limit a number, a global or the length of a global.
+ * Variables are resolved to global slots.
+ */
+typedef struct Lnn_ElementwiseLoop
+{
+	Lnn_ElementwiseOp op;
+	int counter;
+	int dst;
+	int a;
+	int b;				/* -1 for Lnn_EW_SCALE */
+	int factorslot;		/* Global that has the factor of Lnn_EW_SCALE, or -1 if it's the number in factor */
+	Lnn_Value factor;
+	int limitslot;		/* Global that has the limit, or -1 if it's the number in limit */
+	Utl_Bool limitlength;	/* The limit is the length of the array in limitslot */
+	Lnn_Value limit;
+} Lnn_ElementwiseLoop;
+
+/**
+ * @brief Checks if a while statement is an elementwise loop that can run as a kernel.
+ * @param state State that globals are resolved in.
+ * @param stmt The while statement.
+ * @param loop Filled in if the statement is an elementwise loop.
+ * @return Utl_TRUE if it is one.
+ */
+Utl_Bool Lnn_MatchElementwiseLoop(struct Lnn_State* state,
+								  const Lnn_Statement* stmt,
+								  Lnn_ElementwiseLoop* loop);
+
+/**
+ * @brief Runs a whole elementwise loop with a kernel, if the values the globals have right now allow it.
+ * The arrays have to hold numbers and be long enough for every index the loop would use.
+ * The counter is left where the loop would have left it.
+ * @return Utl_FALSE if the loop has to run normally instead, nothing has been changed then.
+ */
+Utl_Bool Lnn_RunElementwiseLoop(struct Lnn_State* state,
+								const Lnn_ElementwiseLoop* loop);
+
+#endif
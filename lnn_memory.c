@@ -0,0 +1,160 @@
+#include "lnn_memory.h"
+#include "lnn_state.h"
+
+
+
+static void* default_allocate(void* userdata, const size_t size)
+{
+	(void)userdata;
+	return malloc(size);
+}
+
+static void default_free(void* userdata, void* block, const size_t size)
+{
+	(void)userdata;
+	(void)size;
+	free(block);
+}
+
+/* Carves a new slab into free blocks of one size class, the first block of the slab links it to the others */
+static Utl_Bool refill_pool(Lnn_Memory* memory, const int sizeclass)
+{
+	char* slab = memory->allocator.allocate(memory->allocator.userdata, Lnn_POOL_SLAB_SIZE);
+	if (!slab) return Utl_FALSE;
+	*(void**)slab = memory->slabs;
+	memory->slabs = slab;
+	memory->slabbytes += Lnn_POOL_SLAB_SIZE;
+
+	const size_t blocksize = (size_t)(sizeclass + 1) * Lnn_POOL_GRANULARITY;
+	for (size_t at = Lnn_POOL_GRANULARITY; at + blocksize <= Lnn_POOL_SLAB_SIZE; at += blocksize)
+	{
+		*(void**)(slab + at) = memory->freeblocks[sizeclass];
+		memory->freeblocks[sizeclass] = slab + at;
+	}
+	return Utl_TRUE;
+}
+
+
+
+void Lnn_InitMemory(Lnn_Memory* memory, const Lnn_Allocator* allocator)
+{
+	Utl_Assert(memory);
+	memset(memory, 0, sizeof(Lnn_Memory));
+	if (allocator)
+		memory->allocator = *allocator;
+	else
+	{
+		memory->allocator.allocate = &default_allocate;
+		memory->allocator.free = &default_free;
+	}
+}
+
+void Lnn_FreeMemory(Lnn_Memory* memory)
+{
+	Utl_Assert(memory);
+	while (memory->slabs)
+	{
+		void* slab = memory->slabs;
+		memory->slabs = *(void**)slab;
+		memory->allocator.free(memory->allocator.userdata, slab, Lnn_POOL_SLAB_SIZE);
+	}
+	memset(memory->freeblocks, 0, sizeof(memory->freeblocks));
+	memory->slabbytes = 0;
+}
+
+void* Lnn_Allocate(Lnn_State* state, const size_t size)
+{
+	Utl_Assert(state);
+	Lnn_Memory* memory = &state->memory;
+	void* block;
+	if (size <= Lnn_POOL_MAX_SIZE)
+	{
+		const int sizeclass = size ? Lnn_SizeClass(size) : 0;
+		if (!memory->freeblocks[sizeclass] && !refill_pool(memory, sizeclass))
+			block = NULL;
+		else
+		{
+			block = memory->freeblocks[sizeclass];
+			memory->freeblocks[sizeclass] = *(void**)block;
+		}
+	} else
+		block = memory->allocator.allocate(memory->allocator.userdata, size);
+
+	if (!block)
+	{
+		/* The caller fails what it was doing, the flag makes sure the run fails even where it can't tell */
+		printf("ERROR! Out of memory allocating %zu bytes\n", size);
+		memory->outofmemory = Utl_TRUE;
+		state->gc.pending = Utl_TRUE;
+		return NULL;
+	}
+
+	memory->livebytes += size;
+	if (memory->livebytes > memory->peakbytes)
+		memory->peakbytes = memory->livebytes;
+	/* The next safepoint finds out if collecting brings the state back under its limit */
+	if (Lnn_IsOverMemoryLimit(memory))
+		state->gc.pending = Utl_TRUE;
+	return block;
+}
+
+void* Lnn_Reallocate(Lnn_State* state, void* block, const size_t oldsize, const size_t newsize)
+{
+	Utl_Assert(state);
+	if (!block)
+		return Lnn_Allocate(state, newsize);
+
+	/* A pooled block that stays in the same size class already has room */
+	if (oldsize <= Lnn_POOL_MAX_SIZE && newsize <= Lnn_POOL_MAX_SIZE &&
+		Lnn_SizeClass(oldsize ? oldsize : 1) == Lnn_SizeClass(newsize ? newsize : 1))
+	{
+		Lnn_Memory* memory = &state->memory;
+		memory->livebytes = memory->livebytes - oldsize + newsize;
+		if (memory->livebytes > memory->peakbytes)
+			memory->peakbytes = memory->livebytes;
+		return block;
+	}
+
+	void* newblock = Lnn_Allocate(state, newsize);
+	if (!newblock) return NULL;
+	memcpy(newblock, block, oldsize < newsize ? oldsize : newsize);
+	Lnn_Deallocate(state, block, oldsize);
+	return newblock;
+}
+
+void Lnn_Deallocate(Lnn_State* state, void* block, const size_t size)
+{
+	Utl_Assert(state);
+	if (!block) return;
+	Lnn_Memory* memory = &state->memory;
+	Utl_Assert(memory->livebytes >= size);
+	memory->livebytes -= size;
+	if (size <= Lnn_POOL_MAX_SIZE)
+	{
+		const int sizeclass = size ? Lnn_SizeClass(size) : 0;
+		*(void**)block = memory->freeblocks[sizeclass];
+		memory->freeblocks[sizeclass] = block;
+	} else
+		memory->allocator.free(memory->allocator.userdata, block, size);
+}
+
+void Lnn_SetMemoryLimit(Lnn_State* state, const size_t limit)
+{
+	Utl_Assert(state);
+	state->memory.limit = limit;
+	if (Lnn_IsOverMemoryLimit(&state->memory))
+		state->gc.pending = Utl_TRUE;
+}
+
+
+
+void Lnn_PrintMemoryStats(const Lnn_State* state)
+{
+	Utl_Assert(state);
+	const Lnn_Memory* memory = &state->memory;
+	printf("Memory:\n");
+	printf("  %zu live bytes, %zu peak bytes, %zu bytes in pool slabs\n",
+		   memory->livebytes, memory->peakbytes, memory->slabbytes);
+	if (memory->limit)
+		printf("  Limit %zu bytes\n", memory->limit);
+}
@@ -0,0 +1,102 @@
+#ifndef _Lnn_MEMORY_H_
+#define _Lnn_MEMORY_H_
+
+#include "fab_utility.h"
+
+struct Lnn_State;
+
+/**
+ * Memory for what scripts make while running, the objects of the collector, the nursery and the
+ * elements and slots that arrays and objects own, goes through the allocator of the state that runs them.
+ * Blocks up to Lnn_POOL_MAX_SIZE bytes are carved out of slabs by size class so the objects that die
+ * and get made all the time don't go to the allocator, bigger blocks go to it directly.
+ * When the allocator has no memory left the allocation gives NULL and a runtime error on the state that
+ * asked for it, whatever needed the memory fails and so does the run, the process and other states go on.
+ * Every state counts the bytes it has in use and can be given a limit. Going over the limit doesn't
+ * fail right away since allocating never collects, instead the next safepoint collects everything
+ * and the run fails if the state is still over its limit.
+ * Compiled code, interned strings and other things made by the host still use Utl_Malloc().
+ */
+
+typedef struct Lnn_Allocator
+{
+	void* (*allocate)(void* userdata, const size_t size);		/* NULL if there is no memory left */
+	void (*free)(void* userdata, void* block, const size_t size);	/* Gets the size the block was allocated with */
+	void* userdata;
+} Lnn_Allocator;
+
+#define Lnn_POOL_GRANULARITY	16
+#define Lnn_POOL_MAX_SIZE		256
+#define Lnn_NUM_SIZE_CLASSES	(Lnn_POOL_MAX_SIZE / Lnn_POOL_GRANULARITY)
+#define Lnn_POOL_SLAB_SIZE		(16 * 1024)
+
+/* Size class of a block that is small enough to be pooled */
+#define Lnn_SizeClass(size)		((int)(((size) + Lnn_POOL_GRANULARITY - 1) / Lnn_POOL_GRANULARITY) - 1)
+
+typedef struct Lnn_Memory
+{
+	Lnn_Allocator allocator;
+	void* freeblocks[Lnn_NUM_SIZE_CLASSES];	/* Free blocks of every size class, each one points to the next */
+	void* slabs;				/* Slabs the pools have carved up, each one points to the next */
+
+	size_t livebytes;			/* Bytes in use, not counting what the pools have left over */
+	size_t peakbytes;
+	size_t slabbytes;			/* Bytes the pools got from the allocator */
+	size_t limit;				/* 0 if there is none */
+	Utl_Bool outofmemory;		/* Set when an allocation failed, the next safepoint of the run fails it */
+} Lnn_Memory;
+
+/**
+ * @brief Sets up the memory of a state.
+ * @param allocator Allocator to use, or NULL for one that uses malloc().
+ */
+void Lnn_InitMemory(Lnn_Memory* memory,
+					const Lnn_Allocator* allocator);
+
+/**
+ * @brief Gives the slabs of the pools back to the allocator, every block has to be freed before.
+ */
+void Lnn_FreeMemory(Lnn_Memory* memory);
+
+/**
+ * @brief Allocates a block of script memory. Never collects.
+ * @param state State the block is counted in.
+ * @param size Size in bytes, it has to be given to Lnn_Deallocate() too.
+ * @return The block, or NULL if the allocator has no memory left, the error is printed and the state flagged.
+ */
+void* Lnn_Allocate(struct Lnn_State* state,
+				   const size_t size);
+
+/**
+ * @brief Changes the size of a block of script memory, the contents are kept up to the smaller size.
+ * @param block Block from Lnn_Allocate(), or NULL to allocate a new one.
+ * @param oldsize Size the block has now, 0 if block is NULL.
+ * @return The block, or NULL like Lnn_Allocate(), the old block is left as it was then.
+ */
+void* Lnn_Reallocate(struct Lnn_State* state,
+					 void* block,
+					 const size_t oldsize,
+					 const size_t newsize);
+
+/**
+ * @brief Frees a block of script memory.
+ * @param block Block from Lnn_Allocate(), or NULL.
+ * @param size Size the block was allocated with.
+ */
+void Lnn_Deallocate(struct Lnn_State* state,
+					void* block,
+					const size_t size);
+
+/**
+ * @brief Limits how much script memory a state can have in use.
+ * @param limit The limit in bytes, or 0 to remove it.
+ */
+void Lnn_SetMemoryLimit(struct Lnn_State* state,
+						const size_t limit);
+
+/* Checks if a state has more script memory in use than its limit allows */
+#define Lnn_IsOverMemoryLimit(memory)	((memory)->limit && (memory)->livebytes > (memory)->limit)
+
+void Lnn_PrintMemoryStats(const struct Lnn_State* state);
+
+#endif
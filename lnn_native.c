@@ -0,0 +1,51 @@
+#include "lnn_native.h"
+#include "lnn_state.h"
+
+
+
+int Lnn_RegisterNative(Lnn_State* state, const char* name, const int numargs, Lnn_NativeFunction function)
+{
+	Utl_Assert(state && name && function);
+	if (numargs < 0)
+	{
+		printf("ERROR! Native %s can't take %i arguments\n", name, numargs);
+		return -1;
+	}
+
+	Lnn_Native* native = Utl_AllocType(Lnn_Native);
+	native->name = _strdup(name);
+	native->numargs = numargs;
+	native->function = function;
+	state->natives = Utl_Realloc(state->natives, sizeof(Lnn_Native*) * (state->numnatives + 1));
+	state->natives[state->numnatives++] = native;
+
+	const int slot = Lnn_GetGlobalSlot(state, name);
+	state->globals[slot].value = Lnn_NativeValue(native);
+	return slot;
+}
+
+void Lnn_DestroyNative(Lnn_Native* native)
+{
+	if (!native) return;
+	Utl_Free(native->name);
+	Utl_Free(native);
+}
+
+Utl_Bool Lnn_IsNativeGlobal(const Lnn_State* state, const char* name)
+{
+	const int slot = Lnn_FindGlobalSlot(state, name);
+	return slot >= 0 && state->globals[slot].value.type == Lnn_VT_NATIVE;
+}
+
+Utl_Bool Lnn_CallNative(Lnn_State* state, const Lnn_Native* native, const Lnn_Value* args, const int numargs, Lnn_Value* result)
+{
+	if (numargs != native->numargs)
+	{
+		printf("ERROR! %s takes %i arguments, not %i\n", native->name, native->numargs, numargs);
+		return Utl_FALSE;
+	}
+	state->gc.holdoff++;
+	const Utl_Bool ok = native->function(state, args, result);
+	state->gc.holdoff--;
+	return ok;
+}
@@ -0,0 +1,60 @@
+#ifndef _Lnn_NATIVE_H_
+#define _Lnn_NATIVE_H_
+
+#include "fab_utility.h"
+#include "lnn_value.h"
+#include "lnn_builtin.h"
+
+struct Lnn_State;
+
+/**
+ * Natives are C functions the host binds to globals of a state before parsing scripts that use them.
+ * A script calls one like any other function, the global is found at compile time and the tiers
+ * pass the arguments as a pointer to where they already are, on the vm stack for the bytecode vm.
+ * Nothing is collected while a native runs, so it can keep the values it gets in C.
+ */
+
+/* Same as a builtin, args has as many values as the native takes */
+typedef Lnn_BuiltinFunction Lnn_NativeFunction;
+
+typedef struct Lnn_Native
+{
+	char* name;
+	int numargs;
+	Lnn_NativeFunction function;
+} Lnn_Native;
+
+/**
+ * @brief Binds a native function to a global, replacing what the global had.
+ * @param state State the native is registered in, it owns the native.
+ * @param name Name of the global scripts call it by.
+ * @param numargs Number of arguments it always takes.
+ * @param function The function.
+ * @return Slot of the global, or -1 if numargs is negative.
+ */
+int Lnn_RegisterNative(struct Lnn_State* state,
+					   const char* name,
+					   const int numargs,
+					   Lnn_NativeFunction function);
+
+void Lnn_DestroyNative(Lnn_Native* native);
+
+/**
+ * @brief Checks if a global of a state is a registered native.
+ */
+Utl_Bool Lnn_IsNativeGlobal(const struct Lnn_State* state,
+							const char* name);
+
+/**
+ * @brief Calls a native after checking how many arguments it got, collections are held off while it runs.
+ * @param args Pointer to the arguments, they aren't copied.
+ * @param result Where the return value is put, it may point to an argument.
+ * @return Utl_FALSE if the arguments don't match or the native failed, the error is printed.
+ */
+Utl_Bool Lnn_CallNative(struct Lnn_State* state,
+						const Lnn_Native* native,
+						const Lnn_Value* args,
+						const int numargs,
+						Lnn_Value* result);
+
+#endif
@@ -0,0 +1,187 @@
+#include "lnn_object.h"
+#include "lnn_state.h"
+#include "lnn_gc.h"
+#include "lnn_array.h"
+#include "lnn_string.h"
+
+
+
+Lnn_Shape* Lnn_CreateEmptyShape(void)
+{
+	return Utl_AllocType(Lnn_Shape);
+}
+
+void Lnn_DestroyShapeTree(Lnn_Shape* shape)
+{
+	if (!shape) return;
+	for (int i = 0; i < shape->numtransitions; i++)
+		Lnn_DestroyShapeTree(shape->transitions[i]);
+	Utl_Free(shape->transitions);
+	Utl_Free(shape->name);
+	Utl_Free(shape);
+}
+
+int Lnn_FindShapeSlot(const Lnn_Shape* shape, const char* name)
+{
+	Utl_Assert(shape && name);
+	for (; shape->parent; shape = shape->parent)
+		if (strcmp(shape->name, name) == 0)
+			return shape->numslots - 1;
+	return -1;
+}
+
+Lnn_Shape* Lnn_AddShapeMember(Lnn_Shape* shape, const char* name)
+{
+	Utl_Assert(shape && name);
+	for (int i = 0; i < shape->numtransitions; i++)
+		if (strcmp(shape->transitions[i]->name, name) == 0)
+			return shape->transitions[i];
+
+	Lnn_Shape* child = Utl_AllocType(Lnn_Shape);
+	child->parent = shape;
+	child->name = _strdup(name);
+	child->numslots = shape->numslots + 1;
+	if (shape->numtransitions >= shape->captransitions)
+	{
+		shape->captransitions = shape->captransitions ? shape->captransitions * 2 : 4;
+		shape->transitions = Utl_Realloc(shape->transitions, sizeof(Lnn_Shape*) * shape->captransitions);
+	}
+	shape->transitions[shape->numtransitions++] = child;
+	return child;
+}
+
+Lnn_Instance* Lnn_NewInstance(Lnn_State* state, const int capacity)
+{
+	Utl_Assert(state && capacity >= 0);
+	Lnn_Instance* instance = (Lnn_Instance*)Lnn_GCAllocate(state, sizeof(Lnn_Instance), Lnn_VT_OBJECT);
+	if (!instance) return NULL;
+	instance->shape = state->emptyshape;
+	instance->capslots = capacity;
+	instance->slots = capacity ? Lnn_Allocate(state, sizeof(Lnn_Value) * capacity) : NULL;
+	/* The collector is left an object without members */
+	if (capacity && !instance->slots)
+	{
+		instance->capslots = 0;
+		return NULL;
+	}
+	return instance;
+}
+
+
+
+static void add_cache_entry(Lnn_MemberCache* cache, Lnn_Shape* shape, Lnn_Shape* newshape, const int slot)
+{
+	if (!cache || cache->numentries >= Lnn_MEMBER_CACHE_SIZE) return;
+	cache->shapes[cache->numentries] = shape;
+	cache->newshapes[cache->numentries] = newshape;
+	cache->slots[cache->numentries] = slot;
+	cache->numentries++;
+}
+
+Utl_Bool Lnn_GetMember(Lnn_State* state,
+					   Lnn_MemberCache* cache,
+					   const char* name,
+					   const Lnn_Value object,
+					   Lnn_Value* result)
+{
+	/* Reading doesn't allocate, the state is only taken to match Lnn_SetMember() */
+	(void)state;
+	Utl_Assert(state && name && result);
+	if (object.type == Lnn_VT_ARRAY && strcmp(name, "length") == 0)
+	{
+		*result = Lnn_IntValue(object.u.array->length);
+		return Utl_TRUE;
+	}
+	if (Lnn_IsString(object) && strcmp(name, "length") == 0)
+	{
+		*result = Lnn_IntValue(Lnn_StringLength(object));
+		return Utl_TRUE;
+	}
+	if (object.type != Lnn_VT_OBJECT)
+	{
+		printf("ERROR! Can't get member '%s' of %s\n", name, lnn_valuetype_names[object.type]);
+		return Utl_FALSE;
+	}
+
+	Lnn_Instance* instance = object.u.instance;
+	const int slot = Lnn_FindShapeSlot(instance->shape, name);
+	if (slot < 0)
+	{
+		*result = Lnn_NullValue();
+		return Utl_TRUE;
+	}
+	add_cache_entry(cache, instance->shape, instance->shape, slot);
+	*result = instance->slots[slot];
+	return Utl_TRUE;
+}
+
+Utl_Bool Lnn_SetMember(Lnn_State* state,
+					   Lnn_MemberCache* cache,
+					   const char* name,
+					   const Lnn_Value object,
+					   const Lnn_Value value)
+{
+	Utl_Assert(state && name);
+	if (object.type != Lnn_VT_OBJECT)
+	{
+		printf("ERROR! Can't set member '%s' of %s\n", name, lnn_valuetype_names[object.type]);
+		return Utl_FALSE;
+	}
+
+	Lnn_Instance* instance = object.u.instance;
+	Lnn_Shape* shape = instance->shape;
+	int slot = Lnn_FindShapeSlot(shape, name);
+	if (slot < 0)
+	{
+		Lnn_Shape* newshape = Lnn_AddShapeMember(shape, name);
+		slot = shape->numslots;
+		if (newshape->numslots > instance->capslots)
+		{
+			const int capacity = instance->capslots ? instance->capslots * 2 : 4;
+			Lnn_Value* slots = Lnn_Reallocate(state, instance->slots,
+											  sizeof(Lnn_Value) * instance->capslots,
+											  sizeof(Lnn_Value) * capacity);
+			if (!slots) return Utl_FALSE;
+			instance->slots = slots;
+			instance->capslots = capacity;
+		}
+		instance->shape = newshape;
+		add_cache_entry(cache, shape, newshape, slot);
+	} else
+		add_cache_entry(cache, shape, shape, slot);
+
+	instance->slots[slot] = value;
+	Lnn_GCWriteBarrier(state, &instance->obj, value);
+	return Utl_TRUE;
+}
+
+
+
+void Lnn_PrintInstance(const Lnn_Instance* instance, const int depth)
+{
+	const int numslots = instance->shape->numslots;
+	if (depth > 2 && numslots > 0)
+	{
+		printf("{...}");
+		return;
+	}
+
+	/* The shape tree has the names from the last member to the first */
+	const char** names = Utl_Malloc(sizeof(char*) * (numslots + 1));
+	for (const Lnn_Shape* shape = instance->shape; shape->parent; shape = shape->parent)
+		names[shape->numslots - 1] = shape->name;
+
+	putchar('{');
+	for (int i = 0; i < numslots; i++)
+	{
+		printf(i ? ", %s = " : "%s = ", names[i]);
+		if (instance->slots[i].type == Lnn_VT_OBJECT)
+			Lnn_PrintInstance(instance->slots[i].u.instance, depth + 1);
+		else if (instance->slots[i].type == Lnn_VT_ARRAY)
+			Lnn_PrintArray(instance->slots[i].u.array, depth + 1);
+		else
+			Lnn_PrintValue(instance->slots[i]);
+	}
+	putchar('}');
+	Utl_Free(names);
+}
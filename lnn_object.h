@@ -0,0 +1,115 @@
+#ifndef _Lnn_OBJECT_H_
+#define _Lnn_OBJECT_H_
+
+#include "fab_utility.h"
+#include "lnn_value.h"
+
+struct Lnn_State;
+
+/**
+ * Objects don't store the names of their members. Every object points to a shape that maps
+ * member names to slots, and objects that got the same members in the same order share a shape.
+ * Adding a member moves the object along a transition to the shape with that member added,
+ * so shapes form a tree with the empty shape of the state at its root.
+ */
+typedef struct Lnn_Shape
+{
+	struct Lnn_Shape* parent;		/* Shape without the last member, NULL for the empty shape */
+	char* name;						/* Name of the last member */
+	int numslots;					/* Number of members, the last one is in slot numslots - 1 */
+
+	struct Lnn_Shape** transitions;	/* Shapes with one more member than this one */
+	int numtransitions;
+	int captransitions;
+} Lnn_Shape;
+
+typedef struct Lnn_Instance
+{
+	Lnn_Object obj;
+	Lnn_Shape* shape;
+	Lnn_Value* slots;
+	int capslots;
+} Lnn_Instance;
+
+Lnn_Shape* Lnn_CreateEmptyShape(void);
+
+/**
+ * @brief Destroys a shape and every shape that can be transitioned to from it.
+ */
+void Lnn_DestroyShapeTree(Lnn_Shape* shape);
+
+/**
+ * @brief Finds the slot of a member by walking up the shape tree.
+ * @return The slot, or -1 if the shape doesn't have the member.
+ */
+int Lnn_FindShapeSlot(const Lnn_Shape* shape,
+					  const char* name);
+
+/**
+ * @brief Gets the shape with one more member, creating the transition if it doesn't exist.
+ * @param shape Shape to transition from, it must not already have the member.
+ * @param name Name of the new member.
+ */
+Lnn_Shape* Lnn_AddShapeMember(Lnn_Shape* shape,
+							  const char* name);
+
+/**
+ * @brief Creates an object with no members, owned by a state.
+ * @param state State that owns the object.
+ * @param capacity How many members to make room for right away.
+ * @return The object, or NULL if there is no memory left, the error is printed.
+ */
+Lnn_Instance* Lnn_NewInstance(struct Lnn_State* state,
+							  const int capacity);
+
+
+
+/* How many shapes an inline cache remembers before the site is treated as megamorphic */
+#define Lnn_MEMBER_CACHE_SIZE 4
+
+/**
+ * @brief Inline cache of one member access in the code.
+ * Sites that only ever see one shape are monomorphic and hit the first entry,
+ * up to Lnn_MEMBER_CACHE_SIZE shapes are polymorphic. Shapes seen after that aren't cached.
+ */
+typedef struct Lnn_MemberCache
+{
+	char* name;
+	int numentries;
+	Lnn_Shape* shapes[Lnn_MEMBER_CACHE_SIZE];		/* Shape the object had */
+	Lnn_Shape* newshapes[Lnn_MEMBER_CACHE_SIZE];	/* Shape after setting, another one if the member was added */
+	int slots[Lnn_MEMBER_CACHE_SIZE];
+} Lnn_MemberCache;
+
+/**
+ * @brief Gets a member of an object, looking it up in the shape and filling in the cache.
+ * This is the slow path, callers check the cache first.
+ * @param state State the object belongs to.
+ * @param cache Cache of the access, or NULL to just look the member up.
+ * @param name Name of the member.
+ * @param object Value to get the member of.
+ * Arrays and strings have the member length, which is the number of elements or characters in them.
+ * @param result Where the member is put, null if the object doesn't have it.
+ * @return Utl_FALSE if the value isn't an object, the error is printed.
+ */
+Utl_Bool Lnn_GetMember(struct Lnn_State* state,
+					   Lnn_MemberCache* cache,
+					   const char* name,
+					   const Lnn_Value object,
+					   Lnn_Value* result);
+
+/**
+ * @brief Sets a member of an object, adding it if the object doesn't have it.
+ * This is the slow path, callers check the cache first.
+ * @return Utl_FALSE if the value isn't an object or there is no memory left for the member, the error is printed.
+ */
+Utl_Bool Lnn_SetMember(struct Lnn_State* state,
+					   Lnn_MemberCache* cache,
+					   const char* name,
+					   const Lnn_Value object,
+					   const Lnn_Value value);
+
+void Lnn_PrintInstance(const Lnn_Instance* instance,
+					   const int depth);
+
+#endif
@@ -1,4 +1,6 @@
+#include <errno.h>
 #include "lnn_parse.h"
+#include "lnn_resolve.h"
 
 
 
@@ -15,6 +17,214 @@ static Lnn_CodeBlock* parse_codeblock(Lnn_State* state,
 
 
 
+/* Goes one nesting level deeper, or prints an error if the code is nested too deep */
+static Utl_Bool enter_nesting(Lnn_State* state)
+{
+	if (state->parsedepth >= state->maxparsedepth)
+	{
+		if (!state->parsetoodeep)
+			printf("ERROR! Code is nested deeper than %i levels\n", state->maxparsedepth);
+		state->parsetoodeep = Utl_TRUE;
+		return Utl_FALSE;
+	}
+	state->parsedepth++;
+	return Utl_TRUE;
+}
+
+#define leave_nesting(state) ((state)->parsedepth--)
+
+
+
+/**
+ * @brief Parses an object literal like { x = 1, y = 2 }.
+ * @param begin The '{' token.
+ * @param end Is set to the '}' token.
+ */
+static Lnn_ExprNode* parse_object_literal(Lnn_State* state,
+										  const Lnn_Token* begin,
+										  const Lnn_Token** end)
+{
+	Lnn_ExprNode* node = Utl_AllocType(Lnn_ExprNode);
+	node->type = Lnn_ET_OBJECT;
+
+	const Lnn_Token* i = begin->links.next;
+	while (i && i->separatorid != Lnn_SP_RBRACE)
+	{
+		Lnn_ExprNode* field = parse_expression(state, i, &i, Utl_FALSE);
+		if (!field) goto on_fail;
+		if (field->type != Lnn_ET_OPERATOR || field->u.op.id != Lnn_OP_ASSIGN || field->u.op.left->type != Lnn_ET_VARIABLE)
+		{
+			printf("ERROR! Object fields have to be written as name = value\n");
+			Lnn_DestroyExpression(field);
+			goto on_fail;
+		}
+
+		/* Take the name and the value out of the assignment */
+		const int index = node->u.object.numfields++;
+		node->u.object.names = Utl_Realloc(node->u.object.names, sizeof(char*) * node->u.object.numfields);
+		node->u.object.values = Utl_Realloc(node->u.object.values, sizeof(Lnn_ExprNode*) * node->u.object.numfields);
+		node->u.object.names[index] = field->u.op.left->u.variable.name;
+		node->u.object.values[index] = field->u.op.right;
+		field->u.op.right->parent = node;
+		field->u.op.left->u.variable.name = NULL;
+		field->u.op.right = NULL;
+		Lnn_DestroyExpression(field);
+
+		if (i && i->separatorid == Lnn_SP_COMMA)
+			i = i->links.next;
+		else if (!i || i->separatorid != Lnn_SP_RBRACE)
+			break;
+	}
+	if (!i || i->separatorid != Lnn_SP_RBRACE)
+		{ printf("ERROR! Missing '}'\n"); goto on_fail; }
+	*end = i;
+	return node;
+
+on_fail:
+	*end = i;
+	Lnn_DestroyExpression(node);
+	return NULL;
+}
+
+/**
+ * @brief Parses a list of expressions separated by commas, like the elements of an array literal.
+ * @param node Node that gets the expressions as children.
+ * @param begin The token that opens the list.
+ * @param end Is set to the token that closes the list.
+ * @param closer Separator that closes the list.
+ * @param exprs Array of expressions that is grown for every expression.
+ * @param count Number of expressions in the array.
+ * @return Utl_FALSE if an expression was invalid or the list wasn't closed, the error is printed.
+ */
+static Utl_Bool parse_expression_list(Lnn_State* state,
+									  Lnn_ExprNode* node,
+									  const Lnn_Token* begin,
+									  const Lnn_Token** end,
+									  const Lnn_SeparatorID closer,
+									  Lnn_ExprNode*** exprs,
+									  int* count)
+{
+	const Lnn_Token* i = begin->links.next;
+	while (i && i->separatorid != closer)
+	{
+		Lnn_ExprNode* expr = parse_expression(state, i, &i, Utl_FALSE);
+		if (!expr && state->parsetoodeep) { *end = NULL; return Utl_FALSE; }
+		if (!expr) break;
+
+		*exprs = Utl_Realloc(*exprs, sizeof(Lnn_ExprNode*) * (*count + 1));
+		(*exprs)[(*count)++] = expr;
+		expr->parent = node;
+
+		if (i && i->separatorid == Lnn_SP_COMMA)
+			i = i->links.next;
+		else if (!i || i->separatorid != closer)
+			break;
+	}
+	*end = i;
+	if (!i || i->separatorid != closer)
+	{
+		printf("ERROR! Missing '%c'\n", closer == Lnn_SP_RPAREN ? ')' : ']');
+		return Utl_FALSE;
+	}
+	return Utl_TRUE;
+}
+
+/**
+ * @brief Parses an array literal like [1, 2, 3].
+ * @param begin The '[' token.
+ * @param end Is set to the ']' token.
+ */
+static Lnn_ExprNode* parse_array_literal(Lnn_State* state,
+										 const Lnn_Token* begin,
+										 const Lnn_Token** end)
+{
+	Lnn_ExprNode* node = Utl_AllocType(Lnn_ExprNode);
+	node->type = Lnn_ET_ARRAY;
+	if (!parse_expression_list(state, node, begin, end, Lnn_SP_RBRACKET, &node->u.array.elements, &node->u.array.numelements))
+	{
+		Lnn_DestroyExpression(node);
+		return NULL;
+	}
+	return node;
+}
+
+/**
+ * @brief Parses a function call like f(a, b).
+ * @param begin The name of the function.
+ * @param end Is set to the token after the ')'.
+ */
+static Lnn_ExprNode* parse_function_call(Lnn_State* state,
+										 const Lnn_Token* begin,
+										 const Lnn_Token** end)
+{
+	Lnn_ExprNode* node = Utl_AllocType(Lnn_ExprNode);
+	node->type = Lnn_ET_FUNCTIONCALL;
+	node->u.functioncall.callee.name = _strdup(begin->string);
+	if (!parse_expression_list(state, node, begin->links.next, end, Lnn_SP_RPAREN,
+							   &node->u.functioncall.args, &node->u.functioncall.numargs))
+	{
+		Lnn_DestroyExpression(node);
+		return NULL;
+	}
+	*end = (*end)->links.next;
+	return node;
+}
+
+/**
+ * @brief Parses a function literal like function(a, b) return a + b end.
+ * @param begin The 'function' keyword.
+ * @param end Is set to the token after the 'end'.
+ * @param name Name the function is declared with, or NULL. The string is copied.
+ */
+static Lnn_ExprNode* parse_function_literal(Lnn_State* state,
+											const Lnn_Token* begin,
+											const Lnn_Token** end,
+											const char* name)
+{
+	Lnn_ExprNode* node = Utl_AllocType(Lnn_ExprNode);
+	node->type = Lnn_ET_CLOSURE;
+	Lnn_Function* function = Utl_AllocType(Lnn_Function);
+	node->u.closure = function;
+	if (name) function->name = _strdup(name);
+
+	const Lnn_Token* i = begin->links.next;
+	if (name && i) i = i->links.next;
+	if (!i || i->separatorid != Lnn_SP_LPAREN)
+		{ printf("ERROR! Function is missing its parameter list\n"); goto on_fail; }
+
+	/* The parameters are the first locals */
+	i = i->links.next;
+	while (i && i->type == Lnn_TT_IDENTIFIER)
+	{
+		function->locals = Utl_Realloc(function->locals, sizeof(char*) * (function->numparams + 1));
+		function->locals[function->numparams++] = _strdup(i->string);
+		function->numlocals = function->numparams;
+		i = i->links.next;
+		if (i && i->separatorid == Lnn_SP_COMMA)
+			i = i->links.next;
+		else
+			break;
+	}
+	if (!i || i->separatorid != Lnn_SP_RPAREN)
+		{ printf("ERROR! Function parameters have to be names separated by ','\n"); goto on_fail; }
+
+	i = i->links.next;
+	if (!i)
+		{ printf("ERROR! Function doesn't have an end\n"); goto on_fail; }
+	function->block = parse_codeblock(state, i, &i);
+	if (!function->block) goto on_fail;
+	if (!i || i->keywordid != Lnn_KW_END)
+		{ printf("ERROR! Function doesn't have an end\n"); goto on_fail; }
+
+	*end = i->links.next;
+	return node;
+
+on_fail:
+	*end = i;
+	Lnn_DestroyExpression(node);
+	return NULL;
+}
+
 static Lnn_ExprNode* parse_expression_separator(Lnn_State* state,
 												const Lnn_Token* begin,
 												const Lnn_Token** end)
@@ -31,19 +241,18 @@ static Lnn_ExprNode* parse_expression_separator(Lnn_State* state,
 
 	if (begin->separatorid == Lnn_SP_LPAREN)
 	{
-		node = parse_expression(state, begin->links.next, &endtoken, Lnn_KW_FALSE);
+		node = parse_expression(state, begin->links.next, &endtoken, Utl_FALSE);
+		if (!node) goto on_fail; /* The error is printed already */
 		if (!endtoken || endtoken->separatorid != Lnn_SP_RPAREN)
 			{ printf("ERROR! Missing ')'\n"); goto on_fail; }
 	} else if (begin->separatorid == Lnn_SP_LBRACKET)
 	{
-		node = parse_expression(state, begin->links.next, &endtoken, Lnn_KW_FALSE);
-		if (!endtoken || endtoken->separatorid != Lnn_SP_RBRACKET)
-			{ printf("ERROR! Missing ']'\n"); goto on_fail; }
+		node = parse_array_literal(state, begin, &endtoken);
+		if (!node) goto on_fail;
 	} else if (begin->separatorid == Lnn_SP_LBRACE)
 	{
-		node = parse_expression(state, begin->links.next, &endtoken, Lnn_KW_FALSE);
-		if (!endtoken || endtoken->separatorid != Lnn_SP_RBRACE)
-			{ printf("ERROR! Missing ']'\n"); goto on_fail; }
+		node = parse_object_literal(state, begin, &endtoken);
+		if (!node) goto on_fail;
 	} else
 	{
 		/* Invalid separator to start an expression */
@@ -54,32 +263,25 @@ static Lnn_ExprNode* parse_expression_separator(Lnn_State* state,
 	return node;
 
 on_fail:
+	Lnn_DestroyExpression(node);
 	*end = endtoken ? endtoken : begin->links.next;
 	return NULL;
 }
 
-typedef struct
-{
-	Utl_ListLinks links;
-	Lnn_ExprNode* exprnode;
-} list_exprnode;
-
-static list_exprnode* parse_operator(Lnn_State* state,
-									 const Lnn_Token* token)
+static Lnn_ExprNode* parse_operator(Lnn_State* state,
+									const Lnn_Token* token)
 {
 	Utl_Assert(state);
 	Utl_Assert(token);
 	Utl_Assert(token->type == Lnn_TT_OPERATOR);
 
-	list_exprnode* node = Utl_AllocType(list_exprnode);
 	Lnn_ExprNode* exprnode = Utl_AllocType(Lnn_ExprNode);
 	exprnode->type = Lnn_ET_OPERATOR;
 	exprnode->u.op.id = token->operatorid;
-	node->exprnode = exprnode;
-	return node;
+	return exprnode;
 }
 
-static list_exprnode* parse_operand(Lnn_State* state,
+static Lnn_ExprNode* parse_operand(Lnn_State* state,
 									const Lnn_Token* begin,
 									const Lnn_Token** end)
 {
@@ -88,37 +290,147 @@ static list_exprnode* parse_operand(Lnn_State* state,
 	Utl_Assert(end);
 
 	*end = begin->links.next;
-	Lnn_ExprNode* exprnode = Utl_AllocType(Lnn_ExprNode);
+	Lnn_ExprNode* exprnode = NULL;
 	switch (begin->type)
 	{
 	case Lnn_TT_IDENTIFIER:
+		/* A name followed by '(' on the same line is a function call */
+		if (!begin->lastonline && begin->links.next &&
+			((const Lnn_Token*)begin->links.next)->type == Lnn_TT_SEPARATOR &&
+			((const Lnn_Token*)begin->links.next)->separatorid == Lnn_SP_LPAREN)
+		{
+			exprnode = parse_function_call(state, begin, end);
+			if (!exprnode) goto on_fail;
+			break;
+		}
+		exprnode = Utl_AllocType(Lnn_ExprNode);
 		exprnode->type = Lnn_ET_VARIABLE;
-		exprnode->u.variable = _strdup(begin->string);
+		exprnode->u.variable.name = _strdup(begin->string);
 		break;
 
 	case Lnn_TT_NUMBERLITERAL:
-		exprnode->type = Lnn_ET_NUMBERLITERAL;
-		exprnode->u.number = Utl_StringToFloat(begin->string, NULL);
+	{
+		/* Numbers without a decimal point are ints if they fit */
+		exprnode = Utl_AllocType(Lnn_ExprNode);
+		errno = 0;
+		const long long integer = strtoll(begin->string, NULL, 10);
+		if (!strchr(begin->string, '.') && errno != ERANGE && integer >= Utl_INT_MIN && integer <= Utl_INT_MAX)
+		{
+			exprnode->type = Lnn_ET_INTLITERAL;
+			exprnode->u.integer = (Utl_Int)integer;
+		} else
+		{
+			exprnode->type = Lnn_ET_NUMBERLITERAL;
+			exprnode->u.number = Utl_StringToFloat(begin->string, NULL);
+		}
+		break;
+	}
+
+	case Lnn_TT_STRINGLITERAL:
+		exprnode = Utl_AllocType(Lnn_ExprNode);
+		exprnode->type = Lnn_ET_STRINGLITERAL;
+		exprnode->u.str.chars = _strdup(begin->string);
+		exprnode->u.str.len = (int)strlen(begin->string);
+		break;
+
+	case Lnn_TT_KEYWORD:
+		if (begin->keywordid == Lnn_KW_FUNCTION)
+		{
+			exprnode = parse_function_literal(state, begin, end, NULL);
+			if (!exprnode) goto on_fail;
+			break;
+		}
+		if (begin->keywordid != Lnn_KW_TRUE && begin->keywordid != Lnn_KW_FALSE)
+		{
+			printf("ERROR! Unexpected keyword %s in expression\n", lnn_keywordid_names[begin->keywordid]);
+			goto on_fail;
+		}
+		exprnode = Utl_AllocType(Lnn_ExprNode);
+		exprnode->type = Lnn_ET_BOOLLITERAL;
+		exprnode->u.boolean = begin->keywordid == Lnn_KW_TRUE;
 		break;
 
 	case Lnn_TT_SEPARATOR:
 		exprnode = parse_expression_separator(state, begin, end);
+		if (!exprnode) goto on_fail;
 		break;
 
 	default:
 		printf("ERROR! Invalid operand type\n");
-		break;
+		goto on_fail;
 	}
 
-	list_exprnode* node = Utl_AllocType(list_exprnode);
-	node->exprnode = exprnode;
-	return node;
+	return exprnode;
 
 on_fail:
 	Lnn_DestroyExpression(exprnode);
 	return NULL;
 }
 
+/* Destroys the expressions in a vector of Lnn_ExprNode* and frees it */
+static void clear_exprnode_vector(Utl_Vector* vector)
+{
+	for (int i = 0; i < vector->count; i++)
+		Lnn_DestroyExpression(Utl_VectorAt(vector, Lnn_ExprNode*, i));
+	Utl_FreeVector(vector);
+}
+
+#define push_exprnode(vector, exprnode)	(*(Lnn_ExprNode**)Utl_PushVector(vector, NULL) = (exprnode))
+#define pop_exprnode(vector)			(*(Lnn_ExprNode**)Utl_PopVector(vector))
+#define top_exprnode(vector)			Utl_VectorBack(vector, Lnn_ExprNode*)
+
+/**
+ * @brief Builds an expression tree from nodes in postfix order.
+ * Operator nodes take their operands from the nodes before them, unary operators only take a right operand.
+ * Operators that already have operands come from parentheses and are treated as operands.
+ * @param postfix Vector of Lnn_ExprNode* in postfix order. It is freed.
+ * @return The root of the tree, or NULL if the operands didn't match up with the operators.
+ */
+static Lnn_ExprNode* build_expression_tree(Utl_Vector* postfix)
+{
+	Utl_Vector operands; /* Vector of Lnn_ExprNode* */
+	Utl_InitVector(&operands, sizeof(Lnn_ExprNode*));
+	int next = 0;
+	while (next < postfix->count)
+	{
+		Lnn_ExprNode* exprnode = Utl_VectorAt(postfix, Lnn_ExprNode*, next);
+		Utl_VectorAt(postfix, Lnn_ExprNode*, next++) = NULL; /* Owned by the operands or the tree now */
+		if (exprnode->type == Lnn_ET_OPERATOR && !exprnode->u.op.right)
+		{
+			const int numoperands = Lnn_IsUnaryOp(exprnode->u.op.id) ? 1 : 2;
+			if (operands.count < numoperands)
+			{
+				printf("ERROR! Operator %s is missing an operand\n", lnn_operatorid_names[exprnode->u.op.id]);
+				Lnn_DestroyExpression(exprnode);
+				goto on_fail;
+			}
+			exprnode->u.op.right = pop_exprnode(&operands);
+			exprnode->u.op.right->parent = exprnode;
+			if (numoperands == 2)
+			{
+				exprnode->u.op.left = pop_exprnode(&operands);
+				exprnode->u.op.left->parent = exprnode;
+			}
+		}
+		push_exprnode(&operands, exprnode);
+	}
+
+	if (operands.count != 1)
+	{
+		printf("ERROR! Expression has %i operands without an operator between them\n", operands.count);
+		goto on_fail;
+	}
+	Lnn_ExprNode* tree = pop_exprnode(&operands);
+	Utl_FreeVector(&operands);
+	Utl_FreeVector(postfix);
+	return tree;
+
+on_fail:
+	clear_exprnode_vector(postfix);
+	clear_exprnode_vector(&operands);
+	return NULL;
+}
+
 static Lnn_ExprNode* parse_expression(Lnn_State* state,
 									  const Lnn_Token* begin,
 									  const Lnn_Token** end,
@@ -127,9 +439,16 @@ static Lnn_ExprNode* parse_expression(Lnn_State* state,
 	Utl_Assert(state);
 	Utl_Assert(begin);
 	Utl_Assert(end);
+	if (!enter_nesting(state))
+	{
+		*end = NULL;
+		return NULL;
+	}
 
-	Utl_List stack = { 0 };
-	Utl_List tokens_postfix = { 0 }; /* List of list_exprnode */
+	Utl_Vector stack; /* Vector of Lnn_ExprNode*, the operators */
+	Utl_Vector tokens_postfix; /* Vector of Lnn_ExprNode* */
+	Utl_InitVector(&stack, sizeof(Lnn_ExprNode*));
+	Utl_InitVector(&tokens_postfix, sizeof(Lnn_ExprNode*));
 
 	Utl_Bool prev_was_operand = Utl_FALSE;
 	const Lnn_Token* i = begin;
@@ -137,30 +456,60 @@ static Lnn_ExprNode* parse_expression(Lnn_State* state,
 	{
 		if (i->type == Lnn_TT_OPERATOR)
 		{
-			list_exprnode* node = parse_operator(state, i);
+			Lnn_ExprNode* node = parse_operator(state, i);
 			if (!node) goto on_fail;
+
+			/* A '-' that doesn't follow an operand is a unary negative */
+			if (!prev_was_operand && node->u.op.id == Lnn_OP_SUB)
+				node->u.op.id = Lnn_OP_NEGATIVE;
+			const Lnn_OperatorID op = node->u.op.id;
 			
 		repeat:
-			if (stack.count > 0 &&
-				Lnn_OpPrecedence(node->exprnode->u.op.id) <= Lnn_OpPrecedence(((list_exprnode*)stack.end)->exprnode->u.op.id))
+			/* Unary operators apply to what comes after them so they can't pop anything,
+			 * and assignments are right associative so they only pop higher precedence. */
+			if (stack.count > 0 && !Lnn_IsUnaryOp(op) &&
+				(Lnn_OpPrecedence(op) < Lnn_OpPrecedence(top_exprnode(&stack)->u.op.id) ||
+				 (!Lnn_IsAssignmentOp(op) && Lnn_OpPrecedence(op) == Lnn_OpPrecedence(top_exprnode(&stack)->u.op.id))))
 			{
 				/* If stack is not empty and the current operator has less or equal precedence to that on the stack */
-				list_exprnode* stacktop = (list_exprnode*)Utl_PopBackList(&stack);
-				Utl_PushBackList(&tokens_postfix, stacktop);
+				push_exprnode(&tokens_postfix, pop_exprnode(&stack));
 				goto repeat;
 			}
 
-			Utl_PushBackList(&stack, node);
+			push_exprnode(&stack, node);
 			i = i->links.next;
 			prev_was_operand = Utl_FALSE;
+		} else if (prev_was_operand && i->type == Lnn_TT_SEPARATOR && i->separatorid == Lnn_SP_LBRACKET)
+		{
+			/* A '[' after an operand indexes it. The operand is complete once the ']' is read,
+			 * so the index and the operator go straight to the output after the member accesses before it. */
+			while (stack.count > 0 &&
+				   Lnn_OpPrecedence(top_exprnode(&stack)->u.op.id) >= Lnn_OpPrecedence(Lnn_OP_ARRAYACCESS))
+				push_exprnode(&tokens_postfix, pop_exprnode(&stack));
+
+			if (!i->links.next) { printf("ERROR! Missing ']'\n"); goto on_fail; }
+			Lnn_ExprNode* index = parse_expression(state, i->links.next, &i, Utl_FALSE);
+			if (!index) goto on_fail;
+			push_exprnode(&tokens_postfix, index);
+			if (!i || i->separatorid != Lnn_SP_RBRACKET)
+				{ printf("ERROR! Missing ']'\n"); goto on_fail; }
+
+			Lnn_ExprNode* access = Utl_AllocType(Lnn_ExprNode);
+			access->type = Lnn_ET_OPERATOR;
+			access->u.op.id = Lnn_OP_ARRAYACCESS;
+			push_exprnode(&tokens_postfix, access);
+
+			const Utl_Bool lastonline = i->lastonline;
+			i = i->links.next;
+			if (readendline && lastonline) goto expr_end;
 		} else
 		{
 			if (prev_was_operand) goto expr_end;
 
 			/* Consider token operand*/
-			list_exprnode* node = parse_operand(state, i, &i);
+			Lnn_ExprNode* node = parse_operand(state, i, &i);
 			if (!node) goto on_fail;
-			Utl_PushBackList(&tokens_postfix, node);
+			push_exprnode(&tokens_postfix, node);
 
 			if (readendline && i && i->lastonline) goto expr_end;
 			prev_was_operand = Utl_TRUE;
@@ -172,24 +521,23 @@ expr_end:
 
 	/* Move everything on the stack onto the postfix output */
 	while (stack.count > 0)
-	{
-		list_exprnode* stacktop = (list_exprnode*)Utl_PopBackList(&stack);
-		Utl_PushBackList(&tokens_postfix, stacktop);
-	}
+		push_exprnode(&tokens_postfix, pop_exprnode(&stack));
+	Utl_FreeVector(&stack);
 
-	list_exprnode* iter = tokens_postfix.begin;
-	while (iter)
+	for (int n = 0; n < tokens_postfix.count; n++)
 	{
-		Lnn_PrintExprNode(iter->exprnode); putchar(' ');
-		iter = iter->links.next;
+		Lnn_PrintExprNode(Utl_VectorAt(&tokens_postfix, Lnn_ExprNode*, n)); putchar(' ');
 	}
 	putchar('\n');
 
-	Lnn_ExprNode* node = Utl_AllocType(Lnn_ExprNode);
-	return node;
+	leave_nesting(state);
+	return build_expression_tree(&tokens_postfix);
 
 on_fail:
-
+	*end = i;
+	leave_nesting(state);
+	clear_exprnode_vector(&stack);
+	clear_exprnode_vector(&tokens_postfix);
 	return NULL;
 }
 
@@ -203,7 +551,13 @@ static Lnn_Statement* parse_expression_statement(Lnn_State* state,
 	Utl_Assert(begin);
 	Utl_Assert(end);
 
-	return parse_expression(state, begin, end, Utl_TRUE);
+	Lnn_ExprNode* expression = parse_expression(state, begin, end, Utl_TRUE);
+	if (!expression) return NULL;
+
+	Lnn_Statement* stmt = Utl_AllocType(Lnn_Statement);
+	stmt->type = Lnn_ST_EXPRESSION;
+	stmt->u.stmt_expr.expression = expression;
+	return stmt;
 }
 
 
@@ -265,6 +619,109 @@ on_fail:
 
 
 
+static Lnn_Statement* parse_while_statement(Lnn_State* state,
+											const Lnn_Token* begin,
+											const Lnn_Token** end)
+{
+	Utl_Assert(state);
+	Utl_Assert(begin);
+	Utl_Assert(end);
+
+	Lnn_ExprNode* condition = NULL;
+	Lnn_CodeBlock* block = NULL;
+
+	const Lnn_Token* i = (const Lnn_Token*)begin->links.next;
+	if (!i)
+		{ printf("ERROR! While statement doesn't have an end\n"); return NULL; }
+	condition = parse_expression(state, i, &i, Utl_FALSE);
+
+	if (!condition)
+		{ printf("ERROR! Couldn't parse while statement condition\n"); return NULL; }
+	if (i == NULL || i->keywordid != Lnn_KW_DO)
+		{ printf("ERROR! While statement is missing the 'do' keyword\n"); goto on_fail; }
+
+	i = (Lnn_Token*)i->links.next;
+	block = parse_codeblock(state, i, &i);
+	if (!block) goto on_fail;
+	if (i == NULL || i->keywordid != Lnn_KW_END)
+		{ printf("ERROR! While statement doesn't have an end\n"); goto on_fail; }
+
+	Lnn_Statement* stmt = Utl_AllocType(Lnn_Statement);
+	stmt->type = Lnn_ST_WHILE;
+	stmt->u.stmt_while.condition = condition;
+	stmt->u.stmt_while.block = block;
+	*end = (const Lnn_Token*)i->links.next;
+	return stmt;
+
+on_fail:
+	Lnn_DestroyExpression(condition);
+	Lnn_DestroyCodeBlock(block);
+	return NULL;
+}
+
+
+
+/**
+ * @brief Parses a function declaration like function f(x) return x end.
+ * It is the same as assigning the function literal to the name.
+ */
+static Lnn_Statement* parse_function_statement(Lnn_State* state,
+											   const Lnn_Token* begin,
+											   const Lnn_Token** end)
+{
+	Utl_Assert(state);
+	Utl_Assert(begin);
+	Utl_Assert(end);
+
+	const Lnn_Token* nametoken = begin->links.next;
+	Lnn_ExprNode* closure = parse_function_literal(state, begin, end, nametoken->string);
+	if (!closure) return NULL;
+
+	Lnn_ExprNode* assignment = Utl_AllocType(Lnn_ExprNode);
+	assignment->type = Lnn_ET_OPERATOR;
+	assignment->u.op.id = Lnn_OP_ASSIGN;
+	assignment->u.op.left = Utl_AllocType(Lnn_ExprNode);
+	assignment->u.op.left->type = Lnn_ET_VARIABLE;
+	assignment->u.op.left->u.variable.name = _strdup(nametoken->string);
+	assignment->u.op.left->parent = assignment;
+	assignment->u.op.right = closure;
+	closure->parent = assignment;
+
+	Lnn_Statement* stmt = Utl_AllocType(Lnn_Statement);
+	stmt->type = Lnn_ST_EXPRESSION;
+	stmt->u.stmt_expr.expression = assignment;
+	return stmt;
+}
+
+
+
+static Lnn_Statement* parse_return_statement(Lnn_State* state,
+											 const Lnn_Token* begin,
+											 const Lnn_Token** end)
+{
+	Utl_Assert(state);
+	Utl_Assert(begin);
+	Utl_Assert(end);
+
+	Lnn_ExprNode* expression = NULL;
+	const Lnn_Token* i = begin->links.next;
+	/* A return without a value is followed by the end of the block */
+	if (!begin->lastonline && i && i->keywordid != Lnn_KW_END && i->keywordid != Lnn_KW_ELSE)
+	{
+		expression = parse_expression(state, i, &i, Utl_TRUE);
+		if (!expression)
+			{ printf("ERROR! Couldn't parse return value\n"); return NULL; }
+	}
+
+	Lnn_Statement* stmt = Utl_AllocType(Lnn_Statement);
+	stmt->type = Lnn_ST_RETURN;
+	stmt->u.stmt_return.expression = expression;
+	*end = i;
+	return stmt;
+}
+
+
+
 /**
  * @brief Parses a statement and puts the token that comes after it in the end param.
  * It doesn't matter how the statement ends, as long as it is valid, the new statement will return.
@@ -286,7 +743,14 @@ static Lnn_Statement* parse_statement(Lnn_State* state,
 	switch (begin->keywordid)
 	{
 	case Lnn_KW_IF: return parse_if_statement(state, begin, end);
-		
+	case Lnn_KW_WHILE: return parse_while_statement(state, begin, end);
+	case Lnn_KW_RETURN: return parse_return_statement(state, begin, end);
+	case Lnn_KW_FUNCTION:
+		/* A function with a name is declared, one without is a literal in an expression */
+		if (begin->links.next && ((const Lnn_Token*)begin->links.next)->type == Lnn_TT_IDENTIFIER)
+			return parse_function_statement(state, begin, end);
+		return parse_expression_statement(state, begin, end);
+
 
 	case Lnn_KW_END:
 	case Lnn_KW_ELSE:
@@ -316,22 +780,43 @@ static Lnn_CodeBlock* parse_codeblock(Lnn_State* state,
 	Utl_Assert(state);
 	Utl_Assert(begin);
 	Utl_Assert(end);
+	if (!enter_nesting(state))
+	{
+		*end = NULL;
+		return NULL;
+	}
 
-	Lnn_CodeBlock* block = Utl_AllocType(Lnn_CodeBlock);
-	for (const Lnn_Token* i = begin; i;)
+	Utl_Vector statements; /* Vector of Lnn_Statement */
+	Utl_InitVector(&statements, sizeof(Lnn_Statement));
+	const Lnn_Token* i = begin;
+	while (i)
 	{
 		Lnn_Token* nexttoken = NULL;
 		Lnn_Statement* stmt = parse_statement(state, i, &nexttoken);
-		if (!stmt)
+		i = nexttoken;
+		if (!stmt && state->parsetoodeep)
 		{
-			*end = nexttoken;
-			return block;
+			for (int n = 0; n < statements.count; n++)
+				Lnn_DestroyStatement(&Utl_VectorAt(&statements, Lnn_Statement, n));
+			Utl_FreeVector(&statements);
+			leave_nesting(state);
+			return NULL;
 		}
-		Utl_PushBackList(&block->statements, stmt);
-		i = nexttoken;
+		if (!stmt) break;
+		Utl_PushVector(&statements, stmt);
+		Utl_Free(stmt);
 	}
-	/* Reached end of file */
-	*end = NULL;
+	/* NULL if it reached the end of the file */
+	*end = i;
+
+	/* The statements are moved into an array that fits them exactly */
+	Lnn_CodeBlock* block = Utl_AllocType(Lnn_CodeBlock);
+	block->numstatements = statements.count;
+	if (statements.count)
+		block->statements = Utl_Realloc(statements.data, sizeof(Lnn_Statement) * statements.count);
+	else
+		Utl_FreeVector(&statements);
+	leave_nesting(state);
 	return block;
 }
 
@@ -358,6 +843,8 @@ Lnn_CodeBlock* Lnn_ParseSourceCode(Lnn_State* state, const char* sourcecode)
 	if (tokens.count <= 0) return NULL;
 
 	Lnn_Token* endtoken = NULL;
+	state->parsedepth = 0;
+	state->parsetoodeep = Utl_FALSE;
 	Lnn_CodeBlock* block = parse_codeblock(state, (Lnn_Token*)tokens.begin, &endtoken);
 	if (!block)
 	{
@@ -365,7 +852,11 @@ Lnn_CodeBlock* Lnn_ParseSourceCode(Lnn_State* state, const char* sourcecode)
 		goto on_fail;
 	}
 	
-	if (endtoken != NULL)
+	if (endtoken == NULL && !Lnn_ResolveVariables(state, block))
+	{
+		Lnn_DestroyCodeBlock(block);
+		block = NULL;
+	} else if (endtoken != NULL)
 	{
 		//Lnn_PUSHTOKENERROR(endtoken, "Sourcecode parsing ended early");
 		printf("ERROR! Invalid source code end on line %i with token ", endtoken->linenum);
@@ -36,8 +36,8 @@ void Lnn_DestroyToken(Lnn_Token* token);
 
 
 
-/* Maximum number of characters sourcecode can be */
-#define Lnn_MAX_SOURCECODE_LENGTH 200
+/* Default for how deep blocks and expressions can nest, see Lnn_State.maxparsedepth */
+#define Lnn_MAX_PARSE_DEPTH 200
 
 /**
  * @brief Reads through a string character by character and divides it into separate tokens.
@@ -0,0 +1,187 @@
+#include "lnn_program.h"
+#include "lnn_parse.h"
+
+
+
+/* Gives every long string constant in a chunk and its functions to the program, so nothing in the compiling state is left in it */
+static void take_strings(Lnn_Program* program, Lnn_Chunk* chunk, int* capstrings)
+{
+	for (int i = 0; i < chunk->numconstants; i++)
+	{
+		Lnn_Value* constant = &chunk->constants[i];
+		if (constant->type != Lnn_VT_STRING) continue;
+
+		const Lnn_String* string = constant->u.string;
+		Lnn_String* copy = Lnn_AllocString(string->chars, string->len);
+		/* Constants are interned so the hash is known, states only ever read the copy */
+		copy->hash = string->hash;
+		constant->u.string = copy;
+
+		if (program->numstrings >= *capstrings)
+		{
+			*capstrings = *capstrings ? *capstrings * 2 : 8;
+			program->strings = Utl_Realloc(program->strings, sizeof(Lnn_String*) * *capstrings);
+		}
+		program->strings[program->numstrings++] = copy;
+	}
+	for (int i = 0; i < chunk->numprototypes; i++)
+		take_strings(program, chunk->prototypes[i]->code, capstrings);
+}
+
+/**
+ * Makes the chunk of a program for a state. What doesn't have to change is shared with the program:
+ * the code and the loops if the globals have the same slots in the state, and the constants if none of them
+ * is a string or a function. The vm copies the code when it first quickens an instruction.
+ * slots maps the global slots of the program to the ones in the state, or is NULL if they are the same.
+ */
+static Lnn_Chunk* load_chunk(Lnn_State* state, const Lnn_Chunk* source, const int* slots)
+{
+	Lnn_Chunk* chunk = Utl_AllocType(Lnn_Chunk);
+	chunk->source = source;
+
+	chunk->numcode = chunk->capcode = source->numcode;
+	if (!slots)
+		chunk->code = source->code;
+	else
+	{
+		chunk->code = Utl_Malloc(sizeof(Lnn_Instruction) * (source->numcode + 1));
+		for (int i = 0; i < source->numcode; i++)
+		{
+			const Lnn_Instruction instr = source->code[i];
+			const Lnn_OpCode op = Lnn_InstrOp(instr);
+			if (op == Lnn_BC_GETGLOBAL || op == Lnn_BC_SETGLOBAL || op == Lnn_BC_SETGLOBAL_POP)
+				chunk->code[i] = Lnn_MakeInstr(op, slots[Lnn_InstrArg(instr)]);
+			else
+				chunk->code[i] = instr;
+		}
+	}
+
+	chunk->numconstants = chunk->capconstants = source->numconstants;
+	chunk->constants = source->constants;
+	for (int i = 0; i < source->numconstants; i++)
+		if (source->constants[i].type == Lnn_VT_STRING || source->constants[i].type == Lnn_VT_FUNCTION)
+		{
+			chunk->constants = Utl_Malloc(sizeof(Lnn_Value) * (source->numconstants + 1));
+			memcpy(chunk->constants, source->constants, sizeof(Lnn_Value) * source->numconstants);
+			break;
+		}
+	/* Values made from the constants can outlive the chunk, so the strings are interned in the state */
+	if (chunk->constants != source->constants)
+		for (int i = 0; i < chunk->numconstants; i++)
+			if (chunk->constants[i].type == Lnn_VT_STRING)
+				chunk->constants[i] = Lnn_LiteralString(state, chunk->constants[i].u.string->chars, chunk->constants[i].u.string->len);
+
+	chunk->numcaches = chunk->capcaches = source->numcaches;
+	chunk->caches = Utl_Malloc(sizeof(Lnn_MemberCache) * (source->numcaches + 1));
+	for (int i = 0; i < source->numcaches; i++)
+	{
+		memset(&chunk->caches[i], 0, sizeof(Lnn_MemberCache));
+		chunk->caches[i].name = _strdup(source->caches[i].name);
+	}
+
+	chunk->numloops = chunk->caploops = source->numloops;
+	if (!slots)
+		chunk->loops = source->loops;
+	else
+	{
+		chunk->loops = Utl_Malloc(sizeof(Lnn_ElementwiseLoop) * (source->numloops + 1));
+		for (int i = 0; i < source->numloops; i++)
+		{
+			Lnn_ElementwiseLoop* loop = &chunk->loops[i];
+			*loop = source->loops[i];
+			loop->counter = slots[loop->counter];
+			loop->dst = slots[loop->dst];
+			loop->a = slots[loop->a];
+			if (loop->b >= 0) loop->b = slots[loop->b];
+			if (loop->factorslot >= 0) loop->factorslot = slots[loop->factorslot];
+			if (loop->limitslot >= 0) loop->limitslot = slots[loop->limitslot];
+		}
+	}
+
+	chunk->numprototypes = chunk->capprototypes = source->numprototypes;
+	chunk->prototypes = Utl_Malloc(sizeof(Lnn_Prototype*) * (source->numprototypes + 1));
+	for (int i = 0; i < source->numprototypes; i++)
+	{
+		const Lnn_Prototype* prototype = source->prototypes[i];
+		chunk->prototypes[i] = Lnn_CopyPrototype(prototype, load_chunk(state, prototype->code, slots));
+	}
+	/* Function constants point to the prototype with the same index */
+	for (int i = 0; i < chunk->numconstants && chunk->constants != source->constants; i++)
+	{
+		if (chunk->constants[i].type != Lnn_VT_FUNCTION) continue;
+		for (int j = 0; j < source->numprototypes; j++)
+			if (chunk->constants[i].u.prototype == source->prototypes[j])
+				chunk->constants[i].u.prototype = chunk->prototypes[j];
+	}
+
+	chunk->maxstack = source->maxstack;
+	return chunk;
+}
+
+
+
+Lnn_Program* Lnn_CompileProgram(Lnn_State* state, const char* sourcecode)
+{
+	Utl_Assert(state && sourcecode);
+
+	Lnn_CodeBlock* block = Lnn_ParseSourceCode(state, sourcecode);
+	if (!block) return NULL;
+	Lnn_Chunk* chunk = Lnn_CompileCode(state, block);
+	Lnn_DestroyCodeBlock(block);
+	if (!chunk) return NULL;
+
+	Lnn_Program* program = Utl_AllocType(Lnn_Program);
+	program->chunk = chunk;
+	program->refcount = 1;
+
+	/* Slots are only ever added, so every slot the code uses is below numglobals */
+	program->numglobals = state->numglobals;
+	program->globalnames = Utl_Malloc(sizeof(char*) * (state->numglobals + 1));
+	for (int i = 0; i < state->numglobals; i++)
+		program->globalnames[i] = _strdup(state->globals[i].name);
+
+	int capstrings = 0;
+	take_strings(program, chunk, &capstrings);
+	return program;
+}
+
+Lnn_Chunk* Lnn_LoadProgram(Lnn_State* state, Lnn_Program* program)
+{
+	Utl_Assert(state && program);
+
+	/* A fresh state gets the globals in the same slots as the program, and then the code can be shared */
+	int* slots = Utl_Malloc(sizeof(int) * (program->numglobals + 1));
+	Utl_Bool sameslots = Utl_TRUE;
+	for (int i = 0; i < program->numglobals; i++)
+	{
+		slots[i] = Lnn_GetGlobalSlot(state, program->globalnames[i]);
+		sameslots = sameslots && slots[i] == i;
+	}
+	Lnn_Chunk* chunk = load_chunk(state, program->chunk, sameslots ? NULL : slots);
+	Utl_Free(slots);
+
+	chunk->program = program;
+	Lnn_RetainProgram(program);
+	return chunk;
+}
+
+void Lnn_RetainProgram(Lnn_Program* program)
+{
+	Utl_Assert(program);
+	Utl_AtomicIncrement(&program->refcount);
+}
+
+void Lnn_ReleaseProgram(Lnn_Program* program)
+{
+	Utl_Assert(program);
+	if (Utl_AtomicDecrement(&program->refcount) > 0) return;
+
+	Lnn_DestroyChunk(program->chunk);
+	for (int i = 0; i < program->numglobals; i++)
+		Utl_Free(program->globalnames[i]);
+	Utl_Free(program->globalnames);
+	for (int i = 0; i < program->numstrings; i++)
+		Lnn_DestroyObject((Lnn_Object*)program->strings[i]);
+	Utl_Free(program->strings);
+	Utl_Free(program);
+}
@@ -0,0 +1,59 @@
+#ifndef _Lnn_PROGRAM_H_
+#define _Lnn_PROGRAM_H_
+
+#include "fab_utility.h"
+#include "lnn_state.h"
+#include "lnn_vm.h"
+
+/**
+ * Programs are compiled scripts that any number of states, on any thread, can run without parsing
+ * the script again. A program is immutable once it is compiled and is shared by reference counting.
+ * It has the bytecode of the script and its functions, the constants and the long strings in them,
+ * and the names of the globals the code uses.
+ * Loading a program into a state makes a chunk for that state with its own inline caches. It shares the
+ * instructions with the program until the vm quickens one of them, and then gets its own copy. Chunks only
+ * get their own copy right away if the globals have other slots in the state than in the program, and their
+ * own constants if there are long strings to intern in the state or functions in them.
+ */
+
+typedef struct Lnn_Program
+{
+	Lnn_Chunk* chunk;		/* Never runs, chunks loaded from it share its code and never write to it */
+	char** globalnames;		/* Names of the global slots the code was compiled with */
+	int numglobals;
+	struct Lnn_String** strings;	/* Long strings in the constants, the program owns them */
+	int numstrings;
+	Utl_AtomicInt refcount;
+} Lnn_Program;
+
+/**
+ * @brief Parses and compiles a script into a program.
+ * Natives the script calls have to be registered in the state, and in every state the program is loaded in.
+ * @param state State to compile in, the globals the script uses are made in it too.
+ * @param sourcecode The script.
+ * @return The program with one reference, or NULL if the script couldn't be compiled.
+ */
+Lnn_Program* Lnn_CompileProgram(Lnn_State* state,
+								const char* sourcecode);
+
+/**
+ * @brief Makes a chunk that runs a program in a state.
+ * The chunk holds a reference to the program, destroy it with Lnn_DestroyChunk().
+ * @param state State the chunk will run in, the globals of the program are resolved in it.
+ * @param program The program.
+ * @return The chunk to give to Lnn_RunChunk().
+ */
+Lnn_Chunk* Lnn_LoadProgram(Lnn_State* state,
+						   Lnn_Program* program);
+
+/**
+ * @brief Adds a reference to a program. Can be called from any thread.
+ */
+void Lnn_RetainProgram(Lnn_Program* program);
+
+/**
+ * @brief Drops a reference to a program, the last one destroys it. Can be called from any thread.
+ */
+void Lnn_ReleaseProgram(Lnn_Program* program);
+
+#endif
@@ -0,0 +1,565 @@
+#include "lnn_resolve.h"
+#include "lnn_state.h"
+#include "lnn_builtin.h"
+#include "lnn_native.h"
+
+
+
+/* What is found out about a local while its function is resolved */
+typedef struct
+{
+	int numassigns;			/* Parameters count as assigned once */
+	int lastassign;			/* Sequence number of the last assignment */
+	int firstcapture;		/* Sequence number of the first capture, -1 if it is never captured */
+	Utl_Bool loopassign;	/* Assigned inside a loop */
+	Utl_Bool innerassign;	/* Assigned by a function inside */
+	Utl_Bool onlycalled;	/* Only ever read as the function of a call */
+	const Lnn_ExprNode* literal;	/* First array or object literal assigned to it, NULL until then */
+	int literalblock;		/* Block that assignment is in, every later reference has to be inside it */
+	int literaldepth;
+	Utl_Bool notscalar;		/* Used in a way that needs a real array or object */
+} local_info;
+
+/* A function literal assigned to a local in a statement of its own, it may not escape */
+typedef struct
+{
+	Lnn_Function* function;
+	int local;
+} nonescaping_candidate;
+
+typedef struct function_scope
+{
+	struct function_scope* parent;
+	Lnn_Function* function;		/* NULL at the top level */
+	local_info* locals;
+	int loopdepth;
+	nonescaping_candidate* candidates;
+	int numcandidates;
+	int* blocks;				/* Blocks the resolver is in, innermost last */
+	int numblocks;
+} function_scope;
+
+typedef struct
+{
+	Lnn_State* state;
+	char** globals;				/* Names assigned at the top level */
+	int numglobals;
+	Lnn_Function** functions;	/* Every function literal, each one after the one it is in */
+	int numfunctions;
+	int sequence;				/* Counts references in the order they run */
+	int numblocksmade;			/* Gives every code block a number */
+	const Lnn_ExprNode* statement;	/* Expression of the statement being resolved */
+	Utl_Bool error;
+} resolver;
+
+
+
+static int find_name(char** names, const int count, const char* name)
+{
+	for (int i = 0; i < count; i++)
+		if (strcmp(names[i], name) == 0)
+			return i;
+	return -1;
+}
+
+static void add_name(char*** names, int* count, const char* name)
+{
+	*names = Utl_Realloc(*names, sizeof(char*) * (*count + 1));
+	(*names)[(*count)++] = _strdup(name);
+}
+
+
+
+/* Declaring */
+
+/**
+ * @brief Finds the names an expression assigns and declares them as globals at the top level,
+ * or as locals in a function. Function literals inside are declared when they are resolved.
+ */
+static void declare_expression(resolver* r, function_scope* scope, const Lnn_ExprNode* expr)
+{
+	if (!expr) return;
+	switch (expr->type)
+	{
+	case Lnn_ET_OPERATOR:
+		if (Lnn_IsAssignmentOp(expr->u.op.id) && expr->u.op.left->type == Lnn_ET_VARIABLE)
+		{
+			const char* name = expr->u.op.left->u.variable.name;
+			if (!scope->function)
+			{
+				if (find_name(r->globals, r->numglobals, name) < 0)
+					add_name(&r->globals, &r->numglobals, name);
+			} else
+			{
+				/* Locals of the functions around and globals are assigned, not declared again */
+				Utl_Bool declared = find_name(r->globals, r->numglobals, name) >= 0;
+				for (const function_scope* i = scope; i && i->function && !declared; i = i->parent)
+					declared = find_name(i->function->locals, i->function->numlocals, name) >= 0;
+				if (!declared)
+					add_name(&scope->function->locals, &scope->function->numlocals, name);
+			}
+		} else
+			declare_expression(r, scope, expr->u.op.left);
+		declare_expression(r, scope, expr->u.op.right);
+		return;
+	case Lnn_ET_OBJECT:
+		for (int i = 0; i < expr->u.object.numfields; i++)
+			declare_expression(r, scope, expr->u.object.values[i]);
+		return;
+	case Lnn_ET_ARRAY:
+		for (int i = 0; i < expr->u.array.numelements; i++)
+			declare_expression(r, scope, expr->u.array.elements[i]);
+		return;
+	case Lnn_ET_FUNCTIONCALL:
+		for (int i = 0; i < expr->u.functioncall.numargs; i++)
+			declare_expression(r, scope, expr->u.functioncall.args[i]);
+		return;
+	default:
+		return;
+	}
+}
+
+static void declare_codeblock(resolver* r, function_scope* scope, const Lnn_CodeBlock* block)
+{
+	if (!block) return;
+	for (const Lnn_Statement* i = block->statements; i < block->statements + block->numstatements; i++)
+	{
+		switch (i->type)
+		{
+		case Lnn_ST_EXPRESSION: declare_expression(r, scope, i->u.stmt_expr.expression); break;
+		case Lnn_ST_RETURN: declare_expression(r, scope, i->u.stmt_return.expression); break;
+		case Lnn_ST_IF:
+			declare_expression(r, scope, i->u.stmt_if.condition);
+			declare_codeblock(r, scope, i->u.stmt_if.block_ontrue);
+			declare_codeblock(r, scope, i->u.stmt_if.block_onfalse);
+			break;
+		case Lnn_ST_WHILE:
+			declare_expression(r, scope, i->u.stmt_while.condition);
+			declare_codeblock(r, scope, i->u.stmt_while.block);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+
+
+/* Resolving */
+
+/**
+ * @brief Finds or adds the capture of a local of an outer function, adding it to every function in between too.
+ * @param scope Function that captures the local.
+ * @param owner Function that the local belongs to.
+ * @return Index of the capture in the function of scope.
+ */
+static int add_capture(function_scope* scope, const function_scope* owner, const int local)
+{
+	Lnn_Capture capture = { 0 };
+	capture.fromlocal = scope->parent == owner;
+	capture.index = capture.fromlocal ? local : add_capture(scope->parent, owner, local);
+
+	Lnn_Function* function = scope->function;
+	for (int i = 0; i < function->numcaptures; i++)
+		if (function->captures[i].fromlocal == capture.fromlocal && function->captures[i].index == capture.index)
+			return i;
+	function->captures = Utl_Realloc(function->captures, sizeof(Lnn_Capture) * (function->numcaptures + 1));
+	function->captures[function->numcaptures] = capture;
+	return function->numcaptures++;
+}
+
+/**
+ * @brief Resolves a reference to a variable.
+ * @param assign If the reference assigns the variable.
+ * @param called If the reference is the function of a call.
+ */
+static void resolve_variable(resolver* r, function_scope* scope, Lnn_VariableRef* ref,
+							 const Utl_Bool assign, const Utl_Bool called)
+{
+	const int sequence = ++r->sequence;
+
+	if (scope->function)
+	{
+		const int local = find_name(scope->function->locals, scope->function->numlocals, ref->name);
+		if (local >= 0)
+		{
+			local_info* info = &scope->locals[local];
+			if (assign)
+			{
+				info->numassigns++;
+				info->lastassign = sequence;
+				if (scope->loopdepth > 0)
+					info->loopassign = Utl_TRUE;
+			}
+			if (!called && !assign)
+				info->onlycalled = Utl_FALSE;
+			ref->kind = Lnn_VK_LOCAL;
+			ref->index = local;
+			return;
+		}
+
+		for (function_scope* owner = scope->parent; owner && owner->function; owner = owner->parent)
+		{
+			const int outer = find_name(owner->function->locals, owner->function->numlocals, ref->name);
+			if (outer < 0) continue;
+			local_info* info = &owner->locals[outer];
+			if (info->firstcapture < 0)
+				info->firstcapture = sequence;
+			if (assign)
+				info->innerassign = Utl_TRUE;
+			info->onlycalled = Utl_FALSE;
+			ref->kind = Lnn_VK_CAPTURE;
+			ref->index = add_capture(scope, owner, outer);
+			return;
+		}
+	}
+
+	/* Functions declared in the script and natives come before builtins with the same name */
+	if (called && find_name(r->globals, r->numglobals, ref->name) < 0 && !Lnn_IsNativeGlobal(r->state, ref->name))
+	{
+		ref->kind = Lnn_VK_BUILTIN;
+		ref->index = Lnn_FindBuiltin(ref->name);
+		if (ref->index < 0)
+		{
+			printf("ERROR! Unknown function '%s'\n", ref->name);
+			r->error = Utl_TRUE;
+		}
+		return;
+	}
+	ref->kind = Lnn_VK_GLOBAL;
+	ref->index = 0;
+}
+
+/* Scalar replacement */
+
+/* Arrays and objects with unique names can be kept in scalars */
+static Utl_Bool is_scalar_literal(const Lnn_ExprNode* literal)
+{
+	if (literal->type == Lnn_ET_ARRAY)
+		return literal->u.array.numelements <= Lnn_MAX_SCALAR_FIELDS;
+	if (literal->type != Lnn_ET_OBJECT || literal->u.object.numfields > Lnn_MAX_SCALAR_FIELDS)
+		return Utl_FALSE;
+	for (int i = 0; i < literal->u.object.numfields; i++)
+		if (find_name(literal->u.object.names, i, literal->u.object.names[i]) >= 0)
+			return Utl_FALSE;
+	return Utl_TRUE;
+}
+
+static int scalar_fields(const Lnn_ExprNode* literal)
+{
+	return literal->type == Lnn_ET_ARRAY ? literal->u.array.numelements : literal->u.object.numfields;
+}
+
+static Utl_Bool same_scalar_fields(const Lnn_ExprNode* a, const Lnn_ExprNode* b)
+{
+	if (a->type != b->type || scalar_fields(a) != scalar_fields(b)) return Utl_FALSE;
+	if (a->type == Lnn_ET_OBJECT)
+		for (int i = 0; i < a->u.object.numfields; i++)
+			if (strcmp(a->u.object.names[i], b->u.object.names[i]) != 0)
+				return Utl_FALSE;
+	return Utl_TRUE;
+}
+
+/* Index of the field a '.' or '[]' reads from a literal, -1 if it isn't one of its fields */
+static int scalar_field(const Lnn_ExprNode* literal, const Lnn_ExprNode* access)
+{
+	const Lnn_ExprNode* key = access->u.op.right;
+	if (access->u.op.id == Lnn_OP_MEMBERACCESS)
+	{
+		if (literal->type != Lnn_ET_OBJECT || key->type != Lnn_ET_VARIABLE) return -1;
+		return find_name(literal->u.object.names, literal->u.object.numfields, key->u.variable.name);
+	}
+	if (literal->type != Lnn_ET_ARRAY || key->type != Lnn_ET_INTLITERAL ||
+		key->u.integer < 0 || key->u.integer >= literal->u.array.numelements)
+		return -1;
+	return (int)key->u.integer;
+}
+
+static void enter_block(resolver* r, function_scope* scope)
+{
+	scope->blocks = Utl_Realloc(scope->blocks, sizeof(int) * (scope->numblocks + 1));
+	scope->blocks[scope->numblocks++] = ++r->numblocksmade;
+}
+
+/* A local can only be replaced by scalars if the first literal assigned to it runs before all its other uses */
+static void use_scalar(function_scope* scope, local_info* info)
+{
+	if (!info->literal || info->literaldepth > scope->numblocks ||
+		scope->blocks[info->literaldepth - 1] != info->literalblock)
+		info->notscalar = Utl_TRUE;
+}
+
+/**
+ * @brief Checks an assignment to a local for scalar replacement.
+ * @param literal The array or object literal assigned in a statement of its own, or NULL for any other assignment.
+ */
+static void assign_scalar(function_scope* scope, local_info* info, const Lnn_ExprNode* literal)
+{
+	if (literal && !info->literal && is_scalar_literal(literal))
+	{
+		info->literal = literal;
+		info->literalblock = scope->blocks[scope->numblocks - 1];
+		info->literaldepth = scope->numblocks;
+		return;
+	}
+	if (!literal || !info->literal || !same_scalar_fields(info->literal, literal))
+		info->notscalar = Utl_TRUE;
+	else
+		use_scalar(scope, info);
+}
+
+/* Local that a reference is to, NULL if it isn't one of the function being resolved */
+#define local_of(scope, ref) ((scope)->function && (ref)->kind == Lnn_VK_LOCAL ? &(scope)->locals[(ref)->index] : NULL)
+
+
+
+static void resolve_function(resolver* r, function_scope* scope, Lnn_Function* function);
+
+/* Resolves the references of an expression in the order they run */
+static void resolve_expression(resolver* r, function_scope* scope, Lnn_ExprNode* expr)
+{
+	if (!expr) return;
+	switch (expr->type)
+	{
+	case Lnn_ET_OPERATOR:
+		if (Lnn_IsAssignmentOp(expr->u.op.id) && expr->u.op.left->type == Lnn_ET_VARIABLE)
+		{
+			/* The value is worked out before the variable is assigned */
+			const Utl_Bool statement = expr == r->statement;
+			resolve_expression(r, scope, expr->u.op.right);
+			resolve_variable(r, scope, &expr->u.op.left->u.variable, Utl_TRUE, Utl_FALSE);
+
+			/* Literals that replace scalars don't have a value, so it can't be used */
+			local_info* info = local_of(scope, &expr->u.op.left->u.variable);
+			if (info)
+				assign_scalar(scope, info, statement && expr->u.op.id == Lnn_OP_ASSIGN ? expr->u.op.right : NULL);
+			return;
+		}
+		if ((expr->u.op.id == Lnn_OP_MEMBERACCESS || expr->u.op.id == Lnn_OP_ARRAYACCESS) &&
+			expr->u.op.left->type == Lnn_ET_VARIABLE)
+		{
+			resolve_variable(r, scope, &expr->u.op.left->u.variable, Utl_FALSE, Utl_FALSE);
+			if (expr->u.op.id == Lnn_OP_ARRAYACCESS)
+				resolve_expression(r, scope, expr->u.op.right);
+
+			local_info* info = local_of(scope, &expr->u.op.left->u.variable);
+			if (info)
+			{
+				use_scalar(scope, info);
+				if (!info->notscalar && scalar_field(info->literal, expr) < 0)
+					info->notscalar = Utl_TRUE;
+			}
+			return;
+		}
+		resolve_expression(r, scope, expr->u.op.left);
+		/* The right side of a member access is a name, not a variable */
+		if (expr->u.op.id != Lnn_OP_MEMBERACCESS)
+			resolve_expression(r, scope, expr->u.op.right);
+		return;
+	case Lnn_ET_VARIABLE:
+	{
+		resolve_variable(r, scope, &expr->u.variable, Utl_FALSE, Utl_FALSE);
+		local_info* info = local_of(scope, &expr->u.variable);
+		if (info)
+			info->notscalar = Utl_TRUE;
+		return;
+	}
+	case Lnn_ET_OBJECT:
+		for (int i = 0; i < expr->u.object.numfields; i++)
+			resolve_expression(r, scope, expr->u.object.values[i]);
+		return;
+	case Lnn_ET_ARRAY:
+		for (int i = 0; i < expr->u.array.numelements; i++)
+			resolve_expression(r, scope, expr->u.array.elements[i]);
+		return;
+	case Lnn_ET_FUNCTIONCALL:
+	{
+		resolve_variable(r, scope, &expr->u.functioncall.callee, Utl_FALSE, Utl_TRUE);
+		local_info* info = local_of(scope, &expr->u.functioncall.callee);
+		if (info)
+			info->notscalar = Utl_TRUE;
+		for (int i = 0; i < expr->u.functioncall.numargs; i++)
+			resolve_expression(r, scope, expr->u.functioncall.args[i]);
+		return;
+	}
+	case Lnn_ET_CLOSURE:
+		resolve_function(r, scope, expr->u.closure);
+		return;
+	default:
+		return;
+	}
+}
+
+static void resolve_codeblock(resolver* r, function_scope* scope, Lnn_CodeBlock* block)
+{
+	if (!block) return;
+	enter_block(r, scope);
+	for (Lnn_Statement* i = block->statements; i < block->statements + block->numstatements; i++)
+	{
+		switch (i->type)
+		{
+		case Lnn_ST_EXPRESSION:
+		{
+			Lnn_ExprNode* expr = i->u.stmt_expr.expression;
+			r->statement = expr;
+			resolve_expression(r, scope, expr);
+
+			/* f = function ... as a statement in a function */
+			if (expr->type == Lnn_ET_OPERATOR && expr->u.op.id == Lnn_OP_ASSIGN &&
+				expr->u.op.right->type == Lnn_ET_CLOSURE && expr->u.op.left->type == Lnn_ET_VARIABLE &&
+				expr->u.op.left->u.variable.kind == Lnn_VK_LOCAL)
+			{
+				scope->candidates = Utl_Realloc(scope->candidates, sizeof(nonescaping_candidate) * (scope->numcandidates + 1));
+				scope->candidates[scope->numcandidates].function = expr->u.op.right->u.closure;
+				scope->candidates[scope->numcandidates].local = expr->u.op.left->u.variable.index;
+				scope->numcandidates++;
+			}
+			break;
+		}
+		case Lnn_ST_RETURN:
+			if (!scope->function)
+			{
+				printf("ERROR! Can't return outside of a function\n");
+				r->error = Utl_TRUE;
+			}
+			resolve_expression(r, scope, i->u.stmt_return.expression);
+			break;
+		case Lnn_ST_IF:
+			resolve_expression(r, scope, i->u.stmt_if.condition);
+			resolve_codeblock(r, scope, i->u.stmt_if.block_ontrue);
+			resolve_codeblock(r, scope, i->u.stmt_if.block_onfalse);
+			break;
+		case Lnn_ST_WHILE:
+			/* The condition runs again for every iteration too */
+			scope->loopdepth++;
+			resolve_expression(r, scope, i->u.stmt_while.condition);
+			resolve_codeblock(r, scope, i->u.stmt_while.block);
+			scope->loopdepth--;
+			break;
+		default:
+			break;
+		}
+	}
+	scope->numblocks--;
+}
+
+/**
+ * @brief Decides which locals are boxed, which are replaced by scalars and which function literals escape,
+ * once every reference is known.
+ */
+static void finish_function(function_scope* scope)
+{
+	Lnn_Function* function = scope->function;
+	function->boxed = Utl_Calloc(function->numlocals + 1, sizeof(Utl_Bool));
+	for (int i = 0; i < function->numlocals; i++)
+	{
+		const local_info* info = &scope->locals[i];
+		function->boxed[i] = info->firstcapture >= 0 &&
+			(info->innerassign || info->loopassign || info->lastassign > info->firstcapture);
+	}
+
+	/* Captures of functions that don't escape get hidden slots after the locals */
+	function->numslots = function->numlocals;
+	for (int i = 0; i < scope->numcandidates; i++)
+	{
+		const nonescaping_candidate* candidate = &scope->candidates[i];
+		const local_info* info = &scope->locals[candidate->local];
+		if (info->numassigns != 1 || info->firstcapture >= 0 || !info->onlycalled) continue;
+
+		candidate->function->escapes = Utl_FALSE;
+		candidate->function->captureslot = function->numslots;
+		function->numslots += candidate->function->numcaptures;
+	}
+
+	/* Fields of locals replaced by scalars get hidden slots after those */
+	function->scalars = Utl_Malloc(sizeof(Lnn_ScalarLocal) * (function->numlocals + 1));
+	for (int i = 0; i < function->numlocals; i++)
+	{
+		const local_info* info = &scope->locals[i];
+		Lnn_ScalarLocal* scalar = &function->scalars[i];
+		scalar->slot = -1;
+		scalar->literal = NULL;
+		if (i < function->numparams || !info->literal || info->notscalar || info->firstcapture >= 0) continue;
+
+		scalar->slot = function->numslots;
+		scalar->literal = info->literal;
+		function->numslots += scalar_fields(info->literal);
+	}
+}
+
+static void resolve_function(resolver* r, function_scope* scope, Lnn_Function* function)
+{
+	function->parent = scope->function;
+	function->escapes = Utl_TRUE;
+	r->functions = Utl_Realloc(r->functions, sizeof(Lnn_Function*) * (r->numfunctions + 1));
+	r->functions[r->numfunctions++] = function;
+
+	function_scope inner = { 0 };
+	inner.parent = scope;
+	inner.function = function;
+	declare_codeblock(r, &inner, function->block);
+
+	inner.locals = Utl_Malloc(sizeof(local_info) * (function->numlocals + 1));
+	for (int i = 0; i < function->numlocals; i++)
+	{
+		local_info* info = &inner.locals[i];
+		info->numassigns = i < function->numparams ? 1 : 0;
+		info->lastassign = -1;
+		info->firstcapture = -1;
+		info->loopassign = Utl_FALSE;
+		info->innerassign = Utl_FALSE;
+		info->onlycalled = Utl_TRUE;
+		info->literal = NULL;
+		info->literalblock = 0;
+		info->literaldepth = 0;
+		info->notscalar = Utl_FALSE;
+	}
+
+	resolve_codeblock(r, &inner, function->block);
+	finish_function(&inner);
+	Utl_Free(inner.locals);
+	Utl_Free(inner.candidates);
+	Utl_Free(inner.blocks);
+}
+
+
+
+Utl_Bool Lnn_ResolveVariables(Lnn_State* state, Lnn_CodeBlock* block)
+{
+	Utl_Assert(state && block);
+
+	resolver r = { 0 };
+	r.state = state;
+	function_scope top = { 0 };
+	declare_codeblock(&r, &top, block);
+	resolve_codeblock(&r, &top, block);
+
+	/* Whether a local is boxed is only known once its function is done, so captures are marked last */
+	for (int i = 0; i < r.numfunctions; i++)
+	{
+		Lnn_Function* function = r.functions[i];
+		for (int j = 0; j < function->numcaptures; j++)
+		{
+			Lnn_Capture* capture = &function->captures[j];
+			capture->boxed = capture->fromlocal ? function->parent->boxed[capture->index] :
+				function->parent->captures[capture->index].boxed;
+		}
+	}
+
+	for (int i = 0; i < r.numglobals; i++)
+		Utl_Free(r.globals[i]);
+	Utl_Free(r.globals);
+	Utl_Free(r.functions);
+	Utl_Free(top.candidates);
+	Utl_Free(top.blocks);
+	return !r.error;
+}
+
+int Lnn_ScalarSlot(const Lnn_Function* function, const Lnn_ExprNode* access)
+{
+	const Lnn_ExprNode* local = access->u.op.left;
+	if (local->type != Lnn_ET_VARIABLE || local->u.variable.kind != Lnn_VK_LOCAL) return -1;
+	const Lnn_ScalarLocal* scalar = &function->scalars[local->u.variable.index];
+	if (scalar->slot < 0) return -1;
+	return scalar->slot + scalar_field(scalar->literal, access);
+}
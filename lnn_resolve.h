@@ -0,0 +1,36 @@
+#ifndef _Lnn_RESOLVE_H_
+#define _Lnn_RESOLVE_H_
+
+#include "fab_utility.h"
+#include "lnn_code.h"
+
+struct Lnn_State;
+
+/**
+ * @brief Resolves every variable in a parsed script to a global, a local, a capture or a builtin,
+ * and works out how the functions in it capture their variables.
+ * A captured local is boxed in a cell if it could change after it was captured: when a function
+ * inside assigns it, when it is assigned in a loop, or when it is assigned after the first capture.
+ * Otherwise the captures are plain copies.
+ * A function literal doesn't escape if it is assigned to a local in a statement of its own,
+ * and that local is assigned once, isn't captured and is only ever called.
+ * A local of a function is replaced by scalars if it is only assigned array or object literals with the same
+ * fields in statements of their own, and is otherwise only used to read or assign those fields by a constant
+ * index or name after the first literal was assigned. Its fields then live in hidden slots of the frame.
+ * @param state State for error logs.
+ * @param block The top level code block, the references in it are filled in.
+ * @return Utl_FALSE if a name couldn't be resolved, the error is printed.
+ */
+Utl_Bool Lnn_ResolveVariables(struct Lnn_State* state,
+							  Lnn_CodeBlock* block);
+
+/**
+ * @brief Finds the hidden slot a field of a local replaced by scalars is in.
+ * @param function Function the access is in.
+ * @param access A '.' or '[]' operator.
+ * @return The slot in the frame, or -1 if the access isn't to a local that was replaced.
+ */
+int Lnn_ScalarSlot(const Lnn_Function* function,
+				   const Lnn_ExprNode* access);
+
+#endif
@@ -0,0 +1,93 @@
+#include "lnn_state.h"
+#include "lnn_string.h"
+#include "lnn_native.h"
+#include "lnn_parse.h"
+#include "lnn_vm.h"
+#include "lnn_channel.h"
+
+
+
+Lnn_State* Lnn_CreateState(void)
+{
+	return Lnn_CreateStateWithAllocator(NULL);
+}
+
+Lnn_State* Lnn_CreateStateWithAllocator(const Lnn_Allocator* allocator)
+{
+	Lnn_State* state = Utl_AllocType(Lnn_State);
+	state->emptyshape = Lnn_CreateEmptyShape();
+	state->kernels = Lnn_SelectArrayKernels();
+	state->maxparsedepth = Lnn_MAX_PARSE_DEPTH;
+	Utl_InitHashMap(&state->globalslots, sizeof(int));
+	Lnn_InitMemory(&state->memory, allocator);
+	if (!Lnn_InitGC(state))
+	{
+		Lnn_DestroyState(state);
+		return NULL;
+	}
+	return state;
+}
+
+void Lnn_DestroyState(Lnn_State* state)
+{
+	if (!state) return;
+	for (int i = 0; i < state->numglobals; i++)
+		Utl_Free(state->globals[i].name);
+	Utl_Free(state->globals);
+	Utl_FreeHashMap(&state->globalslots);
+	for (int i = 0; i < state->numnatives; i++)
+		Lnn_DestroyNative(state->natives[i]);
+	Utl_Free(state->natives);
+	for (int i = 0; i < state->numchannels; i++)
+		Lnn_ReleaseChannel(state->channels[i]);
+	Utl_Free(state->channels);
+	Utl_Free(state->vmstack);
+	while (state->coroutines.begin)
+		Lnn_DestroyCoroutine(state, (Lnn_Coroutine*)state->coroutines.begin);
+	Lnn_FreeGC(state);
+	Lnn_FreeMemory(&state->memory);
+	Lnn_FreeInternedStrings(state);
+	Lnn_DestroyShapeTree(state->emptyshape);
+#ifdef Lnn_PROFILE_OPCODE_PAIRS
+	Utl_Free(state->opcodepairs);
+#endif
+	Utl_Free(state);
+}
+
+
+
+int Lnn_GetGlobalSlot(Lnn_State* state, const char* name)
+{
+	Utl_Assert(state && name);
+	const int* slot = Utl_FindHashMap(&state->globalslots, name);
+	if (slot) return *slot;
+
+	if (state->numglobals >= state->capglobals)
+	{
+		state->capglobals = state->capglobals ? state->capglobals * 2 : 16;
+		state->globals = Utl_Realloc(state->globals, sizeof(Lnn_Global) * state->capglobals);
+	}
+	Lnn_Global* global = &state->globals[state->numglobals];
+	global->name = _strdup(name);
+	global->value = Lnn_NullValue();
+	*(int*)Utl_InsertHashMap(&state->globalslots, global->name, NULL) = state->numglobals;
+	return state->numglobals++;
+}
+
+int Lnn_FindGlobalSlot(const Lnn_State* state, const char* name)
+{
+	Utl_Assert(state && name);
+	const int* slot = Utl_FindHashMap(&state->globalslots, name);
+	return slot ? *slot : -1;
+}
+
+void Lnn_PrintGlobals(const Lnn_State* state)
+{
+	printf("Globals:\n");
+	for (int i = 0; i < state->numglobals; i++)
+	{
+		printf("  %s = ", state->globals[i].name);
+		Lnn_PrintValue(state->globals[i].value);
+		putchar('\n');
+	}
+}
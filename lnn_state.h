@@ -1,9 +1,93 @@
 #ifndef _Lnn_STATE_H_
 #define _Lnn_STATE_H_
 
+#include "fab_utility.h"
+#include "lnn_value.h"
+#include "lnn_gc.h"
+#include "lnn_memory.h"
+#include "lnn_object.h"
+#include "lnn_kernels.h"
+
+typedef struct Lnn_Global
+{
+	char* name;
+	Lnn_Value value;
+} Lnn_Global;
+
+/**
+ * Everything a state changes while lexing, parsing, compiling and running is owned by the state:
+ * globals, interned strings, shapes, the collector, the memory pools and the vm stack.
+ * Tables that every state uses, like the operator tables, builtins and array kernels, are read only.
+ * So states on different threads can run at the same time without locks, as long as each state
+ * is only used by one thread at a time. Parsed code, chunks and closure code belong to the state
+ * they were made for since running them fills in caches and quickens them.
+ */
 typedef struct Lnn_State
 {
-    int temp;
+	Lnn_Global* globals;	/* Indexed by the slots the compiler resolves names to */
+	int numglobals;
+	int capglobals;
+	Utl_HashMap globalslots;	/* Names of the globals to their slots, the keys are the names in globals */
+
+	struct Lnn_String** interned;	/* Hash set of the interned strings, open addressing */
+	int numinterned;
+	int capinterned;
+	Lnn_Shape* emptyshape;	/* Root of the shape tree, new objects start with it */
+
+	/* The parser and everything after it recurse once per nested block or expression, deeper code is an error */
+	int maxparsedepth;
+	int parsedepth;
+	Utl_Bool parsetoodeep;	/* Set once the limit is hit, every block unwinds without more errors */
+
+	const Lnn_ArrayKernels* kernels;	/* Fastest array kernels the cpu can run */
+
+	Lnn_Memory memory;		/* Allocator and byte counts of the memory scripts use */
+	Lnn_GC gc;				/* Manages the objects created while running, pause histograms are in here too */
+
+	struct Lnn_Native** natives;	/* Functions the host registered, they are in globals too */
+	int numnatives;
+	struct Lnn_Channel** channels;	/* Channels the host bound, the channel values of scripts point to them */
+	int numchannels;
+
+	Lnn_Value* vmstack;		/* Lnn_STACK_SIZE values shared by every run of the vm, made on the first run */
+	Lnn_Value* vmstacktop;	/* Where the next run starts, natives can run scripts while one runs */
+	Utl_List coroutines;	/* Every Lnn_Coroutine that hasn't been destroyed */
+
+#ifdef Lnn_PROFILE_OPCODE_PAIRS
+	unsigned long long* opcodepairs; /* Counters indexed by [first * 256 + second] */
+#endif
 } Lnn_State;
 
-#endif
\ No newline at end of file
+Lnn_State* Lnn_CreateState(void);
+
+/**
+ * @brief Creates a state whose script memory comes from a custom allocator, see lnn_memory.h.
+ * @param allocator The allocator, it is copied. NULL uses malloc() like Lnn_CreateState().
+ * @return The state, or NULL if the allocator can't give the nursery.
+ */
+Lnn_State* Lnn_CreateStateWithAllocator(const Lnn_Allocator* allocator);
+
+/**
+ * @brief Destroys a state together with its globals and every object it owns.
+ */
+void Lnn_DestroyState(Lnn_State* state);
+
+/**
+ * @brief Gets the slot of a global variable, creating it with a null value if it doesn't exist.
+ * @param state State the global belongs to.
+ * @param name Name of the variable.
+ * @return Index of the variable in state->globals.
+ */
+int Lnn_GetGlobalSlot(Lnn_State* state,
+					  const char* name);
+
+/**
+ * @brief Finds the slot of a global variable without creating it.
+ * @return Index of the variable in state->globals, or -1 if there is none with the name.
+ */
+int Lnn_FindGlobalSlot(const Lnn_State* state,
+					   const char* name);
+
+void Lnn_PrintGlobals(const Lnn_State* state);
+
+#endif
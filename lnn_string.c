@@ -0,0 +1,347 @@
+#include "lnn_string.h"
+#include "lnn_state.h"
+#include "lnn_gc.h"
+
+const char* lnn_stringkind_names[Lnn_NUM_STRINGKINDS] =
+{
+	"SK_FLAT",
+	"SK_ROPE",
+	"SK_FLATTENED"
+};
+
+
+
+/* FNV-1a, 0 is left out since it means the hash hasn't been computed */
+static unsigned int hash_chars(const char* chars, const int len)
+{
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < len; i++)
+	{
+		hash ^= (unsigned char)chars[i];
+		hash *= 16777619u;
+	}
+	return hash ? hash : 1;
+}
+
+static Lnn_Value short_string(const char* chars, const int len)
+{
+	Utl_Assert(len <= Lnn_SHORT_STRING_MAX);
+	Lnn_Value value;
+	memset(&value, 0, sizeof(Lnn_Value)); /* Zeroes the characters after the end too */
+	value.type = Lnn_VT_SHORTSTRING;
+	memcpy(value.u.shortstring.chars, chars, len);
+	value.u.shortstring.len = (unsigned char)len;
+	return value;
+}
+
+static void init_header(Lnn_String* string, const Lnn_StringKind kind, const int len)
+{
+	string->len = len;
+	string->hash = 0;
+	string->kind = (unsigned char)kind;
+	string->interned = Utl_FALSE;
+	string->left = string->right = NULL;
+}
+
+/* A flat string with room for len characters that are filled in by the caller */
+static Lnn_String* new_flat_string(Lnn_State* state, const int len)
+{
+	Lnn_String* string = (Lnn_String*)Lnn_GCAllocate(state, sizeof(Lnn_String) + len + 1, Lnn_VT_STRING);
+	if (!string) return NULL;
+	init_header(string, Lnn_SK_FLAT, len);
+	string->chars[len] = '\0';
+	return string;
+}
+
+Lnn_String* Lnn_AllocString(const char* chars, const int len)
+{
+	Utl_Assert(chars || len == 0);
+	Utl_Assert(len >= 0);
+
+	Lnn_String* string = Utl_Malloc(sizeof(Lnn_String) + len + 1); /* Plus 1 to include null terminator */
+	string->obj.links.prev = string->obj.links.next = NULL;
+	string->obj.type = Lnn_VT_STRING;
+	string->obj.color = Lnn_GC_BLACK;
+	string->obj.flags = Lnn_GC_STATIC;
+	init_header(string, Lnn_SK_FLAT, len);
+	memcpy(string->chars, chars, len);
+	string->chars[len] = '\0';
+	return string;
+}
+
+Lnn_String* Lnn_NewString(Lnn_State* state, const char* chars, const int len)
+{
+	Utl_Assert(state);
+	Utl_Assert(chars || len == 0);
+	Utl_Assert(len >= 0);
+	Lnn_String* string = new_flat_string(state, len);
+	if (string)
+		memcpy(string->chars, chars, len);
+	return string;
+}
+
+Lnn_Value Lnn_NewStringValue(Lnn_State* state, const char* chars, const int len)
+{
+	if (len <= Lnn_SHORT_STRING_MAX)
+		return short_string(chars, len);
+	Lnn_String* string = Lnn_NewString(state, chars, len);
+	return string ? Lnn_StringValue(string) : Lnn_NullValue();
+}
+
+
+
+/* Interning */
+
+static void grow_intern_table(Lnn_State* state)
+{
+	const int capacity = state->capinterned ? state->capinterned * 2 : 64;
+	Lnn_String** table = Utl_Calloc(capacity, sizeof(Lnn_String*));
+	for (int i = 0; i < state->capinterned; i++)
+	{
+		Lnn_String* string = state->interned[i];
+		if (!string) continue;
+		int slot = string->hash & (capacity - 1);
+		while (table[slot]) slot = (slot + 1) & (capacity - 1);
+		table[slot] = string;
+	}
+	Utl_Free(state->interned);
+	state->interned = table;
+	state->capinterned = capacity;
+}
+
+Lnn_String* Lnn_InternString(Lnn_State* state, const char* chars, const int len)
+{
+	Utl_Assert(state);
+	Utl_Assert(chars || len == 0);
+
+	/* Kept at most three quarters full so probing stays short */
+	if ((state->numinterned + 1) * 4 > state->capinterned * 3)
+		grow_intern_table(state);
+
+	const unsigned int hash = hash_chars(chars, len);
+	int slot = hash & (state->capinterned - 1);
+	for (Lnn_String* string; (string = state->interned[slot]); slot = (slot + 1) & (state->capinterned - 1))
+		if (string->hash == hash && string->len == len && memcmp(string->chars, chars, len) == 0)
+			return string;
+
+	Lnn_String* string = Lnn_AllocString(chars, len);
+	string->hash = hash;
+	string->interned = Utl_TRUE;
+	state->interned[slot] = string;
+	state->numinterned++;
+	return string;
+}
+
+Lnn_Value Lnn_LiteralString(Lnn_State* state, const char* chars, const int len)
+{
+	if (len <= Lnn_SHORT_STRING_MAX)
+		return short_string(chars, len);
+	return Lnn_StringValue(Lnn_InternString(state, chars, len));
+}
+
+void Lnn_FreeInternedStrings(Lnn_State* state)
+{
+	for (int i = 0; i < state->capinterned; i++)
+		Lnn_DestroyObject((Lnn_Object*)state->interned[i]);
+	Utl_Free(state->interned);
+	state->interned = NULL;
+	state->numinterned = state->capinterned = 0;
+}
+
+
+
+/* Ropes */
+
+/**
+ * @brief Calls piece on every flat part of a string from left to right.
+ * Ropes can be as deep as the number of concatenations that made them, so this keeps its own stack.
+ */
+static void for_each_piece(const Lnn_String* string,
+						   void(*piece)(const char* chars, const int len, void* userdata),
+						   void* userdata)
+{
+	const Lnn_String* fixedstack[32];
+	const Lnn_String** stack = fixedstack;
+	int count = 0, capacity = 32;
+
+	stack[count++] = string;
+	while (count > 0)
+	{
+		const Lnn_String* i = stack[--count];
+		if (i->kind == Lnn_SK_FLATTENED) i = i->left;
+		if (i->kind == Lnn_SK_FLAT)
+		{
+			piece(i->chars, i->len, userdata);
+			continue;
+		}
+
+		if (count + 2 > capacity)
+		{
+			capacity *= 2;
+			if (stack == fixedstack)
+			{
+				stack = Utl_Malloc(sizeof(Lnn_String*) * capacity);
+				memcpy(stack, fixedstack, sizeof(fixedstack));
+			} else
+				stack = Utl_Realloc(stack, sizeof(Lnn_String*) * capacity);
+		}
+		stack[count++] = i->right;
+		stack[count++] = i->left;
+	}
+
+	if (stack != fixedstack)
+		Utl_Free(stack);
+}
+
+static void copy_piece(const char* chars, const int len, void* userdata)
+{
+	char** cursor = (char**)userdata;
+	memcpy(*cursor, chars, len);
+	*cursor += len;
+}
+
+static void print_piece(const char* chars, const int len, void* userdata)
+{
+	(void)userdata;
+	fwrite(chars, 1, len, stdout);
+}
+
+/**
+ * @brief Gets the flat string with the characters of a string object, flattening it if it's a rope.
+ * The rope keeps the flat copy and lets go of its halves.
+ * @return The flat string, or NULL if there is no memory left for it, the rope is left as it was then.
+ */
+static Lnn_String* flatten(Lnn_State* state, Lnn_String* string)
+{
+	if (string->kind == Lnn_SK_FLAT) return string;
+	if (string->kind == Lnn_SK_FLATTENED) return string->left;
+
+	Lnn_String* flat = new_flat_string(state, string->len);
+	if (!flat) return NULL;
+	char* cursor = flat->chars;
+	for_each_piece(string, &copy_piece, &cursor);
+	flat->hash = string->hash;
+
+	string->kind = Lnn_SK_FLATTENED;
+	string->left = flat;
+	string->right = NULL;
+	Lnn_GCWriteBarrier(state, &string->obj, Lnn_StringValue(flat));
+	return flat;
+}
+
+/* The string object for a half of a rope, short strings have to be allocated for it */
+static Lnn_String* string_object(Lnn_State* state, const Lnn_Value* string)
+{
+	if (string->type == Lnn_VT_STRING) return string->u.string;
+	return Lnn_NewString(state, string->u.shortstring.chars, string->u.shortstring.len);
+}
+
+Utl_Bool Lnn_ConcatStrings(Lnn_State* state, const Lnn_Value a, const Lnn_Value b, Lnn_Value* result)
+{
+	Utl_Assert(state && Lnn_IsString(a) && Lnn_IsString(b) && result);
+	const int alen = Lnn_StringLength(a), blen = Lnn_StringLength(b);
+	if (alen == 0)
+	{
+		*result = b;
+		return Utl_TRUE;
+	}
+	if (blen == 0)
+	{
+		*result = a;
+		return Utl_TRUE;
+	}
+
+	if (alen > INT32_MAX - blen)
+	{
+		printf("ERROR! Strings can't be longer than %i characters\n", INT32_MAX);
+		return Utl_FALSE;
+	}
+	const int len = alen + blen;
+	if (len < Lnn_MIN_ROPE_LENGTH)
+	{
+		/* Halves this short are never ropes themselves, so nothing is flattened here */
+		char chars[Lnn_MIN_ROPE_LENGTH];
+		memcpy(chars, Lnn_StringChars(state, &a, NULL), alen);
+		memcpy(chars + alen, Lnn_StringChars(state, &b, NULL), blen);
+		*result = Lnn_NewStringValue(state, chars, len);
+		return result->type != Lnn_VT_NULL;
+	}
+
+	/* The halves are made first, nothing refers to them yet so the collector can't be left a half made rope */
+	Lnn_String* left = string_object(state, &a);
+	Lnn_String* right = left ? string_object(state, &b) : NULL;
+	Lnn_String* rope = right ? (Lnn_String*)Lnn_GCAllocate(state, sizeof(Lnn_String), Lnn_VT_STRING) : NULL;
+	if (!rope) return Utl_FALSE;
+	init_header(rope, Lnn_SK_ROPE, len);
+	rope->left = left;
+	rope->right = right;
+	/* The rope is old and black if the nursery was full */
+	Lnn_GCWriteBarrier(state, &rope->obj, Lnn_StringValue(left));
+	Lnn_GCWriteBarrier(state, &rope->obj, Lnn_StringValue(right));
+	*result = Lnn_StringValue(rope);
+	return Utl_TRUE;
+}
+
+
+
+const char* Lnn_StringChars(Lnn_State* state, const Lnn_Value* string, int* len)
+{
+	Utl_Assert(string && Lnn_IsString(*string));
+	if (len) *len = Lnn_StringLength(*string);
+	if (string->type == Lnn_VT_SHORTSTRING)
+		return string->u.shortstring.chars;
+	Lnn_String* flat = flatten(state, string->u.string);
+	return flat ? flat->chars : NULL;
+}
+
+unsigned int Lnn_StringHash(Lnn_State* state, const Lnn_Value* string)
+{
+	Utl_Assert(string && Lnn_IsString(*string));
+	if (string->type == Lnn_VT_SHORTSTRING)
+		return hash_chars(string->u.shortstring.chars, string->u.shortstring.len);
+
+	Lnn_String* object = string->u.string;
+	if (!object->hash)
+	{
+		Lnn_String* flat = flatten(state, object);
+		if (!flat) return 0;
+		object->hash = hash_chars(flat->chars, object->len);
+	}
+	return object->hash;
+}
+
+Utl_Bool Lnn_StringsEqual(Lnn_State* state, const Lnn_Value a, const Lnn_Value b)
+{
+	const int len = Lnn_StringLength(a);
+	if (len != Lnn_StringLength(b)) return Utl_FALSE;
+
+	if (a.type == Lnn_VT_STRING && b.type == Lnn_VT_STRING)
+	{
+		if (a.u.string == b.u.string) return Utl_TRUE;
+		if (a.u.string->interned && b.u.string->interned) return Utl_FALSE;
+		if (Lnn_StringHash(state, &a) != Lnn_StringHash(state, &b)) return Utl_FALSE;
+	}
+	/* Ropes that couldn't be flattened compare unequal, the run fails at its next safepoint anyway */
+	const char* achars = Lnn_StringChars(state, &a, NULL);
+	const char* bchars = Lnn_StringChars(state, &b, NULL);
+	return achars && bchars && memcmp(achars, bchars, len) == 0;
+}
+
+int Lnn_CompareStrings(Lnn_State* state, const Lnn_Value a, const Lnn_Value b)
+{
+	int alen, blen;
+	const char* achars = Lnn_StringChars(state, &a, &alen);
+	const char* bchars = Lnn_StringChars(state, &b, &blen);
+	if (!achars || !bchars) return 0;
+	const int cmp = memcmp(achars, bchars, alen < blen ? alen : blen);
+	if (cmp) return cmp;
+	return alen - blen;
+}
+
+void Lnn_PrintString(const Lnn_Value string)
+{
+	if (string.type == Lnn_VT_SHORTSTRING)
+		printf("%s", string.u.shortstring.chars);
+	else
+		for_each_piece(string.u.string, &print_piece, NULL);
+}
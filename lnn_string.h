@@ -0,0 +1,143 @@
+#ifndef _Lnn_STRING_H_
+#define _Lnn_STRING_H_
+
+#include "fab_utility.h"
+#include "lnn_value.h"
+
+struct Lnn_State;
+
+/**
+ * Strings up to Lnn_SHORT_STRING_MAX characters are kept inside the value as Lnn_VT_SHORTSTRING
+ * and never allocate. Longer ones are Lnn_String objects in one of the kinds below.
+ * Concatenating long strings makes a rope that only refers to the two halves, the characters are
+ * copied together the first time something needs them, so building a string with repeated + is linear.
+ */
+typedef enum
+{
+	Lnn_SK_FLAT,		/* The characters follow the header */
+	Lnn_SK_ROPE,		/* Concatenation of left and right that hasn't been needed yet */
+	Lnn_SK_FLATTENED,	/* Rope that has been flattened, left is the flat copy */
+	Lnn_NUM_STRINGKINDS
+} Lnn_StringKind;
+extern const char* lnn_stringkind_names[Lnn_NUM_STRINGKINDS];
+
+/* Concatenations shorter than this are copied right away instead of making a rope */
+#define Lnn_MIN_ROPE_LENGTH 64
+
+typedef struct Lnn_String
+{
+	Lnn_Object obj;
+	int len;
+	unsigned int hash;			/* Computed the first time it's needed, 0 until then */
+	unsigned char kind;			/* Lnn_StringKind */
+	unsigned char interned;		/* There is only one interned string per state with these characters */
+	struct Lnn_String* left;
+	struct Lnn_String* right;
+	char chars[];				/* Null terminated, only flat strings have them */
+} Lnn_String;
+
+/* Gets the length of a string value without looking at its characters */
+#define Lnn_StringLength(v)		((v).type == Lnn_VT_SHORTSTRING ? (int)(v).u.shortstring.len : (v).u.string->len)
+
+/**
+ * @brief Allocates a flat string that isn't owned by any state.
+ * The garbage collector never frees it.
+ * @param chars Characters to copy, doesn't need to be null terminated.
+ * @param len Number of characters to copy.
+ * @return Pointer to the new string, destroy it with Lnn_DestroyObject().
+ */
+Lnn_String* Lnn_AllocString(const char* chars,
+							const int len);
+
+/**
+ * @brief Creates a flat string owned by a state. It is freed by the garbage collector once nothing refers to it.
+ * @param state State that owns the string.
+ * @param chars Characters to copy, doesn't need to be null terminated.
+ * @param len Number of characters to copy.
+ * @return Pointer to the new string, or NULL if there is no memory left, the error is printed.
+ */
+Lnn_String* Lnn_NewString(struct Lnn_State* state,
+						  const char* chars,
+						  const int len);
+
+/**
+ * @brief Makes a string value, short strings are put in the value and longer ones are allocated in the state.
+ * @return The string, or null if there is no memory left, the error is printed.
+ */
+Lnn_Value Lnn_NewStringValue(struct Lnn_State* state,
+							 const char* chars,
+							 const int len);
+
+/**
+ * @brief Finds the interned string with some characters, interning a new one if there is none.
+ * Interned strings belong to the state and live until it is destroyed.
+ */
+Lnn_String* Lnn_InternString(struct Lnn_State* state,
+							 const char* chars,
+							 const int len);
+
+/**
+ * @brief Makes the value of a string literal, it is either short or interned.
+ */
+Lnn_Value Lnn_LiteralString(struct Lnn_State* state,
+							const char* chars,
+							const int len);
+
+/**
+ * @brief Destroys every string a state has interned.
+ */
+void Lnn_FreeInternedStrings(struct Lnn_State* state);
+
+/**
+ * @brief Concatenates two string values. Long results are ropes, so this doesn't copy any characters then.
+ * @param state State that owns the result.
+ * @param result Set to a string value that is a followed by b.
+ * @return Utl_FALSE if there is no memory left or the result would be too long, the error is printed.
+ */
+Utl_Bool Lnn_ConcatStrings(struct Lnn_State* state,
+						   const Lnn_Value a,
+						   const Lnn_Value b,
+						   Lnn_Value* result);
+
+/**
+ * @brief Gets the characters of a string value, flattening it first if it is a rope.
+ * @param state State that owns the string.
+ * @param string The string value, the characters of short strings are in it so it has to outlive the result.
+ * @param len Set to the length of the string if not NULL.
+ * @return The null terminated characters, or NULL if there was no memory left to flatten a rope.
+ * The error is printed and the run fails at its next safepoint.
+ */
+const char* Lnn_StringChars(struct Lnn_State* state,
+							const Lnn_Value* string,
+							int* len);
+
+/**
+ * @brief Gets the hash of a string value, it is cached in string objects after the first time.
+ * Gives 0 without caching it if a rope couldn't be flattened, see Lnn_StringChars().
+ */
+unsigned int Lnn_StringHash(struct Lnn_State* state,
+							const Lnn_Value* string);
+
+/**
+ * @brief Checks if two string values have the same characters.
+ * Interned strings are compared by identity and cached hashes rule out most other strings
+ * before any characters are compared.
+ */
+Utl_Bool Lnn_StringsEqual(struct Lnn_State* state,
+						  const Lnn_Value a,
+						  const Lnn_Value b);
+
+/**
+ * @brief Compares two string values alphabetically.
+ * @return Less than, equal to or greater than 0 if a comes before, is equal to or comes after b.
+ */
+int Lnn_CompareStrings(struct Lnn_State* state,
+					   const Lnn_Value a,
+					   const Lnn_Value b);
+
+/**
+ * @brief Prints the characters of a string value without flattening it.
+ */
+void Lnn_PrintString(const Lnn_Value string);
+
+#endif
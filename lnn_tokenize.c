@@ -45,7 +45,8 @@ typedef enum
 } chartype;
 
 #define Lnn_IsAlpha(c) (isalpha(c) || c == '_')
-#define Lnn_IsOperatorChar(c) (strchr("+-/*=<>!&|^", c))
+/* strchr() also finds the terminating null, which ends every token */
+#define Lnn_IsOperatorChar(c) (c && strchr("+-/*=<>!&|^", c))
 #define Lnn_IsQuote(c) (c == '\"' || c == '\'')
 
 static chartype check_chartype(const char c)
@@ -96,7 +97,7 @@ static int read_alpha_token(Utl_List* tokens,
 							const int linenum)
 {
 	int end = 0;
-	for (int i = start + 1; i < Lnn_MAX_SOURCECODE_LENGTH; i++)
+	for (int i = start + 1;; i++)
 	{
 		get_char;
 		if (!Lnn_IsAlpha(c) && !isdigit(c))
@@ -133,7 +134,7 @@ static int read_number_token(Lnn_State* state,
 {
 	Utl_Bool pointfound = Utl_FALSE; /* For checking if there are two decimal points in one number */
 	int end = 0;
-	for (int i = start + 1; i < Lnn_MAX_SOURCECODE_LENGTH; i++)
+	for (int i = start + 1;; i++)
 	{
 		get_char;
 		if (c == '.')
@@ -172,7 +173,7 @@ static int read_operator_token(Lnn_State* state,
 							   const int linenum)
 {
 	int end = 0;
-	for (int i = start + 1; i < Lnn_MAX_SOURCECODE_LENGTH; i++)
+	for (int i = start + 1;; i++)
 	{
 		get_char;
 		if (!Lnn_IsOperatorChar(c))
@@ -255,7 +256,7 @@ static int read_string_token(Lnn_State* state,
 static int read_comment(const char* sourcecode,
 						const int start)
 {
-	for (int i = start + 1; i < Lnn_MAX_SOURCECODE_LENGTH; i++)
+	for (int i = start + 1;; i++)
 	{
 		get_char;
 		if (c == '\n')
@@ -282,12 +283,6 @@ int Lnn_ParseSourceCodeTokens(Lnn_State* state,
 	int i = 0;
 	while (1)
 	{
-		if (i >= Lnn_MAX_SOURCECODE_LENGTH) /* Don't exceed max length */
-		{
-			printf("ERROR! Sourcecode exceeds max length of " Utl_Stringify(Lnn_MAX_SOURCECODE_LENGTH) " characters.\n");
-			break;
-		}
-
 		char c = sourcecode[i];
 		if (c == '\0') break;
 		if (c < 0)
@@ -300,7 +295,7 @@ int Lnn_ParseSourceCodeTokens(Lnn_State* state,
 		{
 		case CT_ALPHA:		i = read_alpha_token(tokens, sourcecode, i, linenum); break;
 		case CT_NUMBER:		i = read_number_token(state, tokens, sourcecode, i, linenum); break;
-		case CT_POINT:		i++; continue; /* No need to check if token is invalid */
+		case CT_POINT:		i = read_operator_token(state, tokens, sourcecode, i, linenum); break; /* Member access */
 		case CT_OPERATOR:	i = read_operator_token(state, tokens, sourcecode, i, linenum); break;
 		case CT_SEPARATOR:	i = read_separator_token(state, tokens, sourcecode, i, linenum); break;
 		case CT_SPACER:		i++; continue; /* No need to check if token is invalid */
@@ -0,0 +1,1613 @@
+#include "lnn_tree.h"
+#include "lnn_object.h"
+#include "lnn_array.h"
+#include "lnn_string.h"
+#include "lnn_builtin.h"
+#include "lnn_kernels.h"
+#include "lnn_function.h"
+#include "lnn_native.h"
+
+
+
+/* Name of the member in a member access, or NULL if the right side isn't a name */
+static const char* member_name(const Lnn_ExprNode* expr)
+{
+	if (expr->type != Lnn_ET_OPERATOR || expr->u.op.id != Lnn_OP_MEMBERACCESS ||
+		expr->u.op.right->type != Lnn_ET_VARIABLE)
+		return NULL;
+	return expr->u.op.right->u.variable.name;
+}
+
+
+
+/**
+ * @brief Finds the builtin a function call calls, the resolver has already found it by name.
+ * @return The Lnn_BuiltinID, or -1 if the arguments don't match, the error is printed.
+ */
+static int find_called_builtin(const Lnn_ExprNode* expr)
+{
+	const int builtin = expr->u.functioncall.callee.index;
+	if (expr->u.functioncall.numargs != lnn_builtins[builtin].numargs)
+	{
+		printf("ERROR! %s takes %i arguments, not %i\n", lnn_builtins[builtin].name,
+			   lnn_builtins[builtin].numargs, expr->u.functioncall.numargs);
+		return -1;
+	}
+	return builtin;
+}
+
+
+
+/* Walker */
+
+/* A call with its arguments evaluated that hasn't run yet */
+typedef struct
+{
+	const Lnn_Prototype* prototype;
+	Lnn_Value* locals;
+	Lnn_Value* captures;
+} walk_frame;
+
+/* A running call, the top level is a call without locals */
+typedef struct
+{
+	Lnn_State* state;
+	const Lnn_Prototype* prototype;	/* NULL at the top level */
+	Lnn_Value* locals;
+	Lnn_Value* captures;
+	int depth;
+	Utl_Bool returned;				/* A return statement ran, the blocks stop there */
+	Lnn_Value result;
+	walk_frame tailcall;			/* Set by return f(x), the call replaces this one when it returns */
+} walker;
+
+static Utl_Bool walk_expression(walker* w, const Lnn_ExprNode* expr, Lnn_Value* result);
+static Utl_Bool walk_codeblock(walker* w, const Lnn_CodeBlock* block);
+
+/* Boxed locals and captures are read through their cell */
+static Lnn_Value walk_variable(walker* w, const Lnn_VariableRef* ref)
+{
+	switch (ref->kind)
+	{
+	case Lnn_VK_LOCAL:
+		return w->prototype->boxed[ref->index] ? w->locals[ref->index].u.cell->value : w->locals[ref->index];
+	case Lnn_VK_CAPTURE:
+		return w->prototype->captures[ref->index].boxed ? w->captures[ref->index].u.cell->value : w->captures[ref->index];
+	default:
+	{
+		/* The lookup can grow the globals array so it's done before indexing */
+		const int slot = Lnn_GetGlobalSlot(w->state, ref->name);
+		return w->state->globals[slot].value;
+	}
+	}
+}
+
+static void walk_set_variable(walker* w, const Lnn_VariableRef* ref, const Lnn_Value value)
+{
+	switch (ref->kind)
+	{
+	case Lnn_VK_LOCAL:
+		if (w->prototype->boxed[ref->index])
+			Lnn_SetCell(w->state, w->locals[ref->index].u.cell, value)
+		else
+			w->locals[ref->index] = value;
+		return;
+	case Lnn_VK_CAPTURE:
+		Lnn_SetCell(w->state, w->captures[ref->index].u.cell, value);
+		return;
+	default:
+	{
+		const int slot = Lnn_GetGlobalSlot(w->state, ref->name);
+		w->state->globals[slot].value = value;
+		return;
+	}
+	}
+}
+
+/* The walker makes the prototype of a function literal the first time it runs, its code is the parsed function */
+static Utl_Bool walk_closure(walker* w, Lnn_Function* function, Lnn_Value* result)
+{
+	if (!function->prototype)
+		function->prototype = Lnn_CreatePrototype(function, function);
+	const Lnn_Prototype* prototype = function->prototype;
+	if (prototype->numcaptures != 0 && prototype->escapes)
+	{
+		Lnn_Closure* closure = Lnn_NewClosure(w->state, prototype, w->locals, w->captures);
+		if (!closure) return Utl_FALSE;
+		*result = Lnn_ClosureValue(closure);
+		return Utl_TRUE;
+	}
+	if (prototype->numcaptures != 0)
+		Lnn_CopyCaptures(prototype, w->locals, w->captures, w->locals + prototype->captureslot);
+	*result = Lnn_FunctionValue(prototype);
+	return Utl_TRUE;
+}
+
+static Utl_Bool walk_call_native(walker* w, const Lnn_ExprNode* expr, const Lnn_Native* native, Lnn_Value* result)
+{
+	const int numargs = expr->u.functioncall.numargs;
+	Lnn_Value buffer[Lnn_MAX_BUILTIN_ARGS];
+	Lnn_Value* args = numargs <= Lnn_MAX_BUILTIN_ARGS ? buffer : Utl_Malloc(sizeof(Lnn_Value) * numargs);
+	Utl_Bool ok = Utl_TRUE;
+	for (int i = 0; i < numargs && ok; i++)
+		ok = walk_expression(w, expr->u.functioncall.args[i], &args[i]);
+	ok = ok && Lnn_CallNative(w->state, native, args, numargs, result);
+	if (args != buffer) Utl_Free(args);
+	return ok;
+}
+
+/**
+ * @brief Evaluates the function and the arguments of a call into a new frame.
+ * A function that doesn't escape is only called by the frame that made it, so its captures are in the caller.
+ * Natives are called right away, the frame gets no prototype and result has what they returned.
+ */
+static Utl_Bool walk_enter_call(walker* w, const Lnn_ExprNode* expr, walk_frame* frame, Lnn_Value* result)
+{
+	const int numargs = expr->u.functioncall.numargs;
+	const Lnn_Value callee = walk_variable(w, &expr->u.functioncall.callee);
+	if (callee.type == Lnn_VT_NATIVE)
+	{
+		frame->prototype = NULL;
+		return walk_call_native(w, expr, callee.u.native, result);
+	}
+	const Lnn_Prototype* prototype = Lnn_CheckCall(callee, numargs);
+	if (!prototype) return Utl_FALSE;
+	if (w->depth + 1 >= Lnn_MAX_CALL_DEPTH)
+	{
+		printf("ERROR! Stack overflow in %s\n", prototype->name);
+		return Utl_FALSE;
+	}
+
+	frame->prototype = prototype;
+	frame->locals = Utl_Malloc(sizeof(Lnn_Value) * (prototype->numslots + 1));
+	frame->captures = NULL;
+	if (callee.type == Lnn_VT_CLOSURE)
+		frame->captures = callee.u.closure->captures;
+	else if (!prototype->escapes)
+		frame->captures = w->locals + prototype->captureslot;
+	for (int i = 0; i < numargs; i++)
+		if (!walk_expression(w, expr->u.functioncall.args[i], &frame->locals[i]))
+		{
+			Utl_Free(frame->locals);
+			return Utl_FALSE;
+		}
+	for (int i = numargs; i < prototype->numslots; i++)
+		frame->locals[i] = Lnn_NullValue();
+	if (!Lnn_BoxLocals(w->state, prototype, frame->locals))
+	{
+		Utl_Free(frame->locals);
+		return Utl_FALSE;
+	}
+	return Utl_TRUE;
+}
+
+/* Runs a call, and every call that replaces it with a tail call, in one C frame */
+static Utl_Bool walk_run_call(walker* w, walk_frame frame, Lnn_Value* result)
+{
+	walker call = { 0 };
+	call.state = w->state;
+	call.depth = w->depth + 1;
+	for (;;)
+	{
+		call.prototype = frame.prototype;
+		call.locals = frame.locals;
+		call.captures = frame.captures;
+		call.returned = Utl_FALSE;
+		call.tailcall.prototype = NULL;
+		const Lnn_Function* function = frame.prototype->code;
+		const Utl_Bool ok = walk_codeblock(&call, function->block);
+		Utl_Free(frame.locals);
+		if (!ok) return Utl_FALSE;
+		if (!call.tailcall.prototype) break;
+		frame = call.tailcall;
+	}
+	*result = call.returned ? call.result : Lnn_NullValue();
+	return Utl_TRUE;
+}
+
+static Utl_Bool walk_call(walker* w, const Lnn_ExprNode* expr, Lnn_Value* result)
+{
+	walk_frame frame;
+	if (!walk_enter_call(w, expr, &frame, result)) return Utl_FALSE;
+	if (!frame.prototype) return Utl_TRUE;
+	return walk_run_call(w, frame, result);
+}
+
+static Utl_Bool walk_member_assignment(walker* w, const Lnn_ExprNode* expr, const char* name, Lnn_Value* result)
+{
+	Lnn_Value object, a, b;
+	if (!walk_expression(w, expr->u.op.left->u.op.left, &object)) return Utl_FALSE;
+	if (!walk_expression(w, expr->u.op.right, &b)) return Utl_FALSE;
+	const Lnn_OperatorID op = expr->u.op.id;
+	if (op != Lnn_OP_ASSIGN)
+	{
+		if (!Lnn_GetMember(w->state, NULL, name, object, &a)) return Utl_FALSE;
+		if (!Lnn_BinaryOperation(w->state, Lnn_OP_ADD + (op - Lnn_OP_ASSIGNADD), a, b, &b)) return Utl_FALSE;
+	}
+	if (!Lnn_SetMember(w->state, NULL, name, object, b)) return Utl_FALSE;
+	*result = b;
+	return Utl_TRUE;
+}
+
+static Utl_Bool walk_element_assignment(walker* w, const Lnn_ExprNode* expr, Lnn_Value* result)
+{
+	Lnn_Value array, index, a, b;
+	if (!walk_expression(w, expr->u.op.left->u.op.left, &array)) return Utl_FALSE;
+	if (!walk_expression(w, expr->u.op.left->u.op.right, &index)) return Utl_FALSE;
+	if (!walk_expression(w, expr->u.op.right, &b)) return Utl_FALSE;
+	const Lnn_OperatorID op = expr->u.op.id;
+	if (op != Lnn_OP_ASSIGN)
+	{
+		if (!Lnn_GetElement(w->state, array, index, &a)) return Utl_FALSE;
+		if (!Lnn_BinaryOperation(w->state, Lnn_OP_ADD + (op - Lnn_OP_ASSIGNADD), a, b, &b)) return Utl_FALSE;
+	}
+	if (!Lnn_SetElement(w->state, array, index, b)) return Utl_FALSE;
+	*result = b;
+	return Utl_TRUE;
+}
+
+/**
+ * @brief Evaluates an expression by switching on the node type and operator.
+ * @return Utl_FALSE if there was a runtime error, the error is printed.
+ */
+static Utl_Bool walk_expression(walker* w, const Lnn_ExprNode* expr, Lnn_Value* result)
+{
+	switch (expr->type)
+	{
+	case Lnn_ET_NUMBERLITERAL: *result = Lnn_FloatValue(expr->u.number); return Utl_TRUE;
+	case Lnn_ET_INTLITERAL: *result = Lnn_IntValue(expr->u.integer); return Utl_TRUE;
+	case Lnn_ET_BOOLLITERAL: *result = Lnn_BoolValue(expr->u.boolean); return Utl_TRUE;
+	case Lnn_ET_STRINGLITERAL:
+		*result = Lnn_LiteralString(w->state, expr->u.str.chars, expr->u.str.len);
+		return Utl_TRUE;
+	case Lnn_ET_VARIABLE:
+		*result = walk_variable(w, &expr->u.variable);
+		return Utl_TRUE;
+	case Lnn_ET_OBJECT:
+	{
+		Lnn_Instance* instance = Lnn_NewInstance(w->state, expr->u.object.numfields);
+		if (!instance) return Utl_FALSE;
+		const Lnn_Value object = Lnn_ObjectValue(instance);
+		for (int i = 0; i < expr->u.object.numfields; i++)
+		{
+			Lnn_Value value;
+			if (!walk_expression(w, expr->u.object.values[i], &value)) return Utl_FALSE;
+			if (!Lnn_SetMember(w->state, NULL, expr->u.object.names[i], object, value)) return Utl_FALSE;
+		}
+		*result = object;
+		return Utl_TRUE;
+	}
+	case Lnn_ET_FUNCTIONCALL:
+	{
+		if (expr->u.functioncall.callee.kind != Lnn_VK_BUILTIN)
+			return walk_call(w, expr, result);
+		const int builtin = find_called_builtin(expr);
+		if (builtin < 0) return Utl_FALSE;
+		Lnn_Value args[Lnn_MAX_BUILTIN_ARGS];
+		for (int i = 0; i < expr->u.functioncall.numargs; i++)
+			if (!walk_expression(w, expr->u.functioncall.args[i], &args[i])) return Utl_FALSE;
+		return lnn_builtins[builtin].function(w->state, args, result);
+	}
+	case Lnn_ET_CLOSURE:
+		return walk_closure(w, expr->u.closure, result);
+	case Lnn_ET_ARRAY:
+	{
+		Lnn_Array* array = Lnn_NewArray(w->state, expr->u.array.numelements);
+		if (!array) return Utl_FALSE;
+		for (int i = 0; i < expr->u.array.numelements; i++)
+		{
+			Lnn_Value value;
+			if (!walk_expression(w, expr->u.array.elements[i], &value)) return Utl_FALSE;
+			if (!Lnn_PushElement(w->state, array, value)) return Utl_FALSE;
+		}
+		*result = Lnn_ArrayValue(array);
+		return Utl_TRUE;
+	}
+	case Lnn_ET_OPERATOR:
+		break;
+	default:
+		printf("ERROR! Expression type %s isn't supported yet\n", Lnn_ExprNodeTypeName(expr->type));
+		return Utl_FALSE;
+	}
+
+	const Lnn_OperatorID op = expr->u.op.id;
+	Lnn_Value a, b;
+	switch (op)
+	{
+	case Lnn_OP_ASSIGN:
+	case Lnn_OP_ASSIGNADD:
+	case Lnn_OP_ASSIGNSUB:
+	case Lnn_OP_ASSIGNMUL:
+	case Lnn_OP_ASSIGNDIV:
+	{
+		const char* name = member_name(expr->u.op.left);
+		if (name)
+			return walk_member_assignment(w, expr, name, result);
+		if (expr->u.op.left->type == Lnn_ET_OPERATOR && expr->u.op.left->u.op.id == Lnn_OP_ARRAYACCESS)
+			return walk_element_assignment(w, expr, result);
+		if (expr->u.op.left->type != Lnn_ET_VARIABLE)
+		{
+			printf("ERROR! Can only assign to variables, members and elements\n");
+			return Utl_FALSE;
+		}
+		if (!walk_expression(w, expr->u.op.right, &b)) return Utl_FALSE;
+		const Lnn_VariableRef* target = &expr->u.op.left->u.variable;
+		if (op != Lnn_OP_ASSIGN &&
+			!Lnn_BinaryOperation(w->state, Lnn_OP_ADD + (op - Lnn_OP_ASSIGNADD), walk_variable(w, target), b, &b))
+			return Utl_FALSE;
+		walk_set_variable(w, target, b);
+		*result = b;
+		return Utl_TRUE;
+	}
+
+	case Lnn_OP_NOT:
+		if (!walk_expression(w, expr->u.op.right, &a)) return Utl_FALSE;
+		*result = Lnn_BoolValue(!Lnn_IsTruthy(a));
+		return Utl_TRUE;
+
+	case Lnn_OP_NEGATIVE:
+		if (!walk_expression(w, expr->u.op.right, &a)) return Utl_FALSE;
+		if (!Lnn_IsNumber(a))
+		{
+			printf("ERROR! Can't negate %s\n", lnn_valuetype_names[a.type]);
+			return Utl_FALSE;
+		}
+		*result = Lnn_NegateNumber(a);
+		return Utl_TRUE;
+
+	case Lnn_OP_MEMBERACCESS:
+	{
+		const char* name = member_name(expr);
+		if (!name)
+		{
+			printf("ERROR! Expected a member name after '.'\n");
+			return Utl_FALSE;
+		}
+		if (!walk_expression(w, expr->u.op.left, &a)) return Utl_FALSE;
+		return Lnn_GetMember(w->state, NULL, name, a, result);
+	}
+
+	case Lnn_OP_ARRAYACCESS:
+		if (!walk_expression(w, expr->u.op.left, &a)) return Utl_FALSE;
+		if (!walk_expression(w, expr->u.op.right, &b)) return Utl_FALSE;
+		return Lnn_GetElement(w->state, a, b, result);
+
+	default:
+		if (!walk_expression(w, expr->u.op.left, &a)) return Utl_FALSE;
+		if (!walk_expression(w, expr->u.op.right, &b)) return Utl_FALSE;
+		return Lnn_BinaryOperation(w->state, op, a, b, result);
+	}
+}
+
+static Utl_Bool walk_statement(walker* w, const Lnn_Statement* stmt)
+{
+	Lnn_Value value;
+	switch (stmt->type)
+	{
+	case Lnn_ST_EXPRESSION:
+		return walk_expression(w, stmt->u.stmt_expr.expression, &value);
+
+	case Lnn_ST_IF:
+		if (!walk_expression(w, stmt->u.stmt_if.condition, &value)) return Utl_FALSE;
+		if (Lnn_IsTruthy(value))
+			return walk_codeblock(w, stmt->u.stmt_if.block_ontrue);
+		if (stmt->u.stmt_if.block_onfalse)
+			return walk_codeblock(w, stmt->u.stmt_if.block_onfalse);
+		return Utl_TRUE;
+
+	case Lnn_ST_WHILE:
+		for (;;)
+		{
+			if (!walk_expression(w, stmt->u.stmt_while.condition, &value)) return Utl_FALSE;
+			if (!Lnn_IsTruthy(value)) return Utl_TRUE;
+			if (!walk_codeblock(w, stmt->u.stmt_while.block)) return Utl_FALSE;
+			if (w->returned) return Utl_TRUE;
+		}
+
+	case Lnn_ST_RETURN:
+	{
+		const Lnn_ExprNode* expr = stmt->u.stmt_return.expression;
+		w->result = Lnn_NullValue();
+		if (expr && expr->type == Lnn_ET_FUNCTIONCALL && expr->u.functioncall.callee.kind != Lnn_VK_BUILTIN)
+		{
+			/* return f(x) is run by the call that runs this one, unless f keeps its captures in this frame */
+			walk_frame frame;
+			if (!walk_enter_call(w, expr, &frame, &w->result)) return Utl_FALSE;
+			if (!frame.prototype)
+				;
+			else if (frame.prototype->escapes || frame.prototype->numcaptures == 0)
+				w->tailcall = frame;
+			else if (!walk_run_call(w, frame, &w->result))
+				return Utl_FALSE;
+		} else if (expr && !walk_expression(w, expr, &w->result))
+			return Utl_FALSE;
+		w->returned = Utl_TRUE;
+		return Utl_TRUE;
+	}
+
+	default:
+		printf("ERROR! Statement type %s isn't supported yet\n", lnn_statementtype_names[stmt->type]);
+		return Utl_FALSE;
+	}
+}
+
+static Utl_Bool walk_codeblock(walker* w, const Lnn_CodeBlock* block)
+{
+	for (const Lnn_Statement* i = block->statements; i < block->statements + block->numstatements; i++)
+	{
+		if (!walk_statement(w, i)) return Utl_FALSE;
+		if (w->returned) return Utl_TRUE;
+		/* No values are held between top level statements, so only the globals are roots.
+		 * Calls keep their locals in C, so nothing is collected while one runs */
+		if (w->depth == 0 && !Lnn_GCSafepoint(w->state, NULL, NULL))
+			return Utl_FALSE;
+	}
+	return Utl_TRUE;
+}
+
+Lnn_ExecResult Lnn_WalkCodeBlock(Lnn_State* state, const Lnn_CodeBlock* block)
+{
+	Utl_Assert(state && block);
+	walker w = { 0 };
+	w.state = state;
+	Lnn_GCStartRun(state);
+	return walk_codeblock(&w, block) ? Lnn_EXEC_OK : Lnn_EXEC_ERROR;
+}
+
+
+
+/* Closure compilation */
+
+/* A call with its arguments evaluated that hasn't run yet */
+typedef struct
+{
+	const Lnn_Prototype* prototype;
+	Lnn_Value* locals;
+	Lnn_Value* captures;
+} closure_frame;
+
+typedef struct
+{
+	Lnn_State* state;
+	Lnn_Global* globals;
+	Utl_Bool error;
+	Lnn_Value* locals;		/* Frame of the running call, NULL at the top level */
+	Lnn_Value* captures;
+	int depth;
+	Utl_Bool returned;		/* A return statement ran, the blocks stop there */
+	Lnn_Value result;
+	closure_frame tailcall;	/* Set by return f(x), the call replaces this one when it returns */
+} closure_run;
+
+typedef struct closure_node closure_node;
+typedef Lnn_Value(*closure_function)(closure_run* run, const closure_node* node);
+
+struct closure_node
+{
+	closure_function function;
+	union
+	{
+		Lnn_Value constant;
+		int slot;
+		struct
+		{
+			closure_node* left;
+			closure_node* right;
+			Lnn_Value number;	/* Right operand when it is a number literal */
+			int slot;			/* Global that is assigned to */
+		} op;
+		struct
+		{
+			closure_node* condition;
+			closure_node* ontrue;
+			closure_node* onfalse;
+		} branch;
+		struct
+		{
+			closure_node** nodes;
+			int count;
+		} block;
+		struct
+		{
+			closure_node* object;
+			closure_node* value;		/* NULL when getting the member */
+			Lnn_OperatorID op;			/* Lnn_OP_ASSIGN or a compound assignment */
+			Lnn_MemberCache* cache;
+		} member;
+		struct
+		{
+			closure_node* array;
+			closure_node* index;
+			closure_node* value;
+			Lnn_OperatorID op;			/* Lnn_OP_ASSIGN or a compound assignment */
+		} element;
+		struct
+		{
+			closure_node* args[Lnn_MAX_BUILTIN_ARGS];
+			const Lnn_Builtin* builtin;
+		} call;
+		struct
+		{
+			closure_node* callee;
+			closure_node** args;
+			int numargs;
+		} invoke;
+		const Lnn_Prototype* prototype;
+		struct
+		{
+			Lnn_ElementwiseLoop* loop;
+			closure_node* fallback;	/* The while loop as it's written */
+		} elementwise;
+		struct
+		{
+			closure_node** values;
+			Lnn_MemberCache* caches;	/* One for every field, the names are in the caches */
+			int count;
+		} object;
+	} u;
+};
+
+struct Lnn_ClosureCode
+{
+	closure_node* root;
+	Lnn_Prototype** prototypes;	/* Function literals, their code is the closure node of the body */
+	int numprototypes;
+	int capprototypes;
+};
+
+#define call(node)			((node)->function(run, (node)))
+#define null_on_error		if (run->error) return Lnn_NullValue()
+
+static Lnn_Value fail(closure_run* run)
+{
+	run->error = Utl_TRUE;
+	return Lnn_NullValue();
+}
+
+/* Slow path for any operand types */
+static Lnn_Value generic_binary(closure_run* run, const Lnn_OperatorID op, const Lnn_Value a, const Lnn_Value b)
+{
+	Lnn_Value result;
+	if (!Lnn_BinaryOperation(run->state, op, a, b, &result))
+		return fail(run);
+	return result;
+}
+
+
+
+static Lnn_Value eval_constant(closure_run* run, const closure_node* node)
+{
+	(void)run;
+	return node->u.constant;
+}
+
+static Lnn_Value eval_global(closure_run* run, const closure_node* node)
+{
+	return run->globals[node->u.slot].value;
+}
+
+static Lnn_Value eval_assign(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value value = call(node->u.op.right);
+	null_on_error;
+	run->globals[node->u.op.slot].value = value;
+	return value;
+}
+
+static Lnn_Value eval_local(closure_run* run, const closure_node* node)
+{
+	return run->locals[node->u.slot];
+}
+
+static Lnn_Value eval_boxed(closure_run* run, const closure_node* node)
+{
+	return run->locals[node->u.slot].u.cell->value;
+}
+
+static Lnn_Value eval_capture(closure_run* run, const closure_node* node)
+{
+	return run->captures[node->u.slot];
+}
+
+static Lnn_Value eval_boxedcapture(closure_run* run, const closure_node* node)
+{
+	return run->captures[node->u.slot].u.cell->value;
+}
+
+/* Assignments to locals and captures, compound ones get the operator as their right node */
+static Lnn_Value eval_setlocal(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value value = call(node->u.op.right);
+	null_on_error;
+	run->locals[node->u.op.slot] = value;
+	return value;
+}
+
+static Lnn_Value eval_setboxed(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value value = call(node->u.op.right);
+	null_on_error;
+	Lnn_SetCell(run->state, run->locals[node->u.op.slot].u.cell, value);
+	return value;
+}
+
+static Lnn_Value eval_setboxedcapture(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value value = call(node->u.op.right);
+	null_on_error;
+	Lnn_SetCell(run->state, run->captures[node->u.op.slot].u.cell, value);
+	return value;
+}
+
+static Lnn_Value eval_closure(closure_run* run, const closure_node* node)
+{
+	const Lnn_Prototype* prototype = node->u.prototype;
+	if (prototype->numcaptures == 0)
+		return Lnn_FunctionValue(prototype);
+	if (prototype->escapes)
+	{
+		Lnn_Closure* closure = Lnn_NewClosure(run->state, prototype, run->locals, run->captures);
+		return closure ? Lnn_ClosureValue(closure) : fail(run);
+	}
+	Lnn_CopyCaptures(prototype, run->locals, run->captures, run->locals + prototype->captureslot);
+	return Lnn_FunctionValue(prototype);
+}
+
+static Lnn_Value call_native(closure_run* run, const closure_node* node, const Lnn_Native* native)
+{
+	const int numargs = node->u.invoke.numargs;
+	Lnn_Value buffer[Lnn_MAX_BUILTIN_ARGS];
+	Lnn_Value* args = numargs <= Lnn_MAX_BUILTIN_ARGS ? buffer : Utl_Malloc(sizeof(Lnn_Value) * numargs);
+	Lnn_Value result = Lnn_NullValue();
+	for (int i = 0; i < numargs && !run->error; i++)
+		args[i] = call(node->u.invoke.args[i]);
+	if (!run->error && !Lnn_CallNative(run->state, native, args, numargs, &result))
+		fail(run);
+	if (args != buffer) Utl_Free(args);
+	return result;
+}
+
+/**
+ * @brief Evaluates the function and the arguments of a call into a new frame.
+ * A function that doesn't escape is only called by the frame that made it, so its captures are in the caller.
+ * Natives are called right away, the frame gets no prototype and result has what they returned.
+ */
+static Utl_Bool enter_call(closure_run* run, const closure_node* node, closure_frame* frame, Lnn_Value* result)
+{
+	const Lnn_Value callee = call(node->u.invoke.callee);
+	if (run->error) return Utl_FALSE;
+	if (callee.type == Lnn_VT_NATIVE)
+	{
+		frame->prototype = NULL;
+		*result = call_native(run, node, callee.u.native);
+		return !run->error;
+	}
+	const Lnn_Prototype* prototype = Lnn_CheckCall(callee, node->u.invoke.numargs);
+	if (!prototype)
+	{
+		fail(run);
+		return Utl_FALSE;
+	}
+	if (run->depth + 1 >= Lnn_MAX_CALL_DEPTH)
+	{
+		printf("ERROR! Stack overflow in %s\n", prototype->name);
+		fail(run);
+		return Utl_FALSE;
+	}
+
+	frame->prototype = prototype;
+	frame->locals = Utl_Malloc(sizeof(Lnn_Value) * (prototype->numslots + 1));
+	frame->captures = NULL;
+	if (callee.type == Lnn_VT_CLOSURE)
+		frame->captures = callee.u.closure->captures;
+	else if (!prototype->escapes)
+		frame->captures = run->locals + prototype->captureslot;
+	for (int i = 0; i < node->u.invoke.numargs; i++)
+	{
+		frame->locals[i] = call(node->u.invoke.args[i]);
+		if (run->error)
+		{
+			Utl_Free(frame->locals);
+			return Utl_FALSE;
+		}
+	}
+	for (int i = node->u.invoke.numargs; i < prototype->numslots; i++)
+		frame->locals[i] = Lnn_NullValue();
+	if (!Lnn_BoxLocals(run->state, prototype, frame->locals))
+	{
+		Utl_Free(frame->locals);
+		return Utl_FALSE;
+	}
+	return Utl_TRUE;
+}
+
+/* Runs a call, and every call that replaces it with a tail call, in one C frame */
+static Lnn_Value run_call(closure_run* run, closure_frame frame)
+{
+	closure_run callee = *run;
+	callee.depth = run->depth + 1;
+	for (;;)
+	{
+		callee.locals = frame.locals;
+		callee.captures = frame.captures;
+		callee.returned = Utl_FALSE;
+		callee.result = Lnn_NullValue();
+		callee.tailcall.prototype = NULL;
+		const closure_node* body = frame.prototype->code;
+		body->function(&callee, body);
+		Utl_Free(frame.locals);
+		if (callee.error) return fail(run);
+		if (!callee.tailcall.prototype) break;
+		frame = callee.tailcall;
+	}
+	return callee.result;
+}
+
+static Lnn_Value eval_call(closure_run* run, const closure_node* node)
+{
+	closure_frame frame;
+	Lnn_Value result;
+	if (!enter_call(run, node, &frame, &result)) return Lnn_NullValue();
+	if (!frame.prototype) return result;
+	return run_call(run, frame);
+}
+
+static Lnn_Value eval_not(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value a = call(node->u.op.right);
+	return Lnn_BoolValue(!Lnn_IsTruthy(a));
+}
+
+static Lnn_Value eval_negative(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value a = call(node->u.op.right);
+	null_on_error;
+	if (!Lnn_IsNumber(a))
+	{
+		printf("ERROR! Can't negate %s\n", lnn_valuetype_names[a.type]);
+		return fail(run);
+	}
+	return Lnn_NegateNumber(a);
+}
+
+/* Member access through the inline cache of the node, a hit is a shape compare and an indexed load */
+static Lnn_Value cached_get_member(closure_run* run, Lnn_MemberCache* cache, const Lnn_Value object)
+{
+	if (Lnn_IsObject(object))
+		for (int i = 0; i < cache->numentries; i++)
+			if (cache->shapes[i] == object.u.instance->shape)
+				return object.u.instance->slots[cache->slots[i]];
+	Lnn_Value result;
+	if (!Lnn_GetMember(run->state, cache, cache->name, object, &result))
+		return fail(run);
+	return result;
+}
+
+static void cached_set_member(closure_run* run, Lnn_MemberCache* cache, const Lnn_Value object, const Lnn_Value value)
+{
+	if (Lnn_IsObject(object))
+	{
+		Lnn_Instance* instance = object.u.instance;
+		for (int i = 0; i < cache->numentries; i++)
+			if (cache->shapes[i] == instance->shape && cache->newshapes[i]->numslots <= instance->capslots)
+			{
+				instance->shape = cache->newshapes[i];
+				instance->slots[cache->slots[i]] = value;
+				Lnn_GCWriteBarrier(run->state, &instance->obj, value);
+				return;
+			}
+	}
+	if (!Lnn_SetMember(run->state, cache, cache->name, object, value))
+		fail(run);
+}
+
+static Lnn_Value eval_getmember(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value object = call(node->u.member.object);
+	null_on_error;
+	return cached_get_member(run, node->u.member.cache, object);
+}
+
+static Lnn_Value eval_setmember(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value object = call(node->u.member.object);
+	null_on_error;
+	Lnn_Value value = call(node->u.member.value);
+	null_on_error;
+	if (node->u.member.op != Lnn_OP_ASSIGN)
+	{
+		const Lnn_Value current = cached_get_member(run, node->u.member.cache, object);
+		null_on_error;
+		value = generic_binary(run, Lnn_OP_ADD + (node->u.member.op - Lnn_OP_ASSIGNADD), current, value);
+		null_on_error;
+	}
+	cached_set_member(run, node->u.member.cache, object, value);
+	null_on_error;
+	return value;
+}
+
+static Lnn_Value eval_newobject(closure_run* run, const closure_node* node)
+{
+	Lnn_Instance* instance = Lnn_NewInstance(run->state, node->u.object.count);
+	if (!instance) return fail(run);
+	const Lnn_Value object = Lnn_ObjectValue(instance);
+	for (int i = 0; i < node->u.object.count; i++)
+	{
+		const Lnn_Value value = call(node->u.object.values[i]);
+		null_on_error;
+		cached_set_member(run, &node->u.object.caches[i], object, value);
+		null_on_error;
+	}
+	return object;
+}
+
+static Lnn_Value eval_getelement(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value array = call(node->u.op.left);
+	null_on_error;
+	const Lnn_Value index = call(node->u.op.right);
+	null_on_error;
+	if (Lnn_IsArray(array) && Lnn_IsArrayIndex(array.u.array, index))
+		return Lnn_ArrayElement(array.u.array, Lnn_ArrayIndexOf(index));
+	Lnn_Value result;
+	if (!Lnn_GetElement(run->state, array, index, &result))
+		return fail(run);
+	return result;
+}
+
+static Lnn_Value eval_setelement(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value array = call(node->u.element.array);
+	null_on_error;
+	const Lnn_Value index = call(node->u.element.index);
+	null_on_error;
+	Lnn_Value value = call(node->u.element.value);
+	null_on_error;
+	if (node->u.element.op != Lnn_OP_ASSIGN)
+	{
+		Lnn_Value current;
+		if (!Lnn_GetElement(run->state, array, index, &current))
+			return fail(run);
+		value = generic_binary(run, Lnn_OP_ADD + (node->u.element.op - Lnn_OP_ASSIGNADD), current, value);
+		null_on_error;
+	}
+	if (!Lnn_SetElement(run->state, array, index, value))
+		return fail(run);
+	return value;
+}
+
+static Lnn_Value eval_callbuiltin(closure_run* run, const closure_node* node)
+{
+	Lnn_Value args[Lnn_MAX_BUILTIN_ARGS];
+	const Lnn_Builtin* builtin = node->u.call.builtin;
+	for (int i = 0; i < builtin->numargs; i++)
+	{
+		args[i] = call(node->u.call.args[i]);
+		null_on_error;
+	}
+	Lnn_Value result;
+	if (!builtin->function(run->state, args, &result))
+		return fail(run);
+	return result;
+}
+
+/* The elements are kept like the statements of a block */
+static Lnn_Value eval_newarray(closure_run* run, const closure_node* node)
+{
+	Lnn_Array* array = Lnn_NewArray(run->state, node->u.block.count);
+	if (!array) return fail(run);
+	for (int i = 0; i < node->u.block.count; i++)
+	{
+		const Lnn_Value value = call(node->u.block.nodes[i]);
+		null_on_error;
+		if (!Lnn_PushElement(run->state, array, value))
+			return fail(run);
+	}
+	return Lnn_ArrayValue(array);
+}
+
+/* Comparison of two child nodes, numbers are compared right away */
+#define define_compare(name, opid, cmp)										\
+	static Lnn_Value name(closure_run* run, const closure_node* node)		\
+	{																		\
+		const Lnn_Value a = call(node->u.op.left);							\
+		null_on_error;														\
+		const Lnn_Value b = call(node->u.op.right);							\
+		null_on_error;														\
+		if (Lnn_IsInt(a) && Lnn_IsInt(b))									\
+			return Lnn_BoolValue(a.u.integer cmp b.u.integer);				\
+		if (Lnn_IsNumber(a) && Lnn_IsNumber(b))								\
+			return Lnn_BoolValue(Lnn_NumberOf(a) cmp Lnn_NumberOf(b));		\
+		return generic_binary(run, opid, a, b);								\
+	}
+
+/* Arithmetic on two child nodes, ints stay ints while the result fits and other numbers are done on floats */
+#define define_arithmetic(name, opid, checked, arith)							\
+	static Lnn_Value name(closure_run* run, const closure_node* node)		\
+	{																		\
+		const Lnn_Value a = call(node->u.op.left);							\
+		null_on_error;														\
+		const Lnn_Value b = call(node->u.op.right);							\
+		null_on_error;														\
+		Utl_Int r;															\
+		if (Lnn_IsInt(a) && Lnn_IsInt(b) && checked(a.u.integer, b.u.integer, &r))	\
+			return Lnn_IntValue(r);											\
+		if (Lnn_IsNumber(a) && Lnn_IsNumber(b))								\
+			return Lnn_FloatValue(Lnn_NumberOf(a) arith Lnn_NumberOf(b));		\
+		return generic_binary(run, opid, a, b);								\
+	}
+
+/* Logical operator, works on the truthiness of any value so it can't fail */
+#define define_logical(name, boolresult)									\
+	static Lnn_Value name(closure_run* run, const closure_node* node)		\
+	{																		\
+		const Lnn_Value a = call(node->u.op.left);							\
+		null_on_error;														\
+		const Lnn_Value b = call(node->u.op.right);							\
+		null_on_error;														\
+		return Lnn_BoolValue(boolresult);									\
+	}
+
+/* Comparison with a number literal as the right operand */
+#define define_compare_number(name, opid, cmp)								\
+	static Lnn_Value name(closure_run* run, const closure_node* node)		\
+	{																		\
+		const Lnn_Value a = call(node->u.op.left);							\
+		null_on_error;														\
+		const Lnn_Value b = node->u.op.number;								\
+		if (Lnn_IsInt(a) && Lnn_IsInt(b))									\
+			return Lnn_BoolValue(a.u.integer cmp b.u.integer);				\
+		if (Lnn_IsNumber(a))												\
+			return Lnn_BoolValue(Lnn_NumberOf(a) cmp Lnn_NumberOf(b));		\
+		return generic_binary(run, opid, a, b);								\
+	}
+
+/* Arithmetic with a number literal as the right operand */
+#define define_arithmetic_number(name, opid, checked, arith)					\
+	static Lnn_Value name(closure_run* run, const closure_node* node)		\
+	{																		\
+		const Lnn_Value a = call(node->u.op.left);							\
+		null_on_error;														\
+		const Lnn_Value b = node->u.op.number;								\
+		Utl_Int r;															\
+		if (Lnn_IsInt(a) && Lnn_IsInt(b) && checked(a.u.integer, b.u.integer, &r))	\
+			return Lnn_IntValue(r);											\
+		if (Lnn_IsNumber(a))												\
+			return Lnn_FloatValue(Lnn_NumberOf(a) arith Lnn_NumberOf(b));		\
+		return generic_binary(run, opid, a, b);								\
+	}
+
+/* Compound assignment to a global, like x += 1 */
+#define define_assign(name, opid, checked, arith)								\
+	static Lnn_Value name(closure_run* run, const closure_node* node)		\
+	{																		\
+		const Lnn_Value b = call(node->u.op.right);							\
+		null_on_error;														\
+		Lnn_Value* target = &run->globals[node->u.op.slot].value;			\
+		Utl_Int r;															\
+		if (Lnn_IsInt(*target) && Lnn_IsInt(b) && checked(target->u.integer, b.u.integer, &r))	\
+		{																	\
+			*target = Lnn_IntValue(r);										\
+			return *target;													\
+		}																	\
+		if (Lnn_IsNumber(*target) && Lnn_IsNumber(b))						\
+		{																	\
+			*target = Lnn_FloatValue(Lnn_NumberOf(*target) arith Lnn_NumberOf(b));	\
+			return *target;													\
+		}																	\
+		const Lnn_Value result = generic_binary(run, opid, *target, b);		\
+		null_on_error;														\
+		*target = result;													\
+		return result;														\
+	}
+
+define_compare(eval_equality, Lnn_OP_EQUALITY, ==)
+define_compare(eval_inequality, Lnn_OP_INEQUALITY, !=)
+define_compare(eval_less, Lnn_OP_LESS, <)
+define_compare(eval_greater, Lnn_OP_GREATER, >)
+define_compare(eval_lessequal, Lnn_OP_LESSEQUAL, <=)
+define_compare(eval_greaterequal, Lnn_OP_GREATEREQUAL, >=)
+define_arithmetic(eval_add, Lnn_OP_ADD, Lnn_AddInts, +)
+define_arithmetic(eval_sub, Lnn_OP_SUB, Lnn_SubInts, -)
+define_arithmetic(eval_mul, Lnn_OP_MUL, Lnn_MulInts, *)
+define_arithmetic(eval_div, Lnn_OP_DIV, Lnn_DivInts, /)
+define_logical(eval_and, Lnn_IsTruthy(a) && Lnn_IsTruthy(b))
+define_logical(eval_or, Lnn_IsTruthy(a) || Lnn_IsTruthy(b))
+define_logical(eval_xor, Lnn_IsTruthy(a) != Lnn_IsTruthy(b))
+
+define_compare_number(eval_equality_number, Lnn_OP_EQUALITY, ==)
+define_compare_number(eval_inequality_number, Lnn_OP_INEQUALITY, !=)
+define_compare_number(eval_less_number, Lnn_OP_LESS, <)
+define_compare_number(eval_greater_number, Lnn_OP_GREATER, >)
+define_compare_number(eval_lessequal_number, Lnn_OP_LESSEQUAL, <=)
+define_compare_number(eval_greaterequal_number, Lnn_OP_GREATEREQUAL, >=)
+define_arithmetic_number(eval_add_number, Lnn_OP_ADD, Lnn_AddInts, +)
+define_arithmetic_number(eval_sub_number, Lnn_OP_SUB, Lnn_SubInts, -)
+define_arithmetic_number(eval_mul_number, Lnn_OP_MUL, Lnn_MulInts, *)
+define_arithmetic_number(eval_div_number, Lnn_OP_DIV, Lnn_DivInts, /)
+
+define_assign(eval_assignadd, Lnn_OP_ADD, Lnn_AddInts, +)
+define_assign(eval_assignsub, Lnn_OP_SUB, Lnn_SubInts, -)
+define_assign(eval_assignmul, Lnn_OP_MUL, Lnn_MulInts, *)
+define_assign(eval_assigndiv, Lnn_OP_DIV, Lnn_DivInts, /)
+
+/* Indexed by operator id, NULL where the operator isn't a plain binary operator */
+static const closure_function binary_functions[Lnn_NUM_OPERATORS] =
+{
+	NULL, eval_assignadd, eval_assignsub, eval_assignmul, eval_assigndiv,
+	NULL, eval_and, eval_or, eval_xor, NULL,
+	eval_equality, eval_inequality, eval_less, eval_greater, eval_lessequal, eval_greaterequal,
+	eval_add, eval_sub, eval_mul, eval_div,
+	NULL, NULL,
+};
+
+static const closure_function binary_number_functions[Lnn_NUM_OPERATORS] =
+{
+	NULL, NULL, NULL, NULL, NULL,
+	NULL, NULL, NULL, NULL, NULL,
+	eval_equality_number, eval_inequality_number, eval_less_number, eval_greater_number, eval_lessequal_number, eval_greaterequal_number,
+	eval_add_number, eval_sub_number, eval_mul_number, eval_div_number,
+	NULL, NULL,
+};
+
+
+
+/* Statements evaluate to null, the error flag stops them */
+
+static Lnn_Value exec_block(closure_run* run, const closure_node* node)
+{
+	for (int i = 0; i < node->u.block.count; i++)
+	{
+		const closure_node* stmt = node->u.block.nodes[i];
+		call(stmt);
+		if (run->error || run->returned) return Lnn_NullValue();
+		/* Calls keep their locals in C, so nothing is collected while one runs */
+		if (run->depth == 0 && !Lnn_GCSafepoint(run->state, NULL, NULL))
+		{
+			run->error = Utl_TRUE;
+			return Lnn_NullValue();
+		}
+	}
+	return Lnn_NullValue();
+}
+
+static Lnn_Value exec_return(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value result = node->u.op.right ? call(node->u.op.right) : Lnn_NullValue();
+	null_on_error;
+	run->result = result;
+	run->returned = Utl_TRUE;
+	return Lnn_NullValue();
+}
+
+/* return f(x) is run by the call that runs this one, unless f keeps its captures in this frame */
+static Lnn_Value exec_tailcall(closure_run* run, const closure_node* node)
+{
+	closure_frame frame;
+	if (!enter_call(run, node->u.op.right, &frame, &run->result)) return Lnn_NullValue();
+	if (!frame.prototype)
+		;
+	else if (frame.prototype->escapes || frame.prototype->numcaptures == 0)
+		run->tailcall = frame;
+	else
+	{
+		run->result = run_call(run, frame);
+		null_on_error;
+	}
+	run->returned = Utl_TRUE;
+	return Lnn_NullValue();
+}
+
+static Lnn_Value exec_if(closure_run* run, const closure_node* node)
+{
+	const Lnn_Value condition = call(node->u.branch.condition);
+	null_on_error;
+	if (Lnn_IsTruthy(condition))
+		return call(node->u.branch.ontrue);
+	if (node->u.branch.onfalse)
+		return call(node->u.branch.onfalse);
+	return Lnn_NullValue();
+}
+
+/* An elementwise loop that runs as a kernel when the globals allow it */
+static Lnn_Value exec_elementwise(closure_run* run, const closure_node* node)
+{
+	if (Lnn_RunElementwiseLoop(run->state, node->u.elementwise.loop))
+		return Lnn_NullValue();
+	return call(node->u.elementwise.fallback);
+}
+
+static Lnn_Value exec_while(closure_run* run, const closure_node* node)
+{
+	for (;;)
+	{
+		const Lnn_Value condition = call(node->u.branch.condition);
+		null_on_error;
+		if (!Lnn_IsTruthy(condition))
+			return Lnn_NullValue();
+		call(node->u.branch.ontrue);
+		if (run->error || run->returned) return Lnn_NullValue();
+	}
+}
+
+
+
+typedef struct
+{
+	Lnn_State* state;
+	Lnn_ClosureCode* code;
+	const Lnn_Function* function;	/* Function being compiled, NULL at the top level */
+} closure_compiler;
+
+static closure_node* new_node(const closure_function function)
+{
+	closure_node* node = Utl_AllocType(closure_node);
+	node->function = function;
+	return node;
+}
+
+static Lnn_MemberCache* new_member_cache(const char* name)
+{
+	Lnn_MemberCache* cache = Utl_AllocType(Lnn_MemberCache);
+	cache->name = _strdup(name);
+	return cache;
+}
+
+static void destroy_node(closure_node* node)
+{
+	if (!node) return;
+	if (node->function == exec_block || node->function == eval_newarray)
+	{
+		for (int i = 0; i < node->u.block.count; i++)
+			destroy_node(node->u.block.nodes[i]);
+		Utl_Free(node->u.block.nodes);
+	} else if (node->function == exec_if || node->function == exec_while)
+	{
+		destroy_node(node->u.branch.condition);
+		destroy_node(node->u.branch.ontrue);
+		destroy_node(node->u.branch.onfalse);
+	} else if (node->function == eval_getmember || node->function == eval_setmember)
+	{
+		destroy_node(node->u.member.object);
+		destroy_node(node->u.member.value);
+		Utl_Free(node->u.member.cache->name);
+		Utl_Free(node->u.member.cache);
+	} else if (node->function == eval_callbuiltin)
+	{
+		for (int i = 0; i < node->u.call.builtin->numargs; i++)
+			destroy_node(node->u.call.args[i]);
+	} else if (node->function == eval_call)
+	{
+		destroy_node(node->u.invoke.callee);
+		for (int i = 0; i < node->u.invoke.numargs; i++)
+			destroy_node(node->u.invoke.args[i]);
+		Utl_Free(node->u.invoke.args);
+	} else if (node->function == exec_elementwise)
+	{
+		Utl_Free(node->u.elementwise.loop);
+		destroy_node(node->u.elementwise.fallback);
+	} else if (node->function == eval_setelement)
+	{
+		destroy_node(node->u.element.array);
+		destroy_node(node->u.element.index);
+		destroy_node(node->u.element.value);
+	} else if (node->function == eval_newobject)
+	{
+		for (int i = 0; i < node->u.object.count; i++)
+		{
+			destroy_node(node->u.object.values[i]);
+			Utl_Free(node->u.object.caches[i].name);
+		}
+		Utl_Free(node->u.object.values);
+		Utl_Free(node->u.object.caches);
+	} else if (node->function != eval_constant && node->function != eval_global && node->function != eval_local &&
+			   node->function != eval_boxed && node->function != eval_capture && node->function != eval_boxedcapture &&
+			   node->function != eval_closure)
+	{
+		destroy_node(node->u.op.left);
+		destroy_node(node->u.op.right);
+	}
+	Utl_Free(node);
+}
+
+static closure_node* compile_expression(closure_compiler* c, const Lnn_ExprNode* expr);
+static closure_node* compile_codeblock(closure_compiler* c, const Lnn_CodeBlock* block);
+
+/* Boxed locals and captures are read through their cell */
+static closure_node* compile_variable(closure_compiler* c, const Lnn_VariableRef* ref)
+{
+	closure_node* node;
+	switch (ref->kind)
+	{
+	case Lnn_VK_LOCAL:
+		node = new_node(c->function->boxed[ref->index] ? eval_boxed : eval_local);
+		node->u.slot = ref->index;
+		return node;
+	case Lnn_VK_CAPTURE:
+		node = new_node(c->function->captures[ref->index].boxed ? eval_boxedcapture : eval_capture);
+		node->u.slot = ref->index;
+		return node;
+	default:
+		node = new_node(eval_global);
+		node->u.slot = Lnn_GetGlobalSlot(c->state, ref->name);
+		return node;
+	}
+}
+
+/* Compiles the body of a function literal, its prototype is kept in the code so it can be destroyed with it */
+static closure_node* compile_closure(closure_compiler* c, Lnn_Function* function)
+{
+	closure_compiler inner = *c;
+	inner.function = function;
+	closure_node* body = compile_codeblock(&inner, function->block);
+	if (!body) return NULL;
+
+	Lnn_ClosureCode* code = c->code;
+	if (code->numprototypes >= code->capprototypes)
+	{
+		code->capprototypes = code->capprototypes ? code->capprototypes * 2 : 4;
+		code->prototypes = Utl_Realloc(code->prototypes, sizeof(Lnn_Prototype*) * code->capprototypes);
+	}
+	Lnn_Prototype* prototype = Lnn_CreatePrototype(function, body);
+	code->prototypes[code->numprototypes++] = prototype;
+
+	closure_node* node = new_node(eval_closure);
+	node->u.prototype = prototype;
+	return node;
+}
+
+static closure_node* compile_call(closure_compiler* c, const Lnn_ExprNode* expr)
+{
+	closure_node* node = new_node(eval_call);
+	node->u.invoke.args = Utl_Calloc(expr->u.functioncall.numargs + 1, sizeof(closure_node*));
+	node->u.invoke.callee = compile_variable(c, &expr->u.functioncall.callee);
+	for (int i = 0; i < expr->u.functioncall.numargs; i++)
+	{
+		node->u.invoke.args[i] = compile_expression(c, expr->u.functioncall.args[i]);
+		node->u.invoke.numargs++;
+		if (!node->u.invoke.args[i])
+		{
+			destroy_node(node);
+			return NULL;
+		}
+	}
+	return node;
+}
+
+static closure_node* compile_operator(closure_compiler* c, const Lnn_ExprNode* expr)
+{
+	const Lnn_OperatorID op = expr->u.op.id;
+	closure_node* node = NULL;
+
+	if (Lnn_IsAssignmentOp(op) && member_name(expr->u.op.left))
+	{
+		node = new_node(eval_setmember);
+		node->u.member.op = op;
+		node->u.member.cache = new_member_cache(member_name(expr->u.op.left));
+		node->u.member.object = compile_expression(c, expr->u.op.left->u.op.left);
+		if (!node->u.member.object) goto on_fail;
+		node->u.member.value = compile_expression(c, expr->u.op.right);
+		if (!node->u.member.value) goto on_fail;
+		return node;
+	}
+
+	if (Lnn_IsAssignmentOp(op) && expr->u.op.left->type == Lnn_ET_OPERATOR && expr->u.op.left->u.op.id == Lnn_OP_ARRAYACCESS)
+	{
+		node = new_node(eval_setelement);
+		node->u.element.op = op;
+		node->u.element.array = compile_expression(c, expr->u.op.left->u.op.left);
+		if (!node->u.element.array) goto on_fail;
+		node->u.element.index = compile_expression(c, expr->u.op.left->u.op.right);
+		if (!node->u.element.index) goto on_fail;
+		node->u.element.value = compile_expression(c, expr->u.op.right);
+		if (!node->u.element.value) goto on_fail;
+		return node;
+	}
+
+	if (Lnn_IsAssignmentOp(op))
+	{
+		if (expr->u.op.left->type != Lnn_ET_VARIABLE)
+		{
+			printf("ERROR! Can only assign to variables, members and elements\n");
+			return NULL;
+		}
+		const Lnn_VariableRef* target = &expr->u.op.left->u.variable;
+		if (target->kind == Lnn_VK_GLOBAL)
+		{
+			node = new_node(op == Lnn_OP_ASSIGN ? eval_assign : binary_functions[op]);
+			node->u.op.slot = Lnn_GetGlobalSlot(c->state, target->name);
+			node->u.op.right = compile_expression(c, expr->u.op.right);
+			if (!node->u.op.right) goto on_fail;
+			return node;
+		}
+
+		if (target->kind == Lnn_VK_LOCAL)
+			node = new_node(c->function->boxed[target->index] ? eval_setboxed : eval_setlocal);
+		else
+			node = new_node(eval_setboxedcapture);
+		node->u.op.slot = target->index;
+		closure_node* value = compile_expression(c, expr->u.op.right);
+		if (!value) goto on_fail;
+		if (op != Lnn_OP_ASSIGN)
+		{
+			/* x += y is stored as x = x + y */
+			closure_node* binary = new_node(binary_functions[Lnn_OP_ADD + (op - Lnn_OP_ASSIGNADD)]);
+			binary->u.op.left = compile_variable(c, target);
+			binary->u.op.right = value;
+			value = binary;
+		}
+		node->u.op.right = value;
+		return node;
+	}
+
+	if (Lnn_IsUnaryOp(op))
+	{
+		node = new_node(op == Lnn_OP_NOT ? eval_not : eval_negative);
+		node->u.op.right = compile_expression(c, expr->u.op.right);
+		if (!node->u.op.right) goto on_fail;
+		return node;
+	}
+
+	if (op == Lnn_OP_MEMBERACCESS)
+	{
+		if (!member_name(expr))
+		{
+			printf("ERROR! Expected a member name after '.'\n");
+			return NULL;
+		}
+		node = new_node(eval_getmember);
+		node->u.member.cache = new_member_cache(member_name(expr));
+		node->u.member.object = compile_expression(c, expr->u.op.left);
+		if (!node->u.member.object) goto on_fail;
+		return node;
+	}
+
+	if (op == Lnn_OP_ARRAYACCESS)
+	{
+		node = new_node(eval_getelement);
+		node->u.op.left = compile_expression(c, expr->u.op.left);
+		if (!node->u.op.left) goto on_fail;
+		node->u.op.right = compile_expression(c, expr->u.op.right);
+		if (!node->u.op.right) goto on_fail;
+		return node;
+	}
+
+	if (!binary_functions[op])
+	{
+		printf("ERROR! Operator %s isn't supported yet\n", lnn_operatorid_names[op]);
+		return NULL;
+	}
+
+	/* Number literals on the right are kept in the node itself */
+	if (Lnn_IsNumberLiteral(expr->u.op.right) && binary_number_functions[op])
+	{
+		node = new_node(binary_number_functions[op]);
+		node->u.op.number = expr->u.op.right->type == Lnn_ET_INTLITERAL ?
+			Lnn_IntValue(expr->u.op.right->u.integer) : Lnn_FloatValue(expr->u.op.right->u.number);
+	} else
+	{
+		node = new_node(binary_functions[op]);
+		node->u.op.right = compile_expression(c, expr->u.op.right);
+		if (!node->u.op.right) goto on_fail;
+	}
+	node->u.op.left = compile_expression(c, expr->u.op.left);
+	if (!node->u.op.left) goto on_fail;
+	return node;
+
+on_fail:
+	destroy_node(node);
+	return NULL;
+}
+
+static closure_node* compile_expression(closure_compiler* c, const Lnn_ExprNode* expr)
+{
+	closure_node* node;
+	switch (expr->type)
+	{
+	case Lnn_ET_OPERATOR:
+		return compile_operator(c, expr);
+
+	case Lnn_ET_NUMBERLITERAL:
+		node = new_node(eval_constant);
+		node->u.constant = Lnn_FloatValue(expr->u.number);
+		return node;
+
+	case Lnn_ET_INTLITERAL:
+		node = new_node(eval_constant);
+		node->u.constant = Lnn_IntValue(expr->u.integer);
+		return node;
+
+	case Lnn_ET_BOOLLITERAL:
+		node = new_node(eval_constant);
+		node->u.constant = Lnn_BoolValue(expr->u.boolean);
+		return node;
+
+	case Lnn_ET_STRINGLITERAL:
+		node = new_node(eval_constant);
+		node->u.constant = Lnn_LiteralString(c->state, expr->u.str.chars, expr->u.str.len);
+		return node;
+
+	case Lnn_ET_VARIABLE:
+		return compile_variable(c, &expr->u.variable);
+
+	case Lnn_ET_CLOSURE:
+		return compile_closure(c, expr->u.closure);
+
+	case Lnn_ET_OBJECT:
+		node = new_node(eval_newobject);
+		node->u.object.values = Utl_Calloc(expr->u.object.numfields + 1, sizeof(closure_node*));
+		node->u.object.caches = Utl_Calloc(expr->u.object.numfields + 1, sizeof(Lnn_MemberCache));
+		for (int i = 0; i < expr->u.object.numfields; i++)
+		{
+			node->u.object.caches[i].name = _strdup(expr->u.object.names[i]);
+			node->u.object.values[i] = compile_expression(c, expr->u.object.values[i]);
+			node->u.object.count++;
+			if (!node->u.object.values[i])
+			{
+				destroy_node(node);
+				return NULL;
+			}
+		}
+		return node;
+
+	case Lnn_ET_FUNCTIONCALL:
+	{
+		if (expr->u.functioncall.callee.kind != Lnn_VK_BUILTIN)
+			return compile_call(c, expr);
+		const int builtin = find_called_builtin(expr);
+		if (builtin < 0) return NULL;
+		node = new_node(eval_callbuiltin);
+		node->u.call.builtin = &lnn_builtins[builtin];
+		for (int i = 0; i < expr->u.functioncall.numargs; i++)
+		{
+			node->u.call.args[i] = compile_expression(c, expr->u.functioncall.args[i]);
+			if (!node->u.call.args[i])
+			{
+				destroy_node(node);
+				return NULL;
+			}
+		}
+		return node;
+	}
+
+	case Lnn_ET_ARRAY:
+		node = new_node(eval_newarray);
+		node->u.block.nodes = Utl_Calloc(expr->u.array.numelements + 1, sizeof(closure_node*));
+		for (int i = 0; i < expr->u.array.numelements; i++)
+		{
+			closure_node* element = compile_expression(c, expr->u.array.elements[i]);
+			if (!element)
+			{
+				destroy_node(node);
+				return NULL;
+			}
+			node->u.block.nodes[node->u.block.count++] = element;
+		}
+		return node;
+
+	default:
+		printf("ERROR! Expression type %s isn't supported yet\n", Lnn_ExprNodeTypeName(expr->type));
+		return NULL;
+	}
+}
+
+static closure_node* compile_statement(closure_compiler* c, const Lnn_Statement* stmt)
+{
+	closure_node* node = NULL;
+	switch (stmt->type)
+	{
+	case Lnn_ST_EXPRESSION:
+		return compile_expression(c, stmt->u.stmt_expr.expression);
+
+	case Lnn_ST_IF:
+		node = new_node(exec_if);
+		node->u.branch.condition = compile_expression(c, stmt->u.stmt_if.condition);
+		node->u.branch.ontrue = compile_codeblock(c, stmt->u.stmt_if.block_ontrue);
+		if (!node->u.branch.condition || !node->u.branch.ontrue) goto on_fail;
+		if (stmt->u.stmt_if.block_onfalse)
+		{
+			node->u.branch.onfalse = compile_codeblock(c, stmt->u.stmt_if.block_onfalse);
+			if (!node->u.branch.onfalse) goto on_fail;
+		}
+		return node;
+
+	case Lnn_ST_WHILE:
+		node = new_node(exec_while);
+		node->u.branch.condition = compile_expression(c, stmt->u.stmt_while.condition);
+		node->u.branch.ontrue = compile_codeblock(c, stmt->u.stmt_while.block);
+		if (!node->u.branch.condition || !node->u.branch.ontrue) goto on_fail;
+		{
+			Lnn_ElementwiseLoop loop;
+			if (Lnn_MatchElementwiseLoop(c->state, stmt, &loop))
+			{
+				closure_node* lowered = new_node(exec_elementwise);
+				lowered->u.elementwise.loop = Utl_Malloc(sizeof(Lnn_ElementwiseLoop));
+				*lowered->u.elementwise.loop = loop;
+				lowered->u.elementwise.fallback = node;
+				return lowered;
+			}
+		}
+		return node;
+
+	case Lnn_ST_RETURN:
+		node = new_node(exec_return);
+		if (stmt->u.stmt_return.expression)
+		{
+			node->u.op.right = compile_expression(c, stmt->u.stmt_return.expression);
+			if (!node->u.op.right) goto on_fail;
+			if (node->u.op.right->function == eval_call)
+				node->function = exec_tailcall;
+		}
+		return node;
+
+	default:
+		printf("ERROR! Statement type %s isn't supported yet\n", lnn_statementtype_names[stmt->type]);
+		return NULL;
+	}
+
+on_fail:
+	destroy_node(node);
+	return NULL;
+}
+
+static closure_node* compile_codeblock(closure_compiler* c, const Lnn_CodeBlock* block)
+{
+	closure_node* node = new_node(exec_block);
+	node->u.block.nodes = Utl_Calloc(block->numstatements + 1, sizeof(closure_node*));
+	for (const Lnn_Statement* i = block->statements; i < block->statements + block->numstatements; i++)
+	{
+		closure_node* stmt = compile_statement(c, i);
+		if (!stmt)
+		{
+			destroy_node(node);
+			return NULL;
+		}
+		node->u.block.nodes[node->u.block.count++] = stmt;
+	}
+	return node;
+}
+
+
+
+Lnn_ClosureCode* Lnn_CompileClosures(Lnn_State* state, const Lnn_CodeBlock* block)
+{
+	Utl_Assert(state && block);
+
+	closure_compiler c;
+	c.state = state;
+	c.function = NULL;
+	c.code = Utl_AllocType(Lnn_ClosureCode);
+	c.code->root = compile_codeblock(&c, block);
+	if (!c.code->root)
+	{
+		Lnn_DestroyClosures(c.code);
+		return NULL;
+	}
+	return c.code;
+}
+
+Lnn_ExecResult Lnn_RunClosures(Lnn_State* state, const Lnn_ClosureCode* code)
+{
+	Utl_Assert(state && code);
+
+	closure_run run = { 0 };
+	run.state = state;
+	run.globals = state->globals;
+	run.error = Utl_FALSE;
+	Lnn_GCStartRun(state);
+	code->root->function(&run, code->root);
+	return run.error ? Lnn_EXEC_ERROR : Lnn_EXEC_OK;
+}
+
+void Lnn_DestroyClosures(Lnn_ClosureCode* code)
+{
+	if (!code) return;
+	destroy_node(code->root);
+	for (int i = 0; i < code->numprototypes; i++)
+	{
+		destroy_node(code->prototypes[i]->code);
+		Lnn_DestroyPrototype(code->prototypes[i]);
+	}
+	Utl_Free(code->prototypes);
+	Utl_Free(code);
+}
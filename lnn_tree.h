@@ -0,0 +1,52 @@
+#ifndef _Lnn_TREE_H_
+#define _Lnn_TREE_H_
+
+#include "fab_utility.h"
+#include "lnn_code.h"
+#include "lnn_state.h"
+#include "lnn_vm.h"
+
+/**
+ * Tree execution tiers, they run parsed code without compiling it to bytecode.
+ * The plain walker switches on the type of every node and looks up variables by name.
+ * Closure compilation turns the tree into nodes that each hold a function pointer made for
+ * exactly that operation, with variables resolved to global slots and literals made into values.
+ * Both tiers keep the locals of a call in C, so the collector only runs between top level statements.
+ * Functions can only be called by the tier that made them, their prototypes point to the code of that tier.
+ */
+
+/**
+ * @brief Runs a parsed code block by walking the tree directly.
+ * @param state State to run in.
+ * @param block The top level code block.
+ * @return Lnn_EXEC_OK or Lnn_EXEC_ERROR.
+ */
+Lnn_ExecResult Lnn_WalkCodeBlock(Lnn_State* state,
+								 const Lnn_CodeBlock* block);
+
+
+
+typedef struct Lnn_ClosureCode Lnn_ClosureCode;
+
+/**
+ * @brief Compiles a parsed code block into a tree of closures.
+ * The closure code doesn't point into the parsed tree so the tree can be destroyed afterwards.
+ * @param state State the code will run in, globals are resolved to its slots.
+ * @param block The top level code block.
+ * @return The closure code, or NULL if the code couldn't be compiled.
+ */
+Lnn_ClosureCode* Lnn_CompileClosures(Lnn_State* state,
+									 const Lnn_CodeBlock* block);
+
+/**
+ * @brief Runs closure code from Lnn_CompileClosures().
+ * @param state State to run in, the code must have been compiled for it.
+ * @param code The code to run.
+ * @return Lnn_EXEC_OK or Lnn_EXEC_ERROR.
+ */
+Lnn_ExecResult Lnn_RunClosures(Lnn_State* state,
+							   const Lnn_ClosureCode* code);
+
+void Lnn_DestroyClosures(Lnn_ClosureCode* code);
+
+#endif
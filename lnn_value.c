@@ -0,0 +1,149 @@
+#include "lnn_value.h"
+#include "lnn_state.h"
+#include "lnn_gc.h"
+#include "lnn_object.h"
+#include "lnn_array.h"
+#include "lnn_string.h"
+
+const char* lnn_valuetype_names[Lnn_NUM_VALUETYPES] =
+{
+	"null",
+	"bool",
+	"number",
+	"number",
+	"function",
+	"function",
+	"channel",
+	"string",
+	"string",
+	"object",
+	"array",
+	"function",
+	"cell",
+};
+
+
+
+void Lnn_DestroyObject(Lnn_Object* object)
+{
+	if (!object) return;
+	Utl_Free(object);
+}
+
+
+
+Utl_Bool Lnn_ValuesEqual(Lnn_State* state, const Lnn_Value a, const Lnn_Value b)
+{
+	/* Short and long strings can only be equal if a long one was made through the api */
+	if (Lnn_IsString(a) && Lnn_IsString(b)) return Lnn_StringsEqual(state, a, b);
+	if (Lnn_IsNumber(a) && Lnn_IsNumber(b) && a.type != b.type) return Lnn_NumberOf(a) == Lnn_NumberOf(b);
+	if (a.type != b.type) return Utl_FALSE;
+	switch (a.type)
+	{
+	case Lnn_VT_NULL: return Utl_TRUE;
+	case Lnn_VT_BOOL: return a.u.boolean == b.u.boolean;
+	case Lnn_VT_FLOAT: return a.u.number == b.u.number;
+	case Lnn_VT_INT: return a.u.integer == b.u.integer;
+	case Lnn_VT_FUNCTION: return a.u.prototype == b.u.prototype;
+	case Lnn_VT_NATIVE: return a.u.native == b.u.native;
+	case Lnn_VT_CHANNEL: return a.u.channel == b.u.channel;
+	case Lnn_VT_OBJECT:
+	case Lnn_VT_ARRAY:
+	case Lnn_VT_CLOSURE:
+	case Lnn_VT_CELL: return a.u.object == b.u.object;
+	default: return Utl_FALSE;
+	}
+}
+
+Utl_Bool Lnn_BinaryOperation(Lnn_State* state,
+							 const Lnn_OperatorID op,
+							 const Lnn_Value a,
+							 const Lnn_Value b,
+							 Lnn_Value* result)
+{
+	switch (op)
+	{
+	case Lnn_OP_EQUALITY:	*result = Lnn_BoolValue(Lnn_ValuesEqual(state, a, b)); return Utl_TRUE;
+	case Lnn_OP_INEQUALITY:	*result = Lnn_BoolValue(!Lnn_ValuesEqual(state, a, b)); return Utl_TRUE;
+	case Lnn_OP_AND:		*result = Lnn_BoolValue(Lnn_IsTruthy(a) && Lnn_IsTruthy(b)); return Utl_TRUE;
+	case Lnn_OP_OR:			*result = Lnn_BoolValue(Lnn_IsTruthy(a) || Lnn_IsTruthy(b)); return Utl_TRUE;
+	case Lnn_OP_XOR:		*result = Lnn_BoolValue(Lnn_IsTruthy(a) != Lnn_IsTruthy(b)); return Utl_TRUE;
+	default: break;
+	}
+
+	if (Lnn_IsInt(a) && Lnn_IsInt(b))
+	{
+		const Utl_Int x = a.u.integer, y = b.u.integer;
+		Utl_Int r;
+		switch (op)
+		{
+		case Lnn_OP_LESS:			*result = Lnn_BoolValue(x < y); return Utl_TRUE;
+		case Lnn_OP_GREATER:		*result = Lnn_BoolValue(x > y); return Utl_TRUE;
+		case Lnn_OP_LESSEQUAL:		*result = Lnn_BoolValue(x <= y); return Utl_TRUE;
+		case Lnn_OP_GREATEREQUAL:	*result = Lnn_BoolValue(x >= y); return Utl_TRUE;
+		case Lnn_OP_ADD:			*result = Lnn_AddInts(x, y, &r) ? Lnn_IntValue(r) : Lnn_FloatValue((Utl_Float)x + (Utl_Float)y); return Utl_TRUE;
+		case Lnn_OP_SUB:			*result = Lnn_SubInts(x, y, &r) ? Lnn_IntValue(r) : Lnn_FloatValue((Utl_Float)x - (Utl_Float)y); return Utl_TRUE;
+		case Lnn_OP_MUL:			*result = Lnn_MulInts(x, y, &r) ? Lnn_IntValue(r) : Lnn_FloatValue((Utl_Float)x * (Utl_Float)y); return Utl_TRUE;
+		case Lnn_OP_DIV:			*result = Lnn_FloatValue((Utl_Float)x / (Utl_Float)y); return Utl_TRUE;
+		default: break;
+		}
+	} else if (Lnn_IsNumber(a) && Lnn_IsNumber(b))
+	{
+		const Utl_Float x = Lnn_NumberOf(a), y = Lnn_NumberOf(b);
+		switch (op)
+		{
+		case Lnn_OP_LESS:			*result = Lnn_BoolValue(x < y); return Utl_TRUE;
+		case Lnn_OP_GREATER:		*result = Lnn_BoolValue(x > y); return Utl_TRUE;
+		case Lnn_OP_LESSEQUAL:		*result = Lnn_BoolValue(x <= y); return Utl_TRUE;
+		case Lnn_OP_GREATEREQUAL:	*result = Lnn_BoolValue(x >= y); return Utl_TRUE;
+		case Lnn_OP_ADD:			*result = Lnn_FloatValue(x + y); return Utl_TRUE;
+		case Lnn_OP_SUB:			*result = Lnn_FloatValue(x - y); return Utl_TRUE;
+		case Lnn_OP_MUL:			*result = Lnn_FloatValue(x * y); return Utl_TRUE;
+		case Lnn_OP_DIV:			*result = Lnn_FloatValue(x / y); return Utl_TRUE;
+		default: break;
+		}
+	} else if (Lnn_IsString(a) && Lnn_IsString(b))
+	{
+		/* Concatenating doesn't look at the characters, ropes are only flattened to compare them */
+		if (op == Lnn_OP_ADD)
+			return Lnn_ConcatStrings(state, a, b, result);
+
+		/* Strings compare alphabetically */
+		switch (op)
+		{
+		case Lnn_OP_LESS:			*result = Lnn_BoolValue(Lnn_CompareStrings(state, a, b) < 0); return Utl_TRUE;
+		case Lnn_OP_GREATER:		*result = Lnn_BoolValue(Lnn_CompareStrings(state, a, b) > 0); return Utl_TRUE;
+		case Lnn_OP_LESSEQUAL:		*result = Lnn_BoolValue(Lnn_CompareStrings(state, a, b) <= 0); return Utl_TRUE;
+		case Lnn_OP_GREATEREQUAL:	*result = Lnn_BoolValue(Lnn_CompareStrings(state, a, b) >= 0); return Utl_TRUE;
+		default: break;
+		}
+	}
+
+	printf("ERROR! Can't use '%s' on %s and %s\n", lnn_operator_strings[op],
+		   lnn_valuetype_names[a.type], lnn_valuetype_names[b.type]);
+	return Utl_FALSE;
+}
+
+void Lnn_PrintValue(const Lnn_Value value)
+{
+	switch (value.type)
+	{
+	case Lnn_VT_NULL: printf("null"); return;
+	case Lnn_VT_BOOL: value.u.boolean ? printf("true") : printf("false"); return;
+	case Lnn_VT_FLOAT: printf("%g", value.u.number); return;
+	case Lnn_VT_INT: printf("%lld", (long long)value.u.integer); return;
+	case Lnn_VT_SHORTSTRING:
+	case Lnn_VT_STRING:
+		putchar('"');
+		Lnn_PrintString(value);
+		putchar('"');
+		return;
+	case Lnn_VT_OBJECT: Lnn_PrintInstance(value.u.instance, 0); return;
+	case Lnn_VT_ARRAY: Lnn_PrintArray(value.u.array, 0); return;
+	case Lnn_VT_FUNCTION:
+	case Lnn_VT_NATIVE:
+	case Lnn_VT_CLOSURE: printf("function"); return;
+	case Lnn_VT_CHANNEL: printf("channel"); return;
+	default: printf("invalid"); return;
+	}
+}
@@ -0,0 +1,166 @@
+#ifndef _Lnn_VALUE_H_
+#define _Lnn_VALUE_H_
+
+#include "fab_utility.h"
+#include "lnn_code.h"
+
+struct Lnn_State;
+struct Lnn_String;
+struct Lnn_Instance;
+struct Lnn_Array;
+struct Lnn_Prototype;
+struct Lnn_Closure;
+struct Lnn_Cell;
+struct Lnn_Native;
+struct Lnn_Channel;
+
+typedef enum
+{
+	Lnn_VT_NULL,
+	Lnn_VT_BOOL,
+	Lnn_VT_FLOAT,
+	Lnn_VT_INT,			/* Whole number that fits in Utl_Int, scripts see it as a number like floats */
+	Lnn_VT_FUNCTION,	/* Function value that doesn't need a closure object, see lnn_function.h */
+	Lnn_VT_NATIVE,		/* C function the host registered, see lnn_native.h */
+	Lnn_VT_CHANNEL,		/* Channel the host bound, see lnn_channel.h */
+	Lnn_VT_SHORTSTRING,	/* String that fits in the value itself */
+	Lnn_VT_STRING,		/* This and every type after it is an Lnn_Object */
+	Lnn_VT_OBJECT,
+	Lnn_VT_ARRAY,
+	Lnn_VT_CLOSURE,
+	Lnn_VT_CELL,		/* Box of a captured variable, never seen by scripts */
+	Lnn_NUM_VALUETYPES
+} Lnn_ValueType;
+extern const char* lnn_valuetype_names[Lnn_NUM_VALUETYPES];
+
+/**
+ * @brief Header of every value that lives on the heap.
+ * Objects created while running are managed by the garbage collector of the state that made them,
+ * old ones are linked into its list of the old generation.
+ */
+typedef struct Lnn_Object
+{
+	Utl_ListLinks links;
+	Lnn_ValueType type;
+	unsigned char color;	/* Lnn_GCColor */
+	unsigned char flags;	/* Lnn_GC_STATIC, Lnn_GC_YOUNG... */
+} Lnn_Object;
+
+/* Longest string that is kept inside a value */
+#define Lnn_SHORT_STRING_MAX 6
+
+typedef struct Lnn_Value
+{
+	Lnn_ValueType type;
+	union
+	{
+		Utl_Bool boolean;
+		Utl_Float number;
+		Utl_Int integer;
+		struct
+		{
+			char chars[Lnn_SHORT_STRING_MAX + 1];	/* Null terminated, the rest is zeroed */
+			unsigned char len;
+		} shortstring;
+		struct Lnn_String* string;
+		struct Lnn_Instance* instance;
+		struct Lnn_Array* array;
+		const struct Lnn_Prototype* prototype;
+		struct Lnn_Closure* closure;
+		struct Lnn_Cell* cell;
+		const struct Lnn_Native* native;
+		struct Lnn_Channel* channel;
+		Lnn_Object* object;
+	} u;
+} Lnn_Value;
+
+#define Lnn_NullValue()			((Lnn_Value){ .type = Lnn_VT_NULL })
+#define Lnn_BoolValue(b)		((Lnn_Value){ .type = Lnn_VT_BOOL, .u.boolean = (b) })
+#define Lnn_FloatValue(n)		((Lnn_Value){ .type = Lnn_VT_FLOAT, .u.number = (n) })
+#define Lnn_IntValue(i)			((Lnn_Value){ .type = Lnn_VT_INT, .u.integer = (i) })
+#define Lnn_StringValue(s)		((Lnn_Value){ .type = Lnn_VT_STRING, .u.string = (s) })
+#define Lnn_ObjectValue(o)		((Lnn_Value){ .type = Lnn_VT_OBJECT, .u.instance = (o) })
+#define Lnn_ArrayValue(a)		((Lnn_Value){ .type = Lnn_VT_ARRAY, .u.array = (a) })
+#define Lnn_FunctionValue(p)	((Lnn_Value){ .type = Lnn_VT_FUNCTION, .u.prototype = (p) })
+#define Lnn_ClosureValue(c)		((Lnn_Value){ .type = Lnn_VT_CLOSURE, .u.closure = (c) })
+#define Lnn_CellValue(c)		((Lnn_Value){ .type = Lnn_VT_CELL, .u.cell = (c) })
+#define Lnn_NativeValue(n)		((Lnn_Value){ .type = Lnn_VT_NATIVE, .u.native = (n) })
+#define Lnn_ChannelValue(c)		((Lnn_Value){ .type = Lnn_VT_CHANNEL, .u.channel = (c) })
+
+#define Lnn_IsFloat(v)			((v).type == Lnn_VT_FLOAT)
+#define Lnn_IsInt(v)			((v).type == Lnn_VT_INT)
+#define Lnn_IsNumber(v)			(Lnn_IsFloat(v) || Lnn_IsInt(v))
+#define Lnn_IsString(v)			((v).type == Lnn_VT_SHORTSTRING || (v).type == Lnn_VT_STRING)
+#define Lnn_IsObject(v)			((v).type == Lnn_VT_OBJECT)
+#define Lnn_IsArray(v)			((v).type == Lnn_VT_ARRAY)
+#define Lnn_IsCallable(v)		((v).type == Lnn_VT_FUNCTION || (v).type == Lnn_VT_CLOSURE || (v).type == Lnn_VT_NATIVE)
+
+/* Any number as a float */
+#define Lnn_NumberOf(v)			(Lnn_IsInt(v) ? (Utl_Float)(v).u.integer : (v).u.number)
+
+/**
+ * Arithmetic on two ints stays in ints as long as the result fits.
+ * These check that it fits and only then put it in result, the caller does the operation on floats otherwise.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define Lnn_AddInts(x, y, result)	(!__builtin_add_overflow(x, y, result))
+#define Lnn_SubInts(x, y, result)	(!__builtin_sub_overflow(x, y, result))
+#define Lnn_MulInts(x, y, result)	(!__builtin_mul_overflow(x, y, result))
+#else
+#define Lnn_AddInts(x, y, result)																\
+	(((y) > 0 ? (x) <= Utl_INT_MAX - (y) : (x) >= Utl_INT_MIN - (y)) && (*(result) = (x) + (y), Utl_TRUE))
+#define Lnn_SubInts(x, y, result)																\
+	(((y) < 0 ? (x) <= Utl_INT_MAX + (y) : (x) >= Utl_INT_MIN + (y)) && (*(result) = (x) - (y), Utl_TRUE))
+#define Lnn_MulInts(x, y, result)																\
+	(((x) == 0 || (y) == 0 ||																	\
+	  ((x) > 0 ? ((y) > 0 ? (x) <= Utl_INT_MAX / (y) : (y) >= Utl_INT_MIN / (x)) :				\
+				 ((y) > 0 ? (x) >= Utl_INT_MIN / (y) : (y) >= Utl_INT_MAX / (x)))) &&			\
+	 (*(result) = (x) * (y), Utl_TRUE))
+#endif
+/* Two ints never divide to an int, this only makes division fit in with the others */
+#define Lnn_DivInts(x, y, result)	((void)(result), Utl_FALSE)
+
+/* Negates a number, the smallest int has no negative int */
+#define Lnn_NegateNumber(v)																		\
+	(Lnn_IsFloat(v) ? Lnn_FloatValue(-(v).u.number) :											\
+	 (v).u.integer == Utl_INT_MIN ? Lnn_FloatValue(-(Utl_Float)(v).u.integer) : Lnn_IntValue(-(v).u.integer))
+
+/* Only null and false are false, everything else is true */
+#define Lnn_IsTruthy(v)			(!((v).type == Lnn_VT_NULL || ((v).type == Lnn_VT_BOOL && !(v).u.boolean)))
+
+/**
+ * @brief Destroys an object from Lnn_AllocString(). Objects owned by a state are freed by its garbage collector.
+ */
+void Lnn_DestroyObject(Lnn_Object* object);
+
+/**
+ * @brief Checks if two values are equal. Values of different types are never equal, except ints and floats
+ * which are equal if they are the same number.
+ * Strings are equal if they have the same characters, objects only if they are the same object.
+ * @param state State that owns the values, ropes may be flattened to compare them.
+ */
+Utl_Bool Lnn_ValuesEqual(struct Lnn_State* state,
+						 const Lnn_Value a,
+						 const Lnn_Value b);
+
+/**
+ * @brief Applies a binary operator to two values of any type.
+ * Numbers work with every operator, strings can be compared and added together.
+ * Adding, subtracting and multiplying two ints gives an int if the result fits, dividing always gives a float.
+ * Equality and the logical operators work on everything.
+ * @param state State that owns new values.
+ * @param op A logical, relational or arithmetic operator.
+ * @param a Left operand.
+ * @param b Right operand.
+ * @param result Where the result is put, may point to one of the operands.
+ * @return Utl_FALSE if the operator doesn't work on these types, the error is printed.
+ */
+Utl_Bool Lnn_BinaryOperation(struct Lnn_State* state,
+							 const Lnn_OperatorID op,
+							 const Lnn_Value a,
+							 const Lnn_Value b,
+							 Lnn_Value* result);
+
+void Lnn_PrintValue(const Lnn_Value value);
+
+#endif
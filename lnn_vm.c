@@ -0,0 +1,955 @@
+#include "lnn_vm.h"
+#include "lnn_jit.h"
+#include <limits.h>
+
+
+
+/* Chunks loaded from a program run its code, which other states run too, until they rewrite an instruction */
+#define in_shared_code(chunk, instr)																\
+	((chunk)->source && (instr) >= (chunk)->source->code && (instr) < (chunk)->source->code + (chunk)->numcode)
+
+/* Index of an instruction, frames that got there before the chunk copied the code of its program are still in that code */
+#define code_index(chunk, instr)																	\
+	((int)(in_shared_code(chunk, instr) ? (instr) - (chunk)->source->code : (instr) - (chunk)->code))
+
+/* Rewrites a generic instruction into a quickened one, unless it has missed its guards too many times */
+#define quicken(instr, op)											\
+	if (Lnn_InstrArg(*(instr)) < Lnn_MAX_QUICKEN_MISSES)			\
+	{																\
+		if (in_shared_code(chunk, instr))							\
+			instr = own_code(chunk, instr, &ip, frames, frame);		\
+		*(instr) = Lnn_MakeInstr(op, Lnn_InstrArg(*(instr)));		\
+	}
+
+/* Rewrites a quickened instruction back to its generic form and counts the miss */
+#define dequicken(instr, op)										\
+	*(instr) = Lnn_MakeInstr(op, Lnn_InstrArg(*(instr)) + 1)
+
+#define runtime_error(...)					\
+	{										\
+		printf("ERROR! ");					\
+		printf(__VA_ARGS__);				\
+		putchar('\n');						\
+		goto on_error;						\
+	}
+
+#define both_numbers(a, b) (Lnn_IsNumber(a) && Lnn_IsNumber(b))
+#define both_ints(a, b) (Lnn_IsInt(a) && Lnn_IsInt(b))
+
+
+
+/* Quickened NUM_NUM form of every generic binary instruction, in the same order */
+static const Lnn_OpCode quick_num_num_opcodes[] =
+{
+	Lnn_BC_EQUALITY_NUM_NUM,
+	Lnn_BC_INEQUALITY_NUM_NUM,
+	Lnn_BC_LESS_NUM_NUM,
+	Lnn_BC_GREATER_NUM_NUM,
+	Lnn_BC_LESSEQUAL_NUM_NUM,
+	Lnn_BC_GREATEREQUAL_NUM_NUM,
+	Lnn_BC_ADD_NUM_NUM,
+	Lnn_BC_SUB_NUM_NUM,
+	Lnn_BC_MUL_NUM_NUM,
+	Lnn_BC_DIV_NUM_NUM,
+};
+
+/* Quickened INT_INT form of every generic binary instruction, in the same order. Division has none */
+static const Lnn_OpCode quick_int_int_opcodes[] =
+{
+	Lnn_BC_EQUALITY_INT_INT,
+	Lnn_BC_INEQUALITY_INT_INT,
+	Lnn_BC_LESS_INT_INT,
+	Lnn_BC_GREATER_INT_INT,
+	Lnn_BC_LESSEQUAL_INT_INT,
+	Lnn_BC_GREATEREQUAL_INT_INT,
+	Lnn_BC_ADD_INT_INT,
+	Lnn_BC_SUB_INT_INT,
+	Lnn_BC_MUL_INT_INT,
+	Lnn_BC_DIV_NUM_NUM,
+};
+
+/* Generic form of every quickened instruction, in the same order */
+static const Lnn_OpCode generic_opcodes[] =
+{
+	Lnn_BC_EQUALITY,
+	Lnn_BC_INEQUALITY,
+	Lnn_BC_LESS,
+	Lnn_BC_GREATER,
+	Lnn_BC_LESSEQUAL,
+	Lnn_BC_GREATEREQUAL,
+	Lnn_BC_ADD,
+	Lnn_BC_ADD,
+	Lnn_BC_SUB,
+	Lnn_BC_MUL,
+	Lnn_BC_DIV,
+	Lnn_BC_GETELEMENT,
+	Lnn_BC_GETELEMENT,
+	Lnn_BC_GETELEMENT,
+	Lnn_BC_SETELEMENT,
+	Lnn_BC_SETELEMENT,
+	Lnn_BC_SETELEMENT,
+	Lnn_BC_EQUALITY,
+	Lnn_BC_INEQUALITY,
+	Lnn_BC_LESS,
+	Lnn_BC_GREATER,
+	Lnn_BC_LESSEQUAL,
+	Lnn_BC_GREATEREQUAL,
+	Lnn_BC_ADD,
+	Lnn_BC_SUB,
+	Lnn_BC_MUL,
+};
+
+/* Runs a generic binary instruction, the operators are in the same order as the opcodes */
+#define generic_binary(state, op, a, b, result) \
+	Lnn_BinaryOperation(state, (Lnn_OperatorID)(Lnn_OP_EQUALITY + ((op) - Lnn_BC_EQUALITY)), a, b, result)
+
+/* A quickened NUM_NUM instruction, it goes back to the generic form if either operand isn't a number.
+ * Only division takes two ints, the other instructions have an INT_INT form for them */
+#define quick_num_num(intsguard, result)													\
+	{																						\
+		if (!both_numbers(sp[-2], sp[-1]) || (intsguard))									\
+			goto on_guard_miss;																\
+		const Utl_Float x = Lnn_NumberOf(sp[-2]), y = Lnn_NumberOf(sp[-1]);					\
+		sp[-2] = result;																	\
+		sp--;																				\
+	}
+
+/* A quickened INT_INT comparison, it goes back to the generic form if either operand isn't an int */
+#define quick_int_int(result)																\
+	{																						\
+		if (!both_ints(sp[-2], sp[-1]))														\
+			goto on_guard_miss;																\
+		const Utl_Int x = sp[-2].u.integer, y = sp[-1].u.integer;							\
+		sp[-2] = result;																	\
+		sp--;																				\
+	}
+
+/* Quickened INT_INT arithmetic, a result that doesn't fit is done on floats without leaving the fast path */
+#define quick_int_arithmetic(checked, arith)													\
+	{																						\
+		if (!both_ints(sp[-2], sp[-1]))														\
+			goto on_guard_miss;																\
+		const Utl_Int x = sp[-2].u.integer, y = sp[-1].u.integer;							\
+		Utl_Int r;																			\
+		sp[-2] = checked(x, y, &r) ? Lnn_IntValue(r) : Lnn_FloatValue((Utl_Float)x arith (Utl_Float)y);	\
+		sp--;																				\
+	}
+
+/* A superinstruction with a constant right operand, numbers are done right away */
+#define const_arithmetic(genericop, checked, arith)											\
+	{																						\
+		const Lnn_Value b = constants[Lnn_InstrArg(*instr)];								\
+		Utl_Int r;																			\
+		if (both_ints(sp[-1], b) && checked(sp[-1].u.integer, b.u.integer, &r))				\
+			sp[-1] = Lnn_IntValue(r);														\
+		else if (both_numbers(sp[-1], b))													\
+			sp[-1] = Lnn_FloatValue(Lnn_NumberOf(sp[-1]) arith Lnn_NumberOf(b));				\
+		else if (!generic_binary(state, genericop, sp[-1], b, &sp[-1]))						\
+			goto on_error;																	\
+	}
+
+/* A comparison fused with the branch that uses it, numbers are compared right away */
+#define compare_jump(genericop, cmp)														\
+	{																						\
+		const Lnn_Value a = sp[-2], b = sp[-1];												\
+		Lnn_Value condition;																\
+		sp -= 2;																			\
+		if (both_ints(a, b))																\
+			condition = Lnn_BoolValue(a.u.integer cmp b.u.integer);							\
+		else if (both_numbers(a, b))														\
+			condition = Lnn_BoolValue(Lnn_NumberOf(a) cmp Lnn_NumberOf(b));					\
+		else if (!generic_binary(state, genericop, a, b, &condition))						\
+			goto on_error;																	\
+		if (!condition.u.boolean)															\
+			ip = chunk->code + Lnn_InstrArg(*instr);										\
+	}
+
+
+
+/* Element access quickened for one elements kind, it goes back to the generic form
+ * if the value isn't an array of that kind or the index isn't a number in bounds */
+#define quick_get_element(elementskind, element)											\
+	{																						\
+		if (!Lnn_IsArray(sp[-2]) || sp[-2].u.array->kind != (elementskind) ||				\
+			!Lnn_IsArrayIndex(sp[-2].u.array, sp[-1]))										\
+			goto on_guard_miss;																\
+		const Lnn_Array* array = sp[-2].u.array;											\
+		const int i = Lnn_ArrayIndexOf(sp[-1]);												\
+		sp[-2] = element;																	\
+		sp--;																				\
+	}
+
+/* Element store quickened for one elements kind, the value also has to fit the kind */
+#define quick_set_element(elementskind, valueguard, store)									\
+	{																						\
+		if (!Lnn_IsArray(sp[-3]) || sp[-3].u.array->kind != (elementskind) ||				\
+			!Lnn_IsArrayIndex(sp[-3].u.array, sp[-2]) || !(valueguard))						\
+			goto on_guard_miss;																\
+		Lnn_Array* array = sp[-3].u.array;													\
+		const int i = Lnn_ArrayIndexOf(sp[-2]);												\
+		store;																				\
+		sp[-3] = sp[-1];																	\
+		sp -= 2;																			\
+	}
+
+
+
+/* Finds the entry of the inline cache that has the shape of an object, or numentries if there is none */
+#define probe_member_cache(cache, object, entry)											\
+	int entry = (cache)->numentries;														\
+	if (Lnn_IsObject(object))																\
+		for (entry = 0; entry < (cache)->numentries; entry++)								\
+			if ((cache)->shapes[entry] == (object).u.instance->shape)						\
+				break;
+
+/* Gets a member through the inline cache of the instruction, a hit is a shape compare and an indexed load */
+#define cached_get_member(cacheindex, object, result)										\
+	{																						\
+		Lnn_MemberCache* cache = &chunk->caches[cacheindex];								\
+		probe_member_cache(cache, object, entry);											\
+		if (entry < cache->numentries)														\
+			result = (object).u.instance->slots[cache->slots[entry]];						\
+		else if (!Lnn_GetMember(state, cache, cache->name, object, &(result)))				\
+			goto on_error;																	\
+	}
+
+/* Sets a member through the inline cache of the instruction, a hit can also move the object to a new shape */
+#define cached_set_member(object, value)													\
+	{																						\
+		Lnn_MemberCache* cache = &chunk->caches[Lnn_InstrArg(*instr)];						\
+		probe_member_cache(cache, object, entry);											\
+		Lnn_Instance* instance = (object).u.instance;										\
+		if (entry < cache->numentries && cache->newshapes[entry]->numslots <= instance->capslots)	\
+		{																					\
+			instance->shape = cache->newshapes[entry];										\
+			instance->slots[cache->slots[entry]] = value;									\
+			Lnn_GCWriteBarrier(state, &instance->obj, value);								\
+		} else if (!Lnn_SetMember(state, cache, cache->name, object, value))				\
+			goto on_error;																	\
+	}
+
+
+
+#ifdef Lnn_PROFILE_OPCODE_PAIRS
+
+typedef struct
+{
+	unsigned long long count;
+	int first;
+	int second;
+} opcode_pair;
+
+static int compare_opcode_pairs(const void* a, const void* b)
+{
+	const unsigned long long x = ((const opcode_pair*)a)->count;
+	const unsigned long long y = ((const opcode_pair*)b)->count;
+	return (x < y) - (x > y);
+}
+
+void Lnn_PrintOpcodePairs(const Lnn_State* state, const int maxpairs)
+{
+	Utl_Assert(state);
+	printf("Opcode pairs:\n");
+	if (!state->opcodepairs) return;
+
+	opcode_pair* pairs = Utl_Malloc(sizeof(opcode_pair) * Lnn_NUM_OPCODES * Lnn_NUM_OPCODES);
+	int numpairs = 0;
+	for (int a = 0; a < Lnn_NUM_OPCODES; a++)
+		for (int b = 0; b < Lnn_NUM_OPCODES; b++)
+			if (state->opcodepairs[a * 256 + b] > 0)
+			{
+				pairs[numpairs].count = state->opcodepairs[a * 256 + b];
+				pairs[numpairs].first = a;
+				pairs[numpairs].second = b;
+				numpairs++;
+			}
+	qsort(pairs, numpairs, sizeof(opcode_pair), &compare_opcode_pairs);
+
+	for (int i = 0; i < numpairs && i < maxpairs; i++)
+		printf("  %12llu  %s %s\n", pairs[i].count, lnn_opcode_names[pairs[i].first], lnn_opcode_names[pairs[i].second]);
+	Utl_Free(pairs);
+}
+
+#endif
+
+
+
+#ifdef Lnn_JIT
+
+/**
+ * @brief Runs the jit code of a chunk from where the interpreter is, compiling it first if the chunk is hot.
+ * When the jit code exits, sp and ip are where the interpreter should continue.
+ * If a type guard failed the jit code is thrown away since the types it was compiled for have changed.
+ */
+static void run_jit_code(Lnn_State* state, Lnn_Chunk* chunk, Lnn_Value** sp, Lnn_Instruction** ip, int* ticks)
+{
+	if (!chunk->jitcode)
+	{
+		if (chunk->hotness < Lnn_JIT_THRESHOLD || chunk->numjitdeopts >= Lnn_MAX_JIT_DEOPTS) return;
+		chunk->jitcode = Lnn_JitCompileChunk(chunk);
+		if (!chunk->jitcode)
+		{
+			chunk->numjitdeopts = Lnn_MAX_JIT_DEOPTS;
+			return;
+		}
+	}
+
+	Lnn_JitContext context;
+	context.sp = *sp;
+	context.globals = state->globals;
+	context.ip = code_index(chunk, *ip);
+	context.ticks = *ticks;
+	int exit = chunk->jitcode->function(&context);
+	*ticks = context.ticks;
+	if (exit < 0)
+	{
+		exit = ~exit;
+		Lnn_DestroyJitCode(chunk->jitcode);
+		chunk->jitcode = NULL;
+		chunk->numjitdeopts++;
+		chunk->hotness = 0;
+	}
+	*sp = context.sp;
+	*ip = chunk->code + exit;
+}
+
+#endif
+
+/* A running call, the registers of the caller are saved in its frame while the callee runs */
+typedef struct
+{
+	Lnn_Chunk* chunk;
+	Lnn_Instruction* ip;
+	Lnn_Value* base;		/* First local, the function that was called is right under it */
+	Lnn_Value* captures;	/* Hidden slots in the parent frame if the function doesn't escape */
+} call_frame;
+
+/**
+ * @brief Gives a chunk loaded from a program its own copy of the code, so it can be quickened without touching the program.
+ * The frames of this run in the shared code go on in the copy. Runs further out that are in it stay there,
+ * they only see generic instructions and come here too when they would rewrite one.
+ * @param instr Instruction in the shared code that is about to be rewritten.
+ * @return The same instruction in the copy.
+ */
+static Lnn_Instruction* own_code(Lnn_Chunk* chunk, Lnn_Instruction* instr, Lnn_Instruction** ip, call_frame* frames, call_frame* top)
+{
+	Lnn_Instruction* shared = chunk->source->code;
+	if (chunk->code == shared)
+	{
+		chunk->code = Utl_Malloc(sizeof(Lnn_Instruction) * (chunk->numcode + 1));
+		memcpy(chunk->code, shared, sizeof(Lnn_Instruction) * chunk->numcode);
+	}
+	for (call_frame* frame = frames; frame <= top; frame++)
+		if (frame->chunk == chunk && in_shared_code(chunk, frame->ip))
+			frame->ip = chunk->code + (frame->ip - shared);
+	*ip = chunk->code + (*ip - shared);
+	return chunk->code + (instr - shared);
+}
+
+/* Closures can be moved by the collector, so their captures are looked up again after anything that can collect */
+#define load_captures()														\
+	captures = base[-1].type == Lnn_VT_CLOSURE ? base[-1].u.closure->captures : frame->captures
+
+/* Spends a tick of the budget at a loop iteration or call, runs without a budget just start counting again */
+#define spend_tick()														\
+	if (--ticks <= 0)														\
+	{																		\
+		if (coroutine && coroutine->budget > 0) goto on_preempt;			\
+		ticks = INT_MAX;													\
+	}
+
+/**
+ * @brief Copies the frames and values of a run that yields into its coroutine.
+ * @param top Frame of the call that yielded, its ip is already saved.
+ * @return Utl_FALSE if there is no memory left to save them, the error is printed.
+ */
+static Utl_Bool suspend_coroutine(Lnn_State* state,
+							  Lnn_Coroutine* coroutine,
+							  const Lnn_Value* stack,
+							  const Lnn_Value* sp,
+							  const call_frame* frames,
+							  const call_frame* top)
+{
+	const int numvalues = (int)(sp - stack);
+	const int numframes = (int)(top - frames) + 1;
+	const size_t size = sizeof(Lnn_Value) * numvalues + sizeof(Lnn_SavedFrame) * numframes;
+	if (size != coroutine->savedsize)
+	{
+		Lnn_Value* values = Lnn_Reallocate(state, coroutine->values, coroutine->savedsize, size);
+		if (!values) return Utl_FALSE;
+		coroutine->values = values;
+		coroutine->savedsize = size;
+	}
+	coroutine->numvalues = numvalues;
+	coroutine->numframes = numframes;
+	coroutine->frames = (Lnn_SavedFrame*)(coroutine->values + numvalues);
+	memcpy(coroutine->values, stack, sizeof(Lnn_Value) * numvalues);
+	for (int i = 0; i < numframes; i++)
+	{
+		Lnn_SavedFrame* saved = &coroutine->frames[i];
+		saved->chunk = frames[i].chunk;
+		saved->ip = code_index(frames[i].chunk, frames[i].ip);
+		saved->base = (int)(frames[i].base - stack);
+		saved->captures = frames[i].captures ? (int)(frames[i].captures - stack) : -1;
+	}
+	coroutine->status = Lnn_CO_SUSPENDED;
+	return Utl_TRUE;
+}
+
+/* Frees what a coroutine saved once it can't be resumed anymore */
+static void kill_coroutine(Lnn_State* state, Lnn_Coroutine* coroutine)
+{
+	Lnn_Deallocate(state, coroutine->values, coroutine->savedsize);
+	coroutine->values = NULL;
+	coroutine->frames = NULL;
+	coroutine->numvalues = coroutine->numframes = 0;
+	coroutine->savedsize = 0;
+	coroutine->status = Lnn_CO_DEAD;
+}
+
+/**
+ * @brief Runs a chunk on the vm stack of the state, above the runs that are already on it.
+ * @param callee Function pushed before the arguments, NULL if there is none.
+ * @param args Values pushed before the chunk runs.
+ * @param result Where the value on top of the stack is put when the chunk halts, can be NULL.
+ * @param coroutine Coroutine to resume instead of running the chunk from the start, or NULL.
+ * The frames and values it saved are put back and then the arguments are pushed.
+ */
+static Lnn_ExecResult run_chunk(Lnn_State* state,
+								Lnn_Chunk* chunk,
+								const Lnn_Value* callee,
+								const Lnn_Value* args,
+								const int numargs,
+								Lnn_Value* result,
+								Lnn_Coroutine* coroutine)
+{
+	if (!state->vmstack)
+	{
+		state->vmstack = Utl_Malloc(sizeof(Lnn_Value) * Lnn_STACK_SIZE);
+		state->vmstacktop = state->vmstack;
+	}
+	Lnn_GCStartRun(state);
+	Lnn_Value* stack = state->vmstacktop;
+	Lnn_Value* const stackend = state->vmstack + Lnn_STACK_SIZE;
+	call_frame frames[Lnn_MAX_CALL_DEPTH];
+	call_frame* frame = frames;
+	Lnn_Instruction* ip = chunk->code;
+	const Lnn_Value* constants = chunk->constants;
+	Lnn_Global* globals = state->globals;
+
+	/* The top level is a frame without locals, a null is where the function would be */
+	Lnn_Value* base = stack + 1;
+	Lnn_Value* sp = base; /* Points to where the next value is pushed */
+	Lnn_Value* captures = NULL;
+	frame->chunk = chunk;
+	frame->base = base;
+	frame->captures = NULL;
+	if (coroutine)
+	{
+		const Lnn_SavedFrame* top = &coroutine->frames[coroutine->numframes - 1];
+		if (stack + coroutine->numvalues + numargs + top->chunk->maxstack > stackend)
+		{
+			/* It can still be resumed somewhere with more room */
+			printf("ERROR! Stack overflow\n");
+			return Lnn_EXEC_ERROR;
+		}
+		memcpy(stack, coroutine->values, sizeof(Lnn_Value) * coroutine->numvalues);
+		for (int i = 0; i < coroutine->numframes; i++)
+		{
+			const Lnn_SavedFrame* saved = &coroutine->frames[i];
+			frames[i].chunk = saved->chunk;
+			frames[i].ip = saved->chunk->code + saved->ip;
+			frames[i].base = stack + saved->base;
+			frames[i].captures = saved->captures >= 0 ? stack + saved->captures : NULL;
+		}
+		frame = &frames[coroutine->numframes - 1];
+		chunk = frame->chunk;
+		constants = chunk->constants;
+		ip = frame->ip;
+		base = frame->base;
+		sp = stack + coroutine->numvalues;
+		load_captures();
+		coroutine->status = Lnn_CO_RUNNING;
+		coroutine->preempted = Utl_FALSE;
+	} else
+	{
+		if (base + 1 + numargs + chunk->maxstack > stackend)
+		{
+			printf("ERROR! Stack overflow\n");
+			return Lnn_EXEC_ERROR;
+		}
+		stack[0] = Lnn_NullValue();
+		if (callee)
+			*sp++ = *callee;
+	}
+	for (int i = 0; i < numargs; i++)
+		*sp++ = args[i];
+
+#ifdef Lnn_PROFILE_OPCODE_PAIRS
+	if (!state->opcodepairs)
+		state->opcodepairs = Utl_Calloc(256 * 256, sizeof(unsigned long long));
+	Lnn_OpCode prevop = Lnn_BC_HALT;
+#endif
+
+	int ticks = coroutine && coroutine->budget > 0 ? coroutine->budget : INT_MAX;
+
+	/* A resumed coroutine gets back into jit code at the next loop iteration or call */
+	if (!coroutine || !coroutine->started)
+	{
+		if (chunk->hotness < Lnn_JIT_THRESHOLD)
+			chunk->hotness++;
+#ifdef Lnn_JIT
+		run_jit_code(state, chunk, &sp, &ip, &ticks);
+#endif
+	}
+	if (coroutine)
+		coroutine->started = Utl_TRUE;
+
+	for (;;)
+	{
+		Lnn_Instruction* instr = ip++;
+		Lnn_OpCode op = Lnn_InstrOp(*instr);
+#ifdef Lnn_PROFILE_OPCODE_PAIRS
+		state->opcodepairs[prevop * 256 + op]++;
+		prevop = op;
+#endif
+		switch (op)
+		{
+		case Lnn_BC_HALT: goto on_halt;
+		case Lnn_BC_POP: sp--; break;
+		case Lnn_BC_PUSHNULL: *sp++ = Lnn_NullValue(); break;
+		case Lnn_BC_PUSHTRUE: *sp++ = Lnn_BoolValue(Utl_TRUE); break;
+		case Lnn_BC_PUSHFALSE: *sp++ = Lnn_BoolValue(Utl_FALSE); break;
+		case Lnn_BC_PUSHCONST: *sp++ = constants[Lnn_InstrArg(*instr)]; break;
+		case Lnn_BC_GETGLOBAL: *sp++ = globals[Lnn_InstrArg(*instr)].value; break;
+		case Lnn_BC_SETGLOBAL: globals[Lnn_InstrArg(*instr)].value = sp[-1]; break;
+		case Lnn_BC_JUMP:
+			ip = chunk->code + Lnn_InstrArg(*instr);
+			if (ip <= instr) /* Loop iteration */
+			{
+				if (!Lnn_GCSafepoint(state, stack, sp)) goto on_error;
+				load_captures();
+				spend_tick();
+				if (chunk->hotness < Lnn_JIT_THRESHOLD)
+					chunk->hotness++;
+#ifdef Lnn_JIT
+				run_jit_code(state, chunk, &sp, &ip, &ticks);
+#endif
+			}
+			break;
+		case Lnn_BC_JUMPIFFALSE:
+			sp--;
+			if (!Lnn_IsTruthy(*sp))
+				ip = chunk->code + Lnn_InstrArg(*instr);
+			break;
+
+		case Lnn_BC_NOT: sp[-1] = Lnn_BoolValue(!Lnn_IsTruthy(sp[-1])); break;
+		case Lnn_BC_NEGATIVE:
+			if (!Lnn_IsNumber(sp[-1]))
+				runtime_error("Can't negate %s", lnn_valuetype_names[sp[-1].type]);
+			sp[-1] = Lnn_NegateNumber(sp[-1]);
+			break;
+		case Lnn_BC_AND: sp[-2] = Lnn_BoolValue(Lnn_IsTruthy(sp[-2]) && Lnn_IsTruthy(sp[-1])); sp--; break;
+		case Lnn_BC_OR: sp[-2] = Lnn_BoolValue(Lnn_IsTruthy(sp[-2]) || Lnn_IsTruthy(sp[-1])); sp--; break;
+		case Lnn_BC_XOR: sp[-2] = Lnn_BoolValue(Lnn_IsTruthy(sp[-2]) != Lnn_IsTruthy(sp[-1])); sp--; break;
+
+		case Lnn_BC_DUP: *sp = sp[-1]; sp++; break;
+		case Lnn_BC_NEWOBJECT:
+		{
+			Lnn_Instance* instance = Lnn_NewInstance(state, Lnn_InstrArg(*instr));
+			if (!instance) goto on_error;
+			*sp++ = Lnn_ObjectValue(instance);
+			break;
+		}
+		case Lnn_BC_GETMEMBER: cached_get_member(Lnn_InstrArg(*instr), sp[-1], sp[-1]); break;
+		case Lnn_BC_SETMEMBER: cached_set_member(sp[-2], sp[-1]); sp[-2] = sp[-1]; sp--; break;
+		case Lnn_BC_INITMEMBER: cached_set_member(sp[-2], sp[-1]); sp--; break;
+		case Lnn_BC_DUP2: sp[0] = sp[-2]; sp[1] = sp[-1]; sp += 2; break;
+		case Lnn_BC_NEWARRAY:
+		{
+			Lnn_Array* array = Lnn_NewArray(state, Lnn_InstrArg(*instr));
+			if (!array) goto on_error;
+			*sp++ = Lnn_ArrayValue(array);
+			break;
+		}
+		case Lnn_BC_PUSHELEMENT:
+			if (!Lnn_PushElement(state, sp[-2].u.array, sp[-1])) goto on_error;
+			sp--;
+			break;
+		case Lnn_BC_CALLBUILTIN:
+		{
+			const Lnn_Builtin* builtin = &lnn_builtins[Lnn_InstrArg(*instr)];
+			sp -= builtin->numargs;
+			if (!builtin->function(state, sp, sp)) goto on_error;
+			sp++;
+			break;
+		}
+		case Lnn_BC_ELEMENTWISE:
+			*sp++ = Lnn_BoolValue(!Lnn_RunElementwiseLoop(state, &chunk->loops[Lnn_InstrArg(*instr)]));
+			break;
+		case Lnn_BC_GETLOCAL: *sp++ = base[Lnn_InstrArg(*instr)]; break;
+		case Lnn_BC_SETLOCAL: base[Lnn_InstrArg(*instr)] = sp[-1]; break;
+		case Lnn_BC_GETBOXED: *sp++ = base[Lnn_InstrArg(*instr)].u.cell->value; break;
+		case Lnn_BC_SETBOXED: Lnn_SetCell(state, base[Lnn_InstrArg(*instr)].u.cell, sp[-1]); break;
+		case Lnn_BC_GETCAPTURE: *sp++ = captures[Lnn_InstrArg(*instr)]; break;
+		case Lnn_BC_GETBOXEDCAPTURE: *sp++ = captures[Lnn_InstrArg(*instr)].u.cell->value; break;
+		case Lnn_BC_SETBOXEDCAPTURE: Lnn_SetCell(state, captures[Lnn_InstrArg(*instr)].u.cell, sp[-1]); break;
+		case Lnn_BC_CLOSURE:
+		{
+			Lnn_Closure* closure = Lnn_NewClosure(state, chunk->prototypes[Lnn_InstrArg(*instr)], base, captures);
+			if (!closure) goto on_error;
+			*sp++ = Lnn_ClosureValue(closure);
+			break;
+		}
+		case Lnn_BC_STACKCLOSURE:
+		{
+			const Lnn_Prototype* prototype = chunk->prototypes[Lnn_InstrArg(*instr)];
+			Lnn_CopyCaptures(prototype, base, captures, base + prototype->captureslot);
+			*sp++ = Lnn_FunctionValue(prototype);
+			break;
+		}
+		case Lnn_BC_CALL:
+		case Lnn_BC_TAILCALL:
+		{
+			const int numargs = Lnn_InstrArg(*instr);
+			Lnn_Value* callee = sp - numargs - 1;
+			if (callee->type == Lnn_VT_NATIVE)
+			{
+				/* The native gets the arguments where they are, a script it runs goes above them */
+				state->vmstacktop = sp;
+				const Utl_Bool ok = Lnn_CallNative(state, callee->u.native, callee + 1, numargs, callee);
+				state->vmstacktop = stack;
+				if (!ok) goto on_error;
+				sp = callee + 1;
+				break;
+			}
+			const Lnn_Prototype* prototype = Lnn_CheckCall(*callee, numargs);
+			if (!prototype) goto on_error;
+			Lnn_Chunk* code = prototype->code;
+			/* A function that doesn't escape keeps its captures in this frame, so it can't replace it.
+			 * The RETURN after the TAILCALL returns its result instead */
+			const Utl_Bool tail = op == Lnn_BC_TAILCALL && (prototype->escapes || prototype->numcaptures == 0);
+			Lnn_Value* newbase = tail ? base : callee + 1;
+			if ((!tail && frame - frames + 1 >= Lnn_MAX_CALL_DEPTH) ||
+				newbase + prototype->numslots + code->maxstack > stackend)
+				runtime_error("Stack overflow in %s", prototype->name);
+
+			if (tail)
+				memmove(base - 1, callee, sizeof(Lnn_Value) * (numargs + 1));
+			else
+			{
+				frame->ip = ip;
+				frame++;
+			}
+			frame->chunk = code;
+			frame->base = newbase;
+			frame->captures = prototype->escapes ? NULL : base + prototype->captureslot;
+			base = newbase;
+			sp = base + prototype->numslots;
+			for (Lnn_Value* local = base + numargs; local < sp; local++)
+				*local = Lnn_NullValue();
+			if (!Lnn_BoxLocals(state, prototype, base)) goto on_error;
+
+			chunk = code;
+			constants = chunk->constants;
+			ip = chunk->code;
+			/* Tail calls can loop forever without a back-edge, so they are safepoints too */
+			if (tail && !Lnn_GCSafepoint(state, stack, sp))
+				goto on_error;
+			load_captures();
+			spend_tick();
+			if (chunk->hotness < Lnn_JIT_THRESHOLD)
+				chunk->hotness++;
+#ifdef Lnn_JIT
+			run_jit_code(state, chunk, &sp, &ip, &ticks);
+#endif
+			break;
+		}
+		case Lnn_BC_YIELD:
+			if (!coroutine)
+				runtime_error("yield only works in a coroutine the host resumed");
+			sp--;
+			if (result)
+				*result = *sp;
+			frame->ip = ip;
+			if (!suspend_coroutine(state, coroutine, stack, sp, frames, frame)) goto on_error;
+			return Lnn_EXEC_YIELD;
+		case Lnn_BC_RETURN:
+		{
+			const Lnn_Value result = sp[-1];
+			sp = base - 1;
+			*sp++ = result;
+			frame--;
+			chunk = frame->chunk;
+			constants = chunk->constants;
+			ip = frame->ip;
+			base = frame->base;
+			load_captures();
+			break;
+		}
+
+		case Lnn_BC_EQUALITY:
+		case Lnn_BC_INEQUALITY:
+		case Lnn_BC_LESS:
+		case Lnn_BC_GREATER:
+		case Lnn_BC_LESSEQUAL:
+		case Lnn_BC_GREATEREQUAL:
+		case Lnn_BC_ADD:
+		case Lnn_BC_SUB:
+		case Lnn_BC_MUL:
+		case Lnn_BC_DIV:
+		op_generic_binary:
+		{
+			/* Look at the operand types before they are overwritten by the result */
+			const Utl_Bool ints = both_ints(sp[-2], sp[-1]);
+			const Utl_Bool numbers = both_numbers(sp[-2], sp[-1]);
+			const Utl_Bool strings = Lnn_IsString(sp[-2]) && Lnn_IsString(sp[-1]);
+			if (!generic_binary(state, op, sp[-2], sp[-1], &sp[-2])) goto on_error;
+			sp--;
+			if (ints)
+				{ quicken(instr, quick_int_int_opcodes[op - Lnn_BC_EQUALITY]); }
+			else if (numbers)
+				{ quicken(instr, quick_num_num_opcodes[op - Lnn_BC_EQUALITY]); }
+			else if (strings && op == Lnn_BC_ADD)
+				{ quicken(instr, Lnn_BC_ADD_STR_STR); }
+			break;
+		}
+
+		case Lnn_BC_GETELEMENT:
+		op_generic_getelement:
+		{
+			const int kind = Lnn_IsArray(sp[-2]) ? (int)sp[-2].u.array->kind : -1;
+			if (!Lnn_GetElement(state, sp[-2], sp[-1], &sp[-2])) goto on_error;
+			sp--;
+			quicken(instr, Lnn_BC_GETELEMENT_INT + kind);
+			break;
+		}
+
+		case Lnn_BC_SETELEMENT:
+		op_generic_setelement:
+		{
+			/* Appending isn't quickened, the fast path only stores in bounds */
+			const Utl_Bool inbounds = Lnn_IsArray(sp[-3]) && Lnn_IsArrayIndex(sp[-3].u.array, sp[-2]);
+			if (!Lnn_SetElement(state, sp[-3], sp[-2], sp[-1])) goto on_error;
+			if (inbounds)
+				{ quicken(instr, Lnn_BC_SETELEMENT_INT + sp[-3].u.array->kind); }
+			sp[-3] = sp[-1];
+			sp -= 2;
+			break;
+		}
+
+		case Lnn_BC_EQUALITY_NUM_NUM:		quick_num_num(both_ints(sp[-2], sp[-1]), Lnn_BoolValue(x == y)); break;
+		case Lnn_BC_INEQUALITY_NUM_NUM:		quick_num_num(both_ints(sp[-2], sp[-1]), Lnn_BoolValue(x != y)); break;
+		case Lnn_BC_LESS_NUM_NUM:			quick_num_num(both_ints(sp[-2], sp[-1]), Lnn_BoolValue(x < y)); break;
+		case Lnn_BC_GREATER_NUM_NUM:		quick_num_num(both_ints(sp[-2], sp[-1]), Lnn_BoolValue(x > y)); break;
+		case Lnn_BC_LESSEQUAL_NUM_NUM:		quick_num_num(both_ints(sp[-2], sp[-1]), Lnn_BoolValue(x <= y)); break;
+		case Lnn_BC_GREATEREQUAL_NUM_NUM:	quick_num_num(both_ints(sp[-2], sp[-1]), Lnn_BoolValue(x >= y)); break;
+		case Lnn_BC_ADD_NUM_NUM:			quick_num_num(both_ints(sp[-2], sp[-1]), Lnn_FloatValue(x + y)); break;
+		case Lnn_BC_SUB_NUM_NUM:			quick_num_num(both_ints(sp[-2], sp[-1]), Lnn_FloatValue(x - y)); break;
+		case Lnn_BC_MUL_NUM_NUM:			quick_num_num(both_ints(sp[-2], sp[-1]), Lnn_FloatValue(x * y)); break;
+		case Lnn_BC_DIV_NUM_NUM:			quick_num_num(Utl_FALSE, Lnn_FloatValue(x / y)); break;
+		case Lnn_BC_ADD_STR_STR:
+			if (!Lnn_IsString(sp[-2]) || !Lnn_IsString(sp[-1]))
+				goto on_guard_miss;
+			if (!Lnn_ConcatStrings(state, sp[-2], sp[-1], &sp[-2])) goto on_error;
+			sp--;
+			break;
+		case Lnn_BC_GETELEMENT_INT:		quick_get_element(Lnn_EK_INT, Lnn_IntValue(array->elements.ints[i])); break;
+		case Lnn_BC_GETELEMENT_FLOAT:	quick_get_element(Lnn_EK_FLOAT, Lnn_FloatValue(array->elements.floats[i])); break;
+		case Lnn_BC_GETELEMENT_VALUE:	quick_get_element(Lnn_EK_VALUE, array->elements.values[i]); break;
+		case Lnn_BC_SETELEMENT_INT:
+			quick_set_element(Lnn_EK_INT, Lnn_IsInt(sp[-1]), array->elements.ints[i] = sp[-1].u.integer);
+			break;
+		case Lnn_BC_SETELEMENT_FLOAT:
+			quick_set_element(Lnn_EK_FLOAT, Lnn_IsNumber(sp[-1]), array->elements.floats[i] = Lnn_NumberOf(sp[-1]));
+			break;
+		case Lnn_BC_SETELEMENT_VALUE:
+			quick_set_element(Lnn_EK_VALUE, Utl_TRUE,
+							  array->elements.values[i] = sp[-1]; Lnn_GCWriteBarrier(state, &array->obj, sp[-1]));
+			break;
+		case Lnn_BC_EQUALITY_INT_INT:		quick_int_int(Lnn_BoolValue(x == y)); break;
+		case Lnn_BC_INEQUALITY_INT_INT:		quick_int_int(Lnn_BoolValue(x != y)); break;
+		case Lnn_BC_LESS_INT_INT:			quick_int_int(Lnn_BoolValue(x < y)); break;
+		case Lnn_BC_GREATER_INT_INT:		quick_int_int(Lnn_BoolValue(x > y)); break;
+		case Lnn_BC_LESSEQUAL_INT_INT:		quick_int_int(Lnn_BoolValue(x <= y)); break;
+		case Lnn_BC_GREATEREQUAL_INT_INT:	quick_int_int(Lnn_BoolValue(x >= y)); break;
+		case Lnn_BC_ADD_INT_INT:			quick_int_arithmetic(Lnn_AddInts, +); break;
+		case Lnn_BC_SUB_INT_INT:			quick_int_arithmetic(Lnn_SubInts, -); break;
+		case Lnn_BC_MUL_INT_INT:			quick_int_arithmetic(Lnn_MulInts, *); break;
+
+		case Lnn_BC_SETGLOBAL_POP: globals[Lnn_InstrArg(*instr)].value = *--sp; break;
+		case Lnn_BC_SETLOCAL_POP: base[Lnn_InstrArg(*instr)] = *--sp; break;
+		case Lnn_BC_ADD_CONST: const_arithmetic(Lnn_BC_ADD, Lnn_AddInts, +); break;
+		case Lnn_BC_SUB_CONST: const_arithmetic(Lnn_BC_SUB, Lnn_SubInts, -); break;
+		case Lnn_BC_MUL_CONST: const_arithmetic(Lnn_BC_MUL, Lnn_MulInts, *); break;
+		case Lnn_BC_DIV_CONST: const_arithmetic(Lnn_BC_DIV, Lnn_DivInts, /); break;
+		case Lnn_BC_EQUALITY_JUMPIFFALSE:		compare_jump(Lnn_BC_EQUALITY, ==); break;
+		case Lnn_BC_INEQUALITY_JUMPIFFALSE:		compare_jump(Lnn_BC_INEQUALITY, !=); break;
+		case Lnn_BC_LESS_JUMPIFFALSE:			compare_jump(Lnn_BC_LESS, <); break;
+		case Lnn_BC_GREATER_JUMPIFFALSE:		compare_jump(Lnn_BC_GREATER, >); break;
+		case Lnn_BC_LESSEQUAL_JUMPIFFALSE:		compare_jump(Lnn_BC_LESSEQUAL, <=); break;
+		case Lnn_BC_GREATEREQUAL_JUMPIFFALSE:	compare_jump(Lnn_BC_GREATEREQUAL, >=); break;
+		case Lnn_BC_GETLOCAL_GETMEMBER:
+			*sp = base[Lnn_InstrArgA(*instr)];
+			sp++;
+			cached_get_member(Lnn_InstrArgB(*instr), sp[-1], sp[-1]);
+			break;
+
+		default:
+			runtime_error("Invalid instruction %i", op);
+		}
+		continue;
+
+	on_guard_miss:
+		/* A quickened instruction saw types it isn't made for */
+		op = generic_opcodes[op - Lnn_BC_EQUALITY_NUM_NUM];
+		dequicken(instr, op);
+		if (op == Lnn_BC_GETELEMENT) goto op_generic_getelement;
+		if (op == Lnn_BC_SETELEMENT) goto op_generic_setelement;
+		goto op_generic_binary;
+	}
+
+on_preempt:
+	/* Suspended where the next instruction would run, with nothing to give back */
+	frame->ip = ip;
+	if (result)
+		*result = Lnn_NullValue();
+	if (!suspend_coroutine(state, coroutine, stack, sp, frames, frame)) goto on_error;
+	coroutine->preempted = Utl_TRUE;
+	return Lnn_EXEC_PREEMPTED;
+
+on_halt:
+	/* Catches an allocation that failed where nothing could fail, like flattening a rope to compare it */
+	if (!Lnn_GCSafepoint(state, stack, sp)) goto on_error;
+	if (result)
+		*result = sp > base ? sp[-1] : Lnn_NullValue();
+	if (coroutine)
+		kill_coroutine(state, coroutine);
+	return Lnn_EXEC_OK;
+
+on_error:
+	if (coroutine)
+		kill_coroutine(state, coroutine);
+	return Lnn_EXEC_ERROR;
+}
+
+Lnn_ExecResult Lnn_RunChunk(Lnn_State* state, Lnn_Chunk* chunk)
+{
+	Utl_Assert(state && chunk);
+	return run_chunk(state, chunk, NULL, NULL, 0, NULL, NULL);
+}
+
+
+
+Lnn_FunctionHandle* Lnn_GetFunctionHandle(Lnn_State* state, const char* name, const int numargs)
+{
+	Utl_Assert(state && name && numargs >= 0);
+	const int slot = Lnn_FindGlobalSlot(state, name);
+	if (slot < 0)
+	{
+		printf("ERROR! There is no global named '%s'\n", name);
+		return NULL;
+	}
+
+	Lnn_FunctionHandle* handle = Utl_AllocType(Lnn_FunctionHandle);
+	handle->slot = slot;
+	handle->numargs = numargs;
+	handle->chunk = Utl_AllocType(Lnn_Chunk);
+	handle->chunk->code = Utl_Malloc(sizeof(Lnn_Instruction) * 2);
+	handle->chunk->code[0] = Lnn_MakeInstr(Lnn_BC_CALL, numargs);
+	handle->chunk->code[1] = Lnn_MakeInstr(Lnn_BC_HALT, 0);
+	handle->chunk->numcode = 2;
+	handle->chunk->capcode = 2;
+	handle->chunk->maxstack = 1;
+	return handle;
+}
+
+Lnn_ExecResult Lnn_CallFunction(Lnn_State* state, const Lnn_FunctionHandle* handle, const Lnn_Value* args, Lnn_Value* result)
+{
+	Utl_Assert(state && handle && (args || handle->numargs == 0));
+	return run_chunk(state, handle->chunk, &state->globals[handle->slot].value, args, handle->numargs, result, NULL);
+}
+
+void Lnn_DestroyFunctionHandle(Lnn_FunctionHandle* handle)
+{
+	if (!handle) return;
+	Lnn_DestroyChunk(handle->chunk);
+	Utl_Free(handle);
+}
+
+
+
+const char* lnn_coroutinestatus_names[Lnn_NUM_COROUTINESTATUSES] =
+{
+	"CO_SUSPENDED",
+	"CO_RUNNING",
+	"CO_DEAD",
+};
+
+/* A coroutine that hasn't started is saved like a run that yielded before its first instruction */
+static Lnn_Coroutine* create_coroutine(Lnn_State* state, Lnn_Chunk* chunk, const Lnn_Value* callee, const Lnn_Value* args, const int numargs)
+{
+	Lnn_Coroutine* coroutine = Lnn_Allocate(state, sizeof(Lnn_Coroutine));
+	if (!coroutine) return NULL;
+	memset(coroutine, 0, sizeof(Lnn_Coroutine));
+
+	coroutine->numvalues = 1 + (callee ? 1 + numargs : 0);
+	coroutine->numframes = 1;
+	coroutine->savedsize = sizeof(Lnn_Value) * coroutine->numvalues + sizeof(Lnn_SavedFrame);
+	coroutine->values = Lnn_Allocate(state, coroutine->savedsize);
+	if (!coroutine->values)
+	{
+		Lnn_Deallocate(state, coroutine, sizeof(Lnn_Coroutine));
+		return NULL;
+	}
+	Utl_PushBackList(&state->coroutines, &coroutine->links);
+	coroutine->frames = (Lnn_SavedFrame*)(coroutine->values + coroutine->numvalues);
+	coroutine->values[0] = Lnn_NullValue();
+	if (callee)
+	{
+		coroutine->values[1] = *callee;
+		for (int i = 0; i < numargs; i++)
+			coroutine->values[2 + i] = args[i];
+	}
+	coroutine->frames[0].chunk = chunk;
+	coroutine->frames[0].ip = 0;
+	coroutine->frames[0].base = 1;
+	coroutine->frames[0].captures = -1;
+	coroutine->status = Lnn_CO_SUSPENDED;
+	return coroutine;
+}
+
+Lnn_Coroutine* Lnn_CreateCoroutine(Lnn_State* state, Lnn_Chunk* chunk)
+{
+	Utl_Assert(state && chunk);
+	return create_coroutine(state, chunk, NULL, NULL, 0);
+}
+
+Lnn_Coroutine* Lnn_CreateFunctionCoroutine(Lnn_State* state, const Lnn_FunctionHandle* handle, const Lnn_Value* args)
+{
+	Utl_Assert(state && handle && (args || handle->numargs == 0));
+	return create_coroutine(state, handle->chunk, &state->globals[handle->slot].value, args, handle->numargs);
+}
+
+Lnn_ExecResult Lnn_ResumeCoroutine(Lnn_State* state, Lnn_Coroutine* coroutine, const Lnn_Value sent, Lnn_Value* result)
+{
+	Utl_Assert(state && coroutine);
+	if (coroutine->status != Lnn_CO_SUSPENDED)
+	{
+		printf("ERROR! Can't resume a coroutine that is %s\n",
+			   coroutine->status == Lnn_CO_RUNNING ? "running" : "dead");
+		return Lnn_EXEC_ERROR;
+	}
+	/* The first resume starts the run and a preempted run didn't stop at a yield, there is nothing to give the value to */
+	const int numsent = coroutine->started && !coroutine->preempted ? 1 : 0;
+	return run_chunk(state, coroutine->frames[0].chunk, NULL, &sent, numsent, result, coroutine);
+}
+
+void Lnn_DestroyCoroutine(Lnn_State* state, Lnn_Coroutine* coroutine)
+{
+	if (!coroutine) return;
+	Utl_Assert(state && coroutine->status != Lnn_CO_RUNNING);
+	Utl_UnlinkFromList(&state->coroutines, &coroutine->links);
+	Lnn_Deallocate(state, coroutine->values, coroutine->savedsize);
+	Lnn_Deallocate(state, coroutine, sizeof(Lnn_Coroutine));
+}
@@ -0,0 +1,387 @@
+#ifndef _Lnn_VM_H_
+#define _Lnn_VM_H_
+
+#include "fab_utility.h"
+#include "lnn_code.h"
+#include "lnn_state.h"
+#include "lnn_value.h"
+#include "lnn_object.h"
+#include "lnn_array.h"
+#include "lnn_string.h"
+#include "lnn_builtin.h"
+#include "lnn_kernels.h"
+#include "lnn_function.h"
+#include "lnn_native.h"
+
+typedef unsigned char Lnn_OpCode;
+enum
+{
+	Lnn_BC_HALT,
+	Lnn_BC_POP,
+	Lnn_BC_PUSHNULL,
+	Lnn_BC_PUSHTRUE,
+	Lnn_BC_PUSHFALSE,
+	Lnn_BC_PUSHCONST,		/* arg: Index in the constants */
+	Lnn_BC_GETGLOBAL,		/* arg: Global slot */
+	Lnn_BC_SETGLOBAL,		/* arg: Global slot, leaves the value on the stack */
+	Lnn_BC_JUMP,			/* arg: Instruction to jump to */
+	Lnn_BC_JUMPIFFALSE,		/* arg: Instruction to jump to, pops the condition */
+
+	Lnn_BC_NOT,
+	Lnn_BC_NEGATIVE,
+	Lnn_BC_AND,
+	Lnn_BC_OR,
+	Lnn_BC_XOR,
+
+	Lnn_BC_DUP,
+	Lnn_BC_NEWOBJECT,		/* arg: How many members to make room for */
+	Lnn_BC_GETMEMBER,		/* arg: Index of the member cache, replaces the object with the member */
+	Lnn_BC_SETMEMBER,		/* arg: Index of the member cache, pops the object and leaves the value */
+	Lnn_BC_INITMEMBER,		/* arg: Index of the member cache, pops the value and leaves the object */
+	Lnn_BC_DUP2,
+	Lnn_BC_NEWARRAY,		/* arg: How many elements to make room for */
+	Lnn_BC_PUSHELEMENT,		/* Pops the value and leaves the array */
+	Lnn_BC_CALLBUILTIN,		/* arg: Lnn_BuiltinID, replaces the arguments with the result */
+	Lnn_BC_ELEMENTWISE,		/* arg: Index of the elementwise loop, pushes false if it ran the whole loop as a kernel */
+	Lnn_BC_GETLOCAL,		/* arg: Slot in the frame */
+	Lnn_BC_SETLOCAL,		/* arg: Slot in the frame, leaves the value on the stack */
+	Lnn_BC_GETBOXED,		/* arg: Slot in the frame that has a cell */
+	Lnn_BC_SETBOXED,		/* arg: Slot in the frame that has a cell, leaves the value on the stack */
+	Lnn_BC_GETCAPTURE,		/* arg: Index of the capture */
+	Lnn_BC_GETBOXEDCAPTURE,	/* arg: Index of a capture that is a cell */
+	Lnn_BC_SETBOXEDCAPTURE,	/* arg: Index of a capture that is a cell, leaves the value on the stack */
+	Lnn_BC_CLOSURE,			/* arg: Index of the prototype, pushes a new closure */
+	Lnn_BC_STACKCLOSURE,	/* arg: Index of the prototype, copies the captures to its hidden slots and pushes the function */
+	Lnn_BC_CALL,			/* arg: Number of arguments, the function is under them */
+	Lnn_BC_RETURN,			/* Pops the return value and replaces the function that was called with it */
+	Lnn_BC_TAILCALL,		/* arg: Number of arguments, like CALL but the callee replaces the frame of the caller */
+	Lnn_BC_YIELD,			/* Pops the value to yield and suspends the coroutine, resuming it pushes the value it was given */
+
+	/* Generic instructions that can be quickened. Their arg counts how many times
+	 * a quickened form of the instruction has missed its type guard. */
+	Lnn_BC_EQUALITY,
+	Lnn_BC_INEQUALITY,
+	Lnn_BC_LESS,
+	Lnn_BC_GREATER,
+	Lnn_BC_LESSEQUAL,
+	Lnn_BC_GREATEREQUAL,
+	Lnn_BC_ADD,
+	Lnn_BC_SUB,
+	Lnn_BC_MUL,
+	Lnn_BC_DIV,
+	Lnn_BC_GETELEMENT,		/* Pops the index and replaces the array with the element */
+	Lnn_BC_SETELEMENT,		/* Pops the array and the index and leaves the value */
+
+	/* Quickened instructions, only ever written by the vm over their generic form */
+	Lnn_BC_EQUALITY_NUM_NUM,
+	Lnn_BC_INEQUALITY_NUM_NUM,
+	Lnn_BC_LESS_NUM_NUM,
+	Lnn_BC_GREATER_NUM_NUM,
+	Lnn_BC_LESSEQUAL_NUM_NUM,
+	Lnn_BC_GREATEREQUAL_NUM_NUM,
+	Lnn_BC_ADD_NUM_NUM,
+	Lnn_BC_ADD_STR_STR,
+	Lnn_BC_SUB_NUM_NUM,
+	Lnn_BC_MUL_NUM_NUM,
+	Lnn_BC_DIV_NUM_NUM,
+	Lnn_BC_GETELEMENT_INT,		/* Element access of an array with a number index, one for each elements kind */
+	Lnn_BC_GETELEMENT_FLOAT,
+	Lnn_BC_GETELEMENT_VALUE,
+	Lnn_BC_SETELEMENT_INT,
+	Lnn_BC_SETELEMENT_FLOAT,
+	Lnn_BC_SETELEMENT_VALUE,
+	Lnn_BC_EQUALITY_INT_INT,	/* Both operands ints, arithmetic that overflows gives a float like the generic form */
+	Lnn_BC_INEQUALITY_INT_INT,
+	Lnn_BC_LESS_INT_INT,
+	Lnn_BC_GREATER_INT_INT,
+	Lnn_BC_LESSEQUAL_INT_INT,
+	Lnn_BC_GREATEREQUAL_INT_INT,
+	Lnn_BC_ADD_INT_INT,
+	Lnn_BC_SUB_INT_INT,
+	Lnn_BC_MUL_INT_INT,
+
+	/* Superinstructions, only ever written by the peephole pass over the compiled code */
+	Lnn_BC_SETGLOBAL_POP,				/* arg: Global slot, an assignment statement */
+	Lnn_BC_SETLOCAL_POP,				/* arg: Slot in the frame, an assignment statement */
+	Lnn_BC_ADD_CONST,					/* arg: Index in the constants used as the right operand */
+	Lnn_BC_SUB_CONST,
+	Lnn_BC_MUL_CONST,
+	Lnn_BC_DIV_CONST,
+	Lnn_BC_EQUALITY_JUMPIFFALSE,		/* arg: Instruction to jump to if the comparison is false */
+	Lnn_BC_INEQUALITY_JUMPIFFALSE,
+	Lnn_BC_LESS_JUMPIFFALSE,
+	Lnn_BC_GREATER_JUMPIFFALSE,
+	Lnn_BC_LESSEQUAL_JUMPIFFALSE,
+	Lnn_BC_GREATEREQUAL_JUMPIFFALSE,
+	Lnn_BC_GETLOCAL_GETMEMBER,			/* args: Slot in the frame and index of the member cache, pushes the member of the local */
+
+	Lnn_NUM_OPCODES
+};
+extern const char* lnn_opcode_names[Lnn_NUM_OPCODES];
+
+#define Lnn_IsJumpOp(op)	((op) == Lnn_BC_JUMP || (op) == Lnn_BC_JUMPIFFALSE ||	\
+							 ((op) >= Lnn_BC_EQUALITY_JUMPIFFALSE && (op) <= Lnn_BC_GREATEREQUAL_JUMPIFFALSE))
+
+/* How many times a quickened instruction may miss its guard before it stays generic */
+#define Lnn_MAX_QUICKEN_MISSES 4
+
+/**
+ * Instructions are 32 bits with the opcode in the low 8 bits and an argument in the other 24.
+ * They are fixed size so that the vm can rewrite the opcode of an instruction in place.
+ */
+typedef uint32_t Lnn_Instruction;
+
+#define Lnn_InstrOp(instr)			((Lnn_OpCode)((instr) & 0xFF))
+#define Lnn_InstrArg(instr)			((int)((instr) >> 8))
+#define Lnn_MakeInstr(op, arg)		((Lnn_Instruction)(op) | ((Lnn_Instruction)(arg) << 8))
+
+/* Superinstructions with two arguments have the first in the low 8 bits of the argument and the second in the high 16 */
+#define Lnn_InstrArgA(instr)		((int)(((instr) >> 8) & 0xFF))
+#define Lnn_InstrArgB(instr)		((int)((instr) >> 16))
+#define Lnn_MakeInstrAB(op, a, b)	Lnn_MakeInstr(op, (a) | ((b) << 8))
+#define Lnn_FitsArgA(a)				((a) <= 0xFF)
+#define Lnn_FitsArgB(b)				((b) <= 0xFFFF)
+#define Lnn_MAX_INSTR_ARG			0xFFFFFF
+
+/**
+ * Baseline jit tier, define Lnn_USE_JIT to build it.
+ * It only exists for x86-64, on other targets chunks are always interpreted.
+ */
+#if defined(Lnn_USE_JIT) && (defined(__x86_64__) || defined(_M_X64))
+#define Lnn_JIT
+#endif
+
+/* How many runs and loop iterations a chunk has before the jit compiles it */
+#define Lnn_JIT_THRESHOLD 1000
+
+/* How many times jit code can be thrown away after a guard failed before the chunk is only interpreted */
+#define Lnn_MAX_JIT_DEOPTS 4
+
+/**
+ * @brief Compiled bytecode with the constants it uses.
+ */
+typedef struct Lnn_Chunk
+{
+	Lnn_Instruction* code;
+	int numcode;
+	int capcode;
+
+	Lnn_Value* constants;	/* Strings in here are short or interned in the state */
+	int numconstants;
+	int capconstants;
+
+	Lnn_MemberCache* caches;	/* One inline cache for every member access in the code */
+	int numcaches;
+	int capcaches;
+
+	Lnn_ElementwiseLoop* loops;	/* While loops that can run as array kernels */
+	int numloops;
+	int caploops;
+
+	Lnn_Prototype** prototypes;	/* Function literals in the code, their code is a chunk too */
+	int numprototypes;
+	int capprototypes;
+
+	int maxstack;			/* Most values the code can have on the stack at once, not counting the locals */
+
+	int hotness;			/* Counts runs and loop iterations, stops at Lnn_JIT_THRESHOLD */
+
+	/* Only set in chunks loaded from a program, see Lnn_LoadProgram() */
+	const struct Lnn_Chunk* source;	/* Chunk in the program, its code, constants and loops are used until this chunk needs its own */
+	struct Lnn_Program* program;	/* Referenced by the top level chunk, so the code it shares stays alive */
+#ifdef Lnn_JIT
+	struct Lnn_JitCode* jitcode;
+	int numjitdeopts;
+#endif
+} Lnn_Chunk;
+
+/**
+ * @brief Compiles a parsed code block into bytecode.
+ * Global variables are resolved to slots in the state while compiling.
+ * Unless Lnn_NO_PEEPHOLE is defined the code is then passed through Lnn_OptimizeChunk().
+ * @param state State that the code will run in.
+ * @param block The top level code block.
+ * @return Pointer to the new chunk, or NULL if the code couldn't be compiled.
+ */
+Lnn_Chunk* Lnn_CompileCode(Lnn_State* state,
+						   const Lnn_CodeBlock* block);
+
+/**
+ * @brief Peephole pass that fuses common instruction sequences into superinstructions.
+ * The sequences are the most common pairs in the opcode pair histogram of typical statements:
+ * constant operand arithmetic, comparisons that feed a branch, assignment statements and members of locals.
+ * Sequences are never fused across a jump target.
+ * @param chunk Chunk to optimize in place, it must not have run yet.
+ */
+void Lnn_OptimizeChunk(Lnn_Chunk* chunk);
+
+void Lnn_DestroyChunk(Lnn_Chunk* chunk);
+
+void Lnn_PrintChunk(const Lnn_Chunk* chunk);
+
+
+
+typedef enum
+{
+	Lnn_EXEC_OK,
+	Lnn_EXEC_ERROR,
+	Lnn_EXEC_YIELD,		/* Only from Lnn_ResumeCoroutine() */
+	Lnn_EXEC_PREEMPTED,	/* Only from Lnn_ResumeCoroutine(), the coroutine used up its budget */
+} Lnn_ExecResult;
+
+/**
+ * @brief Runs a chunk until it halts or hits a runtime error.
+ * Instructions in the chunk are quickened as they run, so a chunk shouldn't run in two states at the same time.
+ * Calls run on one stack of Lnn_STACK_SIZE values, a frame is the function that was called,
+ * its locals and then the values its code pushes.
+ * @param state State to run in, the chunk must have been compiled for it.
+ * @param chunk The code to run.
+ * @return Lnn_EXEC_OK or Lnn_EXEC_ERROR.
+ */
+Lnn_ExecResult Lnn_RunChunk(Lnn_State* state,
+							Lnn_Chunk* chunk);
+
+
+
+/**
+ * @brief A script function the host calls many times, the global it is in is only looked up once.
+ */
+typedef struct Lnn_FunctionHandle
+{
+	int slot;			/* Global the function is in */
+	int numargs;
+	Lnn_Chunk* chunk;	/* CALL and HALT, the function and the arguments are pushed before it runs */
+} Lnn_FunctionHandle;
+
+/**
+ * @brief Gets a handle to call the function in a global, the global can be given another function later.
+ * Only functions made by the bytecode vm can be called through it.
+ * @param state State the global is in.
+ * @param name Name of the global.
+ * @param numargs Number of arguments the calls pass.
+ * @return The handle, or NULL if there is no such global, the error is printed.
+ */
+Lnn_FunctionHandle* Lnn_GetFunctionHandle(Lnn_State* state,
+										  const char* name,
+										  const int numargs);
+
+/**
+ * @brief Calls the function of a handle. Natives can call this while a script runs.
+ * @param state State the handle was made for.
+ * @param handle The handle.
+ * @param args handle->numargs arguments, they are pushed on the vm stack.
+ * @param result Where the return value is put, can be NULL.
+ * @return Lnn_EXEC_OK or Lnn_EXEC_ERROR.
+ */
+Lnn_ExecResult Lnn_CallFunction(Lnn_State* state,
+								const Lnn_FunctionHandle* handle,
+								const Lnn_Value* args,
+								Lnn_Value* result);
+
+void Lnn_DestroyFunctionHandle(Lnn_FunctionHandle* handle);
+
+
+
+/**
+ * Coroutines are runs of the vm that scripts can suspend with yield(v), for the host to resume later,
+ * like when the event a script waits for has happened. They are stackless: yielding copies the frames
+ * and values the run has on the vm stack into a block of script memory and returns to the host, and
+ * resuming copies them back. A suspended coroutine holds no thread or C stack, only that block, so a
+ * host can keep many thousands of them. Yield only suspends the run the host resumed, it fails in a
+ * run a native started and in the tree walker and closure tiers.
+ *
+ * A coroutine can be given a budget so a host that runs many scripts can share its threads fairly.
+ * Every loop iteration and call spends a tick, checked only at back-edges and calls so the other
+ * instructions cost nothing more, and jit code counts its loop iterations too. When a resume has
+ * spent the whole budget the coroutine is suspended like at a yield, and resuming continues the run.
+ */
+typedef enum
+{
+	Lnn_CO_SUSPENDED,	/* Not started yet or yielded */
+	Lnn_CO_RUNNING,
+	Lnn_CO_DEAD,		/* Finished or failed, it can't be resumed */
+	Lnn_NUM_COROUTINESTATUSES
+} Lnn_CoroutineStatus;
+extern const char* lnn_coroutinestatus_names[Lnn_NUM_COROUTINESTATUSES];
+
+/* A call of a suspended coroutine, with offsets instead of pointers since it is resumed wherever the vm stack is free */
+typedef struct Lnn_SavedFrame
+{
+	Lnn_Chunk* chunk;
+	int ip;
+	int base;
+	int captures;		/* -1 if the function keeps its captures in a closure */
+} Lnn_SavedFrame;
+
+typedef struct Lnn_Coroutine
+{
+	Utl_ListLinks links;	/* In the coroutines of the state, the collector updates the saved values through it */
+	Lnn_CoroutineStatus status;
+	Utl_Bool started;
+	Utl_Bool preempted;		/* Suspended by its budget instead of a yield, resuming it doesn't push a value */
+	int budget;				/* Ticks every resume can spend before it is preempted, 0 for no limit */
+	Lnn_Value* values;		/* The vm stack of the run from the bottom up, in the same block as the frames */
+	int numvalues;
+	Lnn_SavedFrame* frames;	/* Outermost call first */
+	int numframes;
+	size_t savedsize;		/* Size of the block */
+} Lnn_Coroutine;
+
+/**
+ * @brief Creates a coroutine that runs a chunk from the start when it is first resumed.
+ * @param state State the chunk was compiled for.
+ * @param chunk The code, it has to outlive the coroutine.
+ * @return The coroutine, destroy it with Lnn_DestroyCoroutine(). NULL if there is no memory left, the error is printed.
+ */
+Lnn_Coroutine* Lnn_CreateCoroutine(Lnn_State* state,
+								   Lnn_Chunk* chunk);
+
+/**
+ * @brief Creates a coroutine that calls the function of a handle when it is first resumed.
+ * @param args handle->numargs arguments, they are copied.
+ * @return The coroutine, or NULL like Lnn_CreateCoroutine().
+ */
+Lnn_Coroutine* Lnn_CreateFunctionCoroutine(Lnn_State* state,
+										   const Lnn_FunctionHandle* handle,
+										   const Lnn_Value* args);
+
+/**
+ * @brief Runs a coroutine until it yields, finishes or hits a runtime error.
+ * @param state State the coroutine was created in.
+ * @param coroutine The coroutine, it has to be suspended.
+ * @param sent What the yield the coroutine is suspended in returns, ignored on the first resume.
+ * @param result Where the yielded value or the value the run finished with is put, can be NULL.
+ * @return Lnn_EXEC_YIELD if it yielded, Lnn_EXEC_PREEMPTED if it spent its budget,
+ * Lnn_EXEC_OK if it finished, Lnn_EXEC_ERROR otherwise.
+ */
+Lnn_ExecResult Lnn_ResumeCoroutine(Lnn_State* state,
+								   Lnn_Coroutine* coroutine,
+								   const Lnn_Value sent,
+								   Lnn_Value* result);
+
+/**
+ * @brief Destroys a coroutine that isn't running, whether it finished or not.
+ */
+void Lnn_DestroyCoroutine(Lnn_State* state,
+						  Lnn_Coroutine* coroutine);
+
+
+
+/**
+ * Opcode pair histogram mode.
+ * Define Lnn_PROFILE_OPCODE_PAIRS to make the vm count every pair of instructions that run after
+ * each other in state->opcodepairs. Define Lnn_NO_PEEPHOLE too to see the pairs before fusion.
+ */
+#ifdef Lnn_PROFILE_OPCODE_PAIRS
+
+/**
+ * @brief Prints the most common opcode pairs that have run in a state.
+ * @param state State to print the histogram of.
+ * @param maxpairs How many pairs to print at most.
+ */
+void Lnn_PrintOpcodePairs(const Lnn_State* state,
+						  const int maxpairs);
+
+#endif
+
+#endif
@@ -1,6 +1,26 @@
 #include "fab_utility.h"
 #include "lnn_state.h"
 #include "lnn_parse.h"
+#include "lnn_vm.h"
+#include "lnn_tree.h"
+#include "lnn_memory.h"
+#include "lnn_executor.h"
+#include "lnn_channel.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define fileno _fileno
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifdef Lnn_BENCHMARK
+#include <time.h>
+#endif
 
 
 
@@ -37,15 +57,1616 @@ static char* read_code_from_file(const char* const filename)
 
 
 
+typedef enum
+{
+	TIER_WALKER,
+	TIER_CLOSURES,
+	TIER_VM,
+	NUM_TIERS
+} tier;
+
+
+
+#ifdef Lnn_BENCHMARK
+
+static const char* tier_names[NUM_TIERS] =
+{
+	"Tree walker",
+	"Closures",
+	"Bytecode vm",
+};
+
+/* Loop that is run by every tier */
+static const char* benchmark_code =
+	"i = 0 s = 0 while i < 2000000 do s += i * 2 - 1 if s > 1000 then s -= 1000 end i += 1 end";
+
+/**
+ * @brief Parses and runs the benchmark code on a fresh state in one of the tiers.
+ * Only the execution is timed, parsing and compiling is not.
+ * @return Seconds spent running or a negative number if it failed.
+ */
+static double run_benchmark(const tier tier)
+{
+	double seconds = -1.0;
+	Lnn_State* state = Lnn_CreateState();
+	Lnn_CodeBlock* code = Lnn_ParseSourceCode(state, benchmark_code);
+	if (!code) goto on_fail;
+
+	clock_t start;
+	Lnn_ExecResult result = Lnn_EXEC_ERROR;
+	if (tier == TIER_WALKER)
+	{
+		start = clock();
+		result = Lnn_WalkCodeBlock(state, code);
+	} else if (tier == TIER_CLOSURES)
+	{
+		Lnn_ClosureCode* closures = Lnn_CompileClosures(state, code);
+		if (!closures) goto on_fail;
+		start = clock();
+		result = Lnn_RunClosures(state, closures);
+		seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+		Lnn_DestroyClosures(closures);
+	} else
+	{
+		Lnn_Chunk* chunk = Lnn_CompileCode(state, code);
+		if (!chunk) goto on_fail;
+		start = clock();
+		result = Lnn_RunChunk(state, chunk);
+		seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+		Lnn_DestroyChunk(chunk);
+	}
+	if (tier == TIER_WALKER)
+		seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	if (result != Lnn_EXEC_OK) seconds = -1.0;
+
+	Lnn_DestroyCodeBlock(code);
+	Lnn_DestroyState(state);
+	return seconds;
+
+on_fail:
+	if (code) Lnn_DestroyCodeBlock(code);
+	Lnn_DestroyState(state);
+	return -1.0;
+}
+
+/* Most threads the threaded benchmark runs the vm on at once, each with its own state */
+#define BENCH_MAX_THREADS 8
+
+#ifdef _WIN32
+static DWORD WINAPI bench_thread(LPVOID seconds)
+{
+	*(double*)seconds = run_benchmark(TIER_VM);
+	return 0;
+}
+#else
+static void* bench_thread(void* seconds)
+{
+	*(double*)seconds = run_benchmark(TIER_VM);
+	return NULL;
+}
+#endif
+
+/**
+ * @brief Runs the vm benchmark on a number of threads at the same time.
+ * States share nothing, so the wall time should stay about the same as the threads go up to the cores.
+ * @return Wall seconds until every thread finished or a negative number if one failed.
+ */
+static double run_threaded_benchmark(const int numthreads)
+{
+	double seconds[BENCH_MAX_THREADS];
+	struct timespec start, end;
+	timespec_get(&start, TIME_UTC);
+#ifdef _WIN32
+	HANDLE threads[BENCH_MAX_THREADS];
+	for (int i = 0; i < numthreads; i++)
+		threads[i] = CreateThread(NULL, 0, bench_thread, &seconds[i], 0, NULL);
+	WaitForMultipleObjects(numthreads, threads, TRUE, INFINITE);
+	for (int i = 0; i < numthreads; i++)
+		CloseHandle(threads[i]);
+#else
+	pthread_t threads[BENCH_MAX_THREADS];
+	for (int i = 0; i < numthreads; i++)
+		pthread_create(&threads[i], NULL, bench_thread, &seconds[i]);
+	for (int i = 0; i < numthreads; i++)
+		pthread_join(threads[i], NULL);
+#endif
+	timespec_get(&end, TIME_UTC);
+
+	for (int i = 0; i < numthreads; i++)
+		if (seconds[i] < 0.0) return -1.0;
+	return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+#endif
+
+
+
+/* Tests, they run on every build before the test code */
+
+static int numfailed;
+
+/* Prints a check that doesn't hold and counts it */
+#define check(condition)													\
+	if (!(condition))														\
+	{																		\
+		printf("FAILED! %s:%i: %s\n", __FILE__, __LINE__, #condition);		\
+		numfailed++;														\
+	}
+
+/**
+ * @brief Parses, compiles and runs a script on a state in one of the tiers.
+ * @return Result of the run, Lnn_EXEC_ERROR if the script didn't parse or compile.
+ */
+static Lnn_ExecResult run_script(Lnn_State* state, const tier tier, const char* sourcecode)
+{
+	Lnn_CodeBlock* code = Lnn_ParseSourceCode(state, sourcecode);
+	if (!code) return Lnn_EXEC_ERROR;
+
+	Lnn_ExecResult result = Lnn_EXEC_ERROR;
+	if (tier == TIER_WALKER)
+		result = Lnn_WalkCodeBlock(state, code);
+	else if (tier == TIER_CLOSURES)
+	{
+		Lnn_ClosureCode* closures = Lnn_CompileClosures(state, code);
+		if (closures)
+		{
+			result = Lnn_RunClosures(state, closures);
+			Lnn_DestroyClosures(closures);
+		}
+	} else
+	{
+		Lnn_Chunk* chunk = Lnn_CompileCode(state, code);
+		if (chunk)
+		{
+			result = Lnn_RunChunk(state, chunk);
+			Lnn_DestroyChunk(chunk);
+		}
+	}
+	Lnn_DestroyCodeBlock(code);
+	return result;
+}
+
+/* Value of a global, or null if there is no such global */
+static Lnn_Value global_value(Lnn_State* state, const char* name)
+{
+	const int slot = Lnn_FindGlobalSlot(state, name);
+	return slot >= 0 ? state->globals[slot].value : Lnn_NullValue();
+}
+
+#define is_int(value, i) (Lnn_IsInt(value) && (value).u.integer == (i))
+
+/* Parses and compiles a script for the bytecode vm, NULL if it failed */
+static Lnn_Chunk* compile_script(Lnn_State* state, const char* sourcecode)
+{
+	Lnn_CodeBlock* code = Lnn_ParseSourceCode(state, sourcecode);
+	if (!code) return NULL;
+	Lnn_Chunk* chunk = Lnn_CompileCode(state, code);
+	Lnn_DestroyCodeBlock(code);
+	return chunk;
+}
+
+/* First instruction with an opcode, or -1 */
+static int find_opcode(const Lnn_Chunk* chunk, const Lnn_OpCode op)
+{
+	for (int i = 0; i < chunk->numcode; i++)
+		if (Lnn_InstrOp(chunk->code[i]) == op)
+			return i;
+	return -1;
+}
+
+#define TEST_HASHMAP_KEYS		3000
+#define TEST_HASHMAP_H2			0x2A
+
+/* The cloned first group, and every slot that ever held a key used up one of the inserts before a rehash */
+static Utl_Bool is_consistent_hashmap(const Utl_HashMap* map)
+{
+	int full = 0, empty = 0;
+	for (int i = 0; i < map->capacity; i++)
+	{
+		if (map->ctrl[i] >= 0) full++;
+		else if (map->ctrl[i] == (signed char)-128) empty++;	/* The empty control byte */
+	}
+	for (int i = 0; i < Utl_HASHMAP_GROUP_SIZE && map->capacity; i++)
+		if (map->ctrl[map->capacity + i] != map->ctrl[i]) return Utl_FALSE;
+	return full == map->count && map->growthleft == empty - map->capacity / 8;
+}
+
+/* Keys i of the test in [first, last) are in the map with the value i, the others aren't */
+static Utl_Bool has_hashmap_keys(const Utl_HashMap* map, char keys[][16], const int first, const int last)
+{
+	for (int i = 0; i < TEST_HASHMAP_KEYS; i++)
+	{
+		const int* value = Utl_FindHashMap(map, keys[i]);
+		if (i >= first && i < last ? !value || *value != i : value != NULL) return Utl_FALSE;
+	}
+	return Utl_TRUE;
+}
+
+/**
+ * All the keys have the same 7 hash bits in their control bytes, so every probe compares keys.
+ * The map grows several times, removed keys leave deleted slots that inserts reuse, and churning
+ * a map with few keys cleans the deleted slots up in place instead of growing it.
+ */
+static void test_hashmap(void)
+{
+	static char keys[TEST_HASHMAP_KEYS][16];
+	for (int i = 0, n = 0; i < TEST_HASHMAP_KEYS; n++)
+	{
+		snprintf(keys[i], sizeof(keys[i]), "key%d", n);
+		if ((Utl_HashString(keys[i]) & 0x7F) == TEST_HASHMAP_H2) i++;
+	}
+
+	Utl_HashMap map;
+	Utl_InitHashMap(&map, sizeof(int));
+	check(!Utl_FindHashMap(&map, keys[0]));
+	check(!Utl_RemoveHashMap(&map, keys[0]));
+
+	/* 600 keys grow the map from 16 to 1024 slots */
+	for (int i = 0; i < 600; i++)
+	{
+		Utl_Bool inserted = Utl_FALSE;
+		*(int*)Utl_InsertHashMap(&map, keys[i], &inserted) = i;
+		check(inserted);
+		check(is_consistent_hashmap(&map));
+	}
+	check(map.capacity == 1024 && map.count == 600);
+	check(has_hashmap_keys(&map, keys, 0, 600));
+
+	/* Finding a key again doesn't insert it */
+	Utl_Bool inserted = Utl_TRUE;
+	check(*(int*)Utl_InsertHashMap(&map, keys[7], &inserted) == 7);
+	check(!inserted && map.count == 600);
+
+	/* Keys after a deleted slot in their probe sequence are still found */
+	for (int i = 0; i < 300; i++)
+		check(Utl_RemoveHashMap(&map, keys[i]));
+	check(!Utl_RemoveHashMap(&map, keys[0]));
+	check(is_consistent_hashmap(&map));
+	check(has_hashmap_keys(&map, keys, 300, 600));
+
+	/* Putting them back reuses deleted slots */
+	const int growthleft = map.growthleft;
+	for (int i = 0; i < 300; i++)
+		*(int*)Utl_InsertHashMap(&map, keys[i], NULL) = i;
+	check(map.capacity == 1024 && map.growthleft >= growthleft - 300);
+	check(is_consistent_hashmap(&map));
+	check(has_hashmap_keys(&map, keys, 0, 600));
+
+	/* Churning few keys fills the map with deleted slots, which are rehashed away without growing */
+	for (int i = 0; i < 590; i++)
+		Utl_RemoveHashMap(&map, keys[i]);
+	for (int i = 600; i < TEST_HASHMAP_KEYS; i++)
+	{
+		*(int*)Utl_InsertHashMap(&map, keys[i], NULL) = i;
+		check(Utl_RemoveHashMap(&map, keys[i - 10]));
+		check(is_consistent_hashmap(&map));
+	}
+	check(map.capacity == 1024 && map.count == 10);
+	check(has_hashmap_keys(&map, keys, TEST_HASHMAP_KEYS - 10, TEST_HASHMAP_KEYS));
+
+	Utl_FreeHashMap(&map);
+	check(map.capacity == 0 && map.count == 0 && !Utl_FindHashMap(&map, keys[0]));
+}
+
+/* Allocator that has a fixed number of bytes to give */
+typedef struct
+{
+	size_t used;
+	size_t limit;
+} limited_heap;
+
+static void* limited_allocate(void* userdata, const size_t size)
+{
+	limited_heap* heap = userdata;
+	if (heap->used + size > heap->limit) return NULL;
+	heap->used += size;
+	return malloc(size);
+}
+
+static void limited_free(void* userdata, void* block, const size_t size)
+{
+	((limited_heap*)userdata)->used -= size;
+	free(block);
+}
+
+/* Running out of memory fails the run on the state that asked for it, the state can go on */
+static void test_out_of_memory(void)
+{
+	limited_heap heap = { 0, Lnn_GC_NURSERY_SIZE / 2 };
+	const Lnn_Allocator allocator = { &limited_allocate, &limited_free, &heap };
+	check(!Lnn_CreateStateWithAllocator(&allocator));
+	check(heap.used == 0);
+
+	heap.limit = Lnn_GC_NURSERY_SIZE + 8 * Lnn_POOL_SLAB_SIZE;
+	Lnn_State* state = Lnn_CreateStateWithAllocator(&allocator);
+	check(state);
+	if (!state) return;
+	for (int i = 0; i < NUM_TIERS; i++)
+	{
+		check(run_script(state, (tier)i, "a = [] i = 0 while i < 100000 do a[i] = i i += 1 end") == Lnn_EXEC_ERROR);
+		/* Ropes only run out when they are flattened to be compared, which can't fail right there */
+		check(run_script(state, (tier)i, "s = \"abcdefghijklmnopqrstuvwxyz\" n = 0 while n < 16 do s += s n += 1 end b = s < s + \"x\"") == Lnn_EXEC_ERROR);
+		check(run_script(state, (tier)i, "a = 0 s = 0 b = 1 + 2") == Lnn_EXEC_OK);
+		check(Lnn_IsInt(state->globals[Lnn_FindGlobalSlot(state, "b")].value));
+	}
+	Lnn_DestroyState(state);
+	check(heap.used == 0);
+}
+
+/**
+ * Ints that overflow go on as floats in every tier. The loops overflow after the vm has quickened them
+ * to int instructions and after the jit has compiled them, where the overflow flag exits to the interpreter.
+ */
+static void test_int_overflow(void)
+{
+	static const char* const sources[] =
+	{
+		"y = x + 1 z = x * 2 w = 0 - x - 2",
+		"i = 0 while i < 3000 do x += 1 i += 1 end",
+		"i = 0 while i < 3000 do x = x + 1 i += 1 end",
+		"i = 0 while i < 3000 do x = x * 1 + 1 i += 1 end",
+		"function f(k) j = 0 while j < 3000 do k = k + 1 j += 1 end return k end x = f(x)",
+	};
+
+	for (int i = 0; i < NUM_TIERS; i++)
+		for (int j = 0; j < (int)(sizeof(sources) / sizeof(sources[0])); j++)
+		{
+			Lnn_State* state = Lnn_CreateState();
+			char source[256];
+			snprintf(source, sizeof(source), "x = %lld %s", (long long)(j ? Utl_INT_MAX - 2000 : Utl_INT_MAX), sources[j]);
+			check(run_script(state, (tier)i, source) == Lnn_EXEC_OK);
+			if (j)
+			{
+				/* Past the largest int adding one rounds back to the same float */
+				const Lnn_Value x = global_value(state, "x");
+				check(Lnn_IsFloat(x) && x.u.number == (Utl_Float)Utl_INT_MAX);
+			} else
+			{
+				const Lnn_Value y = global_value(state, "y");
+				const Lnn_Value z = global_value(state, "z");
+				const Lnn_Value w = global_value(state, "w");
+				check(Lnn_IsFloat(y) && y.u.number == (Utl_Float)Utl_INT_MAX + 1);
+				check(Lnn_IsFloat(z) && z.u.number == (Utl_Float)Utl_INT_MAX * 2);
+				check(Lnn_IsFloat(w) && w.u.number == -(Utl_Float)Utl_INT_MAX - 2);
+			}
+			Lnn_DestroyState(state);
+		}
+}
+
+/* Printing goes into this file between begin_capture() and end_capture() */
+static FILE* capturefile;
+static int savedstdout;
+
+static void begin_capture(void)
+{
+	fflush(stdout);
+	capturefile = tmpfile();
+	savedstdout = dup(fileno(stdout));
+	dup2(fileno(capturefile), fileno(stdout));
+}
+
+/**
+ * @brief Stops capturing and reads back what was printed.
+ * @param buffer Filled with the last bufferlength - 1 characters that were printed.
+ */
+static void end_capture(char* buffer, const int bufferlength)
+{
+	fflush(stdout);
+	dup2(savedstdout, fileno(stdout));
+	close(savedstdout);
+
+	const long length = ftell(capturefile);
+	fseek(capturefile, length >= bufferlength ? length - (bufferlength - 1) : 0, SEEK_SET);
+	const size_t numread = fread(buffer, 1, bufferlength - 1, capturefile);
+	buffer[numread] = '\0';
+	fclose(capturefile);
+}
+
+/* Prints a value into a buffer */
+static void print_value(const Lnn_Value value, char* buffer, const int bufferlength)
+{
+	begin_capture();
+	Lnn_PrintValue(value);
+	end_capture(buffer, bufferlength);
+}
+
+/* Longest source the parse depth test nests */
+#define TEST_NESTED_SOURCE_LENGTH (32 * 1024)
+
+/* Start, opening, middle and closing of the sources the parse depth test nests */
+static const char* const nestings[][4] =
+{
+	{ "", "if true then ", "a = 1", " end" },
+	{ "a = ", "(", "1", ")" },
+	{ "a = ", "[", "1", "]" },
+};
+
+/* Puts the start of a nesting, then depth openings, the middle and depth closings into a buffer of TEST_NESTED_SOURCE_LENGTH */
+static const char* nested_source(char* buffer, const char* const nesting[4], const int depth)
+{
+	int length = snprintf(buffer, TEST_NESTED_SOURCE_LENGTH, "%s", nesting[0]);
+	for (int i = 0; i < depth; i++)
+		length += snprintf(buffer + length, TEST_NESTED_SOURCE_LENGTH - length, "%s", nesting[1]);
+	length += snprintf(buffer + length, TEST_NESTED_SOURCE_LENGTH - length, "%s", nesting[2]);
+	for (int i = 0; i < depth; i++)
+		length += snprintf(buffer + length, TEST_NESTED_SOURCE_LENGTH - length, "%s", nesting[3]);
+	return buffer;
+}
+
+/**
+ * Code nested too deep fails to parse with one error and leaves nothing behind.
+ * The depth counts the top block, every block in it and every expression, so a = ((((1)))) needs 6 levels.
+ * Small sources reach a lowered limit, and long ones nest right up to the default limit, where they still
+ * run in every tier, and past it. Leaks show up when the tests run with a leak checker.
+ */
+static void test_parse_depth(void)
+{
+	static const char* const toodeep[] =
+	{
+		"a = ((((1))))",
+		"a = [[{x = [1]}]]",
+		"while false do while false do while false do a = 1 end end end",
+	};
+
+	Lnn_State* state = Lnn_CreateState();
+	state->maxparsedepth = 4;
+	for (int i = 0; i < (int)(sizeof(toodeep) / sizeof(toodeep[0])); i++)
+	{
+		char output[256];
+		begin_capture();
+		Lnn_CodeBlock* code = Lnn_ParseSourceCode(state, toodeep[i]);
+		end_capture(output, sizeof(output));
+		check(!code);
+		check(strstr(output, "ERROR! Code is nested deeper than 4 levels\n"));
+		/* Printed once, not again by every level that unwinds */
+		const char* error = strstr(output, "nested deeper");
+		check(error && !strstr(error + 1, "nested deeper") && !strstr(output, "Missing"));
+		check(state->parsedepth == 0);
+		if (code) Lnn_DestroyCodeBlock(code);
+	}
+
+	/* Code right at the limit still parses, and so does deeper code once the limit is back */
+	Lnn_CodeBlock* code = Lnn_ParseSourceCode(state, "while false do while false do a = 1 end end");
+	check(code && !state->parsetoodeep);
+	if (code) Lnn_DestroyCodeBlock(code);
+	state->maxparsedepth = Lnn_MAX_PARSE_DEPTH;
+	code = Lnn_ParseSourceCode(state, toodeep[0]);
+	check(code && state->parsedepth == 0);
+	if (code) Lnn_DestroyCodeBlock(code);
+
+	static char source[TEST_NESTED_SOURCE_LENGTH];
+	for (int i = 0; i < (int)(sizeof(nestings) / sizeof(nestings[0])); i++)
+	{
+		const int depths[] = { Lnn_MAX_PARSE_DEPTH - 1, 1000 };
+		for (int j = 0; j < 2; j++)
+		{
+			char output[256];
+			begin_capture();
+			code = Lnn_ParseSourceCode(state, nested_source(source, nestings[i], depths[j]));
+			end_capture(output, sizeof(output));
+			check(!code);
+			check(strstr(output, "ERROR! Code is nested deeper than " Utl_Stringify(Lnn_MAX_PARSE_DEPTH) " levels\n"));
+			check(state->parsedepth == 0);
+			if (code) Lnn_DestroyCodeBlock(code);
+		}
+
+		nested_source(source, nestings[i], Lnn_MAX_PARSE_DEPTH - 2);
+		for (int t = 0; t < NUM_TIERS; t++)
+		{
+			Lnn_State* deepstate = Lnn_CreateState();
+			check(run_script(deepstate, (tier)t, source) == Lnn_EXEC_OK);
+			const Lnn_Value a = global_value(deepstate, "a");
+			check(i == 2 ? Lnn_IsArray(a) : is_int(a, 1));
+			Lnn_DestroyState(deepstate);
+		}
+	}
+	Lnn_DestroyState(state);
+}
+
+/* Scripts every thread runs, between them they collect and promote objects, intern strings and grow shapes */
+static const char* const thread_scripts[] =
+{
+	"function f(n) if n < 2 then return n end return f(n - 1) + f(n - 2) end x = f(20) y = x * 1.5 - 0.25",
+	"a = [] i = 0 while i < 20000 do a[i] = {v = i, w = [i * 0.5, \"k\" + \"v\"]} i += 1 end n = a[19999].v b = a[7] c = a[123].w a = 0",
+	"s = \"\" i = 0 while i < 300 do s += \"ab\" i += 1 end t = s == s + \"\" o = {x = 1, y = [1.25, 2]} o.z = o.x + o.y[1] o.y[2] = \"q\"",
+};
+
+/* Operands of one run of the quickening test, and the opcodes the add, the comparison and the element access have after it */
+typedef struct
+{
+	const char* operands;
+	Lnn_OpCode add;
+	Lnn_OpCode less;
+	Lnn_OpCode getelement;
+} quicken_step;
+
+/**
+ * The vm rewrites generic instructions for the operand types it sees, and back when the types change.
+ * After Lnn_MAX_QUICKEN_MISSES misses an instruction stays generic. The results are compared with the tree walker.
+ */
+static void test_quickening(void)
+{
+	static const char* const body = "r = a + b l = a < b e = x[0]";
+	static const char ints[] = "a = 1 b = 2 x = [7]";
+	static const char floats[] = "a = 1.5 b = 2 x = [0.5]";
+	static const char strings[] = "a = \"p\" b = \"q\" x = [\"s\"]";
+	/* Strings aren't compared quickened, so the comparison misses at other runs than the others */
+	static const quicken_step steps[] =
+	{
+		{ ints, Lnn_BC_ADD_INT_INT, Lnn_BC_LESS_INT_INT, Lnn_BC_GETELEMENT_INT },
+		{ floats, Lnn_BC_ADD_NUM_NUM, Lnn_BC_LESS_NUM_NUM, Lnn_BC_GETELEMENT_FLOAT },
+		{ strings, Lnn_BC_ADD_STR_STR, Lnn_BC_LESS, Lnn_BC_GETELEMENT_VALUE },
+		{ ints, Lnn_BC_ADD_INT_INT, Lnn_BC_LESS_INT_INT, Lnn_BC_GETELEMENT_INT },
+		{ floats, Lnn_BC_ADD, Lnn_BC_LESS_NUM_NUM, Lnn_BC_GETELEMENT },
+		{ strings, Lnn_BC_ADD, Lnn_BC_LESS, Lnn_BC_GETELEMENT },
+		{ ints, Lnn_BC_ADD, Lnn_BC_LESS, Lnn_BC_GETELEMENT },
+	};
+
+	Lnn_State* state = Lnn_CreateState();
+	Lnn_State* walker = Lnn_CreateState();
+	Lnn_Chunk* chunk = compile_script(state, body);
+	check(chunk);
+	if (!chunk) goto on_done;
+	const int add = find_opcode(chunk, Lnn_BC_ADD);
+	const int less = find_opcode(chunk, Lnn_BC_LESS);
+	const int getelement = find_opcode(chunk, Lnn_BC_GETELEMENT);
+	check(add >= 0 && less >= 0 && getelement >= 0);
+	if (add < 0 || less < 0 || getelement < 0) goto on_done;
+
+	for (int i = 0; i < (int)(sizeof(steps) / sizeof(steps[0])); i++)
+	{
+		check(run_script(state, TIER_VM, steps[i].operands) == Lnn_EXEC_OK);
+		check(Lnn_RunChunk(state, chunk) == Lnn_EXEC_OK);
+		check(run_script(walker, TIER_WALKER, steps[i].operands) == Lnn_EXEC_OK);
+		check(run_script(walker, TIER_WALKER, body) == Lnn_EXEC_OK);
+
+		check(Lnn_InstrOp(chunk->code[add]) == steps[i].add);
+		check(Lnn_InstrOp(chunk->code[less]) == steps[i].less);
+		check(Lnn_InstrOp(chunk->code[getelement]) == steps[i].getelement);
+		for (int j = 0; j < 3; j++)
+		{
+			const char* const name = j == 0 ? "r" : j == 1 ? "l" : "e";
+			char expected[64], result[64];
+			print_value(global_value(walker, name), expected, sizeof(expected));
+			print_value(global_value(state, name), result, sizeof(result));
+			check(!strcmp(result, expected));
+		}
+	}
+	/* The misses are counted in the argument of the generic form */
+	check(Lnn_InstrArg(chunk->code[add]) == Lnn_MAX_QUICKEN_MISSES);
+	check(Lnn_InstrArg(chunk->code[less]) == Lnn_MAX_QUICKEN_MISSES);
+	check(Lnn_InstrArg(chunk->code[getelement]) == Lnn_MAX_QUICKEN_MISSES);
+
+on_done:
+	Lnn_DestroyChunk(chunk);
+	Lnn_DestroyState(walker);
+	Lnn_DestroyState(state);
+}
+
+/**
+ * The peephole pass fuses every kind of pair it knows, but never one whose second instruction is jumped to,
+ * and moves the jumps to where their targets end up. The chunk is made by hand so nothing has fused it yet.
+ */
+static void test_peephole(void)
+{
+	static const Lnn_Instruction code[] =
+	{
+		Lnn_MakeInstr(Lnn_BC_GETGLOBAL, 0),
+		Lnn_MakeInstr(Lnn_BC_PUSHCONST, 0),
+		Lnn_MakeInstr(Lnn_BC_ADD, 0),
+		Lnn_MakeInstr(Lnn_BC_SETGLOBAL, 0),
+		Lnn_MakeInstr(Lnn_BC_POP, 0),
+		Lnn_MakeInstr(Lnn_BC_GETGLOBAL, 0),
+		Lnn_MakeInstr(Lnn_BC_PUSHCONST, 1),
+		Lnn_MakeInstr(Lnn_BC_LESS, 0),
+		Lnn_MakeInstr(Lnn_BC_JUMPIFFALSE, 14),
+		Lnn_MakeInstr(Lnn_BC_GETLOCAL, 3),
+		Lnn_MakeInstr(Lnn_BC_GETMEMBER, 5),
+		Lnn_MakeInstr(Lnn_BC_PUSHCONST, 0),
+		Lnn_MakeInstr(Lnn_BC_SUB, 0),
+		Lnn_MakeInstr(Lnn_BC_JUMP, 12),
+		Lnn_MakeInstr(Lnn_BC_HALT, 0),
+	};
+	static const Lnn_Instruction fused[] =
+	{
+		Lnn_MakeInstr(Lnn_BC_GETGLOBAL, 0),
+		Lnn_MakeInstr(Lnn_BC_ADD_CONST, 0),
+		Lnn_MakeInstr(Lnn_BC_SETGLOBAL_POP, 0),
+		Lnn_MakeInstr(Lnn_BC_GETGLOBAL, 0),
+		Lnn_MakeInstr(Lnn_BC_PUSHCONST, 1),
+		Lnn_MakeInstr(Lnn_BC_LESS_JUMPIFFALSE, 10),
+		Lnn_MakeInstrAB(Lnn_BC_GETLOCAL_GETMEMBER, 3, 5),
+		/* The sub is jumped to, so the constant is pushed on its own */
+		Lnn_MakeInstr(Lnn_BC_PUSHCONST, 0),
+		Lnn_MakeInstr(Lnn_BC_SUB, 0),
+		Lnn_MakeInstr(Lnn_BC_JUMP, 8),
+		Lnn_MakeInstr(Lnn_BC_HALT, 0),
+	};
+	const int numcode = (int)(sizeof(code) / sizeof(code[0]));
+	const int numfused = (int)(sizeof(fused) / sizeof(fused[0]));
+
+	Lnn_Chunk* chunk = Utl_AllocType(Lnn_Chunk);
+	chunk->code = Utl_Malloc(sizeof(code));
+	memcpy(chunk->code, code, sizeof(code));
+	chunk->numcode = chunk->capcode = numcode;
+	Lnn_OptimizeChunk(chunk);
+	check(chunk->numcode == numfused);
+	for (int i = 0; i < numfused && i < chunk->numcode; i++)
+		check(chunk->code[i] == fused[i]);
+	Lnn_DestroyChunk(chunk);
+
+	/* Compiled code is fused too, members of parameters are read with one instruction */
+	Lnn_State* state = Lnn_CreateState();
+	chunk = compile_script(state, "function f(p) return p.x end");
+	check(chunk && chunk->numprototypes == 1);
+	if (chunk && chunk->numprototypes == 1)
+	{
+#ifndef Lnn_NO_PEEPHOLE
+		check(find_opcode(chunk->prototypes[0]->code, Lnn_BC_GETLOCAL_GETMEMBER) >= 0);
+#else
+		check(find_opcode(chunk->prototypes[0]->code, Lnn_BC_GETLOCAL_GETMEMBER) < 0);
+#endif
+	}
+	Lnn_DestroyChunk(chunk);
+
+	/* Branchy code gives the same globals in the vm as in the tree walker, which runs the code as it was written.
+	 * Builds with Lnn_NO_PEEPHOLE run this test too, so fused and unfused code agree. */
+	static const char* const branchy =
+		"s = 0 i = 0 while i < 50 do if i < 25 then s += i * 2 else s -= 1 end j = 0 "
+		"while j < i do j += 3 end t = i == j i += 1 end o = {x = 4} function g(p) return p.x + 1 end k = g(o)";
+	Lnn_State* walker = Lnn_CreateState();
+	check(run_script(state, TIER_VM, branchy) == Lnn_EXEC_OK);
+	check(run_script(walker, TIER_WALKER, branchy) == Lnn_EXEC_OK);
+	for (int i = 0; i < state->numglobals; i++)
+	{
+		char expected[64], result[64];
+		print_value(global_value(walker, state->globals[i].name), expected, sizeof(expected));
+		print_value(state->globals[i].value, result, sizeof(result));
+		check(!strcmp(result, expected));
+	}
+	Lnn_DestroyState(walker);
+	Lnn_DestroyState(state);
+}
+
+/* Adds in the deopt test, each one gets a float in its own run */
+#define TEST_DEOPT_ADDS 5
+
+/**
+ * A hot loop is compiled by the jit for ints. When an operand becomes a float the guard fails, the jit code is
+ * thrown away and the loop goes on in the interpreter, which compiles it again once it is hot.
+ * After Lnn_MAX_JIT_DEOPTS deopts it stays interpreted. Builds without the jit only check the results.
+ */
+static void test_jit_deopts(void)
+{
+	static const char* const floats[TEST_DEOPT_ADDS] = { "a = 0.5", "c = 0.5", "e = 0.5", "g = 0.5", "p = 0.5" };
+	static const char* const sums[TEST_DEOPT_ADDS] = { "r", "s", "t", "u", "v" };
+
+	Lnn_State* state = Lnn_CreateState();
+	check(run_script(state, TIER_VM, "a = 1 b = 2 c = 1 d = 2 e = 1 f = 2 g = 1 h = 2 p = 1 q = 2") == Lnn_EXEC_OK);
+	Lnn_Chunk* chunk = compile_script(state, "i = 0 while i < n do r = a + b s = c + d t = e + f u = g + h v = p + q i += 1 end");
+	check(chunk);
+	if (!chunk)
+	{
+		Lnn_DestroyState(state);
+		return;
+	}
+
+	/* Past Lnn_JIT_THRESHOLD iterations the loop is compiled */
+	check(run_script(state, TIER_VM, "n = 1500") == Lnn_EXEC_OK);
+	check(Lnn_RunChunk(state, chunk) == Lnn_EXEC_OK);
+#ifdef Lnn_JIT
+	check(chunk->jitcode && chunk->numjitdeopts == 0);
+#endif
+
+	for (int i = 0; i < TEST_DEOPT_ADDS; i++)
+	{
+		/* The guard fails right away and the rest of the short loop is interpreted */
+		check(run_script(state, TIER_VM, floats[i]) == Lnn_EXEC_OK);
+		check(run_script(state, TIER_VM, "n = 500") == Lnn_EXEC_OK);
+		check(Lnn_RunChunk(state, chunk) == Lnn_EXEC_OK);
+		for (int j = 0; j < TEST_DEOPT_ADDS; j++)
+		{
+			const Lnn_Value sum = global_value(state, sums[j]);
+			check(j <= i ? Lnn_IsFloat(sum) && sum.u.number == 2.5 : is_int(sum, 3));
+		}
+		check(is_int(global_value(state, "i"), 500));
+#ifdef Lnn_JIT
+		check(!chunk->jitcode);
+		check(chunk->numjitdeopts == (i + 1 < Lnn_MAX_JIT_DEOPTS ? i + 1 : Lnn_MAX_JIT_DEOPTS));
+#endif
+
+		/* Hot again, it is compiled for the new types until it has deopted too often */
+		check(run_script(state, TIER_VM, "n = 1500") == Lnn_EXEC_OK);
+		check(Lnn_RunChunk(state, chunk) == Lnn_EXEC_OK);
+		check(is_int(global_value(state, "i"), 1500));
+#ifdef Lnn_JIT
+		check(i + 1 < Lnn_MAX_JIT_DEOPTS ? chunk->jitcode != NULL : chunk->jitcode == NULL);
+#endif
+	}
+
+	Lnn_DestroyChunk(chunk);
+	Lnn_DestroyState(state);
+}
+
+/* A script of the capture test, f or mk makes the inner function. Lnn_NUM_OPCODES stands for no opcode */
+typedef struct
+{
+	const char* sourcecode;
+	Utl_Int result;			/* What the script leaves in r */
+	Utl_Bool collects;		/* It allocates enough for minor collections while the captures are in use */
+	Lnn_OpCode outer;		/* In the code of the outer function */
+	Lnn_OpCode notouter;	/* Never in the code of the outer function */
+	Lnn_OpCode inner;		/* In the code of the inner function */
+	Lnn_OpCode notinner;	/* Never in the code of the inner function */
+} capture_case;
+
+/**
+ * Locals that can't change after they are captured are copied, the others are boxed in a cell that is shared with
+ * the closures. Function literals that don't escape are made on the stack. Every tier gives the same results,
+ * also when the collector moves the captures and the cells while they are used.
+ */
+static void test_captures(void)
+{
+	static const capture_case cases[] =
+	{
+		/* Never assigned again, so copied */
+		{ "function f(x) k = x * 2 g = function() return k + 1 end return g end h = f(5) r = h()", 11, Utl_FALSE,
+		  Lnn_BC_CLOSURE, Lnn_BC_SETBOXED, Lnn_BC_GETCAPTURE, Lnn_BC_GETBOXEDCAPTURE },
+		/* Assigned in the inner function */
+		{ "function mk() n = 0 inc = function() n += 1 return n end return inc end c = mk() c() c() r = c()", 3, Utl_FALSE,
+		  Lnn_BC_SETBOXED, Lnn_NUM_OPCODES, Lnn_BC_SETBOXEDCAPTURE, Lnn_BC_GETCAPTURE },
+		/* Assigned in a loop, every closure sees the last value */
+		{ "function f() fs = [] i = 0 while i < 3 do k = i fs[i] = function() return k end i += 1 end return fs end "
+		  "a = f() x = a[0] y = a[1] z = a[2] r = x() + y() * 10 + z() * 100", 222, Utl_FALSE,
+		  Lnn_BC_SETBOXED, Lnn_NUM_OPCODES, Lnn_BC_GETBOXEDCAPTURE, Lnn_BC_GETCAPTURE },
+		/* Assigned after the capture */
+		{ "function f() k = 1 g = function() return k end k = 2 return g end h = f() r = h()", 2, Utl_FALSE,
+		  Lnn_BC_SETBOXED, Lnn_NUM_OPCODES, Lnn_BC_GETBOXEDCAPTURE, Lnn_BC_GETCAPTURE },
+		/* Only called, so it stays on the stack */
+		{ "function f(x) k = x + 1 g = function(y) return y * k end return g(2) + g(3) end r = f(4)", 25, Utl_FALSE,
+		  Lnn_BC_STACKCLOSURE, Lnn_BC_CLOSURE, Lnn_BC_GETCAPTURE, Lnn_NUM_OPCODES },
+		/* The captured array is young when the closure allocates, in a closure and in a function on the stack */
+		{ "function f(x) k = [x] g = function() a = [] i = 0 while i < 20000 do a[i] = [i] i += 1 end return k[0] end "
+		  "return g end h = f(7) r = h()", 7, Utl_TRUE,
+		  Lnn_BC_CLOSURE, Lnn_NUM_OPCODES, Lnn_BC_GETCAPTURE, Lnn_NUM_OPCODES },
+		{ "function f(x) k = [x] g = function() a = [] i = 0 while i < 20000 do a[i] = [i] i += 1 end return k[0] end "
+		  "return g() end r = f(7)", 7, Utl_TRUE,
+		  Lnn_BC_STACKCLOSURE, Lnn_BC_CLOSURE, Lnn_BC_GETCAPTURE, Lnn_NUM_OPCODES },
+		/* A counter that is called between allocations, its cell is moved out of the nursery */
+		{ "function mk() n = 0 inc = function() n += 1 return n end return inc end c = mk() "
+		  "i = 0 while i < 20000 do t = [i, i] c() i += 1 end r = c()", 20001, Utl_TRUE,
+		  Lnn_BC_SETBOXED, Lnn_NUM_OPCODES, Lnn_BC_SETBOXEDCAPTURE, Lnn_BC_GETCAPTURE },
+	};
+
+	for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+	{
+		const capture_case* c = &cases[i];
+		for (int t = 0; t < NUM_TIERS; t++)
+		{
+			Lnn_State* state = Lnn_CreateState();
+			check(run_script(state, (tier)t, c->sourcecode) == Lnn_EXEC_OK);
+			check(is_int(global_value(state, "r"), c->result));
+			check(!c->collects || state->gc.numminor > 0);
+			Lnn_DestroyState(state);
+		}
+
+		Lnn_State* state = Lnn_CreateState();
+		Lnn_Chunk* chunk = compile_script(state, c->sourcecode);
+		const Lnn_Chunk* outer = chunk && chunk->numprototypes == 1 ? chunk->prototypes[0]->code : NULL;
+		const Lnn_Chunk* inner = outer && outer->numprototypes == 1 ? outer->prototypes[0]->code : NULL;
+		check(inner);
+		if (inner)
+		{
+			check(c->outer == Lnn_NUM_OPCODES || find_opcode(outer, c->outer) >= 0);
+			check(c->notouter == Lnn_NUM_OPCODES || find_opcode(outer, c->notouter) < 0);
+			check(c->inner == Lnn_NUM_OPCODES || find_opcode(inner, c->inner) >= 0);
+			check(c->notinner == Lnn_NUM_OPCODES || find_opcode(inner, c->notinner) < 0);
+		}
+		Lnn_DestroyChunk(chunk);
+		Lnn_DestroyState(state);
+	}
+}
+
+/**
+ * return f(x) replaces the frame of the caller in every tier, so tail recursion goes far deeper than
+ * Lnn_MAX_CALL_DEPTH. A function on the stack that captures keeps its captures in the frame of the caller,
+ * so calling it from a return is a normal call, and it can still tail call on its own. Its locals would
+ * overwrite the captures otherwise.
+ */
+static void test_tail_calls(void)
+{
+	static const char* const loop =
+		"function loop(n, acc) if n == 0 then return acc end return loop(n - 1, acc + 1) end r = loop(1000000, 0)";
+	static const char* const evenodd =
+		"function even(n) if n == 0 then return true end return odd(n - 1) end "
+		"function odd(n) if n == 0 then return false end return even(n - 1) end r = even(100001) s = odd(100001)";
+	static const char* const captures =
+		"function f(n, acc) if n == 0 then return acc end k = 2 g = function(m, a) b = 0 c = 0 d = 0 e = 0 return f(m, a + k) end "
+		"return g(n - 1, acc) end r = f(100, 0)";
+
+	for (int t = 0; t < NUM_TIERS; t++)
+	{
+		Lnn_State* state = Lnn_CreateState();
+		check(run_script(state, (tier)t, loop) == Lnn_EXEC_OK);
+		check(is_int(global_value(state, "r"), 1000000));
+
+		check(run_script(state, (tier)t, evenodd) == Lnn_EXEC_OK);
+		const Lnn_Value even = global_value(state, "r");
+		const Lnn_Value odd = global_value(state, "s");
+		check(even.type == Lnn_VT_BOOL && !even.u.boolean);
+		check(odd.type == Lnn_VT_BOOL && odd.u.boolean);
+
+		check(run_script(state, (tier)t, captures) == Lnn_EXEC_OK);
+		check(is_int(global_value(state, "r"), 200));
+		Lnn_DestroyState(state);
+	}
+
+	/* The one that captures is on the stack */
+	Lnn_State* state = Lnn_CreateState();
+	Lnn_Chunk* chunk = compile_script(state, captures);
+	const Lnn_Chunk* f = chunk && chunk->numprototypes == 1 ? chunk->prototypes[0]->code : NULL;
+	check(f && find_opcode(f, Lnn_BC_STACKCLOSURE) >= 0 && find_opcode(f, Lnn_BC_TAILCALL) >= 0);
+	Lnn_DestroyChunk(chunk);
+	Lnn_DestroyState(state);
+}
+
+/* A script of the scalar replacement test, f builds a literal in every one of 20000 iterations */
+typedef struct
+{
+	const char* sourcecode;
+	Utl_Int result;			/* What the script leaves in r */
+	Utl_Bool replaced;		/* The literal in f is replaced by scalars */
+} scalar_case;
+
+/**
+ * A local that is only assigned literals with the same fields, and is only used through those fields,
+ * lives in hidden slots of the compiled function and its loop allocates nothing, so the VM does no
+ * minor collection. Passing it, returning it, indexing it with a variable, reading it whole or assigning
+ * it other fields keeps it a real object. The results are the same in every tier.
+ */
+static void test_scalar_replacement(void)
+{
+	static const scalar_case cases[] =
+	{
+		{ "function f(n) s = 0 i = 0 while i < n do p = {x = i, y = 2} s += p.x * p.y i += 1 end return s end r = f(20000)",
+		  399980000, Utl_TRUE },
+		{ "function f(n) s = 0 i = 0 while i < n do p = [i, 2] s += p[0] * p[1] i += 1 end return s end r = f(20000)",
+		  399980000, Utl_TRUE },
+		{ "function f(n) s = 0 i = 0 p = {x = 0, y = 2} while i < n do p.x = i s += p.x * p.y i += 1 end return s end r = f(20000)",
+		  399980000, Utl_TRUE },
+		{ "function g(q) return q.x * q.y end "
+		  "function f(n) s = 0 i = 0 while i < n do p = {x = i, y = 2} s += g(p) i += 1 end return s end r = f(20000)",
+		  399980000, Utl_FALSE },
+		{ "function f(n) i = 0 while i < n do p = {x = i, y = 2} i += 1 end return p end o = f(20000) r = o.x * o.y",
+		  39998, Utl_FALSE },
+		{ "function f(n) s = 0 i = 0 k = 1 while i < n do p = [i, 2] s += p[0] * p[k] i += 1 end return s end r = f(20000)",
+		  399980000, Utl_FALSE },
+		{ "function f(n) s = 0 i = 0 while i < n do p = {x = i, y = 2} q = p s += q.x * p.y i += 1 end return s end r = f(20000)",
+		  399980000, Utl_FALSE },
+		{ "function f(n) s = 0 i = 0 while i < n do p = {x = i, y = 2} if i < 0 then p = {x = 1} end "
+		  "s += p.x * p.y i += 1 end return s end r = f(20000)",
+		  399980000, Utl_FALSE },
+	};
+
+	for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++)
+	{
+		const scalar_case* c = &cases[i];
+		for (int t = 0; t < NUM_TIERS; t++)
+		{
+			Lnn_State* state = Lnn_CreateState();
+			check(run_script(state, (tier)t, c->sourcecode) == Lnn_EXEC_OK);
+			check(is_int(global_value(state, "r"), c->result));
+			if (t == TIER_VM) check(c->replaced ? state->gc.numminor == 0 : state->gc.numminor > 0);
+			Lnn_DestroyState(state);
+		}
+
+		/* f is the last function in the script */
+		Lnn_State* state = Lnn_CreateState();
+		Lnn_Chunk* chunk = compile_script(state, c->sourcecode);
+		const Lnn_Chunk* f = chunk && chunk->numprototypes > 0 ? chunk->prototypes[chunk->numprototypes - 1]->code : NULL;
+		check(f);
+		if (f)
+		{
+			const Utl_Bool allocates = find_opcode(f, Lnn_BC_NEWOBJECT) >= 0 || find_opcode(f, Lnn_BC_NEWARRAY) >= 0;
+			check(allocates == !c->replaced);
+		}
+		Lnn_DestroyChunk(chunk);
+		Lnn_DestroyState(state);
+	}
+}
+
+/* Most threads a test runs at once */
+#define TEST_MAX_THREADS 8
+
+typedef struct
+{
+	void (*function)(void* job);
+	void* job;
+} test_thread;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_main(LPVOID thread)
+{
+	((test_thread*)thread)->function(((test_thread*)thread)->job);
+	return 0;
+}
+#else
+static void* thread_main(void* thread)
+{
+	((test_thread*)thread)->function(((test_thread*)thread)->job);
+	return NULL;
+}
+#endif
+
+/**
+ * @brief Runs a function on a thread of its own for every job and waits until they are all done.
+ * @param jobs Array of numjobs jobs of jobsize bytes each, the function gets a pointer to one.
+ */
+static void run_threads(void (*function)(void* job), void* jobs, const size_t jobsize, const int numjobs)
+{
+	Utl_Assert(numjobs <= TEST_MAX_THREADS);
+	test_thread threads[TEST_MAX_THREADS];
+	for (int i = 0; i < numjobs; i++)
+	{
+		threads[i].function = function;
+		threads[i].job = (char*)jobs + i * jobsize;
+	}
+#ifdef _WIN32
+	HANDLE handles[TEST_MAX_THREADS];
+	for (int i = 0; i < numjobs; i++)
+		handles[i] = CreateThread(NULL, 0, thread_main, &threads[i], 0, NULL);
+	WaitForMultipleObjects(numjobs, handles, TRUE, INFINITE);
+	for (int i = 0; i < numjobs; i++)
+		CloseHandle(handles[i]);
+#else
+	pthread_t handles[TEST_MAX_THREADS];
+	for (int i = 0; i < numjobs; i++)
+		pthread_create(&handles[i], NULL, thread_main, &threads[i]);
+	for (int i = 0; i < numjobs; i++)
+		pthread_join(handles[i], NULL);
+#endif
+}
+
+#define TEST_THREADS 4
+
+/* States that ran the thread scripts, one for each tier */
+typedef struct
+{
+	Lnn_State* states[NUM_TIERS];
+	Utl_Bool failed;
+} script_run;
+
+static void run_thread_scripts(void* job)
+{
+	script_run* run = job;
+	run->failed = Utl_FALSE;
+	for (int t = 0; t < NUM_TIERS; t++)
+	{
+		run->states[t] = Lnn_CreateState();
+		for (int i = 0; i < (int)(sizeof(thread_scripts) / sizeof(thread_scripts[0])); i++)
+			if (run_script(run->states[t], (tier)t, thread_scripts[i]) != Lnn_EXEC_OK)
+				run->failed = Utl_TRUE;
+	}
+}
+
+/**
+ * States running on several threads at once give the same globals as one state running alone.
+ * Every table that states share, like the operator tables, builtins and array kernels, is const,
+ * and no process global mutable table is left, so a difference means something is shared that shouldn't be.
+ */
+static void test_threads(void)
+{
+	script_run reference;
+	run_thread_scripts(&reference);
+	check(!reference.failed);
+
+	script_run runs[TEST_THREADS];
+	run_threads(&run_thread_scripts, runs, sizeof(runs[0]), TEST_THREADS);
+
+	static char expected[4096], globals[4096];
+	for (int t = 0; t < NUM_TIERS; t++)
+	{
+		begin_capture();
+		Lnn_PrintGlobals(reference.states[t]);
+		end_capture(expected, sizeof(expected));
+		for (int i = 0; i < TEST_THREADS; i++)
+		{
+			check(!runs[i].failed);
+			begin_capture();
+			Lnn_PrintGlobals(runs[i].states[t]);
+			end_capture(globals, sizeof(globals));
+			check(strcmp(globals, expected) == 0);
+			if (strcmp(globals, expected) != 0)
+				printf("Thread %i, tier %i gave\n%sinstead of\n%s", i, t, globals, expected);
+			Lnn_DestroyState(runs[i].states[t]);
+		}
+		Lnn_DestroyState(reference.states[t]);
+	}
+}
+
+#define TEST_COROUTINES 100
+
+/**
+ * Coroutines hand values back and forth at yields, keep what they hold alive and up to date
+ * while the collector moves it, and give back their memory when they are destroyed suspended.
+ */
+static void test_coroutines(void)
+{
+	Lnn_State* state = Lnn_CreateState();
+	Lnn_Value result;
+
+	Lnn_Chunk* chunk = compile_script(state, "t = 0 k = 0 while k < 3 do t += yield(k) k += 1 end");
+	check(chunk);
+	if (chunk)
+	{
+		Lnn_Coroutine* coroutine = Lnn_CreateCoroutine(state, chunk);
+		check(Lnn_ResumeCoroutine(state, coroutine, Lnn_NullValue(), &result) == Lnn_EXEC_YIELD && is_int(result, 0));
+		for (int k = 1; k < 3; k++)
+			check(Lnn_ResumeCoroutine(state, coroutine, Lnn_IntValue(k * 10), &result) == Lnn_EXEC_YIELD && is_int(result, k));
+		check(Lnn_ResumeCoroutine(state, coroutine, Lnn_IntValue(30), &result) == Lnn_EXEC_OK);
+		check(coroutine->status == Lnn_CO_DEAD);
+		check(is_int(global_value(state, "t"), 60));
+		Lnn_DestroyCoroutine(state, coroutine);
+		Lnn_DestroyChunk(chunk);
+	}
+
+	/* The functions live in the chunks that made them */
+	Lnn_Chunk* hchunk = compile_script(state, "function h(k) a = [k, \"s\" + \"t\"] o = {v = k} x = yield(a) "
+		"if a[1] != \"st\" then return -1 end return x + o.v + a[0] end");
+	Lnn_Chunk* fchunk = compile_script(state, "function g(n) return yield(n) + 1 end function f(n) return g(n) * 2 end");
+	check(hchunk && fchunk);
+	Lnn_FunctionHandle* h = NULL;
+	Lnn_FunctionHandle* f = NULL;
+	if (!hchunk || !fchunk) goto on_done;
+	check(Lnn_RunChunk(state, hchunk) == Lnn_EXEC_OK && Lnn_RunChunk(state, fchunk) == Lnn_EXEC_OK);
+	h = Lnn_GetFunctionHandle(state, "h", 1);
+	f = Lnn_GetFunctionHandle(state, "f", 1);
+	check(h && f);
+	if (!h || !f) goto on_done;
+
+	/* The arrays, strings and objects the suspended calls hold are young, so the collection moves them
+	 * and the script after it fills the nursery with other objects */
+	static Lnn_Coroutine* coroutines[TEST_COROUTINES];
+	for (int i = 0; i < TEST_COROUTINES; i++)
+	{
+		const Lnn_Value arg = Lnn_IntValue(i);
+		coroutines[i] = Lnn_CreateFunctionCoroutine(state, h, &arg);
+		check(Lnn_ResumeCoroutine(state, coroutines[i], Lnn_NullValue(), &result) == Lnn_EXEC_YIELD && Lnn_IsArray(result));
+	}
+	const unsigned long long numminor = state->gc.numminor;
+	Lnn_GCFullCollect(state, NULL, NULL);
+	check(run_script(state, TIER_VM, "b = [] i = 0 while i < 10000 do b[i] = [i] i += 1 end b = 0") == Lnn_EXEC_OK);
+	check(state->gc.numminor > numminor);
+	for (int i = 0; i < TEST_COROUTINES; i++)
+	{
+		check(Lnn_ResumeCoroutine(state, coroutines[i], Lnn_IntValue(1000), &result) == Lnn_EXEC_OK && is_int(result, 1000 + 2 * i));
+		Lnn_DestroyCoroutine(state, coroutines[i]);
+	}
+
+	/* A call two functions deep only keeps their frames and values while suspended */
+	const size_t livebytes = state->memory.livebytes;
+	const Lnn_Value arg = Lnn_IntValue(20);
+	Lnn_Coroutine* coroutine = Lnn_CreateFunctionCoroutine(state, f, &arg);
+	check(Lnn_ResumeCoroutine(state, coroutine, Lnn_NullValue(), &result) == Lnn_EXEC_YIELD && is_int(result, 20));
+	/* The frames are the one of the handle, f and g, on 64 bit builds the block is 152 bytes */
+	check(coroutine->numframes == 3 && coroutine->numvalues == 5);
+	check(coroutine->savedsize == 3 * sizeof(Lnn_SavedFrame) + 5 * sizeof(Lnn_Value));
+	Lnn_DestroyCoroutine(state, coroutine);
+	check(state->memory.livebytes == livebytes);
+	check(state->coroutines.count == 0);
+	Lnn_GCFullCollect(state, NULL, NULL);
+
+on_done:
+	if (h) Lnn_DestroyFunctionHandle(h);
+	if (f) Lnn_DestroyFunctionHandle(f);
+	if (hchunk) Lnn_DestroyChunk(hchunk);
+	if (fchunk) Lnn_DestroyChunk(fchunk);
+	Lnn_DestroyState(state);
+}
+
+/**
+ * A coroutine with a budget is preempted once every budget loop iterations, whether the loop runs in the
+ * interpreter or in jit code. Jit code leaves the last tick of a slice for the interpreter to spend.
+ */
+static void test_budget(void)
+{
+	Lnn_State* state = Lnn_CreateState();
+	Lnn_Chunk* chunk = compile_script(state, "i = 0 s = 0 while i < 100000 do s += 2 i += 1 end");
+	check(chunk);
+	if (chunk)
+	{
+		Lnn_Coroutine* coroutine = Lnn_CreateCoroutine(state, chunk);
+		coroutine->budget = 1000;
+		int numpreempted = 0;
+		Lnn_ExecResult result;
+		while ((result = Lnn_ResumeCoroutine(state, coroutine, Lnn_NullValue(), NULL)) == Lnn_EXEC_PREEMPTED)
+		{
+			check(is_int(global_value(state, "i"), (numpreempted + 1) * 1000));
+			numpreempted++;
+		}
+		check(result == Lnn_EXEC_OK);
+		check(numpreempted == 100);
+#ifdef Lnn_JIT
+		check(chunk->jitcode);
+#endif
+		check(is_int(global_value(state, "s"), 200000));
+		Lnn_DestroyCoroutine(state, coroutine);
+		Lnn_DestroyChunk(chunk);
+	}
+	Lnn_DestroyState(state);
+}
+
+#define is_short_string(value, s) ((value).type == Lnn_VT_SHORTSTRING && !strcmp((value).u.shortstring.chars, s))
+
+/* Checks that the vm hasn't rewritten any instruction of a chunk or its functions */
+static Utl_Bool is_unquickened(const Lnn_Chunk* chunk)
+{
+	for (int i = 0; i < chunk->numcode; i++)
+		if (Lnn_InstrOp(chunk->code[i]) >= Lnn_BC_EQUALITY_NUM_NUM && Lnn_InstrOp(chunk->code[i]) <= Lnn_BC_MUL_INT_INT)
+			return Utl_FALSE;
+	for (int i = 0; i < chunk->numprototypes; i++)
+		if (!is_unquickened(chunk->prototypes[i]->code))
+			return Utl_FALSE;
+	return Utl_TRUE;
+}
+
+#define TEST_PROGRAM_STATES 3
+
+/**
+ * A program loaded in several states shares its code until each state quickens it for the types it sees there,
+ * and the code of the program is never rewritten. The last state already has a global, so its slots differ
+ * from the ones in the program and it gets its own code right away.
+ */
+static void test_programs(void)
+{
+	static const char* const types[TEST_PROGRAM_STATES] = { "a = 1 b = 2", "a = \"x\" b = \"y\"", "a = 1.5 b = 2" };
+
+	Lnn_State* compiler = Lnn_CreateState();
+	/* The function is quickened in its deepest call, while the calls under it are still in the shared code */
+	Lnn_Program* program = Lnn_CompileProgram(compiler, "function f(n) if n < 1 then return a + b end m = f(n - 1) return m end "
+		"i = 0 while i < 10 do r = a + b i += 1 end q = f(5)");
+	Lnn_DestroyState(compiler);
+	check(program);
+	if (!program) return;
+	const int add = find_opcode(program->chunk, Lnn_BC_ADD);
+	check(add >= 0);
+
+	Lnn_State* states[TEST_PROGRAM_STATES];
+	Lnn_Chunk* chunks[TEST_PROGRAM_STATES];
+	for (int i = 0; i < TEST_PROGRAM_STATES; i++)
+	{
+		states[i] = Lnn_CreateState();
+		if (i == TEST_PROGRAM_STATES - 1)
+			check(run_script(states[i], TIER_VM, "z = 0") == Lnn_EXEC_OK);
+		chunks[i] = Lnn_LoadProgram(states[i], program);
+		check(run_script(states[i], TIER_VM, types[i]) == Lnn_EXEC_OK);
+	}
+	check(program->refcount == 1 + TEST_PROGRAM_STATES);
+	check(chunks[0]->code == program->chunk->code && chunks[1]->code == program->chunk->code);
+	check(chunks[2]->code != program->chunk->code);
+
+	for (int i = 0; i < TEST_PROGRAM_STATES; i++)
+		check(Lnn_RunChunk(states[i], chunks[i]) == Lnn_EXEC_OK);
+	for (int i = 0; i < 2; i++)
+	{
+		const char* const name = i ? "q" : "r";
+		check(is_int(global_value(states[0], name), 3));
+		check(is_short_string(global_value(states[1], name), "xy"));
+		check(Lnn_IsFloat(global_value(states[2], name)) && global_value(states[2], name).u.number == 3.5);
+	}
+	check(chunks[0]->code != program->chunk->code && chunks[1]->code != chunks[0]->code);
+	check(Lnn_InstrOp(chunks[0]->code[add]) == Lnn_BC_ADD_INT_INT);
+	check(Lnn_InstrOp(chunks[1]->code[add]) == Lnn_BC_ADD_STR_STR);
+	check(Lnn_InstrOp(chunks[2]->code[add]) == Lnn_BC_ADD_NUM_NUM);
+	check(is_unquickened(program->chunk));
+
+	/* Strings in the first state only change its own code */
+	check(run_script(states[0], TIER_VM, types[1]) == Lnn_EXEC_OK);
+	check(Lnn_RunChunk(states[0], chunks[0]) == Lnn_EXEC_OK);
+	check(Lnn_RunChunk(states[1], chunks[1]) == Lnn_EXEC_OK);
+	check(is_short_string(global_value(states[0], "r"), "xy"));
+	check(is_short_string(global_value(states[1], "r"), "xy"));
+	check(Lnn_InstrOp(chunks[1]->code[add]) == Lnn_BC_ADD_STR_STR);
+	check(is_unquickened(program->chunk));
+
+	for (int i = 0; i < TEST_PROGRAM_STATES; i++)
+	{
+		Lnn_DestroyChunk(chunks[i]);
+		Lnn_DestroyState(states[i]);
+	}
+	check(program->refcount == 1);
+	Lnn_ReleaseProgram(program);
+}
+
+/* Values every producer in the channel test sends */
+#define TEST_CHANNEL_VALUES 2000
+
+/* Script one thread of the channel test runs, with the channels it sends to and receives from */
+typedef struct
+{
+	const char* sourcecode;
+	Lnn_Channel* input;
+	Lnn_Channel* output;
+	Utl_Bool failed;
+	Lnn_Value sum;
+} channel_job;
+
+static void run_channel_job(void* job)
+{
+	channel_job* channeljob = job;
+	Lnn_State* state = Lnn_CreateState();
+	if (channeljob->input) Lnn_BindChannel(state, "input", channeljob->input);
+	if (channeljob->output) Lnn_BindChannel(state, "output", channeljob->output);
+	const int slot = Lnn_GetGlobalSlot(state, "n");
+	state->globals[slot].value = Lnn_IntValue(TEST_CHANNEL_VALUES);
+	channeljob->failed = run_script(state, TIER_VM, channeljob->sourcecode) != Lnn_EXEC_OK;
+	channeljob->sum = global_value(state, "s");
+	Lnn_DestroyState(state);
+}
+
+/* Sends n objects with nested arrays and a long string, so every one is deep copied */
+static const char* const channel_producer =
+	"i = 0 while i < n do if send(output, {i = i, a = [i * 0.5, \"a string that is too long to be short\"]}) then i += 1 end end";
+/* Receives n objects and adds up the ones that made it over whole */
+static const char* const channel_consumer =
+	"c = 0 s = 0 while c < n do v = receive(input) if v != null then c += 1 if v.a[0] * 2 == v.i then s += v.i end end end";
+
+/**
+ * Values sent through channels arrive whole and exactly once with one or many threads on each end.
+ * Nested arrays and objects are copied out of a state and into others as they were, and values
+ * nested too deep or containing themselves are refused without leaving anything allocated.
+ * Scripts can't make up channels out of numbers or pass them to another state.
+ */
+static void test_channels(void)
+{
+	const long long sum = (long long)TEST_CHANNEL_VALUES * (TEST_CHANNEL_VALUES - 1) / 2;
+
+	Lnn_Channel* channel = Lnn_CreateChannel(16, Lnn_CK_SPSC);
+	channel_job spsc[2] =
+	{
+		{ .sourcecode = channel_producer, .output = channel },
+		{ .sourcecode = channel_consumer, .input = channel },
+	};
+	run_threads(&run_channel_job, spsc, sizeof(spsc[0]), 2);
+	check(!spsc[0].failed && !spsc[1].failed);
+	check(is_int(spsc[1].sum, sum));
+	Lnn_ReleaseChannel(channel);
+
+	/* Both consumers receive as many values as one producer sends, which ones is up to the race */
+	channel = Lnn_CreateChannel(16, Lnn_CK_MPMC);
+	channel_job mpmc[4] =
+	{
+		{ .sourcecode = channel_producer, .output = channel },
+		{ .sourcecode = channel_producer, .output = channel },
+		{ .sourcecode = channel_consumer, .input = channel },
+		{ .sourcecode = channel_consumer, .input = channel },
+	};
+	run_threads(&run_channel_job, mpmc, sizeof(mpmc[0]), 4);
+	for (int i = 0; i < 4; i++)
+		check(!mpmc[i].failed);
+	check(Lnn_IsInt(mpmc[2].sum) && Lnn_IsInt(mpmc[3].sum) && mpmc[2].sum.u.integer + mpmc[3].sum.u.integer == 2 * sum);
+	Lnn_ReleaseChannel(channel);
+
+	Lnn_State* from = Lnn_CreateState();
+	Lnn_State* to = Lnn_CreateState();
+	check(run_script(from, TIER_VM, "v = {a = [1, [2.5, \"a string that is too long to be short\"], {b = [true, null]}], s = \"x\"} "
+		"a = [] i = 0 while i < 40 do a = [a] i += 1 end") == Lnn_EXEC_OK);
+	static char expected[512], attached[512];
+	Lnn_Value copy, value;
+	const Lnn_Value original = global_value(from, "v");
+	print_value(original, expected, sizeof(expected));
+	check(Lnn_DetachValue(from, original, &copy));
+	for (int i = 0; i < 2; i++)
+	{
+		check(Lnn_AttachValue(to, copy, &value));
+		print_value(value, attached, sizeof(attached));
+		check(strcmp(attached, expected) == 0);
+	}
+	Lnn_FreeDetachedValue(copy);
+	check(Lnn_DetachValue(from, global_value(from, "a"), &copy));
+	Lnn_FreeDetachedValue(copy);
+
+	channel = Lnn_CreateChannel(4, Lnn_CK_SPSC);
+	Utl_Bool sent;
+	check(run_script(from, TIER_VM, "i = 0 while i < 60 do a = [a] i += 1 end b = [] b[0] = b") == Lnn_EXEC_OK);
+	const char* const toodeep[] = { "a", "b" };
+	for (int i = 0; i < 2; i++)
+	{
+		char output[256];
+		begin_capture();
+		check(!Lnn_DetachValue(from, global_value(from, toodeep[i]), &copy));
+		check(!Lnn_TrySend(from, channel, global_value(from, toodeep[i]), &sent));
+		end_capture(output, sizeof(output));
+		check(strstr(output, "ERROR! Can't copy values nested deeper than"));
+	}
+	/* The script may have moved v, so it is looked up again */
+	check(Lnn_TrySend(from, channel, global_value(from, "v"), &sent) && sent);
+	check(Lnn_TryReceive(to, channel, &value));
+	print_value(value, attached, sizeof(attached));
+	check(strcmp(attached, expected) == 0);
+
+	/* A full channel turns values down before copying them, even ones that can't be copied */
+	for (int i = 0; i < 4; i++)
+		check(Lnn_TrySend(from, channel, Lnn_IntValue(i), &sent) && sent);
+	check(Lnn_TrySend(from, channel, global_value(from, "b"), &sent) && !sent);
+
+	/* Scripts can only use the channels they were given, and can't send them on */
+	Lnn_BindChannel(from, "c", channel);
+	check(run_script(from, TIER_VM, "d = c x = receive(d) y = c == d") == Lnn_EXEC_OK);
+	check(is_int(global_value(from, "x"), 0));
+	check(global_value(from, "y").type == Lnn_VT_BOOL && global_value(from, "y").u.boolean);
+	const char* const forged[] = { "x = send(0, 1)", "x = receive(1)", "x = receive(c + 1)", "x = send(c, c)" };
+	const char* const errors[] = { "send needs a channel", "receive needs a channel", "Can't use '+'", "Can't copy channel" };
+	for (int i = 0; i < 4; i++)
+	{
+		char output[256];
+		begin_capture();
+		check(run_script(from, TIER_VM, forged[i]) == Lnn_EXEC_ERROR);
+		end_capture(output, sizeof(output));
+		check(strstr(output, errors[i]));
+	}
+	Lnn_ReleaseChannel(channel);
+
+	Lnn_DestroyState(from);
+	Lnn_DestroyState(to);
+}
+
+/* Counted by the workers as the tasks of the executor test finish */
+typedef struct
+{
+	Utl_AtomicInt right;
+	Utl_AtomicInt wrong;
+	Utl_AtomicInt errors;
+} task_counts;
+
+/* Task that adds up the numbers below count */
+typedef struct
+{
+	task_counts* counts;
+	int count;
+} sum_task;
+
+static void prepare_sum(Lnn_State* state, void* userdata)
+{
+	const int slot = Lnn_GetGlobalSlot(state, "k");
+	state->globals[slot].value = Lnn_IntValue(((sum_task*)userdata)->count);
+}
+
+static void sum_done(Lnn_State* state, Lnn_ExecResult result, void* userdata)
+{
+	sum_task* task = userdata;
+	if (result != Lnn_EXEC_OK)
+	{
+		Utl_AtomicIncrement(&task->counts->errors);
+		return;
+	}
+	const Lnn_Value sum = state->globals[Lnn_FindGlobalSlot(state, "s")].value;
+	if (Lnn_IsInt(sum) && sum.u.integer == (long long)task->count * (task->count - 1) / 2)
+		Utl_AtomicIncrement(&task->counts->right);
+	else
+		Utl_AtomicIncrement(&task->counts->wrong);
+}
+
+#define TEST_TASKS 200
+#define TEST_FAILING_TASKS 10
+
+/**
+ * Every task submitted to the executor runs once and reports its result, and the statistics count them.
+ * Half of the tasks run in slices, the sum is in a function since tasks that interleave share globals.
+ */
+static void test_executor(void)
+{
+	Lnn_State* state = Lnn_CreateState();
+	Lnn_Program* sum = Lnn_CompileProgram(state,
+		"function f(n) t = 0 j = 0 while j < n do t += j j += 1 end return t end s = f(k)");
+	Lnn_Program* failing = Lnn_CompileProgram(state, "s = \"k\" + 1");
+	Lnn_DestroyState(state);
+	check(sum && failing);
+	if (!sum || !failing) return;
+
+	static sum_task tasks[TEST_TASKS];
+	task_counts counts = { 0 };
+	Lnn_Executor* executor = Lnn_CreateExecutor(4, NULL, NULL);
+	for (int i = 0; i < TEST_TASKS; i++)
+	{
+		tasks[i].counts = &counts;
+		tasks[i].count = i * 100;
+		Lnn_Task task = { 0 };
+		task.program = i < TEST_FAILING_TASKS ? failing : sum;
+		task.prepare = &prepare_sum;
+		task.done = &sum_done;
+		task.userdata = &tasks[i];
+		task.affinity = -1;
+		task.budget = i % 2 ? 500 : 0;
+		Lnn_SubmitTask(executor, &task);
+	}
+	Lnn_WaitForExecutor(executor);
+
+	Lnn_ExecutorStats stats;
+	Lnn_GetExecutorStats(executor, -1, &stats);
+	check(counts.right == TEST_TASKS - TEST_FAILING_TASKS);
+	check(counts.wrong == 0);
+	check(counts.errors == TEST_FAILING_TASKS);
+	check(stats.tasksrun == TEST_TASKS);
+	check(stats.taskerrors == TEST_FAILING_TASKS);
+	check(stats.preemptions > 0);
+	check(stats.queuedepth == 0);
+
+	Lnn_DestroyExecutor(executor);
+	Lnn_ReleaseProgram(sum);
+	Lnn_ReleaseProgram(failing);
+}
+
+#define TEST_FOR_LENGTH 10000
+#define TEST_FOR_UNUSED 40
+
+/**
+ * A parallel for gives the same reductions as a loop on one thread, and the same float sum
+ * every time it runs with the same ranges. A range that fails or doesn't leave a number fails the loop.
+ */
+static void test_parallel_for(void)
+{
+	Lnn_State* state = Lnn_CreateState();
+	check(run_script(state, TIER_VM, "a = [] i = 0 while i < 10000 do a[i] = i * 7 - 30000 i += 1 end") == Lnn_EXEC_OK);
+	Lnn_Program* body = Lnn_CompileProgram(state, "i = first while i < last do v = a[i] s += v f += v * 0.1 "
+		"if v < lo then lo = v end if v > hi then hi = v end i += 1 end n += last - first");
+	Lnn_Program* counting = Lnn_CompileProgram(state, "n += 1");
+	Lnn_Program* failing = Lnn_CompileProgram(state, "s = \"k\" + 1");
+	Lnn_Program* notanumber = Lnn_CompileProgram(state, "s = \"k\"");
+	check(body && counting && failing && notanumber);
+	if (!body || !counting || !failing || !notanumber) goto on_done;
+
+	Lnn_Executor* executor = Lnn_CreateExecutor(4, NULL, NULL);
+	const Lnn_ParallelInput input = { "a", global_value(state, "a") };
+	const Lnn_ParallelReduction reductions[] =
+	{
+		{ "s", Lnn_RO_SUM },
+		{ "lo", Lnn_RO_MIN },
+		{ "hi", Lnn_RO_MAX },
+		{ "n", Lnn_RO_SUM },
+		{ "f", Lnn_RO_SUM },
+	};
+	Lnn_ParallelFor loop = { body, 0, TEST_FOR_LENGTH, 0, state, &input, 1, reductions, 5 };
+	Lnn_Value results[5];
+	Utl_Float floatsum = 0.0;
+	for (int run = 0; run < 5; run++)
+	{
+		check(Lnn_RunParallelFor(executor, &loop, results));
+		check(is_int(results[0], 7LL * TEST_FOR_LENGTH * (TEST_FOR_LENGTH - 1) / 2 - 30000LL * TEST_FOR_LENGTH));
+		check(is_int(results[1], -30000));
+		check(is_int(results[2], 7 * (TEST_FOR_LENGTH - 1) - 30000));
+		check(is_int(results[3], TEST_FOR_LENGTH));
+		check(Lnn_IsFloat(results[4]));
+		if (run == 0)
+			floatsum = results[4].u.number;
+		check(results[4].u.number == floatsum);
+	}
+
+	/* Ranges of 1000 indices still add up to the same ints */
+	loop.grain = 1000;
+	check(Lnn_RunParallelFor(executor, &loop, results));
+	check(is_int(results[0], 7LL * TEST_FOR_LENGTH * (TEST_FOR_LENGTH - 1) / 2 - 30000LL * TEST_FOR_LENGTH));
+	check(is_int(results[3], TEST_FOR_LENGTH));
+
+	/* An empty range leaves every reduction at its identity */
+	loop.first = loop.last = 0;
+	check(Lnn_RunParallelFor(executor, &loop, results));
+	check(is_int(results[0], 0) && is_int(results[3], 0));
+
+	/* Inputs and reductions the body never names are still made globals, which grows the globals of every worker */
+	char names[TEST_FOR_UNUSED][8];
+	Lnn_ParallelReduction unused[TEST_FOR_UNUSED + 1] = { { "n", Lnn_RO_SUM } };
+	Lnn_Value unusedresults[TEST_FOR_UNUSED + 1];
+	for (int i = 0; i < TEST_FOR_UNUSED; i++)
+	{
+		snprintf(names[i], sizeof(names[i]), "r%i", i);
+		unused[i + 1] = (Lnn_ParallelReduction){ names[i], Lnn_RO_SUM };
+	}
+	const Lnn_ParallelFor unusedloop = { counting, 0, TEST_FOR_LENGTH, 1000, state, &input, 1, unused, TEST_FOR_UNUSED + 1 };
+	check(Lnn_RunParallelFor(executor, &unusedloop, unusedresults));
+	check(is_int(unusedresults[0], TEST_FOR_LENGTH / 1000));
+	for (int i = 1; i <= TEST_FOR_UNUSED; i++)
+		check(is_int(unusedresults[i], 0));
+
+	loop.first = 0;
+	loop.last = 100;
+	loop.program = failing;
+	check(!Lnn_RunParallelFor(executor, &loop, results));
+	loop.program = notanumber;
+	check(!Lnn_RunParallelFor(executor, &loop, results));
+
+	Lnn_DestroyExecutor(executor);
+on_done:
+	if (body) Lnn_ReleaseProgram(body);
+	if (counting) Lnn_ReleaseProgram(counting);
+	if (failing) Lnn_ReleaseProgram(failing);
+	if (notanumber) Lnn_ReleaseProgram(notanumber);
+	Lnn_DestroyState(state);
+}
+
+typedef struct
+{
+	const char* name;
+	void (*function)(void);
+} test;
+
+static const test tests[] =
+{
+	{ "Hash map", &test_hashmap },
+	{ "Out of memory", &test_out_of_memory },
+	{ "Int overflow", &test_int_overflow },
+	{ "Parse depth", &test_parse_depth },
+	{ "Quickening", &test_quickening },
+	{ "Peephole", &test_peephole },
+	{ "Jit deopts", &test_jit_deopts },
+	{ "Captures", &test_captures },
+	{ "Tail calls", &test_tail_calls },
+	{ "Scalar replacement", &test_scalar_replacement },
+	{ "Threads", &test_threads },
+	{ "Coroutines", &test_coroutines },
+	{ "Budget", &test_budget },
+	{ "Programs", &test_programs },
+	{ "Channels", &test_channels },
+	{ "Executor", &test_executor },
+	{ "Parallel for", &test_parallel_for },
+};
+
+/**
+ * @brief Runs every test and prints which ones failed.
+ * @return Utl_FALSE if any failed.
+ */
+static Utl_Bool run_tests(void)
+{
+	const int numtests = (int)(sizeof(tests) / sizeof(tests[0]));
+	int numpassed = 0;
+	for (int i = 0; i < numtests; i++)
+	{
+		const int failedbefore = numfailed;
+		tests[i].function();
+		if (numfailed == failedbefore)
+			numpassed++;
+		else
+			printf("FAILED! Test '%s'\n", tests[i].name);
+	}
+	printf("%i of %i tests passed\n", numpassed, numtests);
+	return numpassed == numtests;
+}
+
+
+
 int main(void)
 {
-	Lnn_State* state = Utl_AllocType(Lnn_State);
+#ifdef Lnn_BENCHMARK
+	for (int i = 0; i < NUM_TIERS; i++)
+		printf("%-12s %.3fs\n", tier_names[i], run_benchmark((tier)i));
+	for (int i = 1; i <= BENCH_MAX_THREADS; i *= 2)
+		printf("Vm on %i threads %.3fs\n", i, run_threaded_benchmark(i));
+#endif
+
+	const Utl_Bool passed = run_tests();
+
+	Lnn_State* state = Lnn_CreateState();
 
 	const char* sourcecode = read_code_from_file("testcode.lnn");
-	(void)Lnn_ParseSourceCode(state, sourcecode);
+	Lnn_CodeBlock* code = Lnn_ParseSourceCode(state, sourcecode);
 	Utl_Free(sourcecode);
 
-	Utl_Free(state);
+	if (code)
+	{
+		Lnn_Chunk* chunk = Lnn_CompileCode(state, code);
+		Lnn_DestroyCodeBlock(code);
+		if (chunk)
+		{
+			Lnn_RunChunk(state, chunk);
+			Lnn_PrintChunk(chunk);
+			Lnn_PrintGlobals(state);
+			Lnn_PrintGCStats(state);
+			Lnn_PrintMemoryStats(state);
+			Lnn_DestroyChunk(chunk);
+		}
+	}
 
-	return 0;
+	Lnn_DestroyState(state);
+
+	return passed ? 0 : 1;
 }